@@ -0,0 +1,309 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+//
+// Times mkvparser::Block::Parse on synthetic laced SimpleBlocks: Xiph lacing
+// with short sizes and with long runs of 255 bytes, and EBML lacing with
+// positive and negative size deltas. Each case is parsed through a reader
+// that supports IMkvReader::GetSpan and through one that only supports Read.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include "mkvparser.hpp"
+
+namespace {
+
+typedef std::vector<unsigned char> Buffer;
+
+// In-memory reader. GetSpan is only supported when |spans| is true.
+class MemoryReader : public mkvparser::IMkvReader {
+ public:
+  MemoryReader(const Buffer& data, bool spans) : data_(data), spans_(spans) {}
+  virtual ~MemoryReader() {}
+
+  virtual int Read(long long pos, long len, unsigned char* buf) {
+    if (pos < 0 || len < 0 ||
+        pos + len > static_cast<long long>(data_.size()))
+      return -1;
+    if (len > 0)
+      memcpy(buf, &data_[static_cast<size_t>(pos)], len);
+    return 0;
+  }
+
+  virtual int Length(long long* total, long long* available) {
+    if (total)
+      *total = data_.size();
+    if (available)
+      *available = data_.size();
+    return 0;
+  }
+
+  virtual int GetSpan(long long pos, long len, const unsigned char** buf) {
+    if (!spans_ || pos < 0 || len < 0 ||
+        pos + len > static_cast<long long>(data_.size()))
+      return -1;
+    *buf = &data_[static_cast<size_t>(pos)];
+    return 0;
+  }
+
+ private:
+  const Buffer& data_;
+  const bool spans_;
+};
+
+void PutID(Buffer* out, unsigned long id) {
+  int size = 4;
+  while (size > 1 && !(id >> ((size - 1) * 8)))
+    --size;
+  for (int i = size - 1; i >= 0; --i)
+    out->push_back(static_cast<unsigned char>(id >> (i * 8)));
+}
+
+// Writes |value| as an EBML coded number of |size| bytes.
+void PutVInt(Buffer* out, unsigned long long value, int size) {
+  value |= 1ULL << (size * 7);
+  for (int i = size - 1; i >= 0; --i)
+    out->push_back(static_cast<unsigned char>(value >> (i * 8)));
+}
+
+int VIntSize(unsigned long long value) {
+  int size = 1;
+  while (value >= (1ULL << (size * 7)) - 1)
+    ++size;
+  return size;
+}
+
+void PutUInt(Buffer* out, unsigned long id, unsigned long long value) {
+  PutID(out, id);
+  PutVInt(out, 8, 1);
+  for (int i = 7; i >= 0; --i)
+    out->push_back(static_cast<unsigned char>(value >> (i * 8)));
+}
+
+void PutString(Buffer* out, unsigned long id, const char* value) {
+  const size_t len = strlen(value);
+  PutID(out, id);
+  PutVInt(out, len, 1);
+  out->insert(out->end(), value, value + len);
+}
+
+void PutMaster(Buffer* out, unsigned long id, const Buffer& payload) {
+  PutID(out, id);
+  PutVInt(out, payload.size(), 8);
+  out->insert(out->end(), payload.begin(), payload.end());
+}
+
+enum Lacing { kXiph = 1, kEbml = 3 };
+
+struct Case {
+  const char* name;
+  Lacing lacing;
+  int min_frame_size;
+  int max_frame_size;
+};
+
+// Returns the payload of a SimpleBlock holding frames of |sizes|.
+Buffer MakeBlockPayload(Lacing lacing, const std::vector<int>& sizes) {
+  Buffer out;
+  PutVInt(&out, 1, 1);  // track number
+  out.push_back(0);  // timecode
+  out.push_back(0);
+  out.push_back(static_cast<unsigned char>(0x80 | (lacing << 1)));
+  out.push_back(static_cast<unsigned char>(sizes.size() - 1));
+
+  // The size of the last frame is implied.
+  const size_t laced = sizes.size() - 1;
+  if (lacing == kXiph) {
+    for (size_t i = 0; i < laced; ++i) {
+      int size = sizes[i];
+      for (; size >= 255; size -= 255)
+        out.push_back(255);
+      out.push_back(static_cast<unsigned char>(size));
+    }
+  } else {
+    PutVInt(&out, sizes[0], VIntSize(sizes[0]));
+    for (size_t i = 1; i < laced; ++i) {
+      const long long delta = sizes[i] - sizes[i - 1];
+      // Signed values are stored with a bias of 2^(7 * size - 1) - 1.
+      int size = 1;
+      while (delta <= -((1LL << (size * 7 - 1)) - 1) ||
+             delta >= (1LL << (size * 7 - 1)) - 1)
+        ++size;
+      PutVInt(&out, delta + (1LL << (size * 7 - 1)) - 1, size);
+    }
+  }
+
+  for (size_t i = 0; i < sizes.size(); ++i)
+    out.insert(out.end(), sizes[i], static_cast<unsigned char>(i));
+  return out;
+}
+
+struct BlockInfo {
+  long long start;
+  long long size;
+  int frame_count;
+};
+
+// Builds a WebM file with one audio track and one cluster of |block_count|
+// SimpleBlocks laced as described by |c|, and fills |blocks|.
+void MakeFile(const Case& c, int block_count, int frames_per_block,
+              Buffer* file, std::vector<BlockInfo>* blocks) {
+  Buffer ebml;
+  PutString(&ebml, 0x4282, "webm");  // DocType
+  PutUInt(&ebml, 0x4287, 4);  // DocTypeVersion
+  PutUInt(&ebml, 0x4285, 2);  // DocTypeReadVersion
+
+  Buffer info;
+  PutUInt(&info, 0x2AD7B1, 1000000);  // TimecodeScale
+
+  Buffer entry;
+  PutUInt(&entry, 0xD7, 1);  // TrackNumber
+  PutUInt(&entry, 0x73C5, 1);  // TrackUID
+  PutUInt(&entry, 0x83, 2);  // TrackType: audio
+  PutString(&entry, 0x86, "A_VORBIS");  // CodecID
+  Buffer audio;
+  PutUInt(&audio, 0x9F, 2);  // Channels
+  PutMaster(&entry, 0xE1, audio);
+  Buffer tracks;
+  PutMaster(&tracks, 0xAE, entry);
+
+  std::vector<Buffer> payloads;
+  srand(1);
+  for (int i = 0; i < block_count; ++i) {
+    std::vector<int> sizes;
+    for (int j = 0; j < frames_per_block; ++j) {
+      sizes.push_back(c.min_frame_size +
+                      rand() % (c.max_frame_size - c.min_frame_size + 1));
+    }
+    payloads.push_back(MakeBlockPayload(c.lacing, sizes));
+  }
+
+  file->clear();
+  PutMaster(file, 0x1A45DFA3, ebml);
+
+  // Lay out the segment so the offsets of the block payloads are known.
+  Buffer segment;
+  PutMaster(&segment, 0x1549A966, info);
+  PutMaster(&segment, 0x1654AE6B, tracks);
+
+  Buffer cluster;
+  PutUInt(&cluster, 0xE7, 0);  // Timecode
+  std::vector<long long> offsets;
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    PutID(&cluster, 0xA3);  // SimpleBlock
+    PutVInt(&cluster, payloads[i].size(), 8);
+    offsets.push_back(cluster.size());
+    cluster.insert(cluster.end(), payloads[i].begin(), payloads[i].end());
+  }
+
+  const long long cluster_start = segment.size() + 4 + 8;
+  PutMaster(&segment, 0x1F43B675, cluster);
+
+  const long long segment_start = file->size() + 4 + 8;
+  PutMaster(file, 0x18538067, segment);
+
+  blocks->clear();
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    BlockInfo b;
+    b.start = segment_start + cluster_start + offsets[i];
+    b.size = payloads[i].size();
+    b.frame_count = frames_per_block;
+    blocks->push_back(b);
+  }
+}
+
+// Parses every block of |blocks| |passes| times, each pass against a freshly
+// loaded segment so the cluster's frame storage does not keep growing.
+// Returns the seconds spent in Block::Parse, or a negative value on error.
+double TimeParse(mkvparser::IMkvReader* reader,
+                 const std::vector<BlockInfo>& blocks, int passes) {
+  double seconds = 0;
+
+  for (int pass = 0; pass < passes; ++pass) {
+    long long pos = 0;
+    mkvparser::EBMLHeader header;
+    if (header.Parse(reader, pos) < 0)
+      return -1;
+
+    mkvparser::Segment* segment;
+    if (mkvparser::Segment::CreateInstance(reader, pos, segment))
+      return -1;
+
+    long len;
+    if (segment->ParseHeaders() || segment->LoadCluster(pos, len) < 0) {
+      delete segment;
+      return -1;
+    }
+
+    const mkvparser::Cluster* const cluster = segment->GetFirst();
+    if (cluster == NULL || cluster->EOS()) {
+      delete segment;
+      return -1;
+    }
+
+    const clock_t start = clock();
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      mkvparser::Block block(blocks[i].start, blocks[i].size, 0);
+      if (block.Parse(cluster) ||
+          block.GetFrameCount() != blocks[i].frame_count) {
+        delete segment;
+        return -1;
+      }
+    }
+    seconds += static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+
+    delete segment;
+  }
+
+  return seconds;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const int passes = (argc > 1) ? atoi(argv[1]) : 500;
+  if (passes < 1) {
+    printf("usage: %s [passes]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const int kBlockCount = 200;
+  const int kFramesPerBlock = 64;
+  const Case kCases[] = {
+      {"xiph-short", kXiph, 1, 254},
+      {"xiph-255-runs", kXiph, 1000, 3000},
+      {"ebml-deltas", kEbml, 1, 2000},
+  };
+
+  printf("%d blocks of %d frames, %d passes\n", kBlockCount, kFramesPerBlock,
+         passes);
+
+  for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); ++i) {
+    Buffer file;
+    std::vector<BlockInfo> blocks;
+    MakeFile(kCases[i], kBlockCount, kFramesPerBlock, &file, &blocks);
+
+    for (int spans = 1; spans >= 0; --spans) {
+      MemoryReader reader(file, spans != 0);
+      const double seconds = TimeParse(&reader, blocks, passes);
+      if (seconds < 0) {
+        printf("%s: parse error\n", kCases[i].name);
+        return EXIT_FAILURE;
+      }
+
+      const double blocks_parsed = static_cast<double>(kBlockCount) * passes;
+      printf("%-14s %-5s %8.1f ns/block\n", kCases[i].name,
+             spans ? "span" : "read", seconds * 1e9 / blocks_parsed);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
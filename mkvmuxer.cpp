@@ -65,6 +65,19 @@ IMkvWriter::IMkvWriter() {}
 
 IMkvWriter::~IMkvWriter() {}
 
+int32 IMkvWriter::WriteV(const WriteBuffer* buffers, int32 count) {
+  if (count < 0 || (count > 0 && !buffers))
+    return -1;
+
+  for (int32 i = 0; i < count; ++i) {
+    const int32 status = Write(buffers[i].data, buffers[i].length);
+    if (status)
+      return status;
+  }
+
+  return 0;
+}
+
 bool WriteEbmlHeader(IMkvWriter* writer, uint64 doc_type_version) {
   // Level 0
   uint64 size = EbmlElementSize(kMkvEBMLVersion, 1ULL);
@@ -121,12 +134,23 @@ bool ChunkedCopy(mkvparser::IMkvReader* source, mkvmuxer::IMkvWriter* dst,
 //
 // Frame Class
 
+namespace {
+
+// Releases the data that Frame::Init and Frame::AddAdditionalData copy.
+void DeleteFrameData(void* /* context */, const uint8* data) { delete[] data; }
+
+}  // namespace
+
 Frame::Frame()
     : add_id_(0),
       additional_(NULL),
+      additional_release_(NULL),
+      additional_context_(NULL),
       additional_length_(0),
       duration_(0),
       frame_(NULL),
+      frame_release_(NULL),
+      frame_context_(NULL),
       is_key_(false),
       length_(0),
       track_number_(0),
@@ -134,8 +158,11 @@ Frame::Frame()
       discard_padding_(0) {}
 
 Frame::~Frame() {
-  delete[] frame_;
-  delete[] additional_;
+  if (frame_ && frame_release_)
+    frame_release_(frame_context_, frame_);
+
+  if (additional_ && additional_release_)
+    additional_release_(additional_context_, additional_);
 }
 
 bool Frame::Init(const uint8* frame, uint64 length) {
@@ -144,11 +171,20 @@ bool Frame::Init(const uint8* frame, uint64 length) {
   if (!data)
     return false;
 
-  delete[] frame_;
-  frame_ = data;
+  memcpy(data, frame, static_cast<size_t>(length));
+  return Init(data, length, DeleteFrameData, NULL);
+}
+
+bool Frame::Init(const uint8* frame, uint64 length, ReleaseFunc release,
+                 void* context) {
+  if (frame_ && frame_release_)
+    frame_release_(frame_context_, frame_);
+
+  frame_ = frame;
+  frame_release_ = release;
+  frame_context_ = context;
   length_ = length;
 
-  memcpy(frame_, frame, static_cast<size_t>(length_));
   return true;
 }
 
@@ -159,15 +195,164 @@ bool Frame::AddAdditionalData(const uint8* additional, uint64 length,
   if (!data)
     return false;
 
-  delete[] additional_;
-  additional_ = data;
+  memcpy(data, additional, static_cast<size_t>(length));
+  return AddAdditionalData(data, length, add_id, DeleteFrameData, NULL);
+}
+
+bool Frame::AddAdditionalData(const uint8* additional, uint64 length,
+                              uint64 add_id, ReleaseFunc release,
+                              void* context) {
+  if (additional_ && additional_release_)
+    additional_release_(additional_context_, additional_);
+
+  additional_ = additional;
+  additional_release_ = release;
+  additional_context_ = context;
   additional_length_ = length;
   add_id_ = add_id;
 
-  memcpy(additional_, additional, static_cast<size_t>(additional_length_));
   return true;
 }
 
+void Frame::Reset() {
+  Init(NULL, 0, NULL, NULL);
+  AddAdditionalData(NULL, 0, 0, NULL, NULL);
+
+  duration_ = 0;
+  is_key_ = false;
+  track_number_ = 0;
+  timestamp_ = 0;
+  discard_padding_ = 0;
+}
+
+///////////////////////////////////////////////////////////////
+//
+// FramePool Class
+
+FramePool::FramePool()
+    : free_frames_(NULL), free_frames_capacity_(0), free_frames_size_(0) {
+  for (int32 i = 0; i < kSizeClassCount; ++i)
+    free_buffers_[i] = NULL;
+}
+
+FramePool::~FramePool() {
+  for (int32 i = 0; i < free_frames_size_; ++i)
+    delete free_frames_[i];
+  delete[] free_frames_;
+
+  for (int32 i = 0; i < kSizeClassCount; ++i) {
+    while (free_buffers_[i]) {
+      Buffer* const buffer = free_buffers_[i];
+      free_buffers_[i] = buffer->next;
+      delete[] reinterpret_cast<uint8*>(buffer);
+    }
+  }
+}
+
+Frame* FramePool::Acquire(const uint8* data, uint64 length) {
+  if (!data)
+    return NULL;
+
+  uint8* const buf = AllocateBuffer(length);
+  if (!buf)
+    return NULL;
+
+  memcpy(buf, data, static_cast<size_t>(length));
+
+  Frame* frame = NULL;
+  if (free_frames_size_ > 0) {
+    frame = free_frames_[--free_frames_size_];
+  } else {
+    frame = new (std::nothrow) Frame();
+    if (!frame) {
+      FreeBuffer(buf);
+      return NULL;
+    }
+  }
+
+  frame->Init(buf, length, ReleaseBuffer, this);
+  return frame;
+}
+
+void FramePool::Recycle(Frame* frame) {
+  if (!frame)
+    return;
+
+  frame->Reset();
+
+  if (free_frames_size_ >= free_frames_capacity_) {
+    const int32 new_capacity =
+        (!free_frames_capacity_) ? 2 : free_frames_capacity_ * 2;
+
+    if (new_capacity < 1) {
+      delete frame;
+      return;
+    }
+
+    Frame** const frames = new (std::nothrow) Frame* [new_capacity];  // NOLINT
+    if (!frames) {
+      delete frame;
+      return;
+    }
+
+    for (int32 i = 0; i < free_frames_size_; ++i)
+      frames[i] = free_frames_[i];
+
+    delete[] free_frames_;
+    free_frames_ = frames;
+    free_frames_capacity_ = new_capacity;
+  }
+
+  free_frames_[free_frames_size_++] = frame;
+}
+
+void FramePool::ReleaseBuffer(void* context, const uint8* data) {
+  static_cast<FramePool*>(context)->FreeBuffer(data);
+}
+
+uint8* FramePool::AllocateBuffer(uint64 length) {
+  int32 size_class = 0;
+  while (size_class < kSizeClassCount &&
+         (static_cast<uint64>(1) << (kMinSizeShift + size_class)) < length) {
+    ++size_class;
+  }
+
+  Buffer* buffer = NULL;
+  if (size_class < kSizeClassCount && free_buffers_[size_class]) {
+    buffer = free_buffers_[size_class];
+    free_buffers_[size_class] = buffer->next;
+  } else {
+    const uint64 capacity =
+        (size_class < kSizeClassCount)
+            ? static_cast<uint64>(1) << (kMinSizeShift + size_class)
+            : length;
+    uint8* const mem = new (std::nothrow)
+        uint8[static_cast<size_t>(sizeof(Buffer) + capacity)];  // NOLINT
+    if (!mem)
+      return NULL;
+
+    buffer = reinterpret_cast<Buffer*>(mem);
+  }
+
+  buffer->next = NULL;
+  buffer->size_class = size_class;
+  return reinterpret_cast<uint8*>(buffer + 1);
+}
+
+void FramePool::FreeBuffer(const uint8* data) {
+  Buffer* const buffer =
+      reinterpret_cast<Buffer*>(const_cast<uint8*>(data)) - 1;
+  const int32 size_class = buffer->size_class;
+
+  if (size_class >= kSizeClassCount) {
+    delete[] reinterpret_cast<uint8*>(buffer);
+    return;
+  }
+
+  buffer->next = free_buffers_[size_class];
+  free_buffers_[size_class] = buffer;
+}
+
 ///////////////////////////////////////////////////////////////
 //
 // CuePoint Class
@@ -1995,6 +2180,7 @@ Segment::Segment()
       force_new_cluster_(false),
       frames_(NULL),
       frames_capacity_(0),
+      frames_head_(0),
       frames_size_(0),
       has_video_(false),
       header_written_(false),
@@ -2029,8 +2215,8 @@ Segment::~Segment() {
   }
 
   if (frames_) {
-    for (int32 i = 0; i < frames_size_; ++i) {
-      Frame* const frame = frames_[i];
+    while (frames_size_ > 0) {
+      Frame* const frame = PopQueuedFrame();
       delete frame;
     }
     delete[] frames_;
@@ -2341,15 +2527,17 @@ bool Segment::AddFrame(const uint8* frame, uint64 length, uint64 track_number,
   // audio that is associated with the start time of a video key-frame is
   // muxed into the same cluster.
   if (has_video_ && tracks_.TrackIsAudio(track_number) && !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (new_frame == NULL || !new_frame->Init(frame, length))
+    Frame* const new_frame = frame_pool_.Acquire(frame, length);
+    if (new_frame == NULL)
       return false;
     new_frame->set_track_number(track_number);
     new_frame->set_timestamp(timestamp);
     new_frame->set_is_key(is_key);
 
-    if (!QueueFrame(new_frame))
+    if (!QueueFrame(new_frame)) {
+      frame_pool_.Recycle(new_frame);
       return false;
+    }
 
     return true;
   }
@@ -2404,15 +2592,17 @@ bool Segment::AddFrameWithAdditional(const uint8* frame, uint64 length,
   // audio that is associated with the start time of a video key-frame is
   // muxed into the same cluster.
   if (has_video_ && tracks_.TrackIsAudio(track_number) && !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (new_frame == NULL || !new_frame->Init(frame, length))
+    Frame* const new_frame = frame_pool_.Acquire(frame, length);
+    if (new_frame == NULL)
       return false;
     new_frame->set_track_number(track_number);
     new_frame->set_timestamp(timestamp);
     new_frame->set_is_key(is_key);
 
-    if (!QueueFrame(new_frame))
+    if (!QueueFrame(new_frame)) {
+      frame_pool_.Recycle(new_frame);
       return false;
+    }
 
     return true;
   }
@@ -2471,16 +2661,18 @@ bool Segment::AddFrameWithDiscardPadding(const uint8* frame, uint64 length,
   // audio that is associated with the start time of a video key-frame is
   // muxed into the same cluster.
   if (has_video_ && tracks_.TrackIsAudio(track_number) && !force_new_cluster_) {
-    Frame* const new_frame = new (std::nothrow) Frame();
-    if (new_frame == NULL || !new_frame->Init(frame, length))
+    Frame* const new_frame = frame_pool_.Acquire(frame, length);
+    if (new_frame == NULL)
       return false;
     new_frame->set_track_number(track_number);
     new_frame->set_timestamp(timestamp);
     new_frame->set_is_key(is_key);
     new_frame->set_discard_padding(discard_padding);
 
-    if (!QueueFrame(new_frame))
+    if (!QueueFrame(new_frame)) {
+      frame_pool_.Recycle(new_frame);
       return false;
+    }
 
     return true;
   }
@@ -2580,6 +2772,41 @@ bool Segment::AddGenericFrame(const Frame* frame) {
   }
 }
 
+bool Segment::AddOwnedFrame(Frame* frame) {
+  if (!frame)
+    return false;
+
+  const uint64 track_number = frame->track_number();
+
+  // If the segment has a video track, audio frames are queued as in
+  // AddFrame, but without copying them.
+  if (has_video_ && tracks_.TrackIsAudio(track_number) && !force_new_cluster_) {
+    last_block_duration_ = frame->duration();
+
+    // Perform the checks that AddFrame does before queuing a frame.
+    if (!frame->frame() || !CheckHeaderInfo() ||
+        frame->timestamp() < last_timestamp_) {
+      delete frame;
+      return false;
+    }
+
+    if (frame->discard_padding() != 0)
+      doc_type_version_ = 4;
+
+    if (!QueueFrame(frame)) {
+      delete frame;
+      return false;
+    }
+
+    return true;
+  }
+
+  const bool result = AddGenericFrame(frame);
+  delete frame;
+
+  return result;
+}
+
 void Segment::OutputCues(bool output_cues) { output_cues_ = output_cues; }
 
 bool Segment::SetChunking(bool chunking, const char* filename) {
@@ -2869,7 +3096,7 @@ bool Segment::MakeNewCluster(uint64 frame_timestamp_ns) {
   uint64 cluster_timecode = frame_timecode;
 
   if (frames_size_ > 0) {
-    const Frame* const f = frames_[0];  // earliest queued frame
+    const Frame* const f = QueuedFrame(0);  // earliest queued frame
     const uint64 ns = f->timestamp();
     const uint64 tc = ns / timecode_scale;
 
@@ -3031,20 +3258,35 @@ bool Segment::QueueFrame(Frame* frame) {
     if (!frames)
       return false;
 
+    // Unwrap the queue so the earliest frame is at the start of |frames|.
     for (int32 i = 0; i < frames_size_; ++i) {
-      frames[i] = frames_[i];
+      frames[i] = QueuedFrame(i);
     }
 
     delete[] frames_;
     frames_ = frames;
     frames_capacity_ = new_capacity;
+    frames_head_ = 0;
   }
 
-  frames_[frames_size_++] = frame;
+  // |frames_capacity_| is always a power of 2.
+  frames_[(frames_head_ + frames_size_) & (frames_capacity_ - 1)] = frame;
+  ++frames_size_;
 
   return true;
 }
 
+Frame* Segment::QueuedFrame(int32 index) const {
+  return frames_[(frames_head_ + index) & (frames_capacity_ - 1)];
+}
+
+Frame* Segment::PopQueuedFrame() {
+  Frame* const frame = frames_[frames_head_];
+  frames_head_ = (frames_head_ + 1) & (frames_capacity_ - 1);
+  --frames_size_;
+  return frame;
+}
+
 int Segment::WriteFramesAll() {
   if (frames_ == NULL)
     return 0;
@@ -3059,8 +3301,9 @@ int Segment::WriteFramesAll() {
 
   const uint64 timecode_scale = segment_info_.timecode_scale();
 
-  for (int32 i = 0; i < frames_size_; ++i) {
-    Frame*& frame = frames_[i];
+  int result = 0;
+  while (frames_size_ > 0) {
+    const Frame* const frame = QueuedFrame(0);
     const uint64 frame_timestamp = frame->timestamp();  // ns
     const uint64 frame_timecode = frame_timestamp / timecode_scale;
 
@@ -3089,13 +3332,10 @@ int Segment::WriteFramesAll() {
     if (frame_timestamp > last_timestamp_)
       last_timestamp_ = frame_timestamp;
 
-    delete frame;
-    frame = NULL;
+    frame_pool_.Recycle(PopQueuedFrame());
+    ++result;
   }
 
-  const int result = frames_size_;
-  frames_size_ = 0;
-
   return result;
 }
 
@@ -3112,17 +3352,16 @@ bool Segment::WriteFramesLessThan(uint64 timestamp) {
       return false;
 
     const uint64 timecode_scale = segment_info_.timecode_scale();
-    int32 shift_left = 0;
 
     // TODO(fgalligan): Change this to use the durations of frames instead of
     // the next frame's start time if the duration is accurate.
-    for (int32 i = 1; i < frames_size_; ++i) {
-      const Frame* const frame_curr = frames_[i];
+    while (frames_size_ > 1) {
+      const Frame* const frame_curr = QueuedFrame(1);
 
       if (frame_curr->timestamp() > timestamp)
         break;
 
-      const Frame* const frame_prev = frames_[i - 1];
+      const Frame* const frame_prev = QueuedFrame(0);
       const uint64 frame_timestamp = frame_prev->timestamp();
       const uint64 frame_timecode = frame_timestamp / timecode_scale;
       const int64 discard_padding = frame_prev->discard_padding();
@@ -3148,23 +3387,10 @@ bool Segment::WriteFramesLessThan(uint64 timestamp) {
           return false;
       }
 
-      ++shift_left;
       if (frame_timestamp > last_timestamp_)
         last_timestamp_ = frame_timestamp;
 
-      delete frame_prev;
-    }
-
-    if (shift_left > 0) {
-      if (shift_left >= frames_size_)
-        return false;
-
-      const int32 new_frames_size = frames_size_ - shift_left;
-      for (int32 i = 0; i < new_frames_size; ++i) {
-        frames_[i] = frames_[i + shift_left];
-      }
-
-      frames_size_ = new_frames_size;
+      frame_pool_.Recycle(PopQueuedFrame());
     }
   }
 
@@ -23,6 +23,12 @@ namespace mkvmuxer {
 class MkvWriter;
 class Segment;
 
+// One of the buffers passed to IMkvWriter::WriteV.
+struct WriteBuffer {
+  const void* data;
+  uint32 length;
+};
+
 ///////////////////////////////////////////////////////////////
 // Interface used by the mkvmuxer to write out the Mkv data.
 class IMkvWriter {
@@ -30,6 +36,12 @@ class IMkvWriter {
   // Writes out |len| bytes of |buf|. Returns 0 on success.
   virtual int32 Write(const void* buf, uint32 len) = 0;
 
+  // Writes out the |count| buffers in |buffers|, in order. The default
+  // implementation calls Write once per buffer; writers that can hand the
+  // buffers to the output together should override it. Returns 0 on
+  // success.
+  virtual int32 WriteV(const WriteBuffer* buffers, int32 count);
+
   // Returns the offset of the output position from the beginning of the
   // output.
   virtual int64 Position() const = 0;
@@ -71,15 +83,37 @@ bool ChunkedCopy(mkvparser::IMkvReader* source, IMkvWriter* dst, int64 start,
 // Class to hold data the will be written to a block.
 class Frame {
  public:
+  // Called with the |context| and |data| passed to the Init or
+  // AddAdditionalData overloads that do not copy, once the frame no longer
+  // needs |data|.
+  typedef void (*ReleaseFunc)(void* context, const uint8* data);
+
   Frame();
   ~Frame();
 
   // Copies |frame| data into |frame_|. Returns true on success.
   bool Init(const uint8* frame, uint64 length);
 
+  // Makes |frame_| refer to |frame| without copying it. When the Frame no
+  // longer needs the data (it is destroyed, or Init is called again),
+  // |release| is called with |context| and |frame|. If |release| is NULL, the
+  // caller must keep the data valid for the lifetime of the Frame. Returns
+  // true on success.
+  bool Init(const uint8* frame, uint64 length, ReleaseFunc release,
+            void* context);
+
   // Copies |additional| data into |additional_|. Returns true on success.
   bool AddAdditionalData(const uint8* additional, uint64 length, uint64 add_id);
 
+  // Makes |additional_| refer to |additional| without copying it; |release|
+  // and |context| are used as by Init. Returns true on success.
+  bool AddAdditionalData(const uint8* additional, uint64 length, uint64 add_id,
+                         ReleaseFunc release, void* context);
+
+  // Releases the frame and additional data and restores every member to its
+  // default value, so the Frame can be reused.
+  void Reset();
+
   uint64 add_id() const { return add_id_; }
   const uint8* additional() const { return additional_; }
   uint64 additional_length() const { return additional_length_; }
@@ -102,8 +136,10 @@ class Frame {
   // Id of the Additional data.
   uint64 add_id_;
 
-  // Pointer to additional data. Owned by this class.
-  uint8* additional_;
+  // Pointer to additional data, released by |additional_release_|.
+  const uint8* additional_;
+  ReleaseFunc additional_release_;
+  void* additional_context_;
 
   // Length of the additional data.
   uint64 additional_length_;
@@ -111,8 +147,10 @@ class Frame {
   // Duration of the frame in nanoseconds.
   uint64 duration_;
 
-  // Pointer to the data. Owned by this class.
-  uint8* frame_;
+  // Pointer to the data, released by |frame_release_|.
+  const uint8* frame_;
+  ReleaseFunc frame_release_;
+  void* frame_context_;
 
   // Flag telling if the data should set the key flag of a block.
   bool is_key_;
@@ -128,6 +166,67 @@ class Frame {
 
   // Discard padding for the frame.
   int64 discard_padding_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(Frame);
+};
+
+///////////////////////////////////////////////////////////////
+// Class that recycles Frame objects and the storage for their data, so a
+// muxer that queues frames for its whole lifetime does not keep going back to
+// the allocator. Data buffers are kept in power-of-two size classes. The pool
+// is not thread safe.
+class FramePool {
+ public:
+  FramePool();
+  ~FramePool();
+
+  // Returns a Frame holding a copy of |length| bytes of |data|, or NULL on
+  // error. The Frame must be handed back with Recycle, or deleted, before
+  // the pool is destroyed.
+  Frame* Acquire(const uint8* data, uint64 length);
+
+  // Resets |frame| and keeps it for a later Acquire. |frame| must have been
+  // returned by Acquire or allocated with new.
+  void Recycle(Frame* frame);
+
+ private:
+  // Header placed before the data of every buffer handed out by the pool.
+  // While the buffer is in a free list, |next| links it to the next one.
+  struct Buffer {
+    Buffer* next;
+    int32 size_class;
+  };
+
+  enum {
+    // The smallest size class holds 1 << kMinSizeShift bytes.
+    kMinSizeShift = 6,
+    // Number of size classes. Larger buffers are not kept by the pool.
+    kSizeClassCount = 15
+  };
+
+  // Frame::ReleaseFunc for buffers returned by AllocateBuffer. |context| is
+  // the pool.
+  static void ReleaseBuffer(void* context, const uint8* data);
+
+  // Returns a buffer that holds at least |length| bytes, or NULL on error.
+  uint8* AllocateBuffer(uint64 length);
+
+  // Returns |data| to the free list of its size class.
+  void FreeBuffer(const uint8* data);
+
+  // Free buffers of each size class.
+  Buffer* free_buffers_[kSizeClassCount];
+
+  // Frames that are ready to be reused.
+  Frame** free_frames_;
+
+  // Number of frame pointers allocated in |free_frames_|.
+  int32 free_frames_capacity_;
+
+  // Number of frames in |free_frames_|.
+  int32 free_frames_size_;
+
+  LIBWEBM_DISALLOW_COPY_AND_ASSIGN(FramePool);
 };
 
 ///////////////////////////////////////////////////////////////
@@ -1115,6 +1214,14 @@ class Segment {
   //   frame: frame object
   bool AddGenericFrame(const Frame* frame);
 
+  // Writes |frame| as AddGenericFrame does, but takes ownership of it (it
+  // must have been allocated with new), even on failure. Audio frames that
+  // are held back until the next video frame decides their cluster are
+  // queued as they are, instead of being copied into a new Frame. Together
+  // with the Frame::Init overload that does not copy, the frame data is then
+  // never copied by the muxer.
+  bool AddOwnedFrame(Frame* frame);
+
   // Adds a VP8 video track to the segment. Returns the number of the track on
   // success, 0 on error. |number| is the number to use for the video track.
   // |number| must be >= 0. If |number| == 0 then the muxer will decide on
@@ -1209,9 +1316,15 @@ class Segment {
   // chunked files. Returns -1 on error.
   int64 MaxOffset();
 
-  // Adds the frame to our frame array.
+  // Adds the frame to the end of our frame queue.
   bool QueueFrame(Frame* frame);
 
+  // Returns the queued frame at |index|, counting from the earliest one.
+  Frame* QueuedFrame(int32 index) const;
+
+  // Removes the earliest queued frame from the queue and returns it.
+  Frame* PopQueuedFrame();
+
   // Output all frames that are queued. Returns -1 on error, otherwise
   // it returns the number of frames written.
   int WriteFramesAll();
@@ -1317,15 +1430,22 @@ class Segment {
   // List of stored audio frames. These variables are used to store frames so
   // the muxer can follow the guideline "Audio blocks that contain the video
   // key frame's timecode should be in the same cluster as the video key frame
-  // block."
+  // block." The list is a ring buffer, so frames are queued and written
+  // without moving the others.
   Frame** frames_;
 
-  // Number of frame pointers allocated in the frame list.
+  // Number of frame pointers allocated in the frame list. Always a power of 2.
   int32 frames_capacity_;
 
+  // Index in the frame list of the earliest queued frame.
+  int32 frames_head_;
+
   // Number of frames in the frame list.
   int32 frames_size_;
 
+  // Recycles the queued frames and their data once they are written.
+  FramePool frame_pool_;
+
   // Flag telling if a video track has been added to the segment.
   bool has_video_;
 
@@ -35,6 +35,109 @@ namespace {
 // Date elements are always 8 octets in size.
 const int kDateElementSize = 8;
 
+// Stores |value| in |buffer| as |size| bytes in Big Endian order.
+void SerializeIntToBuffer(int64 value, int32 size, uint8* buffer) {
+  for (int32 i = 0; i < size; ++i) {
+    const int32 bit_count = (size - 1 - i) * 8;
+    buffer[i] = static_cast<uint8>(value >> bit_count);
+  }
+}
+
+// Builds the header of an element, and of the elements nested at its start,
+// in a stack buffer so that it reaches the writer in a single Write call, or
+// as one buffer of a WriteV call. |IMkvWriter::ElementStartNotify| is still
+// called for every ID, with the position the ID will have in the output.
+// |writer| must not be NULL.
+class ElementHeader {
+ public:
+  // Builds a header that is written at the current position of |writer|.
+  explicit ElementHeader(IMkvWriter* writer)
+      : writer_(writer), position_(writer->Position()), size_(0) {}
+
+  // Builds a header that will be written at |position|.
+  ElementHeader(IMkvWriter* writer, int64 position)
+      : writer_(writer), position_(position), size_(0) {}
+
+  // Adds the ID |type|. Returns false if the header is full.
+  bool AddID(uint64 type) {
+    const int32 size = GetUIntSize(type);
+    if (size_ + size > kCapacity)
+      return false;
+
+    writer_->ElementStartNotify(type, position_ + size_);
+    SerializeIntToBuffer(type, size, buffer_ + size_);
+    size_ += size;
+    return true;
+  }
+
+  // Adds |value| as an EBML coded number. Returns false if |value| is too
+  // large to be coded or the header is full.
+  bool AddUInt(uint64 value) {
+    const int32 size = GetCodedUIntSize(value);
+    const uint64 bit = 1ULL << (size * 7);
+    if (value > (bit - 2))
+      return false;
+
+    return AddInt(static_cast<int64>(value | bit), size);
+  }
+
+  // Adds |value| as |size| bytes in Big Endian order. Returns false if the
+  // header is full.
+  bool AddInt(int64 value, int32 size) {
+    if (size < 1 || size > 8 || size_ + size > kCapacity)
+      return false;
+
+    SerializeIntToBuffer(value, size, buffer_ + size_);
+    size_ += size;
+    return true;
+  }
+
+  // Writes out the header. Returns true on success.
+  bool Write() { return writer_->Write(buffer_, size_) == 0; }
+
+  // Returns the header as a buffer for IMkvWriter::WriteV.
+  WriteBuffer buffer() const {
+    const WriteBuffer header = {buffer_, static_cast<uint32>(size_)};
+    return header;
+  }
+
+  int32 size() const { return size_; }
+
+ private:
+  // Large enough for the longest run of headers the block writers build.
+  enum { kCapacity = 64 };
+
+  IMkvWriter* const writer_;
+  const int64 position_;
+  uint8 buffer_[kCapacity];
+  int32 size_;
+};
+
+// Returns the bits of |f| as an unsigned integer.
+uint32 FloatBits(float f) {
+  assert(sizeof(uint32) == sizeof(float));
+  // This union is merely used to avoid a reinterpret_cast from float& to
+  // uint32& which will result in violation of strict aliasing.
+  union U32 {
+    uint32 u32;
+    float f;
+  } value;
+  value.f = f;
+  return value.u32;
+}
+
+// Adds the track number, timecode and flags that start the payload of a
+// Block or SimpleBlock to |header|. Returns true on success.
+bool AddBlockHeader(ElementHeader* header, uint64 track_number,
+                    int64 timecode, uint64 is_key) {
+  uint64 flags = 0;
+  if (is_key)
+    flags |= 0x80;
+
+  return header->AddUInt(track_number) && header->AddInt(timecode, 2) &&
+         header->AddInt(flags, 1);
+}
+
 }  // namespace
 
 int32 GetCodedUIntSize(uint64 value) {
@@ -178,18 +281,12 @@ int32 SerializeInt(IMkvWriter* writer, int64 value, int32 size) {
   if (!writer || size < 1 || size > 8)
     return -1;
 
-  for (int32 i = 1; i <= size; ++i) {
-    const int32 byte_count = size - i;
-    const int32 bit_count = byte_count * 8;
+  uint8 buffer[8];
+  SerializeIntToBuffer(value, size, buffer);
 
-    const int64 bb = value >> bit_count;
-    const uint8 b = static_cast<uint8>(bb);
-
-    const int32 status = writer->Write(&b, 1);
-
-    if (status < 0)
-      return status;
-  }
+  const int32 status = writer->Write(buffer, size);
+  if (status < 0)
+    return status;
 
   return 0;
 }
@@ -198,28 +295,7 @@ int32 SerializeFloat(IMkvWriter* writer, float f) {
   if (!writer)
     return -1;
 
-  assert(sizeof(uint32) == sizeof(float));
-  // This union is merely used to avoid a reinterpret_cast from float& to
-  // uint32& which will result in violation of strict aliasing.
-  union U32 {
-    uint32 u32;
-    float f;
-  } value;
-  value.f = f;
-
-  for (int32 i = 1; i <= 4; ++i) {
-    const int32 byte_count = 4 - i;
-    const int32 bit_count = byte_count * 8;
-
-    const uint8 byte = static_cast<uint8>(value.u32 >> bit_count);
-
-    const int32 status = writer->Write(&byte, 1);
-
-    if (status < 0)
-      return status;
-  }
-
-  return 0;
+  return SerializeInt(writer, FloatBits(f), 4);
 }
 
 int32 WriteUInt(IMkvWriter* writer, uint64 value) {
@@ -280,57 +356,36 @@ bool WriteEbmlMasterElement(IMkvWriter* writer, uint64 type, uint64 size) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
-
-  if (WriteUInt(writer, size))
-    return false;
-
-  return true;
+  ElementHeader header(writer);
+  return header.AddID(type) && header.AddUInt(size) && header.Write();
 }
 
 bool WriteEbmlElement(IMkvWriter* writer, uint64 type, uint64 value) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
-
-  const uint64 size = GetUIntSize(value);
-  if (WriteUInt(writer, size))
-    return false;
-
-  if (SerializeInt(writer, value, static_cast<int32>(size)))
-    return false;
+  const int32 size = GetUIntSize(value);
 
-  return true;
+  ElementHeader header(writer);
+  return header.AddID(type) && header.AddUInt(size) &&
+         header.AddInt(value, size) && header.Write();
 }
 
 bool WriteEbmlElement(IMkvWriter* writer, uint64 type, float value) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
-
-  if (WriteUInt(writer, 4))
-    return false;
-
-  if (SerializeFloat(writer, value))
-    return false;
-
-  return true;
+  ElementHeader header(writer);
+  return header.AddID(type) && header.AddUInt(4) &&
+         header.AddInt(FloatBits(value), 4) && header.Write();
 }
 
 bool WriteEbmlElement(IMkvWriter* writer, uint64 type, const char* value) {
   if (!writer || !value)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
-
   const uint64 length = strlen(value);
-  if (WriteUInt(writer, length))
+  if (!WriteEbmlMasterElement(writer, type, length))
     return false;
 
   if (writer->Write(value, static_cast<const uint32>(length)))
@@ -344,10 +399,7 @@ bool WriteEbmlElement(IMkvWriter* writer, uint64 type, const uint8* value,
   if (!writer || !value || size < 1)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
-
-  if (WriteUInt(writer, size))
+  if (!WriteEbmlMasterElement(writer, type, size))
     return false;
 
   if (writer->Write(value, static_cast<uint32>(size)))
@@ -360,16 +412,9 @@ bool WriteEbmlDateElement(IMkvWriter* writer, uint64 type, int64 value) {
   if (!writer)
     return false;
 
-  if (WriteID(writer, type))
-    return false;
-
-  if (WriteUInt(writer, kDateElementSize))
-    return false;
-
-  if (SerializeInt(writer, value, kDateElementSize))
-    return false;
-
-  return true;
+  ElementHeader header(writer);
+  return header.AddID(type) && header.AddUInt(kDateElementSize) &&
+         header.AddInt(value, kDateElementSize) && header.Write();
 }
 
 uint64 WriteSimpleBlock(IMkvWriter* writer, const uint8* data, uint64 length,
@@ -395,27 +440,16 @@ uint64 WriteSimpleBlock(IMkvWriter* writer, const uint8* data, uint64 length,
   if (timecode < 0 || timecode > kMaxBlockTimecode)
     return false;
 
-  if (WriteID(writer, kMkvSimpleBlock))
-    return 0;
-
   const int32 size = static_cast<int32>(length) + 4;
-  if (WriteUInt(writer, size))
-    return 0;
-
-  if (WriteUInt(writer, static_cast<uint64>(track_number)))
-    return 0;
 
-  if (SerializeInt(writer, timecode, 2))
+  ElementHeader header(writer);
+  if (!header.AddID(kMkvSimpleBlock) || !header.AddUInt(size) ||
+      !AddBlockHeader(&header, track_number, timecode, is_key))
     return 0;
 
-  uint64 flags = 0;
-  if (is_key)
-    flags |= 0x80;
-
-  if (SerializeInt(writer, flags, 1))
-    return 0;
-
-  if (writer->Write(data, static_cast<uint32>(length)))
+  const WriteBuffer buffers[] = {header.buffer(),
+                                 {data, static_cast<uint32>(length)}};
+  if (writer->WriteV(buffers, 2))
     return 0;
 
   const uint64 element_size =
@@ -462,51 +496,31 @@ uint64 WriteMetadataBlock(IMkvWriter* writer, const uint8* data, uint64 length,
   const int32 blockg_size = GetCodedUIntSize(blockg_payload_size);
   const uint64 blockg_elem_size = 1 + blockg_size + blockg_payload_size;
 
-  if (WriteID(writer, kMkvBlockGroup))  // 1-byte ID size
-    return 0;
-
-  if (WriteUInt(writer, blockg_payload_size))
-    return 0;
-
-  //  Write Block element
-
-  if (WriteID(writer, kMkvBlock))  // 1-byte ID size
-    return 0;
-
-  if (WriteUInt(writer, block_payload_size))
-    return 0;
-
-  // Byte 1 of 4
-
-  if (WriteUInt(writer, track_number))
-    return 0;
-
-  // Bytes 2 & 3 of 4
-
-  if (SerializeInt(writer, timecode, 2))
-    return 0;
-
-  // Byte 4 of 4
-
-  const uint64 flags = 0;
-
-  if (SerializeInt(writer, flags, 1))
+  if (!writer)
     return 0;
 
-  // Now write the actual frame (of metadata)
+  // The BlockGroup and Block headers, followed by the 4 bytes that start
+  // the Block payload: the track number, the timecode and the flags.
 
-  if (writer->Write(data, static_cast<uint32>(length)))
+  const int64 position = writer->Position();
+  ElementHeader header(writer, position);
+  if (!header.AddID(kMkvBlockGroup) || !header.AddUInt(blockg_payload_size) ||
+      !header.AddID(kMkvBlock) || !header.AddUInt(block_payload_size) ||
+      !AddBlockHeader(&header, track_number, timecode, 0))
     return 0;
 
-  // Write Duration element
+  // The Duration element, which follows the frame (of metadata).
 
-  if (WriteID(writer, kMkvBlockDuration))  // 1-byte ID size
+  ElementHeader duration_header(writer, position + header.size() + length);
+  if (!duration_header.AddID(kMkvBlockDuration) ||
+      !duration_header.AddUInt(duration_payload_size) ||
+      !duration_header.AddInt(duration, duration_payload_size))
     return 0;
 
-  if (WriteUInt(writer, duration_payload_size))
-    return 0;
-
-  if (SerializeInt(writer, duration, duration_payload_size))
+  const WriteBuffer buffers[] = {header.buffer(),
+                                 {data, static_cast<uint32>(length)},
+                                 duration_header.buffer()};
+  if (writer->WriteV(buffers, 3))
     return 0;
 
   // Note that we don't write a reference time as part of the block
@@ -536,7 +550,8 @@ uint64 WriteBlockWithAdditional(IMkvWriter* writer, const uint8* data,
                                 uint64 additional_length, uint64 add_id,
                                 uint64 track_number, int64 timecode,
                                 uint64 is_key) {
-  if (!data || !additional || length < 1 || additional_length < 1)
+  if (!writer || !data || !additional || length < 1 ||
+      additional_length < 1)
     return 0;
 
   const uint64 block_payload_size = 4 + length;
@@ -561,39 +576,36 @@ uint64 WriteBlockWithAdditional(IMkvWriter* writer, const uint8* data,
       EbmlMasterElementSize(kMkvBlockGroup, block_group_payload_size) +
       block_group_payload_size;
 
-  if (!WriteEbmlMasterElement(writer, kMkvBlockGroup, block_group_payload_size))
-    return 0;
-
-  if (!WriteEbmlMasterElement(writer, kMkvBlock, block_payload_size))
+  const int64 position = writer->Position();
+  ElementHeader block_header(writer, position);
+  if (!block_header.AddID(kMkvBlockGroup) ||
+      !block_header.AddUInt(block_group_payload_size) ||
+      !block_header.AddID(kMkvBlock) ||
+      !block_header.AddUInt(block_payload_size) ||
+      !AddBlockHeader(&block_header, track_number, timecode, is_key))
     return 0;
 
-  if (WriteUInt(writer, track_number))
-    return 0;
+  // Everything between the frame and the additional data.
+  const int32 add_id_size = GetUIntSize(add_id);
 
-  if (SerializeInt(writer, timecode, 2))
+  ElementHeader additions_header(writer,
+                                 position + block_header.size() + length);
+  if (!additions_header.AddID(kMkvBlockAdditions) ||
+      !additions_header.AddUInt(block_additions_payload_size) ||
+      !additions_header.AddID(kMkvBlockMore) ||
+      !additions_header.AddUInt(block_more_payload_size) ||
+      !additions_header.AddID(kMkvBlockAddID) ||
+      !additions_header.AddUInt(add_id_size) ||
+      !additions_header.AddInt(add_id, add_id_size) ||
+      !additions_header.AddID(kMkvBlockAdditional) ||
+      !additions_header.AddUInt(additional_length))
     return 0;
 
-  uint64 flags = 0;
-  if (is_key)
-    flags |= 0x80;
-  if (SerializeInt(writer, flags, 1))
-    return 0;
-
-  if (writer->Write(data, static_cast<uint32>(length)))
-    return 0;
-
-  if (!WriteEbmlMasterElement(writer, kMkvBlockAdditions,
-                              block_additions_payload_size))
-    return 0;
-
-  if (!WriteEbmlMasterElement(writer, kMkvBlockMore, block_more_payload_size))
-    return 0;
-
-  if (!WriteEbmlElement(writer, kMkvBlockAddID, add_id))
-    return 0;
-
-  if (!WriteEbmlElement(writer, kMkvBlockAdditional, additional,
-                        additional_length))
+  const WriteBuffer buffers[] = {
+      block_header.buffer(), {data, static_cast<uint32>(length)},
+      additions_header.buffer(),
+      {additional, static_cast<uint32>(additional_length)}};
+  if (writer->WriteV(buffers, 4))
     return 0;
 
   return block_group_elem_size;
@@ -609,7 +621,7 @@ uint64 WriteBlockWithDiscardPadding(IMkvWriter* writer, const uint8* data,
                                     uint64 length, int64 discard_padding,
                                     uint64 track_number, int64 timecode,
                                     uint64 is_key) {
-  if (!data || length < 1)
+  if (!writer || !data || length < 1)
     return 0;
 
   const uint64 block_payload_size = 4 + length;
@@ -623,37 +635,30 @@ uint64 WriteBlockWithDiscardPadding(IMkvWriter* writer, const uint8* data,
       EbmlMasterElementSize(kMkvBlockGroup, block_group_payload_size) +
       block_group_payload_size;
 
-  if (!WriteEbmlMasterElement(writer, kMkvBlockGroup, block_group_payload_size))
+  const int64 position = writer->Position();
+  ElementHeader block_header(writer, position);
+  if (!block_header.AddID(kMkvBlockGroup) ||
+      !block_header.AddUInt(block_group_payload_size) ||
+      !block_header.AddID(kMkvBlock) ||
+      !block_header.AddUInt(block_payload_size) ||
+      !AddBlockHeader(&block_header, track_number, timecode, is_key))
     return 0;
 
-  if (!WriteEbmlMasterElement(writer, kMkvBlock, block_payload_size))
-    return 0;
-
-  if (WriteUInt(writer, track_number))
-    return 0;
-
-  if (SerializeInt(writer, timecode, 2))
-    return 0;
-
-  uint64 flags = 0;
-  if (is_key)
-    flags |= 0x80;
-  if (SerializeInt(writer, flags, 1))
-    return 0;
+  const int32 size = GetIntSize(discard_padding);
 
-  if (writer->Write(data, static_cast<uint32>(length)))
+  ElementHeader padding_header(writer,
+                               position + block_header.size() + length);
+  if (!padding_header.AddID(kMkvDiscardPadding) ||
+      !padding_header.AddUInt(size) ||
+      !padding_header.AddInt(discard_padding, size))
     return 0;
 
-  if (WriteID(writer, kMkvDiscardPadding))
+  const WriteBuffer buffers[] = {block_header.buffer(),
+                                 {data, static_cast<uint32>(length)},
+                                 padding_header.buffer()};
+  if (writer->WriteV(buffers, 3))
     return 0;
 
-  const uint64 size = GetIntSize(discard_padding);
-  if (WriteUInt(writer, size))
-    return false;
-
-  if (SerializeInt(writer, discard_padding, static_cast<int32>(size)))
-    return false;
-
   return block_group_elem_size;
 }
 
@@ -673,16 +678,18 @@ uint64 WriteVoidElement(IMkvWriter* writer, uint64 size) {
   if (payload_position < 0)
     return 0;
 
-  if (WriteID(writer, kMkvVoid))
-    return 0;
-
-  if (WriteUInt(writer, void_entry_size))
+  if (!WriteEbmlMasterElement(writer, kMkvVoid, void_entry_size))
     return 0;
 
-  const uint8 value = 0;
-  for (int32 i = 0; i < static_cast<int32>(void_entry_size); ++i) {
-    if (writer->Write(&value, 1))
+  uint8 zeros[1024];
+  memset(zeros, 0, sizeof(zeros));
+  for (uint64 left = void_entry_size; left > 0;) {
+    const uint32 chunk = (left < sizeof(zeros))
+                             ? static_cast<uint32>(left)
+                             : static_cast<uint32>(sizeof(zeros));
+    if (writer->Write(zeros, chunk))
       return 0;
+    left -= chunk;
   }
 
   const int64 stop_position = writer->Position();
@@ -13,12 +13,270 @@
 #include <climits>
 
 #ifdef _MSC_VER
+#include <intrin.h>
+
 // Disable MSVC warnings that suggest making code non-portable.
 #pragma warning(disable : 4996)
 #endif
 
 mkvparser::IMkvReader::~IMkvReader() {}
 
+int mkvparser::IMkvReader::GetSpan(long long, long, const unsigned char**) {
+  return -1;  // not supported; caller must use Read
+}
+
+void mkvparser::IMkvReader::Prefetch(long long, long) {}
+
+mkvparser::IMkvTaskRunner::~IMkvTaskRunner() {}
+
+mkvparser::IMkvStreamHandler::~IMkvStreamHandler() {}
+
+long mkvparser::IMkvStreamHandler::OnSegment(Segment*) { return 0; }
+
+long mkvparser::IMkvStreamHandler::OnCluster(const Cluster*) { return 0; }
+
+long mkvparser::IMkvStreamHandler::OnClusterEnd(const Cluster*) { return 0; }
+
+namespace mkvparser {
+namespace {
+
+// Returns the length of the EBML variable-size integer whose first byte is
+// |b|, which is the number of leading zero bits plus one. |b| must be nonzero.
+inline long GetVIntLength(unsigned char b) {
+  assert(b != 0);
+#if defined(__GNUC__)
+  return __builtin_clz(b) - (8 * sizeof(unsigned int) - 8) + 1;
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse(&index, b);
+  return 8 - static_cast<long>(index);
+#else
+  long len = 1;
+
+  for (unsigned char m = 0x80; !(b & m); m >>= 1)
+    ++len;
+
+  return len;
+#endif
+}
+
+// Decodes the |len|-byte EBML variable-size integer at |buf|, removing the
+// length marker.
+inline long long DecodeVInt(const unsigned char* buf, long len) {
+  long long result = buf[0] & (0xFF >> len);
+
+  for (long i = 1; i < len; ++i) {
+    result <<= 8;
+    result |= buf[i];
+  }
+
+  return result;
+}
+
+// Look-ahead buffer used to decode element headers. Up to kCapacity bytes
+// are fetched with a single Read (or GetSpan), and the ID and size fields are
+// then decoded from memory. Whenever a field does not fit in the bytes that
+// are available, the functions below defer to the reader-based ReadUInt and
+// GetUIntLength, so results and error codes are the same as theirs.
+class HeaderReader {
+ public:
+  enum { kCapacity = 16 };
+
+  // |avail| is the number of bytes available from the reader; the buffer
+  // never reads past it.
+  HeaderReader(IMkvReader* pReader, long long avail)
+      : m_pReader(pReader),
+        m_avail(avail),
+        m_start(0),
+        m_size(0),
+        m_data(NULL) {}
+
+  long long GetUIntLength(long long pos, long& len) {
+    const unsigned char* const buf = Fetch(pos, 1);
+
+    if (buf == NULL)
+      return mkvparser::GetUIntLength(m_pReader, pos, len);
+
+    len = 1;
+
+    if (buf[0] == 0)  // we can't handle u-int values larger than 8 bytes
+      return E_FILE_FORMAT_INVALID;
+
+    len = GetVIntLength(buf[0]);
+    return 0;  // success
+  }
+
+  long long ReadUInt(long long pos, long& len) {
+    const unsigned char* buf = Fetch(pos, 1);
+
+    if (buf == NULL)
+      return mkvparser::ReadUInt(m_pReader, pos, len);
+
+    len = 1;
+
+    if (buf[0] == 0)  // we can't handle u-int values larger than 8 bytes
+      return E_FILE_FORMAT_INVALID;
+
+    const long n = GetVIntLength(buf[0]);
+
+    buf = Fetch(pos, n);
+
+    if (buf == NULL)
+      return mkvparser::ReadUInt(m_pReader, pos, len);
+
+    len = n;
+    return DecodeVInt(buf, n);
+  }
+
+  // Reads the byte at |pos| into |b|. Returns the status of IMkvReader::Read.
+  int ReadByte(long long pos, unsigned char& b) {
+    const unsigned char* const buf = Fetch(pos, 1);
+
+    if (buf == NULL)
+      return m_pReader->Read(pos, 1, &b);
+
+    b = buf[0];
+    return 0;  // success
+  }
+
+ private:
+  HeaderReader(const HeaderReader&);
+  HeaderReader& operator=(const HeaderReader&);
+
+  // Returns a pointer to the |len| bytes at |pos|, refilling the buffer from
+  // |pos| if they are not already present, or NULL if they are unavailable.
+  const unsigned char* Fetch(long long pos, long len) {
+    if ((pos >= m_start) && ((pos + len) <= (m_start + m_size)))
+      return m_data + (pos - m_start);
+
+    long long size = m_avail - pos;
+
+    if (size > kCapacity)
+      size = kCapacity;
+
+    if (size < len)
+      return NULL;
+
+    m_start = pos;
+    m_size = 0;
+
+    if (m_pReader->GetSpan(pos, static_cast<long>(size), &m_data) != 0) {
+      if (m_pReader->Read(pos, static_cast<long>(size), m_buf) != 0)
+        return NULL;
+
+      m_data = m_buf;
+    }
+
+    m_size = static_cast<long>(size);
+    return m_data;
+  }
+
+  IMkvReader* const m_pReader;
+  const long long m_avail;
+  long long m_start;
+  long m_size;
+  const unsigned char* m_data;
+  unsigned char m_buf[kCapacity];
+};
+
+// Sequential reader for the lacing header of a block. The header is fetched
+// with a single GetSpan, or a single Read of up to kCapacity bytes (more
+// only for very long Xiph headers), in place of one Read per size byte.
+class LaceReader {
+ public:
+  enum { kCapacity = 1024 };
+
+  // |pos| is the start of the lacing header, and |stop| the end of the
+  // block; the reader never reads past it.
+  LaceReader(IMkvReader* pReader, long long pos, long long stop)
+      : m_pReader(pReader),
+        m_pos(pos),
+        m_stop(stop),
+        m_start(pos),
+        m_size(0),
+        m_len(0),
+        m_data(NULL) {}
+
+  long long GetPosition() const { return m_pos; }
+
+  // Returns a pointer to at least |len| bytes at the current position, and
+  // sets |avail| to the number of bytes buffered there, or returns NULL if
+  // the bytes are beyond the block or cannot be read.
+  const unsigned char* Peek(long len, long& avail) {
+    if ((m_stop - m_pos) < len)
+      return NULL;
+
+    if ((m_pos + len) > (m_start + m_size)) {
+      long long size = m_stop - m_pos;
+
+      if (size > LONG_MAX)
+        size = LONG_MAX;
+
+      if (m_pReader->GetSpan(m_pos, static_cast<long>(size), &m_data) != 0) {
+        if (size > kCapacity)
+          size = kCapacity;
+
+        if (m_pReader->Read(m_pos, static_cast<long>(size), m_buf) != 0)
+          return NULL;
+
+        m_data = m_buf;
+      }
+
+      m_start = m_pos;
+      m_size = static_cast<long>(size);
+    }
+
+    const long offset = static_cast<long>(m_pos - m_start);
+
+    avail = m_size - offset;
+    return m_data + offset;
+  }
+
+  void Skip(long len) { m_pos += len; }
+
+  // Reads an EBML variable-size integer, removing the length marker.
+  // Returns a negative value on error.
+  long long ReadVInt() {
+    long avail;
+
+    const unsigned char* buf = Peek(1, avail);
+
+    if ((buf == NULL) || (buf[0] == 0))
+      return E_FILE_FORMAT_INVALID;
+
+    const long len = GetVIntLength(buf[0]);
+
+    buf = Peek(len, avail);
+
+    if (buf == NULL)
+      return E_FILE_FORMAT_INVALID;
+
+    m_pos += len;
+    m_len = len;
+
+    return DecodeVInt(buf, len);
+  }
+
+  // Length of the integer last read by ReadVInt.
+  long GetLength() const { return m_len; }
+
+ private:
+  LaceReader(const LaceReader&);
+  LaceReader& operator=(const LaceReader&);
+
+  IMkvReader* const m_pReader;
+  long long m_pos;
+  const long long m_stop;
+  long long m_start;
+  long m_size;
+  long m_len;
+  const unsigned char* m_data;
+  unsigned char m_buf[kCapacity];
+};
+
+}  // namespace
+}  // namespace mkvparser
+
 void mkvparser::GetVersion(int& major, int& minor, int& build, int& revision) {
   major = 1;
   minor = 0;
@@ -43,6 +301,22 @@ long long mkvparser::ReadUInt(IMkvReader* pReader, long long pos, long& len) {
 
   len = 1;
 
+  const unsigned char* span;
+
+  if (pReader->GetSpan(pos, 1, &span) == 0) {
+    if (span[0] == 0)  // we can't handle u-int values larger than 8 bytes
+      return E_FILE_FORMAT_INVALID;
+
+    const long n = GetVIntLength(span[0]);
+
+    if ((n == 1) || (pReader->GetSpan(pos, n, &span) == 0)) {
+      len = n;
+      return DecodeVInt(span, n);
+    }
+
+    // value is truncated; let Read report the underflow
+  }
+
   unsigned char b;
 
   status = pReader->Read(pos, 1, &b);
@@ -56,18 +330,27 @@ long long mkvparser::ReadUInt(IMkvReader* pReader, long long pos, long& len) {
   if (b == 0)  // we can't handle u-int values larger than 8 bytes
     return E_FILE_FORMAT_INVALID;
 
-  unsigned char m = 0x80;
-
-  while (!(b & m)) {
-    m >>= 1;
-    ++len;
-  }
+  const long n = GetVIntLength(b);
 
   //#ifdef _DEBUG
   //    assert((available - pos) >= len);
   //#endif
 
-  long long result = b & (~m);
+  if (n == 1)
+    return b & 0x7F;
+
+  // Read the remaining bytes at once; if that fails, read them one at a time
+  // below so that the caller sees the same status as before.
+
+  unsigned char buf[8];
+  buf[0] = b;
+
+  len = n;
+
+  if (pReader->Read(pos + 1, n - 1, buf + 1) == 0)
+    return DecodeVInt(buf, n);
+
+  long long result = b & (0xFF >> n);
   ++pos;
 
   for (int i = 1; i < len; ++i) {
@@ -120,12 +403,7 @@ long long mkvparser::GetUIntLength(IMkvReader* pReader, long long pos,
   if (b == 0)  // we can't handle u-int values larger than 8 bytes
     return E_FILE_FORMAT_INVALID;
 
-  unsigned char m = 0x80;
-
-  while (!(b & m)) {
-    m >>= 1;
-    ++len;
-  }
+  len = GetVIntLength(b);
 
   return 0;  // success
 }
@@ -142,6 +420,17 @@ long long mkvparser::UnserializeUInt(IMkvReader* pReader, long long pos,
 
   long long result = 0;
 
+  const unsigned char* span;
+
+  if (pReader->GetSpan(pos, static_cast<long>(size), &span) == 0) {
+    for (long long i = 0; i < size; ++i) {
+      result <<= 8;
+      result |= span[i];
+    }
+
+    return result;
+  }
+
   for (long long i = 0; i < size; ++i) {
     unsigned char b;
 
@@ -169,12 +458,17 @@ long mkvparser::UnserializeFloat(IMkvReader* pReader, long long pos,
 
   const long size = static_cast<long>(size_);
 
-  unsigned char buf[8];
+  unsigned char tmp[8];
+  const unsigned char* buf;
 
-  const int status = pReader->Read(pos, size, buf);
+  if (pReader->GetSpan(pos, size, &buf) != 0) {
+    const int status = pReader->Read(pos, size, tmp);
 
-  if (status < 0)  // error
-    return status;
+    if (status < 0)  // error
+      return status;
+
+    buf = tmp;
+  }
 
   if (size == 4) {
     union {
@@ -226,6 +520,19 @@ long mkvparser::UnserializeInt(IMkvReader* pReader, long long pos, long size,
   assert(size > 0);
   assert(size <= 8);
 
+  const unsigned char* span;
+
+  if (pReader->GetSpan(pos, size, &span) == 0) {
+    result = static_cast<signed char>(span[0]);
+
+    for (long i = 1; i < size; ++i) {
+      result <<= 8;
+      result |= span[i];
+    }
+
+    return 0;  // success
+  }
+
   {
     signed char b;
 
@@ -293,9 +600,16 @@ long mkvparser::ParseElementHeader(IMkvReader* pReader, long long& pos,
   if ((stop >= 0) && (pos >= stop))
     return E_FILE_FORMAT_INVALID;
 
+  long long total, avail;
+
+  if (pReader->Length(&total, &avail) < 0)
+    avail = 0;  // decode through the reader
+
+  HeaderReader header(pReader, avail);
+
   long len;
 
-  id = ReadUInt(pReader, pos, len);
+  id = header.ReadUInt(pos, len);
 
   if (id < 0)
     return E_FILE_FORMAT_INVALID;
@@ -305,7 +619,7 @@ long mkvparser::ParseElementHeader(IMkvReader* pReader, long long& pos,
   if ((stop >= 0) && (pos >= stop))
     return E_FILE_FORMAT_INVALID;
 
-  size = ReadUInt(pReader, pos, len);
+  size = header.ReadUInt(pos, len);
 
   if (size < 0)
     return E_FILE_FORMAT_INVALID;
@@ -610,7 +924,11 @@ Segment::Segment(IMkvReader* pReader, long long elem_start,
       m_clusters(NULL),
       m_clusterCount(0),
       m_clusterPreloadCount(0),
-      m_clusterSize(0) {}
+      m_clusterSize(0),
+      m_keyframeClusterCount(0),
+      m_trackFilter(NULL),
+      m_trackFilterCount(0),
+      m_frozen(false) {}
 
 Segment::~Segment() {
   const long count = m_clusterCount + m_clusterPreloadCount;
@@ -626,6 +944,7 @@ Segment::~Segment() {
   }
 
   delete[] m_clusters;
+  delete[] m_trackFilter;
 
   delete m_pTracks;
   delete m_pInfo;
@@ -926,6 +1245,9 @@ long long Segment::ParseHeaders() {
 }
 
 long Segment::LoadCluster(long long& pos, long& len) {
+  if (m_frozen)
+    return 1;  // all clusters have been loaded
+
   for (;;) {
     const long result = DoLoadCluster(pos, len);
 
@@ -1630,9 +1952,9 @@ void Segment::PreloadCluster(Cluster* pCluster, ptrdiff_t idx) {
 }
 
 long Segment::Load() {
-  assert(m_clusters == NULL);
-  assert(m_clusterSize == 0);
-  assert(m_clusterCount == 0);
+  // Clusters may have been installed already by LoadSeekIndex, in which
+  // case loading resumes after them.
+  assert((m_clusterCount == 0) || (m_clusterCount == m_keyframeClusterCount));
   // assert(m_size >= 0);
 
   // Outermost (level 0) segment object has been constructed,
@@ -2122,9 +2444,18 @@ Cues::Cues(Segment* pSegment, long long start_, long long size_,
       m_cue_points(NULL),
       m_count(0),
       m_preload_count(0),
-      m_pos(start_) {}
+      m_pos(start_),
+      m_index_times(NULL),
+      m_index_tracks(NULL),
+      m_index_positions(NULL),
+      m_index_count(0),
+      m_index_track_count(0) {}
 
 Cues::~Cues() {
+  delete[] m_index_times;
+  delete[] m_index_tracks;
+  delete[] m_index_positions;
+
   const long n = m_count + m_preload_count;
 
   CuePoint** p = m_cue_points;
@@ -2166,18 +2497,25 @@ void Cues::Init() const {
 
   long cue_points_size = 0;
 
+  long long total, avail;
+
+  if (pReader->Length(&total, &avail) < 0)
+    avail = 0;  // decode through the reader
+
+  HeaderReader header(pReader, avail);
+
   while (pos < stop) {
     const long long idpos = pos;
 
     long len;
 
-    const long long id = ReadUInt(pReader, pos, len);
+    const long long id = header.ReadUInt(pos, len);
     assert(id >= 0);  // TODO
     assert((pos + len) <= stop);
 
     pos += len;  // consume ID
 
-    const long long size = ReadUInt(pReader, pos, len);
+    const long long size = header.ReadUInt(pos, len);
     assert(size >= 0);
     assert((pos + len) <= stop);
 
@@ -2277,11 +2615,156 @@ bool Cues::LoadCuePoint() const {
   return false;  // no, we did not load a cue point
 }
 
+namespace {
+
+// Returns the number of elements of the ascending array |a|, of length |n|,
+// that are less than or equal to |value|. The loop has no data-dependent
+// branches, so it compiles to conditional moves.
+long CountNotGreater(const long long* a, long n, long long value) {
+  if (n <= 0)
+    return 0;
+
+  const long long* base = a;
+
+  while (n > 1) {
+    const long half = n / 2;
+    base += (base[half - 1] <= value) ? half : 0;
+    n -= half;
+  }
+
+  return static_cast<long>(base - a) + ((*base <= value) ? 1 : 0);
+}
+
+}  // namespace
+
+bool Cues::BuildIndex() const {
+  if (m_index_times)
+    return true;
+
+  while (LoadCuePoint()) {
+  }
+
+  if ((m_cue_points == NULL) || (m_count <= 0))
+    return false;
+
+  const long n = m_count;
+
+  // Collect the distinct track numbers, of which there are few.
+
+  long track_count = 0;
+  long tracks_size = 0;
+  long long* tracks = NULL;
+
+  for (long k = 0; k < n; ++k) {
+    const CuePoint* const pCP = m_cue_points[k];
+
+    for (size_t i = 0; i < pCP->m_track_positions_count; ++i) {
+      const long long track = pCP->m_track_positions[i].m_track;
+
+      long t = 0;
+
+      while ((t < track_count) && (tracks[t] != track))
+        ++t;
+
+      if (t < track_count)
+        continue;
+
+      if (track_count >= tracks_size) {
+        const long size = (tracks_size <= 0) ? 8 : 2 * tracks_size;
+
+        long long* const buf = new (std::nothrow) long long[size];
+
+        if (buf == NULL) {
+          delete[] tracks;
+          return false;
+        }
+
+        for (long j = 0; j < track_count; ++j)
+          buf[j] = tracks[j];
+
+        delete[] tracks;
+
+        tracks = buf;
+        tracks_size = size;
+      }
+
+      tracks[track_count++] = track;
+    }
+  }
+
+  long long* const times = new (std::nothrow) long long[n];
+
+  const CuePoint::TrackPosition** const positions =
+      new (std::nothrow) const CuePoint::TrackPosition* [n * track_count + 1];
+
+  if ((times == NULL) || (positions == NULL)) {
+    delete[] tracks;
+    delete[] times;
+    delete[] positions;
+
+    return false;
+  }
+
+  for (long i = 0; i < n * track_count; ++i)
+    positions[i] = NULL;
+
+  for (long k = 0; k < n; ++k) {
+    const CuePoint* const pCP = m_cue_points[k];
+
+    times[k] = pCP->GetTime(m_pSegment);
+
+    // As in CuePoint::Find, the first position for a track wins.
+
+    for (size_t i = pCP->m_track_positions_count; i > 0; --i) {
+      const CuePoint::TrackPosition& tp = pCP->m_track_positions[i - 1];
+
+      long t = 0;
+
+      while (tracks[t] != tp.m_track)
+        ++t;
+
+      positions[t * n + k] = &tp;
+    }
+  }
+
+  m_index_times = times;
+  m_index_tracks = tracks;
+  m_index_positions = positions;
+  m_index_count = n;
+  m_index_track_count = track_count;
+
+  return true;
+}
+
 bool Cues::Find(long long time_ns, const Track* pTrack, const CuePoint*& pCP,
                 const CuePoint::TrackPosition*& pTP) const {
   assert(time_ns >= 0);
   assert(pTrack);
 
+  if (m_index_times) {
+    // Same result as the search below: the last cue point whose time is at
+    // most time_ns, or the first cue point if there is none.
+
+    long k = 0;
+
+    if (time_ns > m_index_times[0])
+      k = CountNotGreater(m_index_times, m_index_count, time_ns) - 1;
+
+    pCP = m_cue_points[k];
+    pTP = NULL;
+
+    const long long track = pTrack->GetNumber();
+
+    for (long t = 0; t < m_index_track_count; ++t) {
+      if (m_index_tracks[t] == track) {
+        pTP = m_index_positions[t * m_index_count + k];
+        break;
+      }
+    }
+
+    return (pTP != NULL);
+  }
+
 #if 0
     LoadCuePoint();  //establish invariant
 
@@ -2624,6 +3107,9 @@ const BlockEntry* Segment::GetBlock(const CuePoint& cp,
   assert(i == j);
   // assert(Cluster::HasBlockEntries(this, tp.m_pos));
 
+  if (m_frozen)
+    return NULL;  // no cluster at this position
+
   Cluster* const pCluster = Cluster::Create(this, -1, tp.m_pos);  //, -1);
   assert(pCluster);
 
@@ -2679,6 +3165,9 @@ const Cluster* Segment::FindOrPreloadCluster(long long requested_pos) {
   assert(i == j);
   // assert(Cluster::HasBlockEntries(this, tp.m_pos));
 
+  if (m_frozen)
+    return NULL;  // no cluster at this position
+
   Cluster* const pCluster = Cluster::Create(this, -1, requested_pos);
   //-1);
   assert(pCluster);
@@ -2693,3483 +3182,5692 @@ const Cluster* Segment::FindOrPreloadCluster(long long requested_pos) {
   return pCluster;
 }
 
-CuePoint::CuePoint(long idx, long long pos)
-    : m_element_start(0),
-      m_element_size(0),
-      m_index(idx),
-      m_timecode(-1 * pos),
-      m_track_positions(NULL),
-      m_track_positions_count(0) {
-  assert(pos > 0);
-}
-
-CuePoint::~CuePoint() { delete[] m_track_positions; }
+namespace {
 
-void CuePoint::Load(IMkvReader* pReader) {
-  // odbgstream os;
-  // os << "CuePoint::Load(begin): timecode=" << m_timecode << endl;
+int CompareOffsets(const void* a, const void* b) {
+  const long long x = *static_cast<const long long*>(a);
+  const long long y = *static_cast<const long long*>(b);
 
-  if (m_timecode >= 0)  // already loaded
-    return;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
 
-  assert(m_track_positions == NULL);
-  assert(m_track_positions_count == 0);
+struct ParseClustersContext {
+  Cluster** clusters;
+  long* status;
+};
 
-  long long pos_ = -m_timecode;
-  const long long element_start = pos_;
+void ParseClusterTask(long index, void* context) {
+  ParseClustersContext* const ctx =
+      static_cast<ParseClustersContext*>(context);
 
-  long long stop;
+  const Cluster* const pCluster = ctx->clusters[index];
 
-  {
+  for (;;) {
+    long long pos;
     long len;
 
-    const long long id = ReadUInt(pReader, pos_, len);
-    assert(id == 0x3B);  // CuePoint ID
-    if (id != 0x3B)
+    const long status = pCluster->Parse(pos, len);
+
+    if (status != 0) {  // error, or done
+      ctx->status[index] = (status < 0) ? status : 0;
       return;
+    }
+  }
+}
 
-    pos_ += len;  // consume ID
+}  // namespace
 
-    const long long size = ReadUInt(pReader, pos_, len);
-    assert(size >= 0);
+long Segment::ParseClusters(const long long* positions, long count,
+                            IMkvTaskRunner* pRunner) {
+  if ((count < 0) || ((count > 0) && (positions == NULL)))
+    return -1;
 
-    pos_ += len;  // consume Size field
-    // pos_ now points to start of payload
+  if (m_frozen)
+    return -1;
 
-    stop = pos_ + size;
-  }
+  if (count == 0)
+    return 0;
 
-  const long long element_size = stop - element_start;
+  long long* const offsets = new (std::nothrow) long long[count];
+  Cluster** const clusters = new (std::nothrow) Cluster* [count];
+  long* const status = new (std::nothrow) long[count];
 
-  long long pos = pos_;
+  if ((offsets == NULL) || (clusters == NULL) || (status == NULL)) {
+    delete[] offsets;
+    delete[] clusters;
+    delete[] status;
 
-  // First count number of track positions
-
-  while (pos < stop) {
-    long len;
+    return -1;
+  }
 
-    const long long id = ReadUInt(pReader, pos, len);
-    assert(id >= 0);  // TODO
-    assert((pos + len) <= stop);
+  for (long i = 0; i < count; ++i)
+    offsets[i] = positions[i];
 
-    pos += len;  // consume ID
+  qsort(offsets, count, sizeof(long long), CompareOffsets);
 
-    const long long size = ReadUInt(pReader, pos, len);
-    assert(size >= 0);
-    assert((pos + len) <= stop);
+  // Create (but do not yet publish) a cluster for each position that is
+  // not in the index already.
 
-    pos += len;  // consume Size field
-    assert((pos + size) <= stop);
+  long result = 0;
+  long n = 0;
 
-    if (id == 0x33)  // CueTime ID
-      m_timecode = UnserializeUInt(pReader, pos, size);
+  for (long i = 0; i < count; ++i) {
+    const long long off = offsets[i];
 
-    else if (id == 0x37)  // CueTrackPosition(s) ID
-      ++m_track_positions_count;
+    if ((off < 0) || ((m_size >= 0) && (off >= m_size))) {
+      result = E_FILE_FORMAT_INVALID;
+      break;
+    }
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
-  }
+    if ((i > 0) && (off == offsets[i - 1]))
+      continue;  // duplicate
 
-  assert(m_timecode >= 0);
-  assert(m_track_positions_count > 0);
+    Cluster** i_ = m_clusters;
+    Cluster** j_ = m_clusters + m_clusterCount + m_clusterPreloadCount;
 
-  // os << "CuePoint::Load(cont'd): idpos=" << idpos
-  //   << " timecode=" << m_timecode
-  //   << endl;
+    while (i_ < j_) {
+      Cluster** const k = i_ + (j_ - i_) / 2;
+      const long long pos = (*k)->GetPosition();
 
-  m_track_positions = new TrackPosition[m_track_positions_count];
+      if (pos < off)
+        i_ = k + 1;
+      else
+        j_ = k;
+    }
 
-  // Now parse track positions
+    const long idx = static_cast<long>(i_ - m_clusters);
+    const long total = m_clusterCount + m_clusterPreloadCount;
 
-  TrackPosition* p = m_track_positions;
-  pos = pos_;
+    if ((idx < total) && (m_clusters[idx]->GetPosition() == off))
+      continue;  // already in the index
 
-  while (pos < stop) {
-    long len;
+    if (idx < m_clusterCount) {  // inside the loaded, contiguous range
+      result = E_FILE_FORMAT_INVALID;
+      break;
+    }
 
-    const long long id = ReadUInt(pReader, pos, len);
-    assert(id >= 0);  // TODO
-    assert((pos + len) <= stop);
+    clusters[n] = new (std::nothrow) Cluster(this, -1, m_start + off);
 
-    pos += len;  // consume ID
+    if (clusters[n] == NULL) {
+      result = -1;
+      break;
+    }
 
-    const long long size = ReadUInt(pReader, pos, len);
-    assert(size >= 0);
-    assert((pos + len) <= stop);
+    status[n++] = 0;
+  }
 
-    pos += len;  // consume Size field
-    assert((pos + size) <= stop);
+  if ((result == 0) && (n > 0)) {
+    ParseClustersContext context;
+    context.clusters = clusters;
+    context.status = status;
 
-    if (id == 0x37) {  // CueTrackPosition(s) ID
-      TrackPosition& tp = *p++;
-      tp.Parse(pReader, pos, size);
+    if (pRunner)
+      pRunner->Run(ParseClusterTask, &context, n);
+    else {
+      for (long i = 0; i < n; ++i)
+        ParseClusterTask(i, &context);
     }
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
+    for (long i = 0; i < n; ++i) {
+      if (status[i] < 0) {
+        result = status[i];
+        break;
+      }
+    }
   }
 
-  assert(size_t(p - m_track_positions) == m_track_positions_count);
+  if (result == 0) {
+    // Publish in ascending order, so that each insertion point follows the
+    // previous one.
 
-  m_element_start = element_start;
-  m_element_size = element_size;
-}
+    long idx = m_clusterCount;
 
-void CuePoint::TrackPosition::Parse(IMkvReader* pReader, long long start_,
-                                    long long size_) {
-  const long long stop = start_ + size_;
-  long long pos = start_;
+    for (long i = 0; i < n; ++i) {
+      Cluster* const pCluster = clusters[i];
+      const long long off = pCluster->GetPosition();
 
-  m_track = -1;
-  m_pos = -1;
-  m_block = 1;  // default
+      const long total = m_clusterCount + m_clusterPreloadCount;
 
-  while (pos < stop) {
-    long len;
+      while ((idx < total) && (m_clusters[idx]->GetPosition() < off))
+        ++idx;
 
-    const long long id = ReadUInt(pReader, pos, len);
-    assert(id >= 0);  // TODO
-    assert((pos + len) <= stop);
+      PreloadCluster(pCluster, idx++);
+    }
 
-    pos += len;  // consume ID
+    // Preloaded clusters that continue the loaded range are promoted now,
+    // as DoLoadCluster would do on reaching them.
 
-    const long long size = ReadUInt(pReader, pos, len);
-    assert(size >= 0);
-    assert((pos + len) <= stop);
+    while ((m_clusterPreloadCount > 0) && (m_pUnknownSize == NULL) &&
+           (m_pos >= 0)) {
+      Cluster* const pCluster = m_clusters[m_clusterCount];
+      assert(pCluster->m_index < 0);
 
-    pos += len;  // consume Size field
-    assert((pos + size) <= stop);
+      if (pCluster->m_element_start != m_pos)
+        break;
 
-    if (id == 0x77)  // CueTrack ID
-      m_track = UnserializeUInt(pReader, pos, size);
+      const long long element_size = pCluster->GetElementSize();
 
-    else if (id == 0x71)  // CueClusterPos ID
-      m_pos = UnserializeUInt(pReader, pos, size);
+      if (element_size <= 0)  // not parsed
+        break;
 
-    else if (id == 0x1378)  // CueBlockNumber
-      m_block = UnserializeUInt(pReader, pos, size);
+      pCluster->m_index = m_clusterCount;  // move from preloaded to loaded
+      ++m_clusterCount;
+      --m_clusterPreloadCount;
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
+      m_pos += element_size;  // consume cluster
+    }
+  } else {
+    for (long i = 0; i < n; ++i)
+      delete clusters[i];
   }
 
-  assert(m_pos >= 0);
-  assert(m_track > 0);
-  // assert(m_block > 0);
+  delete[] offsets;
+  delete[] clusters;
+  delete[] status;
+
+  return result;
 }
 
-const CuePoint::TrackPosition* CuePoint::Find(const Track* pTrack) const {
-  assert(pTrack);
+long Segment::BuildKeyframeIndex() {
+  if (m_pTracks == NULL)
+    return -1;
 
-  const long long n = pTrack->GetNumber();
+  // The cluster of unknown size, if any, is the last loaded one, and cannot
+  // be indexed until its size is known.
+  const long count = m_pUnknownSize ? m_clusterCount - 1 : m_clusterCount;
 
-  const TrackPosition* i = m_track_positions;
-  const TrackPosition* const j = i + m_track_positions_count;
+  while (m_keyframeClusterCount < count) {
+    Cluster* const pCluster = m_clusters[m_keyframeClusterCount];
+    assert(pCluster);
 
-  while (i != j) {
-    const TrackPosition& p = *i++;
+    const bool parsed = (pCluster->m_entries_count >= 0);
 
-    if (p.m_track == n)
-      return &p;
+    const long status = IndexNextCluster();
+
+    if (status < 0)  // error
+      return status;
+
+    if (!parsed)
+      pCluster->ReleaseEntries();
   }
 
-  return NULL;  // no matching track number found
+  return 0;  // success
 }
 
-long long CuePoint::GetTimeCode() const { return m_timecode; }
+long Segment::IndexNextCluster() {
+  const long idx = m_keyframeClusterCount;
+  assert(idx < m_clusterCount);
 
-long long CuePoint::GetTime(const Segment* pSegment) const {
-  assert(pSegment);
-  assert(m_timecode >= 0);
+  Cluster* const pCluster = m_clusters[idx];
+  assert(pCluster);
+  assert(pCluster->m_index == idx);
 
-  const SegmentInfo* const pInfo = pSegment->GetInfo();
-  assert(pInfo);
+  const BlockEntry* pEntry;
 
-  const long long scale = pInfo->GetTimeCodeScale();
-  assert(scale >= 1);
+  long status = pCluster->GetFirst(pEntry);
 
-  const long long time = scale * m_timecode;
+  while ((status >= 0) && (pEntry != NULL) && !pEntry->EOS()) {
+    const Block* const pBlock = pEntry->GetBlock();
+    assert(pBlock);
 
-  return time;
-}
+    const long tn = static_cast<long>(pBlock->GetTrackNumber());
+    const Track* const pTrack = m_pTracks->GetTrackByNumber(tn);
 
-#if 0
-long long Segment::Unparsed() const
-{
-    if (m_size < 0)
-        return LLONG_MAX;
+    // Video tracks index each keyframe. Every block of other tracks is a
+    // seek target, so they index the first of their blocks in each cluster.
+    bool indexed = false;
 
-    const long long stop = m_start + m_size;
+    if (pTrack && (pTrack->GetType() == Track::kVideo)) {
+      indexed = pBlock->IsKey();
+    } else if (pTrack) {
+      const long n = pTrack->m_keyframes_count;
+      indexed = (n <= 0) || (pTrack->m_keyframes[n - 1].cluster != idx);
+    }
 
-    const long long result = stop - m_pos;
-    assert(result >= 0);
+    if (indexed) {
+      Track::Keyframe keyframe;
+      keyframe.time = pBlock->GetTime(pCluster);
+      keyframe.cluster = idx;
+      keyframe.block = pEntry->GetIndex();
 
-    return result;
-}
-#else
-bool Segment::DoneParsing() const {
-  if (m_size < 0) {
-    long long total, avail;
+      if (!pTrack->AddKeyframe(keyframe))
+        status = -1;
+    }
 
-    const int status = m_pReader->Length(&total, &avail);
+    if (status >= 0)
+      status = pCluster->GetNext(pEntry, pEntry);
+  }
 
-    if (status < 0)  // error
-      return true;  // must assume done
+  if ((status >= 0) && (pCluster->m_element_size <= 0))
+    status = E_FILE_FORMAT_INVALID;
 
-    if (total < 0)
-      return false;  // assume live stream
+  if (status < 0) {
+    const unsigned long track_count = m_pTracks->GetTracksCount();
 
-    return (m_pos >= total);
-  }
+    for (unsigned long i = 0; i < track_count; ++i) {
+      const Track* const pTrack = m_pTracks->GetTrackByIndex(i);
 
-  const long long stop = m_start + m_size;
+      if (pTrack)
+        pTrack->TruncateKeyframes(idx);
+    }
 
-  return (m_pos >= stop);
+    return status;
+  }
+
+  ++m_keyframeClusterCount;
+  return 0;  // success
 }
-#endif
 
-const Cluster* Segment::GetFirst() const {
-  if ((m_clusters == NULL) || (m_clusterCount <= 0))
-    return &m_eos;
+void Segment::IndexParsedClusters() {
+  if (m_pTracks == NULL)
+    return;
 
-  Cluster* const pCluster = m_clusters[0];
-  assert(pCluster);
+  while (m_keyframeClusterCount < m_clusterCount) {
+    const Cluster* const pCluster = m_clusters[m_keyframeClusterCount];
+    assert(pCluster);
 
-  return pCluster;
+    if ((pCluster == m_pUnknownSize) || (pCluster->m_element_size <= 0) ||
+        (pCluster->m_pos <
+         (pCluster->m_element_start + pCluster->m_element_size))) {
+      break;  // not completely parsed
+    }
+
+    if (IndexNextCluster() < 0)
+      break;
+  }
 }
 
-const Cluster* Segment::GetLast() const {
-  if ((m_clusters == NULL) || (m_clusterCount <= 0))
-    return &m_eos;
+namespace {
 
-  const long idx = m_clusterCount - 1;
+// Layout of the seek index written by Segment::WriteSeekIndex. All fields
+// are big-endian 64-bit integers, except for the magic and version.
+//
+//   header:   magic (4 bytes), version (4 bytes), file length,
+//             segment start, segment size, cluster count
+//   cluster:  offset (relative to segment payload), element size,
+//             timecode, offset of the first block (relative to the cluster),
+//             flags (kSeekIndexSkimmed)
+//   tracks:   track count, then per track: number, keyframe count, and
+//             per keyframe: time (ns), cluster index, block index
+//
+// Version 1 had no cluster flags, so its cluster records are 32 bytes.
 
-  Cluster* const pCluster = m_clusters[idx];
-  assert(pCluster);
+const unsigned char kSeekIndexMagic[4] = {'W', 'S', 'I', 'X'};
+const unsigned long kSeekIndexVersion = 2;
 
-  return pCluster;
+const long long kSeekIndexHeaderSize = 40;
+const long long kSeekIndexClusterSize = 40;
+const long long kSeekIndexTrackSize = 16;
+const long long kSeekIndexKeyframeSize = 24;
+
+// Cluster flag: only the first block of the cluster was indexed.
+const long long kSeekIndexSkimmed = 1;
+
+unsigned char* SerializeUInt64(unsigned long long value, unsigned char* buf) {
+  for (int i = 7; i >= 0; --i) {
+    buf[i] = static_cast<unsigned char>(value & 0xFF);
+    value >>= 8;
+  }
+
+  return buf + 8;
 }
 
-unsigned long Segment::GetCount() const { return m_clusterCount; }
+long long UnserializeInt64(const unsigned char*& buf) {
+  unsigned long long value = 0;
 
-const Cluster* Segment::GetNext(const Cluster* pCurr) {
-  assert(pCurr);
-  assert(pCurr != &m_eos);
-  assert(m_clusters);
+  for (int i = 0; i < 8; ++i)
+    value = (value << 8) | *buf++;
 
-  long idx = pCurr->m_index;
+  return static_cast<long long>(value);
+}
 
-  if (idx >= 0) {
-    assert(m_clusterCount > 0);
-    assert(idx < m_clusterCount);
-    assert(pCurr == m_clusters[idx]);
+}  // namespace
 
-    ++idx;
+long long Segment::WriteSeekIndex(unsigned char* buf, long long size) {
+  const long status = BuildKeyframeIndex();
 
-    if (idx >= m_clusterCount)
-      return &m_eos;  // caller will LoadCluster as desired
+  if (status < 0)
+    return status;
 
-    Cluster* const pNext = m_clusters[idx];
-    assert(pNext);
-    assert(pNext->m_index >= 0);
-    assert(pNext->m_index == idx);
+  long long total, avail;
 
-    return pNext;
-  }
+  if (m_pReader->Length(&total, &avail) < 0)
+    return -1;
 
-  assert(m_clusterPreloadCount > 0);
+  const long cluster_count = m_keyframeClusterCount;
+  const unsigned long track_count = m_pTracks->GetTracksCount();
 
-  long long pos = pCurr->m_element_start;
+  long long index_size = kSeekIndexHeaderSize +
+                         cluster_count * kSeekIndexClusterSize + 8;
+  long long indexed_tracks = 0;
 
-  assert(m_size >= 0);  // TODO
-  const long long stop = m_start + m_size;  // end of segment
+  for (unsigned long i = 0; i < track_count; ++i) {
+    const Track* const pTrack = m_pTracks->GetTrackByIndex(i);
 
-  {
-    long len;
+    if ((pTrack == NULL) || (pTrack->m_keyframes_count <= 0))
+      continue;
 
-    long long result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);
-    assert((pos + len) <= stop);  // TODO
-    if (result != 0)
-      return NULL;
+    index_size += kSeekIndexTrackSize +
+                  pTrack->m_keyframes_count * kSeekIndexKeyframeSize;
+    ++indexed_tracks;
+  }
 
-    const long long id = ReadUInt(m_pReader, pos, len);
-    assert(id == 0x0F43B675);  // Cluster ID
-    if (id != 0x0F43B675)
-      return NULL;
+  if ((buf == NULL) || (size < index_size))
+    return index_size;
 
-    pos += len;  // consume ID
+  unsigned char* p = buf;
 
-    // Read Size
-    result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);  // TODO
-    assert((pos + len) <= stop);  // TODO
+  memcpy(p, kSeekIndexMagic, 4);
+  p += 4;
 
-    const long long size = ReadUInt(m_pReader, pos, len);
-    assert(size > 0);  // TODO
-    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
+  for (int i = 3; i >= 0; --i)
+    *p++ = static_cast<unsigned char>((kSeekIndexVersion >> (8 * i)) & 0xFF);
 
-    pos += len;  // consume length of size of element
-    assert((pos + size) <= stop);  // TODO
+  p = SerializeUInt64(total, p);
+  p = SerializeUInt64(m_start, p);
+  p = SerializeUInt64(m_size, p);
+  p = SerializeUInt64(cluster_count, p);
 
-    // Pos now points to start of payload
+  for (long i = 0; i < cluster_count; ++i) {
+    const Cluster* const pCluster = m_clusters[i];
 
-    pos += size;  // consume payload
+    p = SerializeUInt64(pCluster->GetPosition(), p);
+    p = SerializeUInt64(pCluster->m_element_size, p);
+    p = SerializeUInt64(pCluster->m_timecode, p);
+    p = SerializeUInt64(
+        pCluster->m_entries_start - pCluster->m_element_start, p);
+    p = SerializeUInt64(pCluster->m_skimmed ? kSeekIndexSkimmed : 0, p);
   }
 
-  long long off_next = 0;
+  p = SerializeUInt64(indexed_tracks, p);
 
-  while (pos < stop) {
-    long len;
+  for (unsigned long i = 0; i < track_count; ++i) {
+    const Track* const pTrack = m_pTracks->GetTrackByIndex(i);
 
-    long long result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);
-    assert((pos + len) <= stop);  // TODO
-    if (result != 0)
-      return NULL;
+    if ((pTrack == NULL) || (pTrack->m_keyframes_count <= 0))
+      continue;
 
-    const long long idpos = pos;  // pos of next (potential) cluster
+    p = SerializeUInt64(pTrack->GetNumber(), p);
+    p = SerializeUInt64(pTrack->m_keyframes_count, p);
 
-    const long long id = ReadUInt(m_pReader, idpos, len);
-    assert(id > 0);  // TODO
-
-    pos += len;  // consume ID
-
-    // Read Size
-    result = GetUIntLength(m_pReader, pos, len);
-    assert(result == 0);  // TODO
-    assert((pos + len) <= stop);  // TODO
+    for (long k = 0; k < pTrack->m_keyframes_count; ++k) {
+      const Track::Keyframe& keyframe = pTrack->m_keyframes[k];
 
-    const long long size = ReadUInt(m_pReader, pos, len);
-    assert(size >= 0);  // TODO
+      p = SerializeUInt64(keyframe.time, p);
+      p = SerializeUInt64(keyframe.cluster, p);
+      p = SerializeUInt64(keyframe.block, p);
+    }
+  }
 
-    pos += len;  // consume length of size of element
-    assert((pos + size) <= stop);  // TODO
+  assert((p - buf) == index_size);
 
-    // Pos now points to start of payload
+  return index_size;
+}
 
-    if (size == 0)  // weird
-      continue;
+long Segment::LoadSeekIndex(IMkvReader* pIndexReader) {
+  if (pIndexReader == NULL)
+    return -1;
 
-    if (id == 0x0F43B675) {  // Cluster ID
-      const long long off_next_ = idpos - m_start;
+  if ((m_pInfo == NULL) || (m_pTracks == NULL))
+    return -1;  // ParseHeaders has not completed
 
-      long long pos_;
-      long len_;
+  if ((m_clusterCount > 0) || (m_clusterPreloadCount > 0) || (m_pos < 0))
+    return -1;  // clusters have been loaded already
 
-      const long status = Cluster::HasBlockEntries(this, off_next_, pos_, len_);
+  long long file_total, file_avail;
 
-      assert(status >= 0);
+  long status = m_pReader->Length(&file_total, &file_avail);
 
-      if (status > 0) {
-        off_next = off_next_;
-        break;
-      }
-    }
+  if (status < 0)
+    return status;
 
-    pos += size;  // consume payload
-  }
+  long long total, avail;
 
-  if (off_next <= 0)
-    return 0;
+  status = pIndexReader->Length(&total, &avail);
 
-  Cluster** const ii = m_clusters + m_clusterCount;
-  Cluster** i = ii;
+  if (status < 0)
+    return status;
 
-  Cluster** const jj = ii + m_clusterPreloadCount;
-  Cluster** j = jj;
+  if (total < 0)
+    total = avail;
 
-  while (i < j) {
-    // INVARIANT:
-    //[0, i) < pos_next
-    //[i, j) ?
-    //[j, jj)  > pos_next
+  if ((total < (kSeekIndexHeaderSize + 8)) || (total > LONG_MAX))
+    return E_FILE_FORMAT_INVALID;
 
-    Cluster** const k = i + (j - i) / 2;
-    assert(k < jj);
+  const long buflen = static_cast<long>(total);
 
-    Cluster* const pNext = *k;
-    assert(pNext);
-    assert(pNext->m_index < 0);
+  unsigned char* const buf = new (std::nothrow) unsigned char[buflen];
 
-    // const long long pos_ = pNext->m_pos;
-    // assert(pos_);
-    // pos = pos_ * ((pos_ < 0) ? -1 : 1);
+  if (buf == NULL)
+    return -1;
 
-    pos = pNext->GetPosition();
+  status = pIndexReader->Read(0, buflen, buf);
 
-    if (pos < off_next)
-      i = k + 1;
-    else if (pos > off_next)
-      j = k;
-    else
-      return pNext;
+  if (status != 0) {
+    delete[] buf;
+    return (status < 0) ? status : E_BUFFER_NOT_FULL;
   }
 
-  assert(i == j);
-
-  Cluster* const pNext = Cluster::Create(this, -1, off_next);
-  assert(pNext);
-
-  const ptrdiff_t idx_next = i - m_clusters;  // insertion position
+  // Validate the entire index before changing any state.
 
-  PreloadCluster(pNext, idx_next);
-  assert(m_clusters);
-  assert(idx_next < m_clusterSize);
-  assert(m_clusters[idx_next] == pNext);
+  const unsigned char* p = buf;
+  const unsigned char* const end = buf + buflen;
 
-  return pNext;
-}
+  unsigned long version = 0;
 
-long Segment::ParseNext(const Cluster* pCurr, const Cluster*& pResult,
-                        long long& pos, long& len) {
-  assert(pCurr);
-  assert(!pCurr->EOS());
-  assert(m_clusters);
+  for (int i = 4; i < 8; ++i)
+    version = (version << 8) | buf[i];
 
-  pResult = 0;
+  p += 8;
 
-  if (pCurr->m_index >= 0) {  // loaded (not merely preloaded)
-    assert(m_clusters[pCurr->m_index] == pCurr);
+  const long long file_length = UnserializeInt64(p);
+  const long long start = UnserializeInt64(p);
+  const long long size = UnserializeInt64(p);
+  const long long cluster_count = UnserializeInt64(p);
 
-    const long next_idx = pCurr->m_index + 1;
+  status = 0;
 
-    if (next_idx < m_clusterCount) {
-      pResult = m_clusters[next_idx];
-      return 0;  // success
-    }
+  if ((memcmp(buf, kSeekIndexMagic, 4) != 0) ||
+      (version != kSeekIndexVersion) || (file_length != file_total) ||
+      (start != m_start) ||
+      (size != m_size) || (cluster_count < 0) ||
+      (cluster_count > (end - p - 8) / kSeekIndexClusterSize)) {
+    status = E_FILE_FORMAT_INVALID;
+  }
 
-    // curr cluster is last among loaded
+  const unsigned char* const clusters = p;
 
-    const long result = LoadCluster(pos, len);
+  long long prev_stop = m_pos - m_start;  // where the first cluster starts
 
-    if (result < 0)  // error or underflow
-      return result;
+  for (long long i = 0; (status == 0) && (i < cluster_count); ++i) {
+    const long long off = UnserializeInt64(p);
+    const long long element_size = UnserializeInt64(p);
+    const long long timecode = UnserializeInt64(p);
+    const long long entries_off = UnserializeInt64(p);
+    const long long flags = UnserializeInt64(p);
 
-    if (result > 0)  // no more clusters
-    {
-      // pResult = &m_eos;
-      return 1;
+    if ((off < prev_stop) || (element_size <= 0) || (timecode < 0) ||
+        (entries_off <= 0) || (entries_off >= element_size) ||
+        ((flags & ~kSeekIndexSkimmed) != 0) ||
+        ((m_size >= 0) && (element_size > (m_size - off)))) {
+      status = E_FILE_FORMAT_INVALID;
     }
 
-    pResult = GetLast();
-    return 0;  // success
+    prev_stop = off + element_size;
   }
 
-  assert(m_pos > 0);
-
-  long long total, avail;
-
-  long status = m_pReader->Length(&total, &avail);
+  long long track_count = 0;
+  const unsigned char* tracks = NULL;
 
-  if (status < 0)  // error
-    return status;
+  if (status == 0) {
+    track_count = UnserializeInt64(p);
+    tracks = p;
 
-  assert((total < 0) || (avail <= total));
+    if (track_count < 0)
+      status = E_FILE_FORMAT_INVALID;
+  }
 
-  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+  for (long long i = 0; (status == 0) && (i < track_count); ++i) {
+    if ((end - p) < kSeekIndexTrackSize) {
+      status = E_FILE_FORMAT_INVALID;
+      break;
+    }
 
-  // interrogate curr cluster
+    p += 8;  // track number
 
-  pos = pCurr->m_element_start;
+    const long long count = UnserializeInt64(p);
 
-  if (pCurr->m_element_size >= 0)
-    pos += pCurr->m_element_size;
-  else {
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
+    if ((count <= 0) || (count > (end - p) / kSeekIndexKeyframeSize) ||
+        (count > LONG_MAX)) {
+      status = E_FILE_FORMAT_INVALID;
+      break;
     }
 
-    long long result = GetUIntLength(m_pReader, pos, len);
+    long long prev_cluster = 0;
+    long long prev_block = -1;
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    for (long long k = 0; k < count; ++k) {
+      p += 8;  // time
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+      const long long cluster = UnserializeInt64(p);
+      const long long block = UnserializeInt64(p);
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+      if ((cluster < prev_cluster) || (cluster >= cluster_count) ||
+          (block < 0) || (block > LONG_MAX) ||
+          ((cluster == prev_cluster) && (block <= prev_block))) {
+        status = E_FILE_FORMAT_INVALID;
+        break;
+      }
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+      prev_cluster = cluster;
+      prev_block = block;
+    }
+  }
 
-    const long long id = ReadUInt(m_pReader, pos, len);
+  if ((status == 0) && (p != end))
+    status = E_FILE_FORMAT_INVALID;
 
-    if (id != 0x0F43B675)  // weird: not Cluster ID
-      return -1;
+  // Allocate everything needed, so that installing cannot fail halfway.
 
-    pos += len;  // consume ID
+  Cluster** const pClusters =
+      (status == 0) ? new (std::nothrow) Cluster* [cluster_count + 1] : NULL;
 
-    // Read Size
+  Track::Keyframe** const keyframes =
+      (status == 0) ? new (std::nothrow) Track::Keyframe* [track_count + 1]
+                    : NULL;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+  if ((status == 0) && ((pClusters == NULL) || (keyframes == NULL)))
+    status = -1;
 
-    result = GetUIntLength(m_pReader, pos, len);
+  long long created = 0;
+  long long allocated = 0;
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+  if (status == 0) {
+    p = clusters;
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+    for (; created < cluster_count; ++created) {
+      const long long off = UnserializeInt64(p);
+      const long long element_size = UnserializeInt64(p);
+      const long long timecode = UnserializeInt64(p);
+      const long long entries_off = UnserializeInt64(p);
+      const long long flags = UnserializeInt64(p);
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+      const long idx = static_cast<long>(created);
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+      Cluster* const pCluster =
+          new (std::nothrow) Cluster(this, idx, m_start + off);
 
-    const long long size = ReadUInt(m_pReader, pos, len);
+      if (pCluster == NULL) {
+        status = -1;
+        break;
+      }
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+      // Install the state that Cluster::Load would have established.
 
-    pos += len;  // consume size field
+      pCluster->m_element_size = element_size;
+      pCluster->m_timecode = timecode;
+      pCluster->m_entries_start = pCluster->m_element_start + entries_off;
+      pCluster->m_pos = pCluster->m_entries_start;
+      pCluster->m_skimmed = ((flags & kSeekIndexSkimmed) != 0);
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+      pClusters[created] = pCluster;
+    }
 
-    if (size == unknown_size)  // TODO: should never happen
-      return E_FILE_FORMAT_INVALID;  // TODO: resolve this
+    p = tracks;
 
-    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
+    for (; (status == 0) && (allocated < track_count); ++allocated) {
+      p += 8;  // track number
 
-    if ((segment_stop >= 0) && ((pos + size) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+      const long long count = UnserializeInt64(p);
 
-    // Pos now points to start of payload
+      keyframes[allocated] = new (std::nothrow) Track::Keyframe[count];
 
-    pos += size;  // consume payload (that is, the current cluster)
-    assert((segment_stop < 0) || (pos <= segment_stop));
+      if (keyframes[allocated] == NULL)
+        status = -1;
 
-    // By consuming the payload, we are assuming that the curr
-    // cluster isn't interesting.  That is, we don't bother checking
-    // whether the payload of the curr cluster is less than what
-    // happens to be available (obtained via IMkvReader::Length).
-    // Presumably the caller has already dispensed with the current
-    // cluster, and really does want the next cluster.
+      p += count * kSeekIndexKeyframeSize;
+    }
   }
 
-  // pos now points to just beyond the last fully-loaded cluster
+  if (status != 0) {
+    for (long long i = 0; i < created; ++i)
+      delete pClusters[i];
 
-  for (;;) {
-    const long status = DoParseNext(pResult, pos, len);
+    for (long long i = 0; i < allocated; ++i)
+      delete[] keyframes[i];
 
-    if (status <= 1)
-      return status;
+    delete[] pClusters;
+    delete[] keyframes;
+    delete[] buf;
+
+    return status;
   }
-}
 
-long Segment::DoParseNext(const Cluster*& pResult, long long& pos, long& len) {
-  long long total, avail;
+  for (long long i = 0; i < cluster_count; ++i)
+    AppendCluster(pClusters[i]);
 
-  long status = m_pReader->Length(&total, &avail);
+  p = tracks;
 
-  if (status < 0)  // error
-    return status;
+  for (long long i = 0; i < track_count; ++i) {
+    const long tn = static_cast<long>(UnserializeInt64(p));
+    const long count = static_cast<long>(UnserializeInt64(p));
 
-  assert((total < 0) || (avail <= total));
+    Track::Keyframe* const pKeyframes = keyframes[i];
 
-  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
+    for (long k = 0; k < count; ++k) {
+      Track::Keyframe& keyframe = pKeyframes[k];
 
-  // Parse next cluster.  This is strictly a parsing activity.
-  // Creation of a new cluster object happens later, after the
-  // parsing is done.
+      keyframe.time = UnserializeInt64(p);
+      keyframe.cluster = static_cast<long>(UnserializeInt64(p));
+      keyframe.block = static_cast<long>(UnserializeInt64(p));
+    }
 
-  long long off_next = 0;
-  long long cluster_size = -1;
+    const Track* const pTrack = m_pTracks->GetTrackByNumber(tn);
 
-  for (;;) {
-    if ((total >= 0) && (pos >= total))
-      return 1;  // EOF
+    if ((pTrack == NULL) || (pTrack->GetType() != Track::kVideo)) {
+      delete[] pKeyframes;  // not a track we index
+      continue;
+    }
 
-    if ((segment_stop >= 0) && (pos >= segment_stop))
-      return 1;  // EOF
+    delete[] pTrack->m_keyframes;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+    pTrack->m_keyframes = pKeyframes;
+    pTrack->m_keyframes_count = count;
+    pTrack->m_keyframes_size = count;
+  }
 
-    long long result = GetUIntLength(m_pReader, pos, len);
+  m_keyframeClusterCount = m_clusterCount;
+  m_pos = m_start + prev_stop;
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+  delete[] pClusters;
+  delete[] keyframes;
+  delete[] buf;
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+  return 0;  // success
+}
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+long Segment::SkimClusters(long long& pos, long& len) {
+  if ((m_pInfo == NULL) || (m_pTracks == NULL))
+    return -1;  // ParseHeaders has not completed
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+  const long long scale = m_pInfo->GetTimeCodeScale();
+  assert(scale >= 1);
 
-    const long long idpos = pos;  // absolute
-    const long long idoff = pos - m_start;  // relative
+  for (;;) {
+    // The cluster of unknown size, if any, is the last loaded one, and
+    // cannot be indexed until its size is known.
+    const long count = m_pUnknownSize ? m_clusterCount - 1 : m_clusterCount;
 
-    const long long id = ReadUInt(m_pReader, idpos, len);  // absolute
+    while (m_keyframeClusterCount < count) {
+      const long idx = m_keyframeClusterCount;
 
-    if (id < 0)  // error
-      return static_cast<long>(id);
+      Cluster* const pCluster = m_clusters[idx];
+      assert(pCluster);
+      assert(pCluster->m_index == idx);
 
-    if (id == 0)  // weird
-      return -1;  // generic error
+      long status = pCluster->Load(pos, len);
 
-    pos += len;  // consume ID
+      if (status < 0)  // error, or underflow
+        return status;
 
-    // Read Size
+      if (pCluster->m_element_size <= 0)
+        return E_FILE_FORMAT_INVALID;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+      long long track, timecode;
+      bool key;
 
-    result = GetUIntLength(m_pReader, pos, len);
+      status = pCluster->SkimFirstBlock(track, timecode, key, pos, len);
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+      if (status < 0)  // error, or underflow
+        return status;
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+      if (status == 0) {
+        const Track* const pTrack = m_pTracks->GetTrackByNumber(track);
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+        if (pTrack && (key || (pTrack->GetType() != Track::kVideo))) {
+          Track::Keyframe keyframe;
+          keyframe.time = (pCluster->m_timecode + timecode) * scale;
+          keyframe.cluster = idx;
+          keyframe.block = 0;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+          if (!pTrack->AddKeyframe(keyframe))
+            return -1;
+        }
+      }
 
-    const long long size = ReadUInt(m_pReader, pos, len);
+      pCluster->m_skimmed = true;
+      ++m_keyframeClusterCount;
+    }
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+    const long status = LoadCluster(pos, len);
 
-    pos += len;  // consume length of size of element
-
-    // Pos now points to start of payload
+    if (status < 0)  // error, or underflow
+      return status;
 
-    if (size == 0)  // weird
-      continue;
+    if (status > 0)  // no more clusters
+      return 0;
+  }
+}
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+long Segment::SetTrackFilter(const long long* tracks, long count) {
+  if (m_frozen)
+    return -1;
 
-    if ((segment_stop >= 0) && (size != unknown_size) &&
-        ((pos + size) > segment_stop)) {
-      return E_FILE_FORMAT_INVALID;
-    }
+  long long* filter = NULL;
 
-    if (id == 0x0C53BB6B) {  // Cues ID
-      if (size == unknown_size)
-        return E_FILE_FORMAT_INVALID;
+  if (tracks != NULL) {
+    if (count < 0)
+      return -1;
 
-      const long long element_stop = pos + size;
+    filter = new (std::nothrow) long long[count + 1];
 
-      if ((segment_stop >= 0) && (element_stop > segment_stop))
-        return E_FILE_FORMAT_INVALID;
+    if (filter == NULL)
+      return -1;
 
-      const long long element_start = idpos;
-      const long long element_size = element_stop - element_start;
+    for (long i = 0; i < count; ++i)
+      filter[i] = tracks[i];
+  }
 
-      if (m_pCues == NULL) {
-        m_pCues = new Cues(this, pos, size, element_start, element_size);
-        assert(m_pCues);  // TODO
-      }
+  delete[] m_trackFilter;
 
-      pos += size;  // consume payload
-      assert((segment_stop < 0) || (pos <= segment_stop));
+  m_trackFilter = filter;
+  m_trackFilterCount = (filter == NULL) ? 0 : count;
 
-      continue;
-    }
+  return 0;  // success
+}
 
-    if (id != 0x0F43B675) {  // not a Cluster ID
-      if (size == unknown_size)
-        return E_FILE_FORMAT_INVALID;
+bool Segment::IsTrackParsed(long long track) const {
+  if (m_trackFilter == NULL)
+    return true;
 
-      pos += size;  // consume payload
-      assert((segment_stop < 0) || (pos <= segment_stop));
+  for (long i = 0; i < m_trackFilterCount; ++i) {
+    if (m_trackFilter[i] == track)
+      return true;
+  }
 
-      continue;
-    }
+  return false;
+}
 
-#if 0  // this is commented-out to support incremental cluster parsing
-        len = static_cast<long>(size);
+long Segment::ReleaseCluster(const Cluster* pCluster) {
+  if ((pCluster == NULL) || pCluster->EOS())
+    return -1;
 
-        if (element_stop > avail)
-            return E_BUFFER_NOT_FULL;
-#endif
+  if (pCluster->m_pSegment != this)
+    return -1;
 
-    // We have a cluster.
+  if (m_frozen)
+    return -1;  // entries may be in use by other threads
 
-    off_next = idoff;
+  if (pCluster == m_pUnknownSize)
+    return -1;  // still being parsed
 
-    if (size != unknown_size)
-      cluster_size = size;
+  if (pCluster->m_timecode < 0)  // not loaded, so there is nothing to free
+    return 0;
 
-    break;
-  }
+  if (pCluster->m_element_size < 0)
+    return -1;  // size is not known until parsing completes
 
-  assert(off_next > 0);  // have cluster
+  pCluster->ReleaseEntries();
 
-  // We have parsed the next cluster.
-  // We have not created a cluster object yet.  What we need
-  // to do now is determine whether it has already be preloaded
-  //(in which case, an object for this cluster has already been
-  // created), and if not, create a new cluster object.
+  return 0;  // success
+}
 
-  Cluster** const ii = m_clusters + m_clusterCount;
-  Cluster** i = ii;
+long Segment::Freeze() {
+  if (m_frozen)
+    return 0;
 
-  Cluster** const jj = ii + m_clusterPreloadCount;
-  Cluster** j = jj;
+  const long long header_status = ParseHeaders();
 
-  while (i < j) {
-    // INVARIANT:
-    //[0, i) < pos_next
-    //[i, j) ?
-    //[j, jj)  > pos_next
+  if (header_status < 0)  // error
+    return static_cast<long>(header_status);
 
-    Cluster** const k = i + (j - i) / 2;
-    assert(k < jj);
+  if (header_status > 0)  // underflow
+    return E_BUFFER_NOT_FULL;
 
-    const Cluster* const pNext = *k;
-    assert(pNext);
-    assert(pNext->m_index < 0);
+  for (;;) {
+    const long status = LoadCluster();
 
-    pos = pNext->GetPosition();
-    assert(pos >= 0);
+    if (status < 0)  // error or underflow
+      return status;
 
-    if (pos < off_next)
-      i = k + 1;
-    else if (pos > off_next)
-      j = k;
-    else {
-      pResult = pNext;
-      return 0;  // success
-    }
+    if (status > 0)  // no more clusters
+      break;
   }
 
-  assert(i == j);
+  if ((m_pUnknownSize != NULL) || !DoneParsing())
+    return E_BUFFER_NOT_FULL;
 
-  long long pos_;
-  long len_;
+  // Parse the preloaded clusters too, since cue points may refer to them.
 
-  status = Cluster::HasBlockEntries(this, off_next, pos_, len_);
+  const long count = m_clusterCount + m_clusterPreloadCount;
 
-  if (status < 0) {  // error or underflow
-    pos = pos_;
-    len = len_;
+  for (long i = 0; i < count; ++i) {
+    const Cluster* const pCluster = m_clusters[i];
+    assert(pCluster);
 
-    return status;
+    for (;;) {
+      long long pos;
+      long len;
+
+      const long status = pCluster->Parse(pos, len);
+
+      if (status < 0)  // error or underflow
+        return status;
+
+      if (status > 0)  // no more entries
+        break;
+    }
   }
 
-  if (status > 0) {  // means "found at least one block entry"
-    Cluster* const pNext = Cluster::Create(this,
-                                           -1,  // preloaded
-                                           off_next);
-    // element_size);
-    assert(pNext);
+  const long status = BuildKeyframeIndex();
 
-    const ptrdiff_t idx_next = i - m_clusters;  // insertion position
+  if (status < 0)  // error
+    return status;
 
-    PreloadCluster(pNext, idx_next);
-    assert(m_clusters);
-    assert(idx_next < m_clusterSize);
-    assert(m_clusters[idx_next] == pNext);
+  if (m_keyframeClusterCount < m_clusterCount)
+    return E_FILE_FORMAT_INVALID;
 
-    pResult = pNext;
-    return 0;  // success
+  if ((m_pCues != NULL) && !m_pCues->BuildIndex() &&
+      (m_pCues->GetCount() > 0)) {
+    return -1;  // out of memory
   }
 
-  // status == 0 means "no block entries found"
+  m_frozen = true;
+  return 0;  // success
+}
 
-  if (cluster_size < 0) {  // unknown size
-    const long long payload_pos = pos;  // absolute pos of cluster payload
+bool Segment::IsFrozen() const { return m_frozen; }
 
-    for (;;) {  // determine cluster size
-      if ((total >= 0) && (pos >= total))
-        break;
+CuePoint::CuePoint(long idx, long long pos)
+    : m_element_start(0),
+      m_element_size(0),
+      m_index(idx),
+      m_timecode(-1 * pos),
+      m_track_positions(NULL),
+      m_track_positions_count(0) {
+  assert(pos > 0);
+}
 
-      if ((segment_stop >= 0) && (pos >= segment_stop))
-        break;  // no more clusters
+CuePoint::~CuePoint() { delete[] m_track_positions; }
 
-      // Read ID
+void CuePoint::Load(IMkvReader* pReader) {
+  // odbgstream os;
+  // os << "CuePoint::Load(begin): timecode=" << m_timecode << endl;
 
-      if ((pos + 1) > avail) {
-        len = 1;
-        return E_BUFFER_NOT_FULL;
-      }
+  if (m_timecode >= 0)  // already loaded
+    return;
 
-      long long result = GetUIntLength(m_pReader, pos, len);
+  assert(m_track_positions == NULL);
+  assert(m_track_positions_count == 0);
 
-      if (result < 0)  // error
-        return static_cast<long>(result);
+  long long pos_ = -m_timecode;
+  const long long element_start = pos_;
 
-      if (result > 0)  // weird
-        return E_BUFFER_NOT_FULL;
+  long long stop;
 
-      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-        return E_FILE_FORMAT_INVALID;
+  {
+    long len;
 
-      if ((pos + len) > avail)
-        return E_BUFFER_NOT_FULL;
+    const long long id = ReadUInt(pReader, pos_, len);
+    assert(id == 0x3B);  // CuePoint ID
+    if (id != 0x3B)
+      return;
 
-      const long long idpos = pos;
-      const long long id = ReadUInt(m_pReader, idpos, len);
+    pos_ += len;  // consume ID
 
-      if (id < 0)  // error (or underflow)
-        return static_cast<long>(id);
+    const long long size = ReadUInt(pReader, pos_, len);
+    assert(size >= 0);
 
-      // This is the distinguished set of ID's we use to determine
-      // that we have exhausted the sub-element's inside the cluster
-      // whose ID we parsed earlier.
+    pos_ += len;  // consume Size field
+    // pos_ now points to start of payload
 
-      if (id == 0x0F43B675)  // Cluster ID
-        break;
+    stop = pos_ + size;
+  }
 
-      if (id == 0x0C53BB6B)  // Cues ID
-        break;
+  const long long element_size = stop - element_start;
 
-      pos += len;  // consume ID (of sub-element)
+  long long pos = pos_;
 
-      // Read Size
+  // First count number of track positions
 
-      if ((pos + 1) > avail) {
-        len = 1;
-        return E_BUFFER_NOT_FULL;
-      }
+  while (pos < stop) {
+    long len;
 
-      result = GetUIntLength(m_pReader, pos, len);
+    const long long id = ReadUInt(pReader, pos, len);
+    assert(id >= 0);  // TODO
+    assert((pos + len) <= stop);
 
-      if (result < 0)  // error
-        return static_cast<long>(result);
+    pos += len;  // consume ID
 
-      if (result > 0)  // weird
-        return E_BUFFER_NOT_FULL;
+    const long long size = ReadUInt(pReader, pos, len);
+    assert(size >= 0);
+    assert((pos + len) <= stop);
 
-      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-        return E_FILE_FORMAT_INVALID;
+    pos += len;  // consume Size field
+    assert((pos + size) <= stop);
 
-      if ((pos + len) > avail)
-        return E_BUFFER_NOT_FULL;
+    if (id == 0x33)  // CueTime ID
+      m_timecode = UnserializeUInt(pReader, pos, size);
 
-      const long long size = ReadUInt(m_pReader, pos, len);
+    else if (id == 0x37)  // CueTrackPosition(s) ID
+      ++m_track_positions_count;
 
-      if (size < 0)  // error
-        return static_cast<long>(size);
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
 
-      pos += len;  // consume size field of element
+  assert(m_timecode >= 0);
+  assert(m_track_positions_count > 0);
 
-      // pos now points to start of sub-element's payload
+  // os << "CuePoint::Load(cont'd): idpos=" << idpos
+  //   << " timecode=" << m_timecode
+  //   << endl;
 
-      if (size == 0)  // weird
-        continue;
+  m_track_positions = new TrackPosition[m_track_positions_count];
 
-      const long long unknown_size = (1LL << (7 * len)) - 1;
+  // Now parse track positions
 
-      if (size == unknown_size)
-        return E_FILE_FORMAT_INVALID;  // not allowed for sub-elements
+  TrackPosition* p = m_track_positions;
+  pos = pos_;
 
-      if ((segment_stop >= 0) && ((pos + size) > segment_stop))  // weird
-        return E_FILE_FORMAT_INVALID;
+  while (pos < stop) {
+    long len;
 
-      pos += size;  // consume payload of sub-element
-      assert((segment_stop < 0) || (pos <= segment_stop));
-    }  // determine cluster size
+    const long long id = ReadUInt(pReader, pos, len);
+    assert(id >= 0);  // TODO
+    assert((pos + len) <= stop);
 
-    cluster_size = pos - payload_pos;
-    assert(cluster_size >= 0);  // TODO: handle cluster_size = 0
+    pos += len;  // consume ID
 
-    pos = payload_pos;  // reset and re-parse original cluster
+    const long long size = ReadUInt(pReader, pos, len);
+    assert(size >= 0);
+    assert((pos + len) <= stop);
+
+    pos += len;  // consume Size field
+    assert((pos + size) <= stop);
+
+    if (id == 0x37) {  // CueTrackPosition(s) ID
+      TrackPosition& tp = *p++;
+      tp.Parse(pReader, pos, size);
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
   }
 
-  pos += cluster_size;  // consume payload
-  assert((segment_stop < 0) || (pos <= segment_stop));
+  assert(size_t(p - m_track_positions) == m_track_positions_count);
 
-  return 2;  // try to find a cluster that follows next
+  m_element_start = element_start;
+  m_element_size = element_size;
 }
 
-const Cluster* Segment::FindCluster(long long time_ns) const {
-  if ((m_clusters == NULL) || (m_clusterCount <= 0))
-    return &m_eos;
+void CuePoint::TrackPosition::Parse(IMkvReader* pReader, long long start_,
+                                    long long size_) {
+  const long long stop = start_ + size_;
+  long long pos = start_;
 
-  {
-    Cluster* const pCluster = m_clusters[0];
-    assert(pCluster);
-    assert(pCluster->m_index == 0);
+  m_track = -1;
+  m_pos = -1;
+  m_block = 1;  // default
 
-    if (time_ns <= pCluster->GetTime())
-      return pCluster;
-  }
+  while (pos < stop) {
+    long len;
 
-  // Binary search of cluster array
+    const long long id = ReadUInt(pReader, pos, len);
+    assert(id >= 0);  // TODO
+    assert((pos + len) <= stop);
 
-  long i = 0;
-  long j = m_clusterCount;
+    pos += len;  // consume ID
 
-  while (i < j) {
-    // INVARIANT:
-    //[0, i) <= time_ns
-    //[i, j) ?
-    //[j, m_clusterCount)  > time_ns
+    const long long size = ReadUInt(pReader, pos, len);
+    assert(size >= 0);
+    assert((pos + len) <= stop);
 
-    const long k = i + (j - i) / 2;
-    assert(k < m_clusterCount);
+    pos += len;  // consume Size field
+    assert((pos + size) <= stop);
 
-    Cluster* const pCluster = m_clusters[k];
-    assert(pCluster);
-    assert(pCluster->m_index == k);
+    if (id == 0x77)  // CueTrack ID
+      m_track = UnserializeUInt(pReader, pos, size);
 
-    const long long t = pCluster->GetTime();
+    else if (id == 0x71)  // CueClusterPos ID
+      m_pos = UnserializeUInt(pReader, pos, size);
 
-    if (t <= time_ns)
-      i = k + 1;
-    else
-      j = k;
+    else if (id == 0x1378)  // CueBlockNumber
+      m_block = UnserializeUInt(pReader, pos, size);
 
-    assert(i <= j);
+    pos += size;  // consume payload
+    assert(pos <= stop);
   }
 
-  assert(i == j);
-  assert(i > 0);
-  assert(i <= m_clusterCount);
+  assert(m_pos >= 0);
+  assert(m_track > 0);
+  // assert(m_block > 0);
+}
 
-  const long k = i - 1;
+const CuePoint::TrackPosition* CuePoint::Find(const Track* pTrack) const {
+  assert(pTrack);
 
-  Cluster* const pCluster = m_clusters[k];
-  assert(pCluster);
-  assert(pCluster->m_index == k);
-  assert(pCluster->GetTime() <= time_ns);
+  const long long n = pTrack->GetNumber();
 
-  return pCluster;
-}
+  const TrackPosition* i = m_track_positions;
+  const TrackPosition* const j = i + m_track_positions_count;
 
-#if 0
-const BlockEntry* Segment::Seek(
-    long long time_ns,
-    const Track* pTrack) const
-{
-    assert(pTrack);
+  while (i != j) {
+    const TrackPosition& p = *i++;
 
-    if ((m_clusters == NULL) || (m_clusterCount <= 0))
-        return pTrack->GetEOS();
+    if (p.m_track == n)
+      return &p;
+  }
 
-    Cluster** const i = m_clusters;
-    assert(i);
+  return NULL;  // no matching track number found
+}
 
-    {
-        Cluster* const pCluster = *i;
-        assert(pCluster);
-        assert(pCluster->m_index == 0);  //m_clusterCount > 0
-        assert(pCluster->m_pSegment == this);
+long long CuePoint::GetTimeCode() const { return m_timecode; }
 
-        if (time_ns <= pCluster->GetTime())
-            return pCluster->GetEntry(pTrack);
-    }
+long long CuePoint::GetTime(const Segment* pSegment) const {
+  assert(pSegment);
+  assert(m_timecode >= 0);
 
-    Cluster** const j = i + m_clusterCount;
+  const SegmentInfo* const pInfo = pSegment->GetInfo();
+  assert(pInfo);
 
-    if (pTrack->GetType() == 2) {  //audio
-        //TODO: we could decide to use cues for this, as we do for video.
-        //But we only use it for video because looking around for a keyframe
-        //can get expensive.  Audio doesn't require anything special so a
-        //straight cluster search is good enough (we assume).
+  const long long scale = pInfo->GetTimeCodeScale();
+  assert(scale >= 1);
 
-        Cluster** lo = i;
-        Cluster** hi = j;
+  const long long time = scale * m_timecode;
 
-        while (lo < hi)
-        {
-            //INVARIANT:
-            //[i, lo) <= time_ns
-            //[lo, hi) ?
-            //[hi, j)  > time_ns
+  return time;
+}
 
-            Cluster** const mid = lo + (hi - lo) / 2;
-            assert(mid < hi);
+#if 0
+long long Segment::Unparsed() const
+{
+    if (m_size < 0)
+        return LLONG_MAX;
 
-            Cluster* const pCluster = *mid;
-            assert(pCluster);
-            assert(pCluster->m_index == long(mid - m_clusters));
-            assert(pCluster->m_pSegment == this);
+    const long long stop = m_start + m_size;
 
-            const long long t = pCluster->GetTime();
+    const long long result = stop - m_pos;
+    assert(result >= 0);
 
-            if (t <= time_ns)
-                lo = mid + 1;
-            else
-                hi = mid;
+    return result;
+}
+#else
+bool Segment::DoneParsing() const {
+  if (m_size < 0) {
+    long long total, avail;
 
-            assert(lo <= hi);
-        }
+    const int status = m_pReader->Length(&total, &avail);
 
-        assert(lo == hi);
-        assert(lo > i);
-        assert(lo <= j);
+    if (status < 0)  // error
+      return true;  // must assume done
 
-        while (lo > i)
-        {
-            Cluster* const pCluster = *--lo;
-            assert(pCluster);
-            assert(pCluster->GetTime() <= time_ns);
+    if (total < 0)
+      return false;  // assume live stream
 
-            const BlockEntry* const pBE = pCluster->GetEntry(pTrack);
+    return (m_pos >= total);
+  }
 
-            if ((pBE != 0) && !pBE->EOS())
-                return pBE;
+  const long long stop = m_start + m_size;
 
-            //landed on empty cluster (no entries)
-        }
+  return (m_pos >= stop);
+}
+#endif
 
-        return pTrack->GetEOS();  //weird
-    }
+const Cluster* Segment::GetFirst() const {
+  if ((m_clusters == NULL) || (m_clusterCount <= 0))
+    return &m_eos;
 
-    assert(pTrack->GetType() == 1);  //video
+  Cluster* const pCluster = m_clusters[0];
+  assert(pCluster);
 
-    Cluster** lo = i;
-    Cluster** hi = j;
+  return pCluster;
+}
 
-    while (lo < hi)
-    {
-        //INVARIANT:
-        //[i, lo) <= time_ns
-        //[lo, hi) ?
-        //[hi, j)  > time_ns
+const Cluster* Segment::GetLast() const {
+  if ((m_clusters == NULL) || (m_clusterCount <= 0))
+    return &m_eos;
 
-        Cluster** const mid = lo + (hi - lo) / 2;
-        assert(mid < hi);
+  const long idx = m_clusterCount - 1;
 
-        Cluster* const pCluster = *mid;
-        assert(pCluster);
+  Cluster* const pCluster = m_clusters[idx];
+  assert(pCluster);
 
-        const long long t = pCluster->GetTime();
+  return pCluster;
+}
 
-        if (t <= time_ns)
-            lo = mid + 1;
-        else
-            hi = mid;
+unsigned long Segment::GetCount() const { return m_clusterCount; }
 
-        assert(lo <= hi);
-    }
+const Cluster* Segment::GetNext(const Cluster* pCurr) {
+  assert(pCurr);
+  assert(pCurr != &m_eos);
+  assert(m_clusters);
 
-    assert(lo == hi);
-    assert(lo > i);
-    assert(lo <= j);
-
-    Cluster* pCluster = *--lo;
-    assert(pCluster);
-    assert(pCluster->GetTime() <= time_ns);
+  long idx = pCurr->m_index;
 
-    {
-        const BlockEntry* const pBE = pCluster->GetEntry(pTrack, time_ns);
+  if (idx >= 0) {
+    assert(m_clusterCount > 0);
+    assert(idx < m_clusterCount);
+    assert(pCurr == m_clusters[idx]);
 
-        if ((pBE != 0) && !pBE->EOS())  //found a keyframe
-            return pBE;
-    }
+    ++idx;
 
-    const VideoTrack* const pVideo = static_cast<const VideoTrack*>(pTrack);
+    if (idx >= m_clusterCount)
+      return &m_eos;  // caller will LoadCluster as desired
 
-    while (lo != i)
-    {
-        pCluster = *--lo;
-        assert(pCluster);
-        assert(pCluster->GetTime() <= time_ns);
+    Cluster* const pNext = m_clusters[idx];
+    assert(pNext);
+    assert(pNext->m_index >= 0);
+    assert(pNext->m_index == idx);
 
-        const BlockEntry* const pBlockEntry = pCluster->GetMaxKey(pVideo);
+    return pNext;
+  }
 
-        if ((pBlockEntry != 0) && !pBlockEntry->EOS())
-            return pBlockEntry;
-    }
+  assert(m_clusterPreloadCount > 0);
 
-    //weird: we're on the first cluster, but no keyframe found
-    //should never happen but we must return something anyway
+  long long pos = pCurr->m_element_start;
 
-    return pTrack->GetEOS();
-}
-#endif
+  assert(m_size >= 0);  // TODO
+  const long long stop = m_start + m_size;  // end of segment
 
-#if 0
-bool Segment::SearchCues(
-    long long time_ns,
-    Track* pTrack,
-    Cluster*& pCluster,
-    const BlockEntry*& pBlockEntry,
-    const CuePoint*& pCP,
-    const CuePoint::TrackPosition*& pTP)
-{
-    if (pTrack->GetType() != 1)  //not video
-        return false;  //TODO: for now, just handle video stream
+  {
+    long len;
 
-    if (m_pCues == NULL)
-        return false;
+    long long result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);
+    assert((pos + len) <= stop);  // TODO
+    if (result != 0)
+      return NULL;
 
-    if (!m_pCues->Find(time_ns, pTrack, pCP, pTP))
-        return false;  //weird
+    const long long id = ReadUInt(m_pReader, pos, len);
+    assert(id == 0x0F43B675);  // Cluster ID
+    if (id != 0x0F43B675)
+      return NULL;
 
-    assert(pCP);
-    assert(pTP);
-    assert(pTP->m_track == pTrack->GetNumber());
+    pos += len;  // consume ID
 
-    //We have the cue point and track position we want,
-    //so we now need to search for the cluster having
-    //the indicated position.
+    // Read Size
+    result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);  // TODO
+    assert((pos + len) <= stop);  // TODO
 
-    return GetCluster(pCP, pTP, pCluster, pBlockEntry);
-}
-#endif
+    const long long size = ReadUInt(m_pReader, pos, len);
+    assert(size > 0);  // TODO
+    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
 
-const Tracks* Segment::GetTracks() const { return m_pTracks; }
+    pos += len;  // consume length of size of element
+    assert((pos + size) <= stop);  // TODO
 
-const SegmentInfo* Segment::GetInfo() const { return m_pInfo; }
+    // Pos now points to start of payload
 
-const Cues* Segment::GetCues() const { return m_pCues; }
+    pos += size;  // consume payload
+  }
 
-const Chapters* Segment::GetChapters() const { return m_pChapters; }
+  long long off_next = 0;
 
-const SeekHead* Segment::GetSeekHead() const { return m_pSeekHead; }
+  while (pos < stop) {
+    long len;
 
-long long Segment::GetDuration() const {
-  assert(m_pInfo);
-  return m_pInfo->GetDuration();
-}
+    long long result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);
+    assert((pos + len) <= stop);  // TODO
+    if (result != 0)
+      return NULL;
 
-Chapters::Chapters(Segment* pSegment, long long payload_start,
-                   long long payload_size, long long element_start,
-                   long long element_size)
-    : m_pSegment(pSegment),
-      m_start(payload_start),
-      m_size(payload_size),
-      m_element_start(element_start),
-      m_element_size(element_size),
-      m_editions(NULL),
-      m_editions_size(0),
-      m_editions_count(0) {}
+    const long long idpos = pos;  // pos of next (potential) cluster
 
-Chapters::~Chapters() {
-  while (m_editions_count > 0) {
-    Edition& e = m_editions[--m_editions_count];
-    e.Clear();
-  }
-  delete[] m_editions;
-}
+    const long long id = ReadUInt(m_pReader, idpos, len);
+    assert(id > 0);  // TODO
 
-long Chapters::Parse() {
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+    pos += len;  // consume ID
 
-  long long pos = m_start;  // payload start
-  const long long stop = pos + m_size;  // payload stop
+    // Read Size
+    result = GetUIntLength(m_pReader, pos, len);
+    assert(result == 0);  // TODO
+    assert((pos + len) <= stop);  // TODO
 
-  while (pos < stop) {
-    long long id, size;
+    const long long size = ReadUInt(m_pReader, pos, len);
+    assert(size >= 0);  // TODO
 
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
+    pos += len;  // consume length of size of element
+    assert((pos + size) <= stop);  // TODO
 
-    if (status < 0)  // error
-      return status;
+    // Pos now points to start of payload
 
     if (size == 0)  // weird
       continue;
 
-    if (id == 0x05B9) {  // EditionEntry ID
-      status = ParseEdition(pos, size);
+    if (id == 0x0F43B675) {  // Cluster ID
+      const long long off_next_ = idpos - m_start;
 
-      if (status < 0)  // error
-        return status;
+      long long pos_;
+      long len_;
+
+      const long status = Cluster::HasBlockEntries(this, off_next_, pos_, len_);
+
+      assert(status >= 0);
+
+      if (status > 0) {
+        off_next = off_next_;
+        break;
+      }
     }
 
-    pos += size;
-    assert(pos <= stop);
+    pos += size;  // consume payload
   }
 
-  assert(pos == stop);
-  return 0;
-}
-
-int Chapters::GetEditionCount() const { return m_editions_count; }
+  if (off_next <= 0)
+    return 0;
 
-const Chapters::Edition* Chapters::GetEdition(int idx) const {
-  if (idx < 0)
-    return NULL;
+  Cluster** const ii = m_clusters + m_clusterCount;
+  Cluster** i = ii;
 
-  if (idx >= m_editions_count)
-    return NULL;
+  Cluster** const jj = ii + m_clusterPreloadCount;
+  Cluster** j = jj;
 
-  return m_editions + idx;
-}
+  while (i < j) {
+    // INVARIANT:
+    //[0, i) < pos_next
+    //[i, j) ?
+    //[j, jj)  > pos_next
 
-bool Chapters::ExpandEditionsArray() {
-  if (m_editions_size > m_editions_count)
-    return true;  // nothing else to do
+    Cluster** const k = i + (j - i) / 2;
+    assert(k < jj);
 
-  const int size = (m_editions_size == 0) ? 1 : 2 * m_editions_size;
+    Cluster* const pNext = *k;
+    assert(pNext);
+    assert(pNext->m_index < 0);
 
-  Edition* const editions = new (std::nothrow) Edition[size];
+    // const long long pos_ = pNext->m_pos;
+    // assert(pos_);
+    // pos = pos_ * ((pos_ < 0) ? -1 : 1);
 
-  if (editions == NULL)
-    return false;
+    pos = pNext->GetPosition();
 
-  for (int idx = 0; idx < m_editions_count; ++idx) {
-    m_editions[idx].ShallowCopy(editions[idx]);
+    if (pos < off_next)
+      i = k + 1;
+    else if (pos > off_next)
+      j = k;
+    else
+      return pNext;
   }
 
-  delete[] m_editions;
-  m_editions = editions;
+  assert(i == j);
 
-  m_editions_size = size;
-  return true;
-}
+  Cluster* const pNext = Cluster::Create(this, -1, off_next);
+  assert(pNext);
 
-long Chapters::ParseEdition(long long pos, long long size) {
-  if (!ExpandEditionsArray())
-    return -1;
+  const ptrdiff_t idx_next = i - m_clusters;  // insertion position
 
-  Edition& e = m_editions[m_editions_count++];
-  e.Init();
+  PreloadCluster(pNext, idx_next);
+  assert(m_clusters);
+  assert(idx_next < m_clusterSize);
+  assert(m_clusters[idx_next] == pNext);
 
-  return e.Parse(m_pSegment->m_pReader, pos, size);
+  return pNext;
 }
 
-Chapters::Edition::Edition() {}
+long Segment::ParseNext(const Cluster* pCurr, const Cluster*& pResult,
+                        long long& pos, long& len) {
+  assert(pCurr);
+  assert(!pCurr->EOS());
+  assert(m_clusters);
 
-Chapters::Edition::~Edition() {}
+  pResult = 0;
 
-int Chapters::Edition::GetAtomCount() const { return m_atoms_count; }
+  if (pCurr->m_index >= 0) {  // loaded (not merely preloaded)
+    assert(m_clusters[pCurr->m_index] == pCurr);
 
-const Chapters::Atom* Chapters::Edition::GetAtom(int index) const {
-  if (index < 0)
-    return NULL;
+    const long next_idx = pCurr->m_index + 1;
 
-  if (index >= m_atoms_count)
-    return NULL;
+    if (next_idx < m_clusterCount) {
+      pResult = m_clusters[next_idx];
+      return 0;  // success
+    }
 
-  return m_atoms + index;
-}
+    // curr cluster is last among loaded
 
-void Chapters::Edition::Init() {
-  m_atoms = NULL;
-  m_atoms_size = 0;
-  m_atoms_count = 0;
-}
+    const long result = LoadCluster(pos, len);
 
-void Chapters::Edition::ShallowCopy(Edition& rhs) const {
-  rhs.m_atoms = m_atoms;
-  rhs.m_atoms_size = m_atoms_size;
-  rhs.m_atoms_count = m_atoms_count;
-}
+    if (result < 0)  // error or underflow
+      return result;
 
-void Chapters::Edition::Clear() {
-  while (m_atoms_count > 0) {
-    Atom& a = m_atoms[--m_atoms_count];
-    a.Clear();
+    if (result > 0)  // no more clusters
+    {
+      // pResult = &m_eos;
+      return 1;
+    }
+
+    pResult = GetLast();
+    return 0;  // success
   }
 
-  delete[] m_atoms;
-  m_atoms = NULL;
+  assert(m_pos > 0);
 
-  m_atoms_size = 0;
-}
+  long long total, avail;
 
-long Chapters::Edition::Parse(IMkvReader* pReader, long long pos,
-                              long long size) {
-  const long long stop = pos + size;
+  long status = m_pReader->Length(&total, &avail);
 
-  while (pos < stop) {
-    long long id, size;
+  if (status < 0)  // error
+    return status;
 
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
+  assert((total < 0) || (avail <= total));
 
-    if (status < 0)  // error
-      return status;
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
 
-    if (size == 0)  // weird
-      continue;
+  // interrogate curr cluster
 
-    if (id == 0x36) {  // Atom ID
-      status = ParseAtom(pReader, pos, size);
+  pos = pCurr->m_element_start;
 
-      if (status < 0)  // error
-        return status;
+  if (pCurr->m_element_size >= 0)
+    pos += pCurr->m_element_size;
+  else {
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
     }
 
-    pos += size;
-    assert(pos <= stop);
-  }
+    long long result = GetUIntLength(m_pReader, pos, len);
 
-  assert(pos == stop);
-  return 0;
-}
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-long Chapters::Edition::ParseAtom(IMkvReader* pReader, long long pos,
-                                  long long size) {
-  if (!ExpandAtomsArray())
-    return -1;
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  Atom& a = m_atoms[m_atoms_count++];
-  a.Init();
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  return a.Parse(pReader, pos, size);
-}
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-bool Chapters::Edition::ExpandAtomsArray() {
-  if (m_atoms_size > m_atoms_count)
-    return true;  // nothing else to do
+    const long long id = ReadUInt(m_pReader, pos, len);
 
-  const int size = (m_atoms_size == 0) ? 1 : 2 * m_atoms_size;
+    if (id != 0x0F43B675)  // weird: not Cluster ID
+      return -1;
 
-  Atom* const atoms = new (std::nothrow) Atom[size];
+    pos += len;  // consume ID
 
-  if (atoms == NULL)
-    return false;
+    // Read Size
 
-  for (int idx = 0; idx < m_atoms_count; ++idx) {
-    m_atoms[idx].ShallowCopy(atoms[idx]);
-  }
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  delete[] m_atoms;
-  m_atoms = atoms;
+    result = GetUIntLength(m_pReader, pos, len);
 
-  m_atoms_size = size;
-  return true;
-}
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-Chapters::Atom::Atom() {}
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-Chapters::Atom::~Atom() {}
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-unsigned long long Chapters::Atom::GetUID() const { return m_uid; }
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-const char* Chapters::Atom::GetStringUID() const { return m_string_uid; }
+    const long long size = ReadUInt(m_pReader, pos, len);
 
-long long Chapters::Atom::GetStartTimecode() const { return m_start_timecode; }
+    if (size < 0)  // error
+      return static_cast<long>(size);
 
-long long Chapters::Atom::GetStopTimecode() const { return m_stop_timecode; }
+    pos += len;  // consume size field
 
-long long Chapters::Atom::GetStartTime(const Chapters* pChapters) const {
-  return GetTime(pChapters, m_start_timecode);
-}
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-long long Chapters::Atom::GetStopTime(const Chapters* pChapters) const {
-  return GetTime(pChapters, m_stop_timecode);
-}
+    if (size == unknown_size)  // TODO: should never happen
+      return E_FILE_FORMAT_INVALID;  // TODO: resolve this
 
-int Chapters::Atom::GetDisplayCount() const { return m_displays_count; }
+    // assert((pCurr->m_size <= 0) || (pCurr->m_size == size));
 
-const Chapters::Display* Chapters::Atom::GetDisplay(int index) const {
-  if (index < 0)
-    return NULL;
+    if ((segment_stop >= 0) && ((pos + size) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  if (index >= m_displays_count)
-    return NULL;
+    // Pos now points to start of payload
 
-  return m_displays + index;
-}
+    pos += size;  // consume payload (that is, the current cluster)
+    assert((segment_stop < 0) || (pos <= segment_stop));
 
-void Chapters::Atom::Init() {
-  m_string_uid = NULL;
-  m_uid = 0;
-  m_start_timecode = -1;
-  m_stop_timecode = -1;
+    // By consuming the payload, we are assuming that the curr
+    // cluster isn't interesting.  That is, we don't bother checking
+    // whether the payload of the curr cluster is less than what
+    // happens to be available (obtained via IMkvReader::Length).
+    // Presumably the caller has already dispensed with the current
+    // cluster, and really does want the next cluster.
+  }
 
-  m_displays = NULL;
-  m_displays_size = 0;
-  m_displays_count = 0;
-}
+  // pos now points to just beyond the last fully-loaded cluster
 
-void Chapters::Atom::ShallowCopy(Atom& rhs) const {
-  rhs.m_string_uid = m_string_uid;
-  rhs.m_uid = m_uid;
-  rhs.m_start_timecode = m_start_timecode;
-  rhs.m_stop_timecode = m_stop_timecode;
+  for (;;) {
+    const long status = DoParseNext(pResult, pos, len);
 
-  rhs.m_displays = m_displays;
-  rhs.m_displays_size = m_displays_size;
-  rhs.m_displays_count = m_displays_count;
+    if (status <= 1)
+      return status;
+  }
 }
 
-void Chapters::Atom::Clear() {
-  delete[] m_string_uid;
-  m_string_uid = NULL;
+long Segment::DoParseNext(const Cluster*& pResult, long long& pos, long& len) {
+  long long total, avail;
 
-  while (m_displays_count > 0) {
-    Display& d = m_displays[--m_displays_count];
-    d.Clear();
-  }
+  long status = m_pReader->Length(&total, &avail);
 
-  delete[] m_displays;
-  m_displays = NULL;
+  if (status < 0)  // error
+    return status;
 
-  m_displays_size = 0;
-}
+  assert((total < 0) || (avail <= total));
 
-long Chapters::Atom::Parse(IMkvReader* pReader, long long pos, long long size) {
-  const long long stop = pos + size;
+  const long long segment_stop = (m_size < 0) ? -1 : m_start + m_size;
 
-  while (pos < stop) {
-    long long id, size;
+  // Parse next cluster.  This is strictly a parsing activity.
+  // Creation of a new cluster object happens later, after the
+  // parsing is done.
 
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
+  long long off_next = 0;
+  long long cluster_size = -1;
 
-    if (status < 0)  // error
-      return status;
+  for (;;) {
+    if ((total >= 0) && (pos >= total))
+      return 1;  // EOF
 
-    if (size == 0)  // weird
-      continue;
+    if ((segment_stop >= 0) && (pos >= segment_stop))
+      return 1;  // EOF
 
-    if (id == 0x00) {  // Display ID
-      status = ParseDisplay(pReader, pos, size);
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-      if (status < 0)  // error
-        return status;
-    } else if (id == 0x1654) {  // StringUID ID
-      status = UnserializeString(pReader, pos, size, m_string_uid);
+    long long result = GetUIntLength(m_pReader, pos, len);
 
-      if (status < 0)  // error
-        return status;
-    } else if (id == 0x33C4) {  // UID ID
-      long long val;
-      status = UnserializeInt(pReader, pos, size, val);
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-      if (status < 0)  // error
-        return status;
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-      m_uid = static_cast<unsigned long long>(val);
-    } else if (id == 0x11) {  // TimeStart ID
-      const long long val = UnserializeUInt(pReader, pos, size);
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-      if (val < 0)  // error
-        return static_cast<long>(val);
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-      m_start_timecode = val;
-    } else if (id == 0x12) {  // TimeEnd ID
-      const long long val = UnserializeUInt(pReader, pos, size);
+    const long long idpos = pos;  // absolute
+    const long long idoff = pos - m_start;  // relative
 
-      if (val < 0)  // error
-        return static_cast<long>(val);
+    const long long id = ReadUInt(m_pReader, idpos, len);  // absolute
 
-      m_stop_timecode = val;
-    }
+    if (id < 0)  // error
+      return static_cast<long>(id);
 
-    pos += size;
-    assert(pos <= stop);
-  }
+    if (id == 0)  // weird
+      return -1;  // generic error
 
-  assert(pos == stop);
-  return 0;
-}
+    pos += len;  // consume ID
 
-long long Chapters::Atom::GetTime(const Chapters* pChapters,
-                                  long long timecode) {
-  if (pChapters == NULL)
-    return -1;
+    // Read Size
 
-  Segment* const pSegment = pChapters->m_pSegment;
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  if (pSegment == NULL)  // weird
-    return -1;
+    result = GetUIntLength(m_pReader, pos, len);
 
-  const SegmentInfo* const pInfo = pSegment->GetInfo();
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-  if (pInfo == NULL)
-    return -1;
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  const long long timecode_scale = pInfo->GetTimeCodeScale();
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  if (timecode_scale < 1)  // weird
-    return -1;
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-  if (timecode < 0)
-    return -1;
+    const long long size = ReadUInt(m_pReader, pos, len);
 
-  const long long result = timecode_scale * timecode;
+    if (size < 0)  // error
+      return static_cast<long>(size);
 
-  return result;
-}
+    pos += len;  // consume length of size of element
 
-long Chapters::Atom::ParseDisplay(IMkvReader* pReader, long long pos,
-                                  long long size) {
-  if (!ExpandDisplaysArray())
-    return -1;
+    // Pos now points to start of payload
 
-  Display& d = m_displays[m_displays_count++];
-  d.Init();
+    if (size == 0)  // weird
+      continue;
 
-  return d.Parse(pReader, pos, size);
-}
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-bool Chapters::Atom::ExpandDisplaysArray() {
-  if (m_displays_size > m_displays_count)
-    return true;  // nothing else to do
+    if ((segment_stop >= 0) && (size != unknown_size) &&
+        ((pos + size) > segment_stop)) {
+      return E_FILE_FORMAT_INVALID;
+    }
 
-  const int size = (m_displays_size == 0) ? 1 : 2 * m_displays_size;
+    if (id == 0x0C53BB6B) {  // Cues ID
+      if (size == unknown_size)
+        return E_FILE_FORMAT_INVALID;
 
-  Display* const displays = new (std::nothrow) Display[size];
+      const long long element_stop = pos + size;
 
-  if (displays == NULL)
-    return false;
+      if ((segment_stop >= 0) && (element_stop > segment_stop))
+        return E_FILE_FORMAT_INVALID;
 
-  for (int idx = 0; idx < m_displays_count; ++idx) {
-    m_displays[idx].ShallowCopy(displays[idx]);
-  }
+      const long long element_start = idpos;
+      const long long element_size = element_stop - element_start;
 
-  delete[] m_displays;
-  m_displays = displays;
+      if (m_pCues == NULL) {
+        m_pCues = new Cues(this, pos, size, element_start, element_size);
+        assert(m_pCues);  // TODO
+      }
 
-  m_displays_size = size;
-  return true;
-}
+      pos += size;  // consume payload
+      assert((segment_stop < 0) || (pos <= segment_stop));
 
-Chapters::Display::Display() {}
+      continue;
+    }
 
-Chapters::Display::~Display() {}
+    if (id != 0x0F43B675) {  // not a Cluster ID
+      if (size == unknown_size)
+        return E_FILE_FORMAT_INVALID;
 
-const char* Chapters::Display::GetString() const { return m_string; }
+      pos += size;  // consume payload
+      assert((segment_stop < 0) || (pos <= segment_stop));
 
-const char* Chapters::Display::GetLanguage() const { return m_language; }
+      continue;
+    }
 
-const char* Chapters::Display::GetCountry() const { return m_country; }
+#if 0  // this is commented-out to support incremental cluster parsing
+        len = static_cast<long>(size);
 
-void Chapters::Display::Init() {
-  m_string = NULL;
-  m_language = NULL;
-  m_country = NULL;
-}
+        if (element_stop > avail)
+            return E_BUFFER_NOT_FULL;
+#endif
 
-void Chapters::Display::ShallowCopy(Display& rhs) const {
-  rhs.m_string = m_string;
-  rhs.m_language = m_language;
-  rhs.m_country = m_country;
-}
+    // We have a cluster.
 
-void Chapters::Display::Clear() {
-  delete[] m_string;
-  m_string = NULL;
+    off_next = idoff;
 
-  delete[] m_language;
-  m_language = NULL;
+    if (size != unknown_size)
+      cluster_size = size;
 
-  delete[] m_country;
-  m_country = NULL;
-}
+    break;
+  }
 
-long Chapters::Display::Parse(IMkvReader* pReader, long long pos,
-                              long long size) {
-  const long long stop = pos + size;
+  assert(off_next > 0);  // have cluster
 
-  while (pos < stop) {
-    long long id, size;
+  // We have parsed the next cluster.
+  // We have not created a cluster object yet.  What we need
+  // to do now is determine whether it has already be preloaded
+  //(in which case, an object for this cluster has already been
+  // created), and if not, create a new cluster object.
 
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
+  Cluster** const ii = m_clusters + m_clusterCount;
+  Cluster** i = ii;
 
-    if (status < 0)  // error
-      return status;
+  Cluster** const jj = ii + m_clusterPreloadCount;
+  Cluster** j = jj;
 
-    if (size == 0)  // weird
-      continue;
+  while (i < j) {
+    // INVARIANT:
+    //[0, i) < pos_next
+    //[i, j) ?
+    //[j, jj)  > pos_next
 
-    if (id == 0x05) {  // ChapterString ID
-      status = UnserializeString(pReader, pos, size, m_string);
+    Cluster** const k = i + (j - i) / 2;
+    assert(k < jj);
 
-      if (status)
-        return status;
-    } else if (id == 0x037C) {  // ChapterLanguage ID
-      status = UnserializeString(pReader, pos, size, m_language);
+    const Cluster* const pNext = *k;
+    assert(pNext);
+    assert(pNext->m_index < 0);
 
-      if (status)
-        return status;
-    } else if (id == 0x037E) {  // ChapterCountry ID
-      status = UnserializeString(pReader, pos, size, m_country);
+    pos = pNext->GetPosition();
+    assert(pos >= 0);
 
-      if (status)
-        return status;
+    if (pos < off_next)
+      i = k + 1;
+    else if (pos > off_next)
+      j = k;
+    else {
+      pResult = pNext;
+      return 0;  // success
     }
-
-    pos += size;
-    assert(pos <= stop);
   }
 
-  assert(pos == stop);
-  return 0;
-}
+  assert(i == j);
 
-SegmentInfo::SegmentInfo(Segment* pSegment, long long start, long long size_,
-                         long long element_start, long long element_size)
-    : m_pSegment(pSegment),
-      m_start(start),
-      m_size(size_),
-      m_element_start(element_start),
-      m_element_size(element_size),
-      m_pMuxingAppAsUTF8(NULL),
-      m_pWritingAppAsUTF8(NULL),
-      m_pTitleAsUTF8(NULL) {}
+  long long pos_;
+  long len_;
 
-SegmentInfo::~SegmentInfo() {
-  delete[] m_pMuxingAppAsUTF8;
-  m_pMuxingAppAsUTF8 = NULL;
+  status = Cluster::HasBlockEntries(this, off_next, pos_, len_);
 
-  delete[] m_pWritingAppAsUTF8;
-  m_pWritingAppAsUTF8 = NULL;
+  if (status < 0) {  // error or underflow
+    pos = pos_;
+    len = len_;
 
-  delete[] m_pTitleAsUTF8;
-  m_pTitleAsUTF8 = NULL;
-}
+    return status;
+  }
 
-long SegmentInfo::Parse() {
-  assert(m_pMuxingAppAsUTF8 == NULL);
-  assert(m_pWritingAppAsUTF8 == NULL);
-  assert(m_pTitleAsUTF8 == NULL);
+  if (status > 0) {  // means "found at least one block entry"
+    Cluster* const pNext = Cluster::Create(this,
+                                           -1,  // preloaded
+                                           off_next);
+    // element_size);
+    assert(pNext);
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+    const ptrdiff_t idx_next = i - m_clusters;  // insertion position
 
-  long long pos = m_start;
-  const long long stop = m_start + m_size;
+    PreloadCluster(pNext, idx_next);
+    assert(m_clusters);
+    assert(idx_next < m_clusterSize);
+    assert(m_clusters[idx_next] == pNext);
 
-  m_timecodeScale = 1000000;
-  m_duration = -1;
+    pResult = pNext;
+    return 0;  // success
+  }
 
-  while (pos < stop) {
-    long long id, size;
+  // status == 0 means "no block entries found"
 
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+  if (cluster_size < 0) {  // unknown size
+    const long long payload_pos = pos;  // absolute pos of cluster payload
 
-    if (status < 0)  // error
-      return status;
+    for (;;) {  // determine cluster size
+      if ((total >= 0) && (pos >= total))
+        break;
 
-    if (id == 0x0AD7B1) {  // Timecode Scale
-      m_timecodeScale = UnserializeUInt(pReader, pos, size);
+      if ((segment_stop >= 0) && (pos >= segment_stop))
+        break;  // no more clusters
 
-      if (m_timecodeScale <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x0489) {  // Segment duration
-      const long status = UnserializeFloat(pReader, pos, size, m_duration);
+      // Read ID
 
-      if (status < 0)
-        return status;
+      if ((pos + 1) > avail) {
+        len = 1;
+        return E_BUFFER_NOT_FULL;
+      }
 
-      if (m_duration < 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x0D80) {  // MuxingApp
-      const long status =
-          UnserializeString(pReader, pos, size, m_pMuxingAppAsUTF8);
+      long long result = GetUIntLength(m_pReader, pos, len);
 
-      if (status)
-        return status;
-    } else if (id == 0x1741) {  // WritingApp
-      const long status =
-          UnserializeString(pReader, pos, size, m_pWritingAppAsUTF8);
+      if (result < 0)  // error
+        return static_cast<long>(result);
 
-      if (status)
-        return status;
-    } else if (id == 0x3BA9) {  // Title
-      const long status = UnserializeString(pReader, pos, size, m_pTitleAsUTF8);
+      if (result > 0)  // weird
+        return E_BUFFER_NOT_FULL;
 
-      if (status)
-        return status;
-    }
+      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+        return E_FILE_FORMAT_INVALID;
 
-    pos += size;
-    assert(pos <= stop);
-  }
+      if ((pos + len) > avail)
+        return E_BUFFER_NOT_FULL;
 
-  assert(pos == stop);
+      const long long idpos = pos;
+      const long long id = ReadUInt(m_pReader, idpos, len);
 
-  return 0;
-}
+      if (id < 0)  // error (or underflow)
+        return static_cast<long>(id);
 
-long long SegmentInfo::GetTimeCodeScale() const { return m_timecodeScale; }
+      // This is the distinguished set of ID's we use to determine
+      // that we have exhausted the sub-element's inside the cluster
+      // whose ID we parsed earlier.
 
-long long SegmentInfo::GetDuration() const {
-  if (m_duration < 0)
-    return -1;
+      if (id == 0x0F43B675)  // Cluster ID
+        break;
 
-  assert(m_timecodeScale >= 1);
+      if (id == 0x0C53BB6B)  // Cues ID
+        break;
 
-  const double dd = double(m_duration) * double(m_timecodeScale);
-  const long long d = static_cast<long long>(dd);
+      pos += len;  // consume ID (of sub-element)
 
-  return d;
-}
+      // Read Size
 
-const char* SegmentInfo::GetMuxingAppAsUTF8() const {
-  return m_pMuxingAppAsUTF8;
-}
+      if ((pos + 1) > avail) {
+        len = 1;
+        return E_BUFFER_NOT_FULL;
+      }
 
-const char* SegmentInfo::GetWritingAppAsUTF8() const {
-  return m_pWritingAppAsUTF8;
-}
+      result = GetUIntLength(m_pReader, pos, len);
 
-const char* SegmentInfo::GetTitleAsUTF8() const { return m_pTitleAsUTF8; }
+      if (result < 0)  // error
+        return static_cast<long>(result);
 
-///////////////////////////////////////////////////////////////
-// ContentEncoding element
-ContentEncoding::ContentCompression::ContentCompression()
-    : algo(0), settings(NULL), settings_len(0) {}
+      if (result > 0)  // weird
+        return E_BUFFER_NOT_FULL;
 
-ContentEncoding::ContentCompression::~ContentCompression() {
-  delete[] settings;
-}
+      if ((segment_stop >= 0) && ((pos + len) > segment_stop))
+        return E_FILE_FORMAT_INVALID;
 
-ContentEncoding::ContentEncryption::ContentEncryption()
-    : algo(0),
-      key_id(NULL),
-      key_id_len(0),
-      signature(NULL),
-      signature_len(0),
-      sig_key_id(NULL),
-      sig_key_id_len(0),
-      sig_algo(0),
-      sig_hash_algo(0) {}
+      if ((pos + len) > avail)
+        return E_BUFFER_NOT_FULL;
 
-ContentEncoding::ContentEncryption::~ContentEncryption() {
-  delete[] key_id;
-  delete[] signature;
-  delete[] sig_key_id;
-}
+      const long long size = ReadUInt(m_pReader, pos, len);
 
-ContentEncoding::ContentEncoding()
-    : compression_entries_(NULL),
-      compression_entries_end_(NULL),
-      encryption_entries_(NULL),
-      encryption_entries_end_(NULL),
-      encoding_order_(0),
-      encoding_scope_(1),
-      encoding_type_(0) {}
+      if (size < 0)  // error
+        return static_cast<long>(size);
 
-ContentEncoding::~ContentEncoding() {
-  ContentCompression** comp_i = compression_entries_;
-  ContentCompression** const comp_j = compression_entries_end_;
+      pos += len;  // consume size field of element
 
-  while (comp_i != comp_j) {
-    ContentCompression* const comp = *comp_i++;
-    delete comp;
-  }
+      // pos now points to start of sub-element's payload
 
-  delete[] compression_entries_;
+      if (size == 0)  // weird
+        continue;
 
-  ContentEncryption** enc_i = encryption_entries_;
-  ContentEncryption** const enc_j = encryption_entries_end_;
+      const long long unknown_size = (1LL << (7 * len)) - 1;
 
-  while (enc_i != enc_j) {
-    ContentEncryption* const enc = *enc_i++;
-    delete enc;
-  }
+      if (size == unknown_size)
+        return E_FILE_FORMAT_INVALID;  // not allowed for sub-elements
 
-  delete[] encryption_entries_;
-}
+      if ((segment_stop >= 0) && ((pos + size) > segment_stop))  // weird
+        return E_FILE_FORMAT_INVALID;
 
-const ContentEncoding::ContentCompression*
-ContentEncoding::GetCompressionByIndex(unsigned long idx) const {
-  const ptrdiff_t count = compression_entries_end_ - compression_entries_;
-  assert(count >= 0);
+      pos += size;  // consume payload of sub-element
+      assert((segment_stop < 0) || (pos <= segment_stop));
+    }  // determine cluster size
 
-  if (idx >= static_cast<unsigned long>(count))
-    return NULL;
+    cluster_size = pos - payload_pos;
+    assert(cluster_size >= 0);  // TODO: handle cluster_size = 0
 
-  return compression_entries_[idx];
-}
+    pos = payload_pos;  // reset and re-parse original cluster
+  }
 
-unsigned long ContentEncoding::GetCompressionCount() const {
-  const ptrdiff_t count = compression_entries_end_ - compression_entries_;
-  assert(count >= 0);
+  pos += cluster_size;  // consume payload
+  assert((segment_stop < 0) || (pos <= segment_stop));
 
-  return static_cast<unsigned long>(count);
+  return 2;  // try to find a cluster that follows next
 }
 
-const ContentEncoding::ContentEncryption* ContentEncoding::GetEncryptionByIndex(
-    unsigned long idx) const {
-  const ptrdiff_t count = encryption_entries_end_ - encryption_entries_;
-  assert(count >= 0);
+const Cluster* Segment::FindCluster(long long time_ns) const {
+  if ((m_clusters == NULL) || (m_clusterCount <= 0))
+    return &m_eos;
 
-  if (idx >= static_cast<unsigned long>(count))
-    return NULL;
+  {
+    Cluster* const pCluster = m_clusters[0];
+    assert(pCluster);
+    assert(pCluster->m_index == 0);
 
-  return encryption_entries_[idx];
-}
+    if (time_ns <= pCluster->GetTime())
+      return pCluster;
+  }
 
-unsigned long ContentEncoding::GetEncryptionCount() const {
-  const ptrdiff_t count = encryption_entries_end_ - encryption_entries_;
-  assert(count >= 0);
+  // Binary search of cluster array
 
-  return static_cast<unsigned long>(count);
-}
+  long i = 0;
+  long j = m_clusterCount;
 
-long ContentEncoding::ParseContentEncAESSettingsEntry(
-    long long start, long long size, IMkvReader* pReader,
-    ContentEncAESSettings* aes) {
-  assert(pReader);
-  assert(aes);
+  while (i < j) {
+    // INVARIANT:
+    //[0, i) <= time_ns
+    //[i, j) ?
+    //[j, m_clusterCount)  > time_ns
 
-  long long pos = start;
-  const long long stop = start + size;
+    const long k = i + (j - i) / 2;
+    assert(k < m_clusterCount);
 
-  while (pos < stop) {
-    long long id, size;
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
-    if (status < 0)  // error
-      return status;
+    Cluster* const pCluster = m_clusters[k];
+    assert(pCluster);
+    assert(pCluster->m_index == k);
 
-    if (id == 0x7E8) {
-      // AESSettingsCipherMode
-      aes->cipher_mode = UnserializeUInt(pReader, pos, size);
-      if (aes->cipher_mode != 1)
-        return E_FILE_FORMAT_INVALID;
-    }
+    const long long t = pCluster->GetTime();
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
+    if (t <= time_ns)
+      i = k + 1;
+    else
+      j = k;
+
+    assert(i <= j);
   }
 
-  return 0;
-}
+  assert(i == j);
+  assert(i > 0);
+  assert(i <= m_clusterCount);
 
-long ContentEncoding::ParseContentEncodingEntry(long long start, long long size,
-                                                IMkvReader* pReader) {
-  assert(pReader);
+  const long k = i - 1;
 
-  long long pos = start;
-  const long long stop = start + size;
+  Cluster* const pCluster = m_clusters[k];
+  assert(pCluster);
+  assert(pCluster->m_index == k);
+  assert(pCluster->GetTime() <= time_ns);
 
-  // Count ContentCompression and ContentEncryption elements.
-  int compression_count = 0;
-  int encryption_count = 0;
+  return pCluster;
+}
 
-  while (pos < stop) {
-    long long id, size;
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
-    if (status < 0)  // error
-      return status;
+#if 0
+const BlockEntry* Segment::Seek(
+    long long time_ns,
+    const Track* pTrack) const
+{
+    assert(pTrack);
+
+    if ((m_clusters == NULL) || (m_clusterCount <= 0))
+        return pTrack->GetEOS();
+
+    Cluster** const i = m_clusters;
+    assert(i);
+
+    {
+        Cluster* const pCluster = *i;
+        assert(pCluster);
+        assert(pCluster->m_index == 0);  //m_clusterCount > 0
+        assert(pCluster->m_pSegment == this);
+
+        if (time_ns <= pCluster->GetTime())
+            return pCluster->GetEntry(pTrack);
+    }
+
+    Cluster** const j = i + m_clusterCount;
+
+    if (pTrack->GetType() == 2) {  //audio
+        //TODO: we could decide to use cues for this, as we do for video.
+        //But we only use it for video because looking around for a keyframe
+        //can get expensive.  Audio doesn't require anything special so a
+        //straight cluster search is good enough (we assume).
+
+        Cluster** lo = i;
+        Cluster** hi = j;
+
+        while (lo < hi)
+        {
+            //INVARIANT:
+            //[i, lo) <= time_ns
+            //[lo, hi) ?
+            //[hi, j)  > time_ns
+
+            Cluster** const mid = lo + (hi - lo) / 2;
+            assert(mid < hi);
+
+            Cluster* const pCluster = *mid;
+            assert(pCluster);
+            assert(pCluster->m_index == long(mid - m_clusters));
+            assert(pCluster->m_pSegment == this);
+
+            const long long t = pCluster->GetTime();
+
+            if (t <= time_ns)
+                lo = mid + 1;
+            else
+                hi = mid;
+
+            assert(lo <= hi);
+        }
+
+        assert(lo == hi);
+        assert(lo > i);
+        assert(lo <= j);
+
+        while (lo > i)
+        {
+            Cluster* const pCluster = *--lo;
+            assert(pCluster);
+            assert(pCluster->GetTime() <= time_ns);
+
+            const BlockEntry* const pBE = pCluster->GetEntry(pTrack);
+
+            if ((pBE != 0) && !pBE->EOS())
+                return pBE;
+
+            //landed on empty cluster (no entries)
+        }
+
+        return pTrack->GetEOS();  //weird
+    }
+
+    assert(pTrack->GetType() == 1);  //video
+
+    Cluster** lo = i;
+    Cluster** hi = j;
+
+    while (lo < hi)
+    {
+        //INVARIANT:
+        //[i, lo) <= time_ns
+        //[lo, hi) ?
+        //[hi, j)  > time_ns
+
+        Cluster** const mid = lo + (hi - lo) / 2;
+        assert(mid < hi);
+
+        Cluster* const pCluster = *mid;
+        assert(pCluster);
+
+        const long long t = pCluster->GetTime();
+
+        if (t <= time_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+
+        assert(lo <= hi);
+    }
+
+    assert(lo == hi);
+    assert(lo > i);
+    assert(lo <= j);
+
+    Cluster* pCluster = *--lo;
+    assert(pCluster);
+    assert(pCluster->GetTime() <= time_ns);
+
+    {
+        const BlockEntry* const pBE = pCluster->GetEntry(pTrack, time_ns);
+
+        if ((pBE != 0) && !pBE->EOS())  //found a keyframe
+            return pBE;
+    }
+
+    const VideoTrack* const pVideo = static_cast<const VideoTrack*>(pTrack);
+
+    while (lo != i)
+    {
+        pCluster = *--lo;
+        assert(pCluster);
+        assert(pCluster->GetTime() <= time_ns);
+
+        const BlockEntry* const pBlockEntry = pCluster->GetMaxKey(pVideo);
+
+        if ((pBlockEntry != 0) && !pBlockEntry->EOS())
+            return pBlockEntry;
+    }
+
+    //weird: we're on the first cluster, but no keyframe found
+    //should never happen but we must return something anyway
+
+    return pTrack->GetEOS();
+}
+#endif
+
+#if 0
+bool Segment::SearchCues(
+    long long time_ns,
+    Track* pTrack,
+    Cluster*& pCluster,
+    const BlockEntry*& pBlockEntry,
+    const CuePoint*& pCP,
+    const CuePoint::TrackPosition*& pTP)
+{
+    if (pTrack->GetType() != 1)  //not video
+        return false;  //TODO: for now, just handle video stream
+
+    if (m_pCues == NULL)
+        return false;
+
+    if (!m_pCues->Find(time_ns, pTrack, pCP, pTP))
+        return false;  //weird
+
+    assert(pCP);
+    assert(pTP);
+    assert(pTP->m_track == pTrack->GetNumber());
+
+    //We have the cue point and track position we want,
+    //so we now need to search for the cluster having
+    //the indicated position.
+
+    return GetCluster(pCP, pTP, pCluster, pBlockEntry);
+}
+#endif
+
+const Tracks* Segment::GetTracks() const { return m_pTracks; }
+
+const SegmentInfo* Segment::GetInfo() const { return m_pInfo; }
+
+const Cues* Segment::GetCues() const { return m_pCues; }
+
+const Chapters* Segment::GetChapters() const { return m_pChapters; }
+
+const SeekHead* Segment::GetSeekHead() const { return m_pSeekHead; }
+
+long long Segment::GetDuration() const {
+  assert(m_pInfo);
+  return m_pInfo->GetDuration();
+}
+
+Chapters::Chapters(Segment* pSegment, long long payload_start,
+                   long long payload_size, long long element_start,
+                   long long element_size)
+    : m_pSegment(pSegment),
+      m_start(payload_start),
+      m_size(payload_size),
+      m_element_start(element_start),
+      m_element_size(element_size),
+      m_editions(NULL),
+      m_editions_size(0),
+      m_editions_count(0) {}
+
+Chapters::~Chapters() {
+  while (m_editions_count > 0) {
+    Edition& e = m_editions[--m_editions_count];
+    e.Clear();
+  }
+  delete[] m_editions;
+}
+
+long Chapters::Parse() {
+  IMkvReader* const pReader = m_pSegment->m_pReader;
+
+  long long pos = m_start;  // payload start
+  const long long stop = pos + m_size;  // payload stop
+
+  while (pos < stop) {
+    long long id, size;
+
+    long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (size == 0)  // weird
+      continue;
+
+    if (id == 0x05B9) {  // EditionEntry ID
+      status = ParseEdition(pos, size);
+
+      if (status < 0)  // error
+        return status;
+    }
+
+    pos += size;
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+  return 0;
+}
+
+int Chapters::GetEditionCount() const { return m_editions_count; }
+
+const Chapters::Edition* Chapters::GetEdition(int idx) const {
+  if (idx < 0)
+    return NULL;
+
+  if (idx >= m_editions_count)
+    return NULL;
+
+  return m_editions + idx;
+}
+
+bool Chapters::ExpandEditionsArray() {
+  if (m_editions_size > m_editions_count)
+    return true;  // nothing else to do
+
+  const int size = (m_editions_size == 0) ? 1 : 2 * m_editions_size;
+
+  Edition* const editions = new (std::nothrow) Edition[size];
+
+  if (editions == NULL)
+    return false;
+
+  for (int idx = 0; idx < m_editions_count; ++idx) {
+    m_editions[idx].ShallowCopy(editions[idx]);
+  }
+
+  delete[] m_editions;
+  m_editions = editions;
+
+  m_editions_size = size;
+  return true;
+}
+
+long Chapters::ParseEdition(long long pos, long long size) {
+  if (!ExpandEditionsArray())
+    return -1;
+
+  Edition& e = m_editions[m_editions_count++];
+  e.Init();
+
+  return e.Parse(m_pSegment->m_pReader, pos, size);
+}
+
+Chapters::Edition::Edition() {}
+
+Chapters::Edition::~Edition() {}
+
+int Chapters::Edition::GetAtomCount() const { return m_atoms_count; }
+
+const Chapters::Atom* Chapters::Edition::GetAtom(int index) const {
+  if (index < 0)
+    return NULL;
+
+  if (index >= m_atoms_count)
+    return NULL;
+
+  return m_atoms + index;
+}
+
+void Chapters::Edition::Init() {
+  m_atoms = NULL;
+  m_atoms_size = 0;
+  m_atoms_count = 0;
+}
+
+void Chapters::Edition::ShallowCopy(Edition& rhs) const {
+  rhs.m_atoms = m_atoms;
+  rhs.m_atoms_size = m_atoms_size;
+  rhs.m_atoms_count = m_atoms_count;
+}
+
+void Chapters::Edition::Clear() {
+  while (m_atoms_count > 0) {
+    Atom& a = m_atoms[--m_atoms_count];
+    a.Clear();
+  }
+
+  delete[] m_atoms;
+  m_atoms = NULL;
+
+  m_atoms_size = 0;
+}
+
+long Chapters::Edition::Parse(IMkvReader* pReader, long long pos,
+                              long long size) {
+  const long long stop = pos + size;
+
+  while (pos < stop) {
+    long long id, size;
+
+    long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (size == 0)  // weird
+      continue;
+
+    if (id == 0x36) {  // Atom ID
+      status = ParseAtom(pReader, pos, size);
+
+      if (status < 0)  // error
+        return status;
+    }
+
+    pos += size;
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+  return 0;
+}
+
+long Chapters::Edition::ParseAtom(IMkvReader* pReader, long long pos,
+                                  long long size) {
+  if (!ExpandAtomsArray())
+    return -1;
+
+  Atom& a = m_atoms[m_atoms_count++];
+  a.Init();
+
+  return a.Parse(pReader, pos, size);
+}
+
+bool Chapters::Edition::ExpandAtomsArray() {
+  if (m_atoms_size > m_atoms_count)
+    return true;  // nothing else to do
+
+  const int size = (m_atoms_size == 0) ? 1 : 2 * m_atoms_size;
+
+  Atom* const atoms = new (std::nothrow) Atom[size];
+
+  if (atoms == NULL)
+    return false;
+
+  for (int idx = 0; idx < m_atoms_count; ++idx) {
+    m_atoms[idx].ShallowCopy(atoms[idx]);
+  }
+
+  delete[] m_atoms;
+  m_atoms = atoms;
+
+  m_atoms_size = size;
+  return true;
+}
+
+Chapters::Atom::Atom() {}
+
+Chapters::Atom::~Atom() {}
+
+unsigned long long Chapters::Atom::GetUID() const { return m_uid; }
+
+const char* Chapters::Atom::GetStringUID() const { return m_string_uid; }
+
+long long Chapters::Atom::GetStartTimecode() const { return m_start_timecode; }
+
+long long Chapters::Atom::GetStopTimecode() const { return m_stop_timecode; }
+
+long long Chapters::Atom::GetStartTime(const Chapters* pChapters) const {
+  return GetTime(pChapters, m_start_timecode);
+}
+
+long long Chapters::Atom::GetStopTime(const Chapters* pChapters) const {
+  return GetTime(pChapters, m_stop_timecode);
+}
+
+int Chapters::Atom::GetDisplayCount() const { return m_displays_count; }
+
+const Chapters::Display* Chapters::Atom::GetDisplay(int index) const {
+  if (index < 0)
+    return NULL;
+
+  if (index >= m_displays_count)
+    return NULL;
+
+  return m_displays + index;
+}
+
+void Chapters::Atom::Init() {
+  m_string_uid = NULL;
+  m_uid = 0;
+  m_start_timecode = -1;
+  m_stop_timecode = -1;
+
+  m_displays = NULL;
+  m_displays_size = 0;
+  m_displays_count = 0;
+}
+
+void Chapters::Atom::ShallowCopy(Atom& rhs) const {
+  rhs.m_string_uid = m_string_uid;
+  rhs.m_uid = m_uid;
+  rhs.m_start_timecode = m_start_timecode;
+  rhs.m_stop_timecode = m_stop_timecode;
+
+  rhs.m_displays = m_displays;
+  rhs.m_displays_size = m_displays_size;
+  rhs.m_displays_count = m_displays_count;
+}
+
+void Chapters::Atom::Clear() {
+  delete[] m_string_uid;
+  m_string_uid = NULL;
+
+  while (m_displays_count > 0) {
+    Display& d = m_displays[--m_displays_count];
+    d.Clear();
+  }
+
+  delete[] m_displays;
+  m_displays = NULL;
+
+  m_displays_size = 0;
+}
+
+long Chapters::Atom::Parse(IMkvReader* pReader, long long pos, long long size) {
+  const long long stop = pos + size;
+
+  while (pos < stop) {
+    long long id, size;
+
+    long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (size == 0)  // weird
+      continue;
+
+    if (id == 0x00) {  // Display ID
+      status = ParseDisplay(pReader, pos, size);
+
+      if (status < 0)  // error
+        return status;
+    } else if (id == 0x1654) {  // StringUID ID
+      status = UnserializeString(pReader, pos, size, m_string_uid);
+
+      if (status < 0)  // error
+        return status;
+    } else if (id == 0x33C4) {  // UID ID
+      long long val;
+      status = UnserializeInt(pReader, pos, size, val);
+
+      if (status < 0)  // error
+        return status;
+
+      m_uid = static_cast<unsigned long long>(val);
+    } else if (id == 0x11) {  // TimeStart ID
+      const long long val = UnserializeUInt(pReader, pos, size);
+
+      if (val < 0)  // error
+        return static_cast<long>(val);
+
+      m_start_timecode = val;
+    } else if (id == 0x12) {  // TimeEnd ID
+      const long long val = UnserializeUInt(pReader, pos, size);
+
+      if (val < 0)  // error
+        return static_cast<long>(val);
+
+      m_stop_timecode = val;
+    }
+
+    pos += size;
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+  return 0;
+}
+
+long long Chapters::Atom::GetTime(const Chapters* pChapters,
+                                  long long timecode) {
+  if (pChapters == NULL)
+    return -1;
+
+  Segment* const pSegment = pChapters->m_pSegment;
+
+  if (pSegment == NULL)  // weird
+    return -1;
+
+  const SegmentInfo* const pInfo = pSegment->GetInfo();
+
+  if (pInfo == NULL)
+    return -1;
+
+  const long long timecode_scale = pInfo->GetTimeCodeScale();
+
+  if (timecode_scale < 1)  // weird
+    return -1;
+
+  if (timecode < 0)
+    return -1;
+
+  const long long result = timecode_scale * timecode;
+
+  return result;
+}
+
+long Chapters::Atom::ParseDisplay(IMkvReader* pReader, long long pos,
+                                  long long size) {
+  if (!ExpandDisplaysArray())
+    return -1;
+
+  Display& d = m_displays[m_displays_count++];
+  d.Init();
+
+  return d.Parse(pReader, pos, size);
+}
+
+bool Chapters::Atom::ExpandDisplaysArray() {
+  if (m_displays_size > m_displays_count)
+    return true;  // nothing else to do
+
+  const int size = (m_displays_size == 0) ? 1 : 2 * m_displays_size;
+
+  Display* const displays = new (std::nothrow) Display[size];
+
+  if (displays == NULL)
+    return false;
+
+  for (int idx = 0; idx < m_displays_count; ++idx) {
+    m_displays[idx].ShallowCopy(displays[idx]);
+  }
+
+  delete[] m_displays;
+  m_displays = displays;
+
+  m_displays_size = size;
+  return true;
+}
+
+Chapters::Display::Display() {}
+
+Chapters::Display::~Display() {}
+
+const char* Chapters::Display::GetString() const { return m_string; }
+
+const char* Chapters::Display::GetLanguage() const { return m_language; }
+
+const char* Chapters::Display::GetCountry() const { return m_country; }
+
+void Chapters::Display::Init() {
+  m_string = NULL;
+  m_language = NULL;
+  m_country = NULL;
+}
+
+void Chapters::Display::ShallowCopy(Display& rhs) const {
+  rhs.m_string = m_string;
+  rhs.m_language = m_language;
+  rhs.m_country = m_country;
+}
+
+void Chapters::Display::Clear() {
+  delete[] m_string;
+  m_string = NULL;
+
+  delete[] m_language;
+  m_language = NULL;
+
+  delete[] m_country;
+  m_country = NULL;
+}
+
+long Chapters::Display::Parse(IMkvReader* pReader, long long pos,
+                              long long size) {
+  const long long stop = pos + size;
+
+  while (pos < stop) {
+    long long id, size;
+
+    long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (size == 0)  // weird
+      continue;
+
+    if (id == 0x05) {  // ChapterString ID
+      status = UnserializeString(pReader, pos, size, m_string);
+
+      if (status)
+        return status;
+    } else if (id == 0x037C) {  // ChapterLanguage ID
+      status = UnserializeString(pReader, pos, size, m_language);
+
+      if (status)
+        return status;
+    } else if (id == 0x037E) {  // ChapterCountry ID
+      status = UnserializeString(pReader, pos, size, m_country);
+
+      if (status)
+        return status;
+    }
+
+    pos += size;
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+  return 0;
+}
+
+SegmentInfo::SegmentInfo(Segment* pSegment, long long start, long long size_,
+                         long long element_start, long long element_size)
+    : m_pSegment(pSegment),
+      m_start(start),
+      m_size(size_),
+      m_element_start(element_start),
+      m_element_size(element_size),
+      m_pMuxingAppAsUTF8(NULL),
+      m_pWritingAppAsUTF8(NULL),
+      m_pTitleAsUTF8(NULL) {}
+
+SegmentInfo::~SegmentInfo() {
+  delete[] m_pMuxingAppAsUTF8;
+  m_pMuxingAppAsUTF8 = NULL;
+
+  delete[] m_pWritingAppAsUTF8;
+  m_pWritingAppAsUTF8 = NULL;
+
+  delete[] m_pTitleAsUTF8;
+  m_pTitleAsUTF8 = NULL;
+}
+
+long SegmentInfo::Parse() {
+  assert(m_pMuxingAppAsUTF8 == NULL);
+  assert(m_pWritingAppAsUTF8 == NULL);
+  assert(m_pTitleAsUTF8 == NULL);
+
+  IMkvReader* const pReader = m_pSegment->m_pReader;
+
+  long long pos = m_start;
+  const long long stop = m_start + m_size;
+
+  m_timecodeScale = 1000000;
+  m_duration = -1;
+
+  while (pos < stop) {
+    long long id, size;
+
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x0AD7B1) {  // Timecode Scale
+      m_timecodeScale = UnserializeUInt(pReader, pos, size);
+
+      if (m_timecodeScale <= 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x0489) {  // Segment duration
+      const long status = UnserializeFloat(pReader, pos, size, m_duration);
+
+      if (status < 0)
+        return status;
+
+      if (m_duration < 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x0D80) {  // MuxingApp
+      const long status =
+          UnserializeString(pReader, pos, size, m_pMuxingAppAsUTF8);
+
+      if (status)
+        return status;
+    } else if (id == 0x1741) {  // WritingApp
+      const long status =
+          UnserializeString(pReader, pos, size, m_pWritingAppAsUTF8);
+
+      if (status)
+        return status;
+    } else if (id == 0x3BA9) {  // Title
+      const long status = UnserializeString(pReader, pos, size, m_pTitleAsUTF8);
+
+      if (status)
+        return status;
+    }
+
+    pos += size;
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+
+  return 0;
+}
+
+long long SegmentInfo::GetTimeCodeScale() const { return m_timecodeScale; }
+
+long long SegmentInfo::GetDuration() const {
+  if (m_duration < 0)
+    return -1;
+
+  assert(m_timecodeScale >= 1);
+
+  const double dd = double(m_duration) * double(m_timecodeScale);
+  const long long d = static_cast<long long>(dd);
+
+  return d;
+}
+
+const char* SegmentInfo::GetMuxingAppAsUTF8() const {
+  return m_pMuxingAppAsUTF8;
+}
+
+const char* SegmentInfo::GetWritingAppAsUTF8() const {
+  return m_pWritingAppAsUTF8;
+}
+
+const char* SegmentInfo::GetTitleAsUTF8() const { return m_pTitleAsUTF8; }
+
+///////////////////////////////////////////////////////////////
+// ContentEncoding element
+ContentEncoding::ContentCompression::ContentCompression()
+    : algo(0), settings(NULL), settings_len(0) {}
+
+ContentEncoding::ContentCompression::~ContentCompression() {
+  delete[] settings;
+}
+
+ContentEncoding::ContentEncryption::ContentEncryption()
+    : algo(0),
+      key_id(NULL),
+      key_id_len(0),
+      signature(NULL),
+      signature_len(0),
+      sig_key_id(NULL),
+      sig_key_id_len(0),
+      sig_algo(0),
+      sig_hash_algo(0) {}
+
+ContentEncoding::ContentEncryption::~ContentEncryption() {
+  delete[] key_id;
+  delete[] signature;
+  delete[] sig_key_id;
+}
+
+ContentEncoding::ContentEncoding()
+    : compression_entries_(NULL),
+      compression_entries_end_(NULL),
+      encryption_entries_(NULL),
+      encryption_entries_end_(NULL),
+      encoding_order_(0),
+      encoding_scope_(1),
+      encoding_type_(0) {}
+
+ContentEncoding::~ContentEncoding() {
+  ContentCompression** comp_i = compression_entries_;
+  ContentCompression** const comp_j = compression_entries_end_;
+
+  while (comp_i != comp_j) {
+    ContentCompression* const comp = *comp_i++;
+    delete comp;
+  }
+
+  delete[] compression_entries_;
+
+  ContentEncryption** enc_i = encryption_entries_;
+  ContentEncryption** const enc_j = encryption_entries_end_;
+
+  while (enc_i != enc_j) {
+    ContentEncryption* const enc = *enc_i++;
+    delete enc;
+  }
+
+  delete[] encryption_entries_;
+}
+
+const ContentEncoding::ContentCompression*
+ContentEncoding::GetCompressionByIndex(unsigned long idx) const {
+  const ptrdiff_t count = compression_entries_end_ - compression_entries_;
+  assert(count >= 0);
+
+  if (idx >= static_cast<unsigned long>(count))
+    return NULL;
+
+  return compression_entries_[idx];
+}
+
+unsigned long ContentEncoding::GetCompressionCount() const {
+  const ptrdiff_t count = compression_entries_end_ - compression_entries_;
+  assert(count >= 0);
+
+  return static_cast<unsigned long>(count);
+}
+
+const ContentEncoding::ContentEncryption* ContentEncoding::GetEncryptionByIndex(
+    unsigned long idx) const {
+  const ptrdiff_t count = encryption_entries_end_ - encryption_entries_;
+  assert(count >= 0);
+
+  if (idx >= static_cast<unsigned long>(count))
+    return NULL;
+
+  return encryption_entries_[idx];
+}
+
+unsigned long ContentEncoding::GetEncryptionCount() const {
+  const ptrdiff_t count = encryption_entries_end_ - encryption_entries_;
+  assert(count >= 0);
+
+  return static_cast<unsigned long>(count);
+}
+
+long ContentEncoding::ParseContentEncAESSettingsEntry(
+    long long start, long long size, IMkvReader* pReader,
+    ContentEncAESSettings* aes) {
+  assert(pReader);
+  assert(aes);
+
+  long long pos = start;
+  const long long stop = start + size;
+
+  while (pos < stop) {
+    long long id, size;
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x7E8) {
+      // AESSettingsCipherMode
+      aes->cipher_mode = UnserializeUInt(pReader, pos, size);
+      if (aes->cipher_mode != 1)
+        return E_FILE_FORMAT_INVALID;
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  return 0;
+}
+
+long ContentEncoding::ParseContentEncodingEntry(long long start, long long size,
+                                                IMkvReader* pReader) {
+  assert(pReader);
+
+  long long pos = start;
+  const long long stop = start + size;
+
+  // Count ContentCompression and ContentEncryption elements.
+  int compression_count = 0;
+  int encryption_count = 0;
+
+  while (pos < stop) {
+    long long id, size;
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x1034)  // ContentCompression ID
+      ++compression_count;
+
+    if (id == 0x1035)  // ContentEncryption ID
+      ++encryption_count;
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  if (compression_count <= 0 && encryption_count <= 0)
+    return -1;
+
+  if (compression_count > 0) {
+    compression_entries_ =
+        new (std::nothrow) ContentCompression* [compression_count];
+    if (!compression_entries_)
+      return -1;
+    compression_entries_end_ = compression_entries_;
+  }
+
+  if (encryption_count > 0) {
+    encryption_entries_ =
+        new (std::nothrow) ContentEncryption* [encryption_count];
+    if (!encryption_entries_) {
+      delete[] compression_entries_;
+      return -1;
+    }
+    encryption_entries_end_ = encryption_entries_;
+  }
+
+  pos = start;
+  while (pos < stop) {
+    long long id, size;
+    long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x1031) {
+      // ContentEncodingOrder
+      encoding_order_ = UnserializeUInt(pReader, pos, size);
+    } else if (id == 0x1032) {
+      // ContentEncodingScope
+      encoding_scope_ = UnserializeUInt(pReader, pos, size);
+      if (encoding_scope_ < 1)
+        return -1;
+    } else if (id == 0x1033) {
+      // ContentEncodingType
+      encoding_type_ = UnserializeUInt(pReader, pos, size);
+    } else if (id == 0x1034) {
+      // ContentCompression ID
+      ContentCompression* const compression =
+          new (std::nothrow) ContentCompression();
+      if (!compression)
+        return -1;
+
+      status = ParseCompressionEntry(pos, size, pReader, compression);
+      if (status) {
+        delete compression;
+        return status;
+      }
+      *compression_entries_end_++ = compression;
+    } else if (id == 0x1035) {
+      // ContentEncryption ID
+      ContentEncryption* const encryption =
+          new (std::nothrow) ContentEncryption();
+      if (!encryption)
+        return -1;
+
+      status = ParseEncryptionEntry(pos, size, pReader, encryption);
+      if (status) {
+        delete encryption;
+        return status;
+      }
+      *encryption_entries_end_++ = encryption;
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+  return 0;
+}
+
+long ContentEncoding::ParseCompressionEntry(long long start, long long size,
+                                            IMkvReader* pReader,
+                                            ContentCompression* compression) {
+  assert(pReader);
+  assert(compression);
+
+  long long pos = start;
+  const long long stop = start + size;
+
+  bool valid = false;
+
+  while (pos < stop) {
+    long long id, size;
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x254) {
+      // ContentCompAlgo
+      long long algo = UnserializeUInt(pReader, pos, size);
+      if (algo < 0)
+        return E_FILE_FORMAT_INVALID;
+      compression->algo = algo;
+      valid = true;
+    } else if (id == 0x255) {
+      // ContentCompSettings
+      if (size <= 0)
+        return E_FILE_FORMAT_INVALID;
+
+      const size_t buflen = static_cast<size_t>(size);
+      typedef unsigned char* buf_t;
+      const buf_t buf = new (std::nothrow) unsigned char[buflen];
+      if (buf == NULL)
+        return -1;
+
+      const int read_status =
+          pReader->Read(pos, static_cast<long>(buflen), buf);
+      if (read_status) {
+        delete[] buf;
+        return status;
+      }
+
+      compression->settings = buf;
+      compression->settings_len = buflen;
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  // ContentCompAlgo is mandatory
+  if (!valid)
+    return E_FILE_FORMAT_INVALID;
+
+  return 0;
+}
+
+long ContentEncoding::ParseEncryptionEntry(long long start, long long size,
+                                           IMkvReader* pReader,
+                                           ContentEncryption* encryption) {
+  assert(pReader);
+  assert(encryption);
+
+  long long pos = start;
+  const long long stop = start + size;
+
+  while (pos < stop) {
+    long long id, size;
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x7E1) {
+      // ContentEncAlgo
+      encryption->algo = UnserializeUInt(pReader, pos, size);
+      if (encryption->algo != 5)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x7E2) {
+      // ContentEncKeyID
+      delete[] encryption -> key_id;
+      encryption->key_id = NULL;
+      encryption->key_id_len = 0;
+
+      if (size <= 0)
+        return E_FILE_FORMAT_INVALID;
+
+      const size_t buflen = static_cast<size_t>(size);
+      typedef unsigned char* buf_t;
+      const buf_t buf = new (std::nothrow) unsigned char[buflen];
+      if (buf == NULL)
+        return -1;
+
+      const int read_status =
+          pReader->Read(pos, static_cast<long>(buflen), buf);
+      if (read_status) {
+        delete[] buf;
+        return status;
+      }
+
+      encryption->key_id = buf;
+      encryption->key_id_len = buflen;
+    } else if (id == 0x7E3) {
+      // ContentSignature
+      delete[] encryption -> signature;
+      encryption->signature = NULL;
+      encryption->signature_len = 0;
+
+      if (size <= 0)
+        return E_FILE_FORMAT_INVALID;
+
+      const size_t buflen = static_cast<size_t>(size);
+      typedef unsigned char* buf_t;
+      const buf_t buf = new (std::nothrow) unsigned char[buflen];
+      if (buf == NULL)
+        return -1;
+
+      const int read_status =
+          pReader->Read(pos, static_cast<long>(buflen), buf);
+      if (read_status) {
+        delete[] buf;
+        return status;
+      }
+
+      encryption->signature = buf;
+      encryption->signature_len = buflen;
+    } else if (id == 0x7E4) {
+      // ContentSigKeyID
+      delete[] encryption -> sig_key_id;
+      encryption->sig_key_id = NULL;
+      encryption->sig_key_id_len = 0;
+
+      if (size <= 0)
+        return E_FILE_FORMAT_INVALID;
+
+      const size_t buflen = static_cast<size_t>(size);
+      typedef unsigned char* buf_t;
+      const buf_t buf = new (std::nothrow) unsigned char[buflen];
+      if (buf == NULL)
+        return -1;
+
+      const int read_status =
+          pReader->Read(pos, static_cast<long>(buflen), buf);
+      if (read_status) {
+        delete[] buf;
+        return status;
+      }
+
+      encryption->sig_key_id = buf;
+      encryption->sig_key_id_len = buflen;
+    } else if (id == 0x7E5) {
+      // ContentSigAlgo
+      encryption->sig_algo = UnserializeUInt(pReader, pos, size);
+    } else if (id == 0x7E6) {
+      // ContentSigHashAlgo
+      encryption->sig_hash_algo = UnserializeUInt(pReader, pos, size);
+    } else if (id == 0x7E7) {
+      // ContentEncAESSettings
+      const long status = ParseContentEncAESSettingsEntry(
+          pos, size, pReader, &encryption->aes_settings);
+      if (status)
+        return status;
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  return 0;
+}
+
+Track::Track(Segment* pSegment, long long element_start, long long element_size)
+    : m_pSegment(pSegment),
+      m_element_start(element_start),
+      m_element_size(element_size),
+      content_encoding_entries_(NULL),
+      content_encoding_entries_end_(NULL),
+      m_keyframes(NULL),
+      m_keyframes_count(0),
+      m_keyframes_size(0) {}
+
+Track::~Track() {
+  delete[] m_keyframes;
+
+  Info& info = const_cast<Info&>(m_info);
+  info.Clear();
+
+  ContentEncoding** i = content_encoding_entries_;
+  ContentEncoding** const j = content_encoding_entries_end_;
+
+  while (i != j) {
+    ContentEncoding* const encoding = *i++;
+    delete encoding;
+  }
+
+  delete[] content_encoding_entries_;
+}
+
+const Track::Keyframe* Track::GetKeyframes(long& count) const {
+  count = m_keyframes_count;
+  return (count > 0) ? m_keyframes : NULL;
+}
+
+long Track::GetDecodeList(const BlockEntry* pStart, long long time_ns,
+                          const BlockEntry** entries, long size) const {
+  if ((pStart == NULL) || (size < 0))
+    return -1;
+
+  long count = 0;
+
+  const BlockEntry* pEntry = pStart;
+
+  while (!pEntry->EOS()) {
+    const Block* const pBlock = pEntry->GetBlock();
+    assert(pBlock);
+
+    if (pBlock->GetTrackNumber() != m_info.number)
+      return -1;
+
+    if ((count > 0) && (pBlock->GetTime(pEntry->GetCluster()) > time_ns))
+      break;
+
+    if ((entries != NULL) && (count < size))
+      entries[count] = pEntry;
+
+    ++count;
+
+    const long status = GetNext(pEntry, pEntry);
+
+    if (status < 0)  // error, or another cluster must be loaded
+      return status;
+  }
+
+  return count;
+}
+
+const BlockEntry* Track::FindKeyframe(long cluster,
+                                      long long time_ns) const {
+  m_pSegment->IndexParsedClusters();
+
+  if ((m_keyframes_count <= 0) ||
+      (cluster >= m_pSegment->m_keyframeClusterCount)) {
+    return NULL;
+  }
+
+  // Find the first keyframe beyond |cluster|, then walk back to the last one
+  // that is not later than |time_ns|.
+
+  long lo = 0;
+  long hi = m_keyframes_count;
+
+  while (lo < hi) {
+    const long mid = lo + (hi - lo) / 2;
+
+    if (m_keyframes[mid].cluster <= cluster)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  while ((lo > 0) && (m_keyframes[lo - 1].time > time_ns))
+    --lo;
+
+  if (lo <= 0)
+    return NULL;
+
+  const Keyframe& keyframe = m_keyframes[lo - 1];
+
+  // A skimmed cluster may have keyframes that are not in the index.
+
+  Cluster** const clusters = m_pSegment->m_clusters;
+
+  for (long i = keyframe.cluster; i <= cluster; ++i) {
+    if (clusters[i]->m_skimmed)
+      return NULL;
+  }
+
+  const Cluster* const pCluster = clusters[keyframe.cluster];
+
+  const BlockEntry* pEntry;
+
+  for (;;) {
+    long status = pCluster->GetEntry(keyframe.block, pEntry);
+
+    if (status != E_BUFFER_NOT_FULL)
+      break;
+
+    long long pos;
+    long len;
+
+    status = pCluster->Parse(pos, len);
+
+    if (status != 0)  // error, or nothing left to parse
+      return NULL;
+  }
+
+  if (pEntry == NULL)
+    return NULL;
+
+  // Verify the entry, in case the index is stale (e.g. it was loaded from a
+  // seek index that does not match the file).
+
+  const Block* const pBlock = pEntry->GetBlock();
+
+  if ((pBlock == NULL) || (pBlock->GetTrackNumber() != m_info.number) ||
+      !VetEntry(pEntry) || (pBlock->GetTime(pCluster) != keyframe.time)) {
+    return NULL;
+  }
+
+  return pEntry;
+}
+
+bool Track::AddKeyframe(const Keyframe& keyframe) const {
+  if (m_keyframes_count >= m_keyframes_size) {
+    const long size = (m_keyframes_size <= 0) ? 256 : 2 * m_keyframes_size;
+
+    Keyframe* const keyframes = new (std::nothrow) Keyframe[size];
+
+    if (keyframes == NULL)
+      return false;
+
+    for (long i = 0; i < m_keyframes_count; ++i)
+      keyframes[i] = m_keyframes[i];
+
+    delete[] m_keyframes;
+
+    m_keyframes = keyframes;
+    m_keyframes_size = size;
+  }
+
+  m_keyframes[m_keyframes_count++] = keyframe;
+  return true;
+}
+
+void Track::TruncateKeyframes(long cluster) const {
+  while ((m_keyframes_count > 0) &&
+         (m_keyframes[m_keyframes_count - 1].cluster >= cluster)) {
+    --m_keyframes_count;
+  }
+}
+
+long Track::Create(Segment* pSegment, const Info& info, long long element_start,
+                   long long element_size, Track*& pResult) {
+  if (pResult)
+    return -1;
+
+  Track* const pTrack =
+      new (std::nothrow) Track(pSegment, element_start, element_size);
+
+  if (pTrack == NULL)
+    return -1;  // generic error
+
+  const int status = info.Copy(pTrack->m_info);
+
+  if (status) {  // error
+    delete pTrack;
+    return status;
+  }
+
+  pResult = pTrack;
+  return 0;  // success
+}
+
+Track::Info::Info()
+    : uid(0),
+      defaultDuration(0),
+      codecDelay(0),
+      seekPreRoll(0),
+      nameAsUTF8(NULL),
+      language(NULL),
+      codecId(NULL),
+      codecNameAsUTF8(NULL),
+      codecPrivate(NULL),
+      codecPrivateSize(0),
+      lacing(false) {}
+
+Track::Info::~Info() { Clear(); }
+
+void Track::Info::Clear() {
+  delete[] nameAsUTF8;
+  nameAsUTF8 = NULL;
+
+  delete[] language;
+  language = NULL;
+
+  delete[] codecId;
+  codecId = NULL;
+
+  delete[] codecPrivate;
+  codecPrivate = NULL;
+  codecPrivateSize = 0;
+
+  delete[] codecNameAsUTF8;
+  codecNameAsUTF8 = NULL;
+}
+
+int Track::Info::CopyStr(char* Info::*str, Info& dst_) const {
+  if (str == static_cast<char * Info::*>(NULL))
+    return -1;
+
+  char*& dst = dst_.*str;
+
+  if (dst)  // should be NULL already
+    return -1;
+
+  const char* const src = this->*str;
+
+  if (src == NULL)
+    return 0;
+
+  const size_t len = strlen(src);
+
+  dst = new (std::nothrow) char[len + 1];
+
+  if (dst == NULL)
+    return -1;
+
+  strcpy(dst, src);
+
+  return 0;
+}
+
+int Track::Info::Copy(Info& dst) const {
+  if (&dst == this)
+    return 0;
+
+  dst.type = type;
+  dst.number = number;
+  dst.defaultDuration = defaultDuration;
+  dst.codecDelay = codecDelay;
+  dst.seekPreRoll = seekPreRoll;
+  dst.uid = uid;
+  dst.lacing = lacing;
+  dst.settings = settings;
+
+  // We now copy the string member variables from src to dst.
+  // This involves memory allocation so in principle the operation
+  // can fail (indeed, that's why we have Info::Copy), so we must
+  // report this to the caller.  An error return from this function
+  // therefore implies that the copy was only partially successful.
+
+  if (int status = CopyStr(&Info::nameAsUTF8, dst))
+    return status;
+
+  if (int status = CopyStr(&Info::language, dst))
+    return status;
+
+  if (int status = CopyStr(&Info::codecId, dst))
+    return status;
+
+  if (int status = CopyStr(&Info::codecNameAsUTF8, dst))
+    return status;
+
+  if (codecPrivateSize > 0) {
+    if (codecPrivate == NULL)
+      return -1;
+
+    if (dst.codecPrivate)
+      return -1;
+
+    if (dst.codecPrivateSize != 0)
+      return -1;
+
+    dst.codecPrivate = new (std::nothrow) unsigned char[codecPrivateSize];
+
+    if (dst.codecPrivate == NULL)
+      return -1;
+
+    memcpy(dst.codecPrivate, codecPrivate, codecPrivateSize);
+    dst.codecPrivateSize = codecPrivateSize;
+  }
+
+  return 0;
+}
+
+const BlockEntry* Track::GetEOS() const { return &m_eos; }
+
+long Track::GetType() const { return m_info.type; }
+
+long Track::GetNumber() const { return m_info.number; }
+
+unsigned long long Track::GetUid() const { return m_info.uid; }
+
+const char* Track::GetNameAsUTF8() const { return m_info.nameAsUTF8; }
+
+const char* Track::GetLanguage() const { return m_info.language; }
+
+const char* Track::GetCodecNameAsUTF8() const { return m_info.codecNameAsUTF8; }
+
+const char* Track::GetCodecId() const { return m_info.codecId; }
+
+const unsigned char* Track::GetCodecPrivate(size_t& size) const {
+  size = m_info.codecPrivateSize;
+  return m_info.codecPrivate;
+}
+
+bool Track::GetLacing() const { return m_info.lacing; }
+
+unsigned long long Track::GetDefaultDuration() const {
+  return m_info.defaultDuration;
+}
+
+unsigned long long Track::GetCodecDelay() const { return m_info.codecDelay; }
+
+unsigned long long Track::GetSeekPreRoll() const { return m_info.seekPreRoll; }
+
+long Track::GetFirst(const BlockEntry*& pBlockEntry) const {
+  const Cluster* pCluster = m_pSegment->GetFirst();
+
+  for (int i = 0;;) {
+    if (pCluster == NULL) {
+      pBlockEntry = GetEOS();
+      return 1;
+    }
+
+    if (pCluster->EOS()) {
+#if 0
+            if (m_pSegment->Unparsed() <= 0) {  //all clusters have been loaded
+                pBlockEntry = GetEOS();
+                return 1;
+            }
+#else
+      if (m_pSegment->DoneParsing()) {
+        pBlockEntry = GetEOS();
+        return 1;
+      }
+#endif
+
+      pBlockEntry = 0;
+      return E_BUFFER_NOT_FULL;
+    }
+
+    long status = pCluster->GetFirst(pBlockEntry);
+
+    if (status < 0)  // error
+      return status;
+
+    if (pBlockEntry == 0) {  // empty cluster
+      pCluster = m_pSegment->GetNext(pCluster);
+      continue;
+    }
+
+    for (;;) {
+      const Block* const pBlock = pBlockEntry->GetBlock();
+      assert(pBlock);
+
+      const long long tn = pBlock->GetTrackNumber();
+
+      if ((tn == m_info.number) && VetEntry(pBlockEntry))
+        return 0;
+
+      const BlockEntry* pNextEntry;
+
+      status = pCluster->GetNext(pBlockEntry, pNextEntry);
+
+      if (status < 0)  // error
+        return status;
+
+      if (pNextEntry == 0)
+        break;
+
+      pBlockEntry = pNextEntry;
+    }
+
+    ++i;
+
+    if (i >= 100)
+      break;
+
+    pCluster = m_pSegment->GetNext(pCluster);
+  }
+
+  // NOTE: if we get here, it means that we didn't find a block with
+  // a matching track number.  We interpret that as an error (which
+  // might be too conservative).
+
+  pBlockEntry = GetEOS();  // so we can return a non-NULL value
+  return 1;
+}
+
+long Track::GetNext(const BlockEntry* pCurrEntry,
+                    const BlockEntry*& pNextEntry) const {
+  assert(pCurrEntry);
+  assert(!pCurrEntry->EOS());  //?
+
+  const Block* const pCurrBlock = pCurrEntry->GetBlock();
+  assert(pCurrBlock && pCurrBlock->GetTrackNumber() == m_info.number);
+  if (!pCurrBlock || pCurrBlock->GetTrackNumber() != m_info.number)
+    return -1;
+
+  const Cluster* pCluster = pCurrEntry->GetCluster();
+  assert(pCluster);
+  assert(!pCluster->EOS());
+
+  long status = pCluster->GetNext(pCurrEntry, pNextEntry);
+
+  if (status < 0)  // error
+    return status;
+
+  for (int i = 0;;) {
+    while (pNextEntry) {
+      const Block* const pNextBlock = pNextEntry->GetBlock();
+      assert(pNextBlock);
+
+      if (pNextBlock->GetTrackNumber() == m_info.number)
+        return 0;
+
+      pCurrEntry = pNextEntry;
+
+      status = pCluster->GetNext(pCurrEntry, pNextEntry);
+
+      if (status < 0)  // error
+        return status;
+    }
+
+    pCluster = m_pSegment->GetNext(pCluster);
+
+    if (pCluster == NULL) {
+      pNextEntry = GetEOS();
+      return 1;
+    }
+
+    if (pCluster->EOS()) {
+#if 0
+            if (m_pSegment->Unparsed() <= 0)   //all clusters have been loaded
+            {
+                pNextEntry = GetEOS();
+                return 1;
+            }
+#else
+      if (m_pSegment->DoneParsing()) {
+        pNextEntry = GetEOS();
+        return 1;
+      }
+#endif
+
+      // TODO: there is a potential O(n^2) problem here: we tell the
+      // caller to (pre)load another cluster, which he does, but then he
+      // calls GetNext again, which repeats the same search.  This is
+      // a pathological case, since the only way it can happen is if
+      // there exists a long sequence of clusters none of which contain a
+      // block from this track.  One way around this problem is for the
+      // caller to be smarter when he loads another cluster: don't call
+      // us back until you have a cluster that contains a block from this
+      // track. (Of course, that's not cheap either, since our caller
+      // would have to scan the each cluster as it's loaded, so that
+      // would just push back the problem.)
+
+      pNextEntry = NULL;
+      return E_BUFFER_NOT_FULL;
+    }
+
+    status = pCluster->GetFirst(pNextEntry);
+
+    if (status < 0)  // error
+      return status;
+
+    if (pNextEntry == NULL)  // empty cluster
+      continue;
+
+    ++i;
+
+    if (i >= 100)
+      break;
+  }
+
+  // NOTE: if we get here, it means that we didn't find a block with
+  // a matching track number after lots of searching, so we give
+  // up trying.
+
+  pNextEntry = GetEOS();  // so we can return a non-NULL value
+  return 1;
+}
+
+bool Track::VetEntry(const BlockEntry* pBlockEntry) const {
+  assert(pBlockEntry);
+  const Block* const pBlock = pBlockEntry->GetBlock();
+  assert(pBlock);
+  assert(pBlock->GetTrackNumber() == m_info.number);
+  if (!pBlock || pBlock->GetTrackNumber() != m_info.number)
+    return false;
+
+  // This function is used during a seek to determine whether the
+  // frame is a valid seek target.  This default function simply
+  // returns true, which means all frames are valid seek targets.
+  // It gets overridden by the VideoTrack class, because only video
+  // keyframes can be used as seek target.
+
+  return true;
+}
+
+long Track::Seek(long long time_ns, const BlockEntry*& pResult) const {
+  const long status = GetFirst(pResult);
+
+  if (status < 0)  // buffer underflow, etc
+    return status;
+
+  assert(pResult);
+
+  if (pResult->EOS())
+    return 0;
+
+  const Cluster* pCluster = pResult->GetCluster();
+  assert(pCluster);
+  assert(pCluster->GetIndex() >= 0);
+
+  if (time_ns <= pResult->GetBlock()->GetTime(pCluster))
+    return 0;
+
+  Cluster** const clusters = m_pSegment->m_clusters;
+  assert(clusters);
+
+  const long count = m_pSegment->GetCount();  // loaded only, not preloaded
+  assert(count > 0);
+
+  Cluster** const i = clusters + pCluster->GetIndex();
+  assert(i);
+  assert(*i == pCluster);
+  assert(pCluster->GetTime() <= time_ns);
+
+  Cluster** const j = clusters + count;
+
+  Cluster** lo = i;
+  Cluster** hi = j;
+
+  while (lo < hi) {
+    // INVARIANT:
+    //[i, lo) <= time_ns
+    //[lo, hi) ?
+    //[hi, j)  > time_ns
+
+    Cluster** const mid = lo + (hi - lo) / 2;
+    assert(mid < hi);
+
+    pCluster = *mid;
+    assert(pCluster);
+    assert(pCluster->GetIndex() >= 0);
+    assert(pCluster->GetIndex() == long(mid - m_pSegment->m_clusters));
+
+    const long long t = pCluster->GetTime();
+
+    if (t <= time_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+    assert(lo <= hi);
+  }
+
+  assert(lo == hi);
+  assert(lo > i);
+  assert(lo <= j);
+
+  pCluster = *(lo - 1);
+  assert(pCluster);
+  assert(pCluster->GetTime() <= time_ns);
+
+  // The index holds the first block of this track in each cluster, so its
+  // last entry up to this cluster is the block the scan below would find,
+  // whatever its time.
+  pResult = FindKeyframe(pCluster->GetIndex(), LLONG_MAX);
+
+  if (pResult != 0)  // found in the keyframe index
+    return 0;
+
+  while (lo > i) {
+    pCluster = *--lo;
+    assert(pCluster);
+    assert(pCluster->GetTime() <= time_ns);
+
+    pResult = pCluster->GetEntry(this);
+
+    if ((pResult != 0) && !pResult->EOS())
+      return 0;
+
+    // landed on empty cluster (no entries)
+  }
+
+  pResult = GetEOS();  // weird
+  return 0;
+}
+
+const ContentEncoding* Track::GetContentEncodingByIndex(
+    unsigned long idx) const {
+  const ptrdiff_t count =
+      content_encoding_entries_end_ - content_encoding_entries_;
+  assert(count >= 0);
+
+  if (idx >= static_cast<unsigned long>(count))
+    return NULL;
+
+  return content_encoding_entries_[idx];
+}
+
+unsigned long Track::GetContentEncodingCount() const {
+  const ptrdiff_t count =
+      content_encoding_entries_end_ - content_encoding_entries_;
+  assert(count >= 0);
+
+  return static_cast<unsigned long>(count);
+}
+
+long Track::ParseContentEncodingsEntry(long long start, long long size) {
+  IMkvReader* const pReader = m_pSegment->m_pReader;
+  assert(pReader);
+
+  long long pos = start;
+  const long long stop = start + size;
+
+  // Count ContentEncoding elements.
+  int count = 0;
+  while (pos < stop) {
+    long long id, size;
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (status < 0)  // error
+      return status;
+
+    // pos now designates start of element
+    if (id == 0x2240)  // ContentEncoding ID
+      ++count;
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  if (count <= 0)
+    return -1;
+
+  content_encoding_entries_ = new (std::nothrow) ContentEncoding* [count];
+  if (!content_encoding_entries_)
+    return -1;
+
+  content_encoding_entries_end_ = content_encoding_entries_;
+
+  pos = start;
+  while (pos < stop) {
+    long long id, size;
+    long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (status < 0)  // error
+      return status;
+
+    // pos now designates start of element
+    if (id == 0x2240) {  // ContentEncoding ID
+      ContentEncoding* const content_encoding =
+          new (std::nothrow) ContentEncoding();
+      if (!content_encoding)
+        return -1;
+
+      status = content_encoding->ParseContentEncodingEntry(pos, size, pReader);
+      if (status) {
+        delete content_encoding;
+        return status;
+      }
+
+      *content_encoding_entries_end_++ = content_encoding;
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+
+  return 0;
+}
+
+Track::EOSBlock::EOSBlock() : BlockEntry(NULL, LONG_MIN) {}
+
+BlockEntry::Kind Track::EOSBlock::GetKind() const { return kBlockEOS; }
+
+const Block* Track::EOSBlock::GetBlock() const { return NULL; }
+
+VideoTrack::VideoTrack(Segment* pSegment, long long element_start,
+                       long long element_size)
+    : Track(pSegment, element_start, element_size) {}
+
+long VideoTrack::Parse(Segment* pSegment, const Info& info,
+                       long long element_start, long long element_size,
+                       VideoTrack*& pResult) {
+  if (pResult)
+    return -1;
+
+  if (info.type != Track::kVideo)
+    return -1;
+
+  long long width = 0;
+  long long height = 0;
+  long long display_width = 0;
+  long long display_height = 0;
+  long long stereo_mode = 0;
+
+  double rate = 0.0;
+
+  IMkvReader* const pReader = pSegment->m_pReader;
+
+  const Settings& s = info.settings;
+  assert(s.start >= 0);
+  assert(s.size >= 0);
+
+  long long pos = s.start;
+  assert(pos >= 0);
+
+  const long long stop = pos + s.size;
+
+  while (pos < stop) {
+    long long id, size;
+
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x30) {  // pixel width
+      width = UnserializeUInt(pReader, pos, size);
+
+      if (width <= 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x3A) {  // pixel height
+      height = UnserializeUInt(pReader, pos, size);
+
+      if (height <= 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x14B0) { // display width
+      display_width = UnserializeUInt(pReader, pos, size);
+
+      if (display_width <= 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x14BA) { // display height
+      display_height = UnserializeUInt(pReader, pos, size);
+
+      if (display_height <= 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x13B8) { // stereo mode
+      stereo_mode = UnserializeUInt(pReader, pos, size);
+
+      if (stereo_mode < 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x0383E3) {  // frame rate
+      const long status = UnserializeFloat(pReader, pos, size, rate);
+
+      if (status < 0)
+        return status;
+
+      if (rate <= 0)
+        return E_FILE_FORMAT_INVALID;
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+
+  VideoTrack* const pTrack =
+      new (std::nothrow) VideoTrack(pSegment, element_start, element_size);
+
+  if (pTrack == NULL)
+    return -1;  // generic error
+
+  const int status = info.Copy(pTrack->m_info);
+
+  if (status) {  // error
+    delete pTrack;
+    return status;
+  }
+
+  pTrack->m_width = width;
+  pTrack->m_height = height;
+  pTrack->m_display_width = display_width;
+  pTrack->m_display_height = display_height;
+  pTrack->m_stereo_mode = stereo_mode;
+  pTrack->m_rate = rate;
+
+  pResult = pTrack;
+  return 0;  // success
+}
+
+bool VideoTrack::VetEntry(const BlockEntry* pBlockEntry) const {
+  return Track::VetEntry(pBlockEntry) && pBlockEntry->GetBlock()->IsKey();
+}
+
+long VideoTrack::Seek(long long time_ns, const BlockEntry*& pResult) const {
+  const long status = GetFirst(pResult);
+
+  if (status < 0)  // buffer underflow, etc
+    return status;
+
+  assert(pResult);
+
+  if (pResult->EOS())
+    return 0;
+
+  const Cluster* pCluster = pResult->GetCluster();
+  assert(pCluster);
+  assert(pCluster->GetIndex() >= 0);
+
+  if (time_ns <= pResult->GetBlock()->GetTime(pCluster))
+    return 0;
+
+  Cluster** const clusters = m_pSegment->m_clusters;
+  assert(clusters);
+
+  const long count = m_pSegment->GetCount();  // loaded only, not pre-loaded
+  assert(count > 0);
+
+  Cluster** const i = clusters + pCluster->GetIndex();
+  assert(i);
+  assert(*i == pCluster);
+  assert(pCluster->GetTime() <= time_ns);
+
+  Cluster** const j = clusters + count;
+
+  Cluster** lo = i;
+  Cluster** hi = j;
+
+  while (lo < hi) {
+    // INVARIANT:
+    //[i, lo) <= time_ns
+    //[lo, hi) ?
+    //[hi, j)  > time_ns
+
+    Cluster** const mid = lo + (hi - lo) / 2;
+    assert(mid < hi);
+
+    pCluster = *mid;
+    assert(pCluster);
+    assert(pCluster->GetIndex() >= 0);
+    assert(pCluster->GetIndex() == long(mid - m_pSegment->m_clusters));
+
+    const long long t = pCluster->GetTime();
+
+    if (t <= time_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+    assert(lo <= hi);
+  }
+
+  assert(lo == hi);
+  assert(lo > i);
+  assert(lo <= j);
+
+  pCluster = *--lo;
+  assert(pCluster);
+  assert(pCluster->GetTime() <= time_ns);
+
+  pResult = FindKeyframe(pCluster->GetIndex(), time_ns);
+
+  if (pResult != 0)  // found in the keyframe index
+    return 0;
+
+  pResult = pCluster->GetEntry(this, time_ns);
+
+  if ((pResult != 0) && !pResult->EOS())  // found a keyframe
+    return 0;
+
+  while (lo != i) {
+    pCluster = *--lo;
+    assert(pCluster);
+    assert(pCluster->GetTime() <= time_ns);
+
+#if 0
+        //TODO:
+        //We need to handle the case when a cluster
+        //contains multiple keyframes.  Simply returning
+        //the largest keyframe on the cluster isn't
+        //good enough.
+        pResult = pCluster->GetMaxKey(this);
+#else
+    pResult = pCluster->GetEntry(this, time_ns);
+#endif
+
+    if ((pResult != 0) && !pResult->EOS())
+      return 0;
+  }
+
+  // weird: we're on the first cluster, but no keyframe found
+  // should never happen but we must return something anyway
+
+  pResult = GetEOS();
+  return 0;
+}
+
+long long VideoTrack::GetWidth() const { return m_width; }
+
+long long VideoTrack::GetHeight() const { return m_height; }
+
+long long VideoTrack::GetDisplayWidth() const {
+  return m_display_width > 0 ? m_display_width : GetWidth();
+}
+
+long long VideoTrack::GetDisplayHeight() const {
+  return m_display_height > 0 ? m_display_height : GetHeight();
+}
+
+long long VideoTrack::GetStereoMode() const { return m_stereo_mode; }
+
+double VideoTrack::GetFrameRate() const { return m_rate; }
+
+AudioTrack::AudioTrack(Segment* pSegment, long long element_start,
+                       long long element_size)
+    : Track(pSegment, element_start, element_size) {}
+
+long AudioTrack::Parse(Segment* pSegment, const Info& info,
+                       long long element_start, long long element_size,
+                       AudioTrack*& pResult) {
+  if (pResult)
+    return -1;
+
+  if (info.type != Track::kAudio)
+    return -1;
+
+  IMkvReader* const pReader = pSegment->m_pReader;
+
+  const Settings& s = info.settings;
+  assert(s.start >= 0);
+  assert(s.size >= 0);
+
+  long long pos = s.start;
+  assert(pos >= 0);
+
+  const long long stop = pos + s.size;
+
+  double rate = 8000.0;  // MKV default
+  long long channels = 1;
+  long long bit_depth = 0;
+
+  while (pos < stop) {
+    long long id, size;
+
+    long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (id == 0x35) {  // Sample Rate
+      status = UnserializeFloat(pReader, pos, size, rate);
+
+      if (status < 0)
+        return status;
+
+      if (rate <= 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x1F) {  // Channel Count
+      channels = UnserializeUInt(pReader, pos, size);
+
+      if (channels <= 0)
+        return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x2264) {  // Bit Depth
+      bit_depth = UnserializeUInt(pReader, pos, size);
+
+      if (bit_depth <= 0)
+        return E_FILE_FORMAT_INVALID;
+    }
+
+    pos += size;  // consume payload
+    assert(pos <= stop);
+  }
+
+  assert(pos == stop);
+
+  AudioTrack* const pTrack =
+      new (std::nothrow) AudioTrack(pSegment, element_start, element_size);
+
+  if (pTrack == NULL)
+    return -1;  // generic error
+
+  const int status = info.Copy(pTrack->m_info);
+
+  if (status) {
+    delete pTrack;
+    return status;
+  }
+
+  pTrack->m_rate = rate;
+  pTrack->m_channels = channels;
+  pTrack->m_bitDepth = bit_depth;
+
+  pResult = pTrack;
+  return 0;  // success
+}
+
+double AudioTrack::GetSamplingRate() const { return m_rate; }
+
+long long AudioTrack::GetChannels() const { return m_channels; }
+
+long long AudioTrack::GetBitDepth() const { return m_bitDepth; }
+
+Tracks::Tracks(Segment* pSegment, long long start, long long size_,
+               long long element_start, long long element_size)
+    : m_pSegment(pSegment),
+      m_start(start),
+      m_size(size_),
+      m_element_start(element_start),
+      m_element_size(element_size),
+      m_trackEntries(NULL),
+      m_trackEntriesEnd(NULL) {}
+
+long Tracks::Parse() {
+  assert(m_trackEntries == NULL);
+  assert(m_trackEntriesEnd == NULL);
+
+  const long long stop = m_start + m_size;
+  IMkvReader* const pReader = m_pSegment->m_pReader;
 
-    if (id == 0x1034)  // ContentCompression ID
-      ++compression_count;
+  int count = 0;
+  long long pos = m_start;
 
-    if (id == 0x1035)  // ContentEncryption ID
-      ++encryption_count;
+  while (pos < stop) {
+    long long id, size;
+
+    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    if (status < 0)  // error
+      return status;
+
+    if (size == 0)  // weird
+      continue;
+
+    if (id == 0x2E)  // TrackEntry ID
+      ++count;
 
     pos += size;  // consume payload
     assert(pos <= stop);
   }
 
-  if (compression_count <= 0 && encryption_count <= 0)
+  assert(pos == stop);
+
+  if (count <= 0)
+    return 0;  // success
+
+  m_trackEntries = new (std::nothrow) Track* [count];
+
+  if (m_trackEntries == NULL)
     return -1;
 
-  if (compression_count > 0) {
-    compression_entries_ =
-        new (std::nothrow) ContentCompression* [compression_count];
-    if (!compression_entries_)
-      return -1;
-    compression_entries_end_ = compression_entries_;
-  }
+  m_trackEntriesEnd = m_trackEntries;
 
-  if (encryption_count > 0) {
-    encryption_entries_ =
-        new (std::nothrow) ContentEncryption* [encryption_count];
-    if (!encryption_entries_) {
-      delete[] compression_entries_;
-      return -1;
-    }
-    encryption_entries_end_ = encryption_entries_;
-  }
+  pos = m_start;
 
-  pos = start;
   while (pos < stop) {
-    long long id, size;
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
+    const long long element_start = pos;
+
+    long long id, payload_size;
+
+    const long status =
+        ParseElementHeader(pReader, pos, stop, id, payload_size);
+
     if (status < 0)  // error
       return status;
 
-    if (id == 0x1031) {
-      // ContentEncodingOrder
-      encoding_order_ = UnserializeUInt(pReader, pos, size);
-    } else if (id == 0x1032) {
-      // ContentEncodingScope
-      encoding_scope_ = UnserializeUInt(pReader, pos, size);
-      if (encoding_scope_ < 1)
-        return -1;
-    } else if (id == 0x1033) {
-      // ContentEncodingType
-      encoding_type_ = UnserializeUInt(pReader, pos, size);
-    } else if (id == 0x1034) {
-      // ContentCompression ID
-      ContentCompression* const compression =
-          new (std::nothrow) ContentCompression();
-      if (!compression)
-        return -1;
+    if (payload_size == 0)  // weird
+      continue;
 
-      status = ParseCompressionEntry(pos, size, pReader, compression);
-      if (status) {
-        delete compression;
-        return status;
-      }
-      *compression_entries_end_++ = compression;
-    } else if (id == 0x1035) {
-      // ContentEncryption ID
-      ContentEncryption* const encryption =
-          new (std::nothrow) ContentEncryption();
-      if (!encryption)
-        return -1;
+    const long long payload_stop = pos + payload_size;
+    assert(payload_stop <= stop);  // checked in ParseElement
 
-      status = ParseEncryptionEntry(pos, size, pReader, encryption);
-      if (status) {
-        delete encryption;
+    const long long element_size = payload_stop - element_start;
+
+    if (id == 0x2E) {  // TrackEntry ID
+      Track*& pTrack = *m_trackEntriesEnd;
+      pTrack = NULL;
+
+      const long status = ParseTrackEntry(pos, payload_size, element_start,
+                                          element_size, pTrack);
+
+      if (status)
         return status;
-      }
-      *encryption_entries_end_++ = encryption;
+
+      if (pTrack)
+        ++m_trackEntriesEnd;
     }
 
-    pos += size;  // consume payload
+    pos = payload_stop;
     assert(pos <= stop);
   }
 
   assert(pos == stop);
-  return 0;
+
+  return 0;  // success
 }
 
-long ContentEncoding::ParseCompressionEntry(long long start, long long size,
-                                            IMkvReader* pReader,
-                                            ContentCompression* compression) {
-  assert(pReader);
-  assert(compression);
+unsigned long Tracks::GetTracksCount() const {
+  const ptrdiff_t result = m_trackEntriesEnd - m_trackEntries;
+  assert(result >= 0);
 
-  long long pos = start;
-  const long long stop = start + size;
+  return static_cast<unsigned long>(result);
+}
 
-  bool valid = false;
+long Tracks::ParseTrackEntry(long long track_start, long long track_size,
+                             long long element_start, long long element_size,
+                             Track*& pResult) const {
+  if (pResult)
+    return -1;
 
-  while (pos < stop) {
+  IMkvReader* const pReader = m_pSegment->m_pReader;
+
+  long long pos = track_start;
+  const long long track_stop = track_start + track_size;
+
+  Track::Info info;
+
+  info.type = 0;
+  info.number = 0;
+  info.uid = 0;
+  info.defaultDuration = 0;
+
+  Track::Settings v;
+  v.start = -1;
+  v.size = -1;
+
+  Track::Settings a;
+  a.start = -1;
+  a.size = -1;
+
+  Track::Settings e;  // content_encodings_settings;
+  e.start = -1;
+  e.size = -1;
+
+  long long lacing = 1;  // default is true
+
+  while (pos < track_stop) {
     long long id, size;
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+
+    const long status = ParseElementHeader(pReader, pos, track_stop, id, size);
+
     if (status < 0)  // error
       return status;
 
-    if (id == 0x254) {
-      // ContentCompAlgo
-      long long algo = UnserializeUInt(pReader, pos, size);
-      if (algo < 0)
+    if (size < 0)
+      return E_FILE_FORMAT_INVALID;
+
+    const long long start = pos;
+
+    if (id == 0x60) {  // VideoSettings ID
+      v.start = start;
+      v.size = size;
+    } else if (id == 0x61) {  // AudioSettings ID
+      a.start = start;
+      a.size = size;
+    } else if (id == 0x2D80) {  // ContentEncodings ID
+      e.start = start;
+      e.size = size;
+    } else if (id == 0x33C5) {  // Track UID
+      if (size > 8)
         return E_FILE_FORMAT_INVALID;
-      compression->algo = algo;
-      valid = true;
-    } else if (id == 0x255) {
-      // ContentCompSettings
-      if (size <= 0)
+
+      info.uid = 0;
+
+      long long pos_ = start;
+      const long long pos_end = start + size;
+
+      while (pos_ != pos_end) {
+        unsigned char b;
+
+        const int status = pReader->Read(pos_, 1, &b);
+
+        if (status)
+          return status;
+
+        info.uid <<= 8;
+        info.uid |= b;
+
+        ++pos_;
+      }
+    } else if (id == 0x57) {  // Track Number
+      const long long num = UnserializeUInt(pReader, pos, size);
+
+      if ((num <= 0) || (num > 127))
+        return E_FILE_FORMAT_INVALID;
+
+      info.number = static_cast<long>(num);
+    } else if (id == 0x03) {  // Track Type
+      const long long type = UnserializeUInt(pReader, pos, size);
+
+      if ((type <= 0) || (type > 254))
+        return E_FILE_FORMAT_INVALID;
+
+      info.type = static_cast<long>(type);
+    } else if (id == 0x136E) {  // Track Name
+      const long status =
+          UnserializeString(pReader, pos, size, info.nameAsUTF8);
+
+      if (status)
+        return status;
+    } else if (id == 0x02B59C) {  // Track Language
+      const long status = UnserializeString(pReader, pos, size, info.language);
+
+      if (status)
+        return status;
+    } else if (id == 0x03E383) {  // Default Duration
+      const long long duration = UnserializeUInt(pReader, pos, size);
+
+      if (duration < 0)
+        return E_FILE_FORMAT_INVALID;
+
+      info.defaultDuration = static_cast<unsigned long long>(duration);
+    } else if (id == 0x06) {  // CodecID
+      const long status = UnserializeString(pReader, pos, size, info.codecId);
+
+      if (status)
+        return status;
+    } else if (id == 0x1C) {  // lacing
+      lacing = UnserializeUInt(pReader, pos, size);
+
+      if ((lacing < 0) || (lacing > 1))
         return E_FILE_FORMAT_INVALID;
+    } else if (id == 0x23A2) {  // Codec Private
+      delete[] info.codecPrivate;
+      info.codecPrivate = NULL;
+      info.codecPrivateSize = 0;
+
+      const size_t buflen = static_cast<size_t>(size);
+
+      if (buflen) {
+        typedef unsigned char* buf_t;
 
-      const size_t buflen = static_cast<size_t>(size);
-      typedef unsigned char* buf_t;
-      const buf_t buf = new (std::nothrow) unsigned char[buflen];
-      if (buf == NULL)
-        return -1;
+        const buf_t buf = new (std::nothrow) unsigned char[buflen];
 
-      const int read_status =
-          pReader->Read(pos, static_cast<long>(buflen), buf);
-      if (read_status) {
-        delete[] buf;
-        return status;
+        if (buf == NULL)
+          return -1;
+
+        const int status = pReader->Read(pos, static_cast<long>(buflen), buf);
+
+        if (status) {
+          delete[] buf;
+          return status;
+        }
+
+        info.codecPrivate = buf;
+        info.codecPrivateSize = buflen;
       }
+    } else if (id == 0x058688) {  // Codec Name
+      const long status =
+          UnserializeString(pReader, pos, size, info.codecNameAsUTF8);
 
-      compression->settings = buf;
-      compression->settings_len = buflen;
+      if (status)
+        return status;
+    } else if (id == 0x16AA) {  // Codec Delay
+      info.codecDelay = UnserializeUInt(pReader, pos, size);
+    } else if (id == 0x16BB) {  // Seek Pre Roll
+      info.seekPreRoll = UnserializeUInt(pReader, pos, size);
     }
 
     pos += size;  // consume payload
-    assert(pos <= stop);
+    assert(pos <= track_stop);
   }
 
-  // ContentCompAlgo is mandatory
-  if (!valid)
+  assert(pos == track_stop);
+
+  if (info.number <= 0)  // not specified
     return E_FILE_FORMAT_INVALID;
 
-  return 0;
-}
+  if (GetTrackByNumber(info.number))
+    return E_FILE_FORMAT_INVALID;
 
-long ContentEncoding::ParseEncryptionEntry(long long start, long long size,
-                                           IMkvReader* pReader,
-                                           ContentEncryption* encryption) {
-  assert(pReader);
-  assert(encryption);
+  if (info.type <= 0)  // not specified
+    return E_FILE_FORMAT_INVALID;
 
-  long long pos = start;
-  const long long stop = start + size;
+  info.lacing = (lacing > 0) ? true : false;
 
-  while (pos < stop) {
-    long long id, size;
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
-    if (status < 0)  // error
+  if (info.type == Track::kVideo) {
+    if (v.start < 0)
+      return E_FILE_FORMAT_INVALID;
+
+    if (a.start >= 0)
+      return E_FILE_FORMAT_INVALID;
+
+    info.settings = v;
+
+    VideoTrack* pTrack = NULL;
+
+    const long status = VideoTrack::Parse(m_pSegment, info, element_start,
+                                          element_size, pTrack);
+
+    if (status)
       return status;
 
-    if (id == 0x7E1) {
-      // ContentEncAlgo
-      encryption->algo = UnserializeUInt(pReader, pos, size);
-      if (encryption->algo != 5)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x7E2) {
-      // ContentEncKeyID
-      delete[] encryption -> key_id;
-      encryption->key_id = NULL;
-      encryption->key_id_len = 0;
+    pResult = pTrack;
+    assert(pResult);
 
-      if (size <= 0)
-        return E_FILE_FORMAT_INVALID;
+    if (e.start >= 0)
+      pResult->ParseContentEncodingsEntry(e.start, e.size);
+  } else if (info.type == Track::kAudio) {
+    if (a.start < 0)
+      return E_FILE_FORMAT_INVALID;
 
-      const size_t buflen = static_cast<size_t>(size);
-      typedef unsigned char* buf_t;
-      const buf_t buf = new (std::nothrow) unsigned char[buflen];
-      if (buf == NULL)
-        return -1;
+    if (v.start >= 0)
+      return E_FILE_FORMAT_INVALID;
 
-      const int read_status =
-          pReader->Read(pos, static_cast<long>(buflen), buf);
-      if (read_status) {
-        delete[] buf;
-        return status;
-      }
+    info.settings = a;
 
-      encryption->key_id = buf;
-      encryption->key_id_len = buflen;
-    } else if (id == 0x7E3) {
-      // ContentSignature
-      delete[] encryption -> signature;
-      encryption->signature = NULL;
-      encryption->signature_len = 0;
+    AudioTrack* pTrack = NULL;
 
-      if (size <= 0)
-        return E_FILE_FORMAT_INVALID;
+    const long status = AudioTrack::Parse(m_pSegment, info, element_start,
+                                          element_size, pTrack);
 
-      const size_t buflen = static_cast<size_t>(size);
-      typedef unsigned char* buf_t;
-      const buf_t buf = new (std::nothrow) unsigned char[buflen];
-      if (buf == NULL)
-        return -1;
+    if (status)
+      return status;
 
-      const int read_status =
-          pReader->Read(pos, static_cast<long>(buflen), buf);
-      if (read_status) {
-        delete[] buf;
-        return status;
-      }
+    pResult = pTrack;
+    assert(pResult);
 
-      encryption->signature = buf;
-      encryption->signature_len = buflen;
-    } else if (id == 0x7E4) {
-      // ContentSigKeyID
-      delete[] encryption -> sig_key_id;
-      encryption->sig_key_id = NULL;
-      encryption->sig_key_id_len = 0;
+    if (e.start >= 0)
+      pResult->ParseContentEncodingsEntry(e.start, e.size);
+  } else {
+    // neither video nor audio - probably metadata or subtitles
 
-      if (size <= 0)
-        return E_FILE_FORMAT_INVALID;
+    if (a.start >= 0)
+      return E_FILE_FORMAT_INVALID;
 
-      const size_t buflen = static_cast<size_t>(size);
-      typedef unsigned char* buf_t;
-      const buf_t buf = new (std::nothrow) unsigned char[buflen];
-      if (buf == NULL)
-        return -1;
+    if (v.start >= 0)
+      return E_FILE_FORMAT_INVALID;
 
-      const int read_status =
-          pReader->Read(pos, static_cast<long>(buflen), buf);
-      if (read_status) {
-        delete[] buf;
-        return status;
-      }
+    if (info.type == Track::kMetadata && e.start >= 0)
+      return E_FILE_FORMAT_INVALID;
 
-      encryption->sig_key_id = buf;
-      encryption->sig_key_id_len = buflen;
-    } else if (id == 0x7E5) {
-      // ContentSigAlgo
-      encryption->sig_algo = UnserializeUInt(pReader, pos, size);
-    } else if (id == 0x7E6) {
-      // ContentSigHashAlgo
-      encryption->sig_hash_algo = UnserializeUInt(pReader, pos, size);
-    } else if (id == 0x7E7) {
-      // ContentEncAESSettings
-      const long status = ParseContentEncAESSettingsEntry(
-          pos, size, pReader, &encryption->aes_settings);
-      if (status)
-        return status;
-    }
+    info.settings.start = -1;
+    info.settings.size = 0;
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
+    Track* pTrack = NULL;
+
+    const long status =
+        Track::Create(m_pSegment, info, element_start, element_size, pTrack);
+
+    if (status)
+      return status;
+
+    pResult = pTrack;
+    assert(pResult);
   }
 
-  return 0;
+  return 0;  // success
 }
 
-Track::Track(Segment* pSegment, long long element_start, long long element_size)
-    : m_pSegment(pSegment),
-      m_element_start(element_start),
-      m_element_size(element_size),
-      content_encoding_entries_(NULL),
-      content_encoding_entries_end_(NULL) {}
+Tracks::~Tracks() {
+  Track** i = m_trackEntries;
+  Track** const j = m_trackEntriesEnd;
 
-Track::~Track() {
-  Info& info = const_cast<Info&>(m_info);
-  info.Clear();
+  while (i != j) {
+    Track* const pTrack = *i++;
+    delete pTrack;
+  }
 
-  ContentEncoding** i = content_encoding_entries_;
-  ContentEncoding** const j = content_encoding_entries_end_;
+  delete[] m_trackEntries;
+}
+
+const Track* Tracks::GetTrackByNumber(long tn) const {
+  if (tn < 0)
+    return NULL;
+
+  Track** i = m_trackEntries;
+  Track** const j = m_trackEntriesEnd;
 
   while (i != j) {
-    ContentEncoding* const encoding = *i++;
-    delete encoding;
+    Track* const pTrack = *i++;
+
+    if (pTrack == NULL)
+      continue;
+
+    if (tn == pTrack->GetNumber())
+      return pTrack;
   }
 
-  delete[] content_encoding_entries_;
+  return NULL;  // not found
 }
 
-long Track::Create(Segment* pSegment, const Info& info, long long element_start,
-                   long long element_size, Track*& pResult) {
-  if (pResult)
-    return -1;
+const Track* Tracks::GetTrackByIndex(unsigned long idx) const {
+  const ptrdiff_t count = m_trackEntriesEnd - m_trackEntries;
+
+  if (idx >= static_cast<unsigned long>(count))
+    return NULL;
+
+  return m_trackEntries[idx];
+}
+
+#if 0
+long long Cluster::Unparsed() const
+{
+    if (m_timecode < 0)  //not even partially loaded
+        return LLONG_MAX;
+
+    assert(m_pos >= m_element_start);
+    //assert(m_element_size > m_size);
+
+    const long long element_stop = m_element_start + m_element_size;
+    assert(m_pos <= element_stop);
 
-  Track* const pTrack =
-      new (std::nothrow) Track(pSegment, element_start, element_size);
+    const long long result = element_stop - m_pos;
+    assert(result >= 0);
 
-  if (pTrack == NULL)
-    return -1;  // generic error
+    return result;
+}
+#endif
 
-  const int status = info.Copy(pTrack->m_info);
+long Cluster::Load(long long& pos, long& len) const {
+  assert(m_pSegment);
+  assert(m_pos >= m_element_start);
 
-  if (status) {  // error
-    delete pTrack;
-    return status;
-  }
+  if (m_timecode >= 0)  // at least partially loaded
+    return 0;
 
-  pResult = pTrack;
-  return 0;  // success
-}
+  assert(m_pos == m_element_start);
+  assert(m_element_size < 0);
 
-Track::Info::Info()
-    : uid(0),
-      defaultDuration(0),
-      codecDelay(0),
-      seekPreRoll(0),
-      nameAsUTF8(NULL),
-      language(NULL),
-      codecId(NULL),
-      codecNameAsUTF8(NULL),
-      codecPrivate(NULL),
-      codecPrivateSize(0),
-      lacing(false) {}
+  IMkvReader* const pReader = m_pSegment->m_pReader;
 
-Track::Info::~Info() { Clear(); }
+  long long total, avail;
 
-void Track::Info::Clear() {
-  delete[] nameAsUTF8;
-  nameAsUTF8 = NULL;
+  const int status = pReader->Length(&total, &avail);
 
-  delete[] language;
-  language = NULL;
+  if (status < 0)  // error
+    return status;
 
-  delete[] codecId;
-  codecId = NULL;
+  assert((total < 0) || (avail <= total));
+  assert((total < 0) || (m_pos <= total));  // TODO: verify this
 
-  delete[] codecPrivate;
-  codecPrivate = NULL;
-  codecPrivateSize = 0;
+  HeaderReader header(pReader, avail);
 
-  delete[] codecNameAsUTF8;
-  codecNameAsUTF8 = NULL;
-}
+  pos = m_pos;
 
-int Track::Info::CopyStr(char* Info::*str, Info& dst_) const {
-  if (str == static_cast<char * Info::*>(NULL))
-    return -1;
+  long long cluster_size = -1;
 
-  char*& dst = dst_.*str;
+  {
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  if (dst)  // should be NULL already
-    return -1;
+    long long result = header.GetUIntLength(pos, len);
 
-  const char* const src = this->*str;
+    if (result < 0)  // error or underflow
+      return static_cast<long>(result);
 
-  if (src == NULL)
-    return 0;
+    if (result > 0)  // underflow (weird)
+      return E_BUFFER_NOT_FULL;
 
-  const size_t len = strlen(src);
+    // if ((pos + len) > segment_stop)
+    //    return E_FILE_FORMAT_INVALID;
 
-  dst = new (std::nothrow) char[len + 1];
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-  if (dst == NULL)
-    return -1;
+    const long long id_ = header.ReadUInt(pos, len);
 
-  strcpy(dst, src);
+    if (id_ < 0)  // error
+      return static_cast<long>(id_);
 
-  return 0;
-}
+    if (id_ != 0x0F43B675)  // Cluster ID
+      return E_FILE_FORMAT_INVALID;
 
-int Track::Info::Copy(Info& dst) const {
-  if (&dst == this)
-    return 0;
+    pos += len;  // consume id
 
-  dst.type = type;
-  dst.number = number;
-  dst.defaultDuration = defaultDuration;
-  dst.codecDelay = codecDelay;
-  dst.seekPreRoll = seekPreRoll;
-  dst.uid = uid;
-  dst.lacing = lacing;
-  dst.settings = settings;
+    // read cluster size
 
-  // We now copy the string member variables from src to dst.
-  // This involves memory allocation so in principle the operation
-  // can fail (indeed, that's why we have Info::Copy), so we must
-  // report this to the caller.  An error return from this function
-  // therefore implies that the copy was only partially successful.
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  if (int status = CopyStr(&Info::nameAsUTF8, dst))
-    return status;
+    result = header.GetUIntLength(pos, len);
 
-  if (int status = CopyStr(&Info::language, dst))
-    return status;
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-  if (int status = CopyStr(&Info::codecId, dst))
-    return status;
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  if (int status = CopyStr(&Info::codecNameAsUTF8, dst))
-    return status;
+    // if ((pos + len) > segment_stop)
+    //    return E_FILE_FORMAT_INVALID;
 
-  if (codecPrivateSize > 0) {
-    if (codecPrivate == NULL)
-      return -1;
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-    if (dst.codecPrivate)
-      return -1;
+    const long long size = header.ReadUInt(pos, len);
 
-    if (dst.codecPrivateSize != 0)
-      return -1;
+    if (size < 0)  // error
+      return static_cast<long>(cluster_size);
 
-    dst.codecPrivate = new (std::nothrow) unsigned char[codecPrivateSize];
+    if (size == 0)
+      return E_FILE_FORMAT_INVALID;  // TODO: verify this
 
-    if (dst.codecPrivate == NULL)
-      return -1;
+    pos += len;  // consume length of size of element
 
-    memcpy(dst.codecPrivate, codecPrivate, codecPrivateSize);
-    dst.codecPrivateSize = codecPrivateSize;
+    const long long unknown_size = (1LL << (7 * len)) - 1;
+
+    if (size != unknown_size)
+      cluster_size = size;
   }
 
-  return 0;
-}
+// pos points to start of payload
 
-const BlockEntry* Track::GetEOS() const { return &m_eos; }
+#if 0
+    len = static_cast<long>(size_);
 
-long Track::GetType() const { return m_info.type; }
+    if (cluster_stop > avail)
+        return E_BUFFER_NOT_FULL;
+#endif
 
-long Track::GetNumber() const { return m_info.number; }
+  long long timecode = -1;
+  long long new_pos = -1;
+  bool bBlock = false;
 
-unsigned long long Track::GetUid() const { return m_info.uid; }
+  long long cluster_stop = (cluster_size < 0) ? -1 : pos + cluster_size;
 
-const char* Track::GetNameAsUTF8() const { return m_info.nameAsUTF8; }
+  for (;;) {
+    if ((cluster_stop >= 0) && (pos >= cluster_stop))
+      break;
 
-const char* Track::GetLanguage() const { return m_info.language; }
+    // Parse ID
 
-const char* Track::GetCodecNameAsUTF8() const { return m_info.codecNameAsUTF8; }
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-const char* Track::GetCodecId() const { return m_info.codecId; }
+    long long result = header.GetUIntLength(pos, len);
 
-const unsigned char* Track::GetCodecPrivate(size_t& size) const {
-  size = m_info.codecPrivateSize;
-  return m_info.codecPrivate;
-}
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-bool Track::GetLacing() const { return m_info.lacing; }
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-unsigned long long Track::GetDefaultDuration() const {
-  return m_info.defaultDuration;
-}
+    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-unsigned long long Track::GetCodecDelay() const { return m_info.codecDelay; }
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-unsigned long long Track::GetSeekPreRoll() const { return m_info.seekPreRoll; }
+    const long long id = header.ReadUInt(pos, len);
 
-long Track::GetFirst(const BlockEntry*& pBlockEntry) const {
-  const Cluster* pCluster = m_pSegment->GetFirst();
+    if (id < 0)  // error
+      return static_cast<long>(id);
 
-  for (int i = 0;;) {
-    if (pCluster == NULL) {
-      pBlockEntry = GetEOS();
-      return 1;
-    }
+    if (id == 0)
+      return E_FILE_FORMAT_INVALID;
 
-    if (pCluster->EOS()) {
-#if 0
-            if (m_pSegment->Unparsed() <= 0) {  //all clusters have been loaded
-                pBlockEntry = GetEOS();
-                return 1;
-            }
-#else
-      if (m_pSegment->DoneParsing()) {
-        pBlockEntry = GetEOS();
-        return 1;
-      }
-#endif
+    // This is the distinguished set of ID's we use to determine
+    // that we have exhausted the sub-element's inside the cluster
+    // whose ID we parsed earlier.
 
-      pBlockEntry = 0;
-      return E_BUFFER_NOT_FULL;
-    }
+    if (id == 0x0F43B675)  // Cluster ID
+      break;
 
-    long status = pCluster->GetFirst(pBlockEntry);
+    if (id == 0x0C53BB6B)  // Cues ID
+      break;
 
-    if (status < 0)  // error
-      return status;
+    pos += len;  // consume ID field
 
-    if (pBlockEntry == 0) {  // empty cluster
-      pCluster = m_pSegment->GetNext(pCluster);
-      continue;
+    // Parse Size
+
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
     }
 
-    for (;;) {
-      const Block* const pBlock = pBlockEntry->GetBlock();
-      assert(pBlock);
+    result = header.GetUIntLength(pos, len);
 
-      const long long tn = pBlock->GetTrackNumber();
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-      if ((tn == m_info.number) && VetEntry(pBlockEntry))
-        return 0;
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-      const BlockEntry* pNextEntry;
+    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-      status = pCluster->GetNext(pBlockEntry, pNextEntry);
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-      if (status < 0)  // error
-        return status;
+    const long long size = header.ReadUInt(pos, len);
 
-      if (pNextEntry == 0)
-        break;
+    if (size < 0)  // error
+      return static_cast<long>(size);
 
-      pBlockEntry = pNextEntry;
-    }
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-    ++i;
+    if (size == unknown_size)
+      return E_FILE_FORMAT_INVALID;
 
-    if (i >= 100)
-      break;
+    pos += len;  // consume size field
 
-    pCluster = m_pSegment->GetNext(pCluster);
-  }
+    if ((cluster_stop >= 0) && (pos > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  // NOTE: if we get here, it means that we didn't find a block with
-  // a matching track number.  We interpret that as an error (which
-  // might be too conservative).
+    // pos now points to start of payload
 
-  pBlockEntry = GetEOS();  // so we can return a non-NULL value
-  return 1;
-}
+    if (size == 0)  // weird
+      continue;
 
-long Track::GetNext(const BlockEntry* pCurrEntry,
-                    const BlockEntry*& pNextEntry) const {
-  assert(pCurrEntry);
-  assert(!pCurrEntry->EOS());  //?
+    if ((cluster_stop >= 0) && ((pos + size) > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  const Block* const pCurrBlock = pCurrEntry->GetBlock();
-  assert(pCurrBlock && pCurrBlock->GetTrackNumber() == m_info.number);
-  if (!pCurrBlock || pCurrBlock->GetTrackNumber() != m_info.number)
-    return -1;
+    if (id == 0x67) {  // TimeCode ID
+      len = static_cast<long>(size);
 
-  const Cluster* pCluster = pCurrEntry->GetCluster();
-  assert(pCluster);
-  assert(!pCluster->EOS());
+      if ((pos + size) > avail)
+        return E_BUFFER_NOT_FULL;
 
-  long status = pCluster->GetNext(pCurrEntry, pNextEntry);
+      timecode = UnserializeUInt(pReader, pos, size);
 
-  if (status < 0)  // error
-    return status;
+      if (timecode < 0)  // error (or underflow)
+        return static_cast<long>(timecode);
 
-  for (int i = 0;;) {
-    while (pNextEntry) {
-      const Block* const pNextBlock = pNextEntry->GetBlock();
-      assert(pNextBlock);
+      new_pos = pos + size;
 
-      if (pNextBlock->GetTrackNumber() == m_info.number)
-        return 0;
+      if (bBlock)
+        break;
+    } else if (id == 0x20) {  // BlockGroup ID
+      bBlock = true;
+      break;
+    } else if (id == 0x23) {  // SimpleBlock ID
+      bBlock = true;
+      break;
+    }
 
-      pCurrEntry = pNextEntry;
+    pos += size;  // consume payload
+    assert((cluster_stop < 0) || (pos <= cluster_stop));
+  }
 
-      status = pCluster->GetNext(pCurrEntry, pNextEntry);
+  assert((cluster_stop < 0) || (pos <= cluster_stop));
 
-      if (status < 0)  // error
-        return status;
-    }
+  if (timecode < 0)  // no timecode found
+    return E_FILE_FORMAT_INVALID;
 
-    pCluster = m_pSegment->GetNext(pCluster);
+  if (!bBlock)
+    return E_FILE_FORMAT_INVALID;
 
-    if (pCluster == NULL) {
-      pNextEntry = GetEOS();
-      return 1;
-    }
+  m_pos = new_pos;  // designates position just beyond timecode payload
+  m_entries_start = new_pos;
+  m_timecode = timecode;  // m_timecode >= 0 means we're partially loaded
 
-    if (pCluster->EOS()) {
-#if 0
-            if (m_pSegment->Unparsed() <= 0)   //all clusters have been loaded
-            {
-                pNextEntry = GetEOS();
-                return 1;
-            }
-#else
-      if (m_pSegment->DoneParsing()) {
-        pNextEntry = GetEOS();
-        return 1;
-      }
-#endif
+  if (cluster_size >= 0)
+    m_element_size = cluster_stop - m_element_start;
 
-      // TODO: there is a potential O(n^2) problem here: we tell the
-      // caller to (pre)load another cluster, which he does, but then he
-      // calls GetNext again, which repeats the same search.  This is
-      // a pathological case, since the only way it can happen is if
-      // there exists a long sequence of clusters none of which contain a
-      // block from this track.  One way around this problem is for the
-      // caller to be smarter when he loads another cluster: don't call
-      // us back until you have a cluster that contains a block from this
-      // track. (Of course, that's not cheap either, since our caller
-      // would have to scan the each cluster as it's loaded, so that
-      // would just push back the problem.)
+  return 0;
+}
 
-      pNextEntry = NULL;
-      return E_BUFFER_NOT_FULL;
-    }
+long Cluster::Parse(long long& pos, long& len) const {
+  long status = Load(pos, len);
 
-    status = pCluster->GetFirst(pNextEntry);
+  if (status < 0)
+    return status;
 
-    if (status < 0)  // error
-      return status;
+  assert(m_pos >= m_element_start);
+  assert(m_timecode >= 0);
+  // assert(m_size > 0);
+  // assert(m_element_size > m_size);
 
-    if (pNextEntry == NULL)  // empty cluster
-      continue;
+  const long long cluster_stop =
+      (m_element_size < 0) ? -1 : m_element_start + m_element_size;
 
-    ++i;
+  if ((cluster_stop >= 0) && (m_pos >= cluster_stop))
+    return 1;  // nothing else to do
 
-    if (i >= 100)
-      break;
-  }
+  IMkvReader* const pReader = m_pSegment->m_pReader;
 
-  // NOTE: if we get here, it means that we didn't find a block with
-  // a matching track number after lots of searching, so we give
-  // up trying.
+  long long total, avail;
 
-  pNextEntry = GetEOS();  // so we can return a non-NULL value
-  return 1;
-}
+  status = pReader->Length(&total, &avail);
 
-bool Track::VetEntry(const BlockEntry* pBlockEntry) const {
-  assert(pBlockEntry);
-  const Block* const pBlock = pBlockEntry->GetBlock();
-  assert(pBlock);
-  assert(pBlock->GetTrackNumber() == m_info.number);
-  if (!pBlock || pBlock->GetTrackNumber() != m_info.number)
-    return false;
+  if (status < 0)  // error
+    return status;
 
-  // This function is used during a seek to determine whether the
-  // frame is a valid seek target.  This default function simply
-  // returns true, which means all frames are valid seek targets.
-  // It gets overridden by the VideoTrack class, because only video
-  // keyframes can be used as seek target.
+  assert((total < 0) || (avail <= total));
 
-  return true;
-}
+  pos = m_pos;
 
-long Track::Seek(long long time_ns, const BlockEntry*& pResult) const {
-  const long status = GetFirst(pResult);
+  HeaderReader header(pReader, avail);
 
-  if (status < 0)  // buffer underflow, etc
-    return status;
+  for (;;) {
+    if ((cluster_stop >= 0) && (pos >= cluster_stop))
+      break;
 
-  assert(pResult);
+    if ((total >= 0) && (pos >= total)) {
+      if (m_element_size < 0)
+        m_element_size = pos - m_element_start;
 
-  if (pResult->EOS())
-    return 0;
+      break;
+    }
 
-  const Cluster* pCluster = pResult->GetCluster();
-  assert(pCluster);
-  assert(pCluster->GetIndex() >= 0);
+    // Parse ID
 
-  if (time_ns <= pResult->GetBlock()->GetTime(pCluster))
-    return 0;
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  Cluster** const clusters = m_pSegment->m_clusters;
-  assert(clusters);
+    long long result = header.GetUIntLength(pos, len);
 
-  const long count = m_pSegment->GetCount();  // loaded only, not preloaded
-  assert(count > 0);
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-  Cluster** const i = clusters + pCluster->GetIndex();
-  assert(i);
-  assert(*i == pCluster);
-  assert(pCluster->GetTime() <= time_ns);
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  Cluster** const j = clusters + count;
+    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  Cluster** lo = i;
-  Cluster** hi = j;
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-  while (lo < hi) {
-    // INVARIANT:
-    //[i, lo) <= time_ns
-    //[lo, hi) ?
-    //[hi, j)  > time_ns
+    const long long id = header.ReadUInt(pos, len);
 
-    Cluster** const mid = lo + (hi - lo) / 2;
-    assert(mid < hi);
+    if (id < 0)  // error
+      return static_cast<long>(id);
 
-    pCluster = *mid;
-    assert(pCluster);
-    assert(pCluster->GetIndex() >= 0);
-    assert(pCluster->GetIndex() == long(mid - m_pSegment->m_clusters));
+    if (id == 0)  // weird
+      return E_FILE_FORMAT_INVALID;
 
-    const long long t = pCluster->GetTime();
+    // This is the distinguished set of ID's we use to determine
+    // that we have exhausted the sub-element's inside the cluster
+    // whose ID we parsed earlier.
 
-    if (t <= time_ns)
-      lo = mid + 1;
-    else
-      hi = mid;
+    if ((id == 0x0F43B675) || (id == 0x0C53BB6B)) {  // Cluster or Cues ID
+      if (m_element_size < 0)
+        m_element_size = pos - m_element_start;
 
-    assert(lo <= hi);
-  }
+      break;
+    }
 
-  assert(lo == hi);
-  assert(lo > i);
-  assert(lo <= j);
+    pos += len;  // consume ID field
 
-  while (lo > i) {
-    pCluster = *--lo;
-    assert(pCluster);
-    assert(pCluster->GetTime() <= time_ns);
+    // Parse Size
 
-    pResult = pCluster->GetEntry(this);
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-    if ((pResult != 0) && !pResult->EOS())
-      return 0;
+    result = header.GetUIntLength(pos, len);
 
-    // landed on empty cluster (no entries)
-  }
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-  pResult = GetEOS();  // weird
-  return 0;
-}
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-const ContentEncoding* Track::GetContentEncodingByIndex(
-    unsigned long idx) const {
-  const ptrdiff_t count =
-      content_encoding_entries_end_ - content_encoding_entries_;
-  assert(count >= 0);
+    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-  if (idx >= static_cast<unsigned long>(count))
-    return NULL;
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-  return content_encoding_entries_[idx];
-}
+    const long long size = header.ReadUInt(pos, len);
 
-unsigned long Track::GetContentEncodingCount() const {
-  const ptrdiff_t count =
-      content_encoding_entries_end_ - content_encoding_entries_;
-  assert(count >= 0);
+    if (size < 0)  // error
+      return static_cast<long>(size);
 
-  return static_cast<unsigned long>(count);
-}
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-long Track::ParseContentEncodingsEntry(long long start, long long size) {
-  IMkvReader* const pReader = m_pSegment->m_pReader;
-  assert(pReader);
+    if (size == unknown_size)
+      return E_FILE_FORMAT_INVALID;
 
-  long long pos = start;
-  const long long stop = start + size;
+    pos += len;  // consume size field
 
-  // Count ContentEncoding elements.
-  int count = 0;
-  while (pos < stop) {
-    long long id, size;
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
-    if (status < 0)  // error
-      return status;
+    if ((cluster_stop >= 0) && (pos > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-    // pos now designates start of element
-    if (id == 0x2240)  // ContentEncoding ID
-      ++count;
+    // pos now points to start of payload
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
-  }
+    if (size == 0)  // weird
+      continue;
 
-  if (count <= 0)
-    return -1;
+    // const long long block_start = pos;
+    const long long block_stop = pos + size;
 
-  content_encoding_entries_ = new (std::nothrow) ContentEncoding* [count];
-  if (!content_encoding_entries_)
-    return -1;
+    if (cluster_stop >= 0) {
+      if (block_stop > cluster_stop) {
+        if ((id == 0x20) || (id == 0x23))
+          return E_FILE_FORMAT_INVALID;
 
-  content_encoding_entries_end_ = content_encoding_entries_;
+        pos = cluster_stop;
+        break;
+      }
+    } else if ((total >= 0) && (block_stop > total)) {
+      m_element_size = total - m_element_start;
+      pos = total;
+      break;
+    } else if (block_stop > avail) {
+      len = static_cast<long>(size);
+      return E_BUFFER_NOT_FULL;
+    }
 
-  pos = start;
-  while (pos < stop) {
-    long long id, size;
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
-    if (status < 0)  // error
-      return status;
+    Cluster* const this_ = const_cast<Cluster*>(this);
 
-    // pos now designates start of element
-    if (id == 0x2240) {  // ContentEncoding ID
-      ContentEncoding* const content_encoding =
-          new (std::nothrow) ContentEncoding();
-      if (!content_encoding)
-        return -1;
+    if ((id == 0x20) || (id == 0x23)) {  // BlockGroup or SimpleBlock
+      status = (id == 0x20) ? this_->ParseBlockGroup(size, pos, len)
+                            : this_->ParseSimpleBlock(size, pos, len);
 
-      status = content_encoding->ParseContentEncodingEntry(pos, size, pReader);
-      if (status) {
-        delete content_encoding;
+      if (status <= 0)  // error, or have new entry
         return status;
-      }
 
-      *content_encoding_entries_end_++ = content_encoding;
+      pos = m_pos;  // block skipped by the track filter
+      continue;
     }
 
     pos += size;  // consume payload
-    assert(pos <= stop);
+    assert((cluster_stop < 0) || (pos <= cluster_stop));
   }
 
-  assert(pos == stop);
-
-  return 0;
-}
-
-Track::EOSBlock::EOSBlock() : BlockEntry(NULL, LONG_MIN) {}
-
-BlockEntry::Kind Track::EOSBlock::GetKind() const { return kBlockEOS; }
-
-const Block* Track::EOSBlock::GetBlock() const { return NULL; }
+  assert(m_element_size > 0);
 
-VideoTrack::VideoTrack(Segment* pSegment, long long element_start,
-                       long long element_size)
-    : Track(pSegment, element_start, element_size) {}
+  m_pos = pos;
+  assert((cluster_stop < 0) || (m_pos <= cluster_stop));
 
-long VideoTrack::Parse(Segment* pSegment, const Info& info,
-                       long long element_start, long long element_size,
-                       VideoTrack*& pResult) {
-  if (pResult)
-    return -1;
+  if (m_entries_count > 0) {
+    const long idx = m_entries_count - 1;
 
-  if (info.type != Track::kVideo)
-    return -1;
+    const BlockEntry* const pLast = m_entries[idx];
+    assert(pLast);
 
-  long long width = 0;
-  long long height = 0;
-  long long display_width = 0;
-  long long display_height = 0;
-  long long stereo_mode = 0;
+    const Block* const pBlock = pLast->GetBlock();
+    assert(pBlock);
 
-  double rate = 0.0;
+    const long long start = pBlock->m_start;
 
-  IMkvReader* const pReader = pSegment->m_pReader;
+    if ((total >= 0) && (start > total))
+      return -1;  // defend against trucated stream
 
-  const Settings& s = info.settings;
-  assert(s.start >= 0);
-  assert(s.size >= 0);
+    const long long size = pBlock->m_size;
 
-  long long pos = s.start;
-  assert(pos >= 0);
+    const long long stop = start + size;
+    assert((cluster_stop < 0) || (stop <= cluster_stop));
 
-  const long long stop = pos + s.size;
+    if ((total >= 0) && (stop > total))
+      return -1;  // defend against trucated stream
+  }
 
-  while (pos < stop) {
-    long long id, size;
+  return 1;  // no more entries
+}
 
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+long Cluster::ParseSimpleBlock(long long block_size, long long& pos,
+                               long& len) {
+  const long long block_start = pos;
+  const long long block_stop = pos + block_size;
 
-    if (status < 0)  // error
-      return status;
+  IMkvReader* const pReader = m_pSegment->m_pReader;
 
-    if (id == 0x30) {  // pixel width
-      width = UnserializeUInt(pReader, pos, size);
+  long long total, avail;
 
-      if (width <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x3A) {  // pixel height
-      height = UnserializeUInt(pReader, pos, size);
+  long status = pReader->Length(&total, &avail);
 
-      if (height <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x14B0) { // display width
-      display_width = UnserializeUInt(pReader, pos, size);
+  if (status < 0)  // error
+    return status;
 
-      if (display_width <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x14BA) { // display height
-      display_height = UnserializeUInt(pReader, pos, size);
+  assert((total < 0) || (avail <= total));
 
-      if (display_height <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x13B8) { // stereo mode
-      stereo_mode = UnserializeUInt(pReader, pos, size);
+  HeaderReader header(pReader, avail);
 
-      if (stereo_mode < 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x0383E3) {  // frame rate
-      const long status = UnserializeFloat(pReader, pos, size, rate);
+  // parse track number
 
-      if (status < 0)
-        return status;
+  if ((pos + 1) > avail) {
+    len = 1;
+    return E_BUFFER_NOT_FULL;
+  }
 
-      if (rate <= 0)
-        return E_FILE_FORMAT_INVALID;
-    }
+  long long result = header.GetUIntLength(pos, len);
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
-  }
+  if (result < 0)  // error
+    return static_cast<long>(result);
 
-  assert(pos == stop);
+  if (result > 0)  // weird
+    return E_BUFFER_NOT_FULL;
 
-  VideoTrack* const pTrack =
-      new (std::nothrow) VideoTrack(pSegment, element_start, element_size);
+  if ((pos + len) > block_stop)
+    return E_FILE_FORMAT_INVALID;
 
-  if (pTrack == NULL)
-    return -1;  // generic error
+  if ((pos + len) > avail)
+    return E_BUFFER_NOT_FULL;
 
-  const int status = info.Copy(pTrack->m_info);
+  const long long track = header.ReadUInt(pos, len);
 
-  if (status) {  // error
-    delete pTrack;
-    return status;
-  }
+  if (track < 0)  // error
+    return static_cast<long>(track);
 
-  pTrack->m_width = width;
-  pTrack->m_height = height;
-  pTrack->m_display_width = display_width;
-  pTrack->m_display_height = display_height;
-  pTrack->m_stereo_mode = stereo_mode;
-  pTrack->m_rate = rate;
+  if (track == 0)
+    return E_FILE_FORMAT_INVALID;
 
-  pResult = pTrack;
-  return 0;  // success
-}
+#if 0
+    //TODO(matthewjheaney)
+    //This turned out to be too conservative.  The problem is that
+    //if we see a track header in the tracks element with an unsupported
+    //track type, we throw that track header away, so it is not present
+    //in the track map.  But even though we don't understand the track
+    //header, there are still blocks in the cluster with that track
+    //number.  It was our decision to ignore that track header, so it's
+    //up to us to deal with blocks associated with that track -- we
+    //cannot simply report an error since technically there's nothing
+    //wrong with the file.
+    //
+    //For now we go ahead and finish the parse, creating a block entry
+    //for this block.  This is somewhat wasteful, because without a
+    //track header there's nothing you can do with the block. What
+    //we really need here is a special return value that indicates to
+    //the caller that he should ignore this particular block, and
+    //continue parsing.
 
-bool VideoTrack::VetEntry(const BlockEntry* pBlockEntry) const {
-  return Track::VetEntry(pBlockEntry) && pBlockEntry->GetBlock()->IsKey();
-}
+    const Tracks* const pTracks = m_pSegment->GetTracks();
+    assert(pTracks);
 
-long VideoTrack::Seek(long long time_ns, const BlockEntry*& pResult) const {
-  const long status = GetFirst(pResult);
+    const long tn = static_cast<long>(track);
 
-  if (status < 0)  // buffer underflow, etc
-    return status;
+    const Track* const pTrack = pTracks->GetTrackByNumber(tn);
 
-  assert(pResult);
+    if (pTrack == NULL)
+        return E_FILE_FORMAT_INVALID;
+#endif
 
-  if (pResult->EOS())
-    return 0;
+  if (!m_pSegment->IsTrackParsed(track)) {
+    m_pos = block_stop;  // skip the block without creating an entry
+    return 1;
+  }
 
-  const Cluster* pCluster = pResult->GetCluster();
-  assert(pCluster);
-  assert(pCluster->GetIndex() >= 0);
+  pos += len;  // consume track number
 
-  if (time_ns <= pResult->GetBlock()->GetTime(pCluster))
-    return 0;
+  if ((pos + 2) > block_stop)
+    return E_FILE_FORMAT_INVALID;
 
-  Cluster** const clusters = m_pSegment->m_clusters;
-  assert(clusters);
+  if ((pos + 2) > avail) {
+    len = 2;
+    return E_BUFFER_NOT_FULL;
+  }
 
-  const long count = m_pSegment->GetCount();  // loaded only, not pre-loaded
-  assert(count > 0);
+  pos += 2;  // consume timecode
 
-  Cluster** const i = clusters + pCluster->GetIndex();
-  assert(i);
-  assert(*i == pCluster);
-  assert(pCluster->GetTime() <= time_ns);
+  if ((pos + 1) > block_stop)
+    return E_FILE_FORMAT_INVALID;
 
-  Cluster** const j = clusters + count;
+  if ((pos + 1) > avail) {
+    len = 1;
+    return E_BUFFER_NOT_FULL;
+  }
 
-  Cluster** lo = i;
-  Cluster** hi = j;
+  unsigned char flags;
 
-  while (lo < hi) {
-    // INVARIANT:
-    //[i, lo) <= time_ns
-    //[lo, hi) ?
-    //[hi, j)  > time_ns
+  status = header.ReadByte(pos, flags);
 
-    Cluster** const mid = lo + (hi - lo) / 2;
-    assert(mid < hi);
+  if (status < 0) {  // error or underflow
+    len = 1;
+    return status;
+  }
 
-    pCluster = *mid;
-    assert(pCluster);
-    assert(pCluster->GetIndex() >= 0);
-    assert(pCluster->GetIndex() == long(mid - m_pSegment->m_clusters));
+  ++pos;  // consume flags byte
+  assert(pos <= avail);
 
-    const long long t = pCluster->GetTime();
+  if (pos >= block_stop)
+    return E_FILE_FORMAT_INVALID;
 
-    if (t <= time_ns)
-      lo = mid + 1;
-    else
-      hi = mid;
+  const int lacing = int(flags & 0x06) >> 1;
 
-    assert(lo <= hi);
+  if ((lacing != 0) && (block_stop > avail)) {
+    len = static_cast<long>(block_stop - pos);
+    return E_BUFFER_NOT_FULL;
   }
 
-  assert(lo == hi);
-  assert(lo > i);
-  assert(lo <= j);
+  status = CreateBlock(0x23,  // simple block id
+                       block_start, block_size,
+                       0);  // DiscardPadding
 
-  pCluster = *--lo;
-  assert(pCluster);
-  assert(pCluster->GetTime() <= time_ns);
+  if (status != 0)
+    return status;
 
-  pResult = pCluster->GetEntry(this, time_ns);
+  m_pos = block_stop;
 
-  if ((pResult != 0) && !pResult->EOS())  // found a keyframe
-    return 0;
+  return 0;  // success
+}
 
-  while (lo != i) {
-    pCluster = *--lo;
-    assert(pCluster);
-    assert(pCluster->GetTime() <= time_ns);
+long Cluster::ParseBlockGroup(long long payload_size, long long& pos,
+                              long& len) {
+  const long long payload_start = pos;
+  const long long payload_stop = pos + payload_size;
 
-#if 0
-        //TODO:
-        //We need to handle the case when a cluster
-        //contains multiple keyframes.  Simply returning
-        //the largest keyframe on the cluster isn't
-        //good enough.
-        pResult = pCluster->GetMaxKey(this);
-#else
-    pResult = pCluster->GetEntry(this, time_ns);
-#endif
+  IMkvReader* const pReader = m_pSegment->m_pReader;
 
-    if ((pResult != 0) && !pResult->EOS())
-      return 0;
+  long long total, avail;
+
+  long status = pReader->Length(&total, &avail);
+
+  if (status < 0)  // error
+    return status;
+
+  assert((total < 0) || (avail <= total));
+
+  if ((total >= 0) && (payload_stop > total))
+    return E_FILE_FORMAT_INVALID;
+
+  if (payload_stop > avail) {
+    len = static_cast<long>(payload_size);
+    return E_BUFFER_NOT_FULL;
   }
 
-  // weird: we're on the first cluster, but no keyframe found
-  // should never happen but we must return something anyway
+  long long discard_padding = 0;
 
-  pResult = GetEOS();
-  return 0;
-}
+  HeaderReader header(pReader, avail);
 
-long long VideoTrack::GetWidth() const { return m_width; }
+  while (pos < payload_stop) {
+    // parse sub-block element ID
 
-long long VideoTrack::GetHeight() const { return m_height; }
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-long long VideoTrack::GetDisplayWidth() const {
-  return m_display_width > 0 ? m_display_width : GetWidth();
-}
+    long long result = header.GetUIntLength(pos, len);
 
-long long VideoTrack::GetDisplayHeight() const {
-  return m_display_height > 0 ? m_display_height : GetHeight();
-}
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-long long VideoTrack::GetStereoMode() const { return m_stereo_mode; }
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-double VideoTrack::GetFrameRate() const { return m_rate; }
+    if ((pos + len) > payload_stop)
+      return E_FILE_FORMAT_INVALID;
 
-AudioTrack::AudioTrack(Segment* pSegment, long long element_start,
-                       long long element_size)
-    : Track(pSegment, element_start, element_size) {}
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-long AudioTrack::Parse(Segment* pSegment, const Info& info,
-                       long long element_start, long long element_size,
-                       AudioTrack*& pResult) {
-  if (pResult)
-    return -1;
+    const long long id = header.ReadUInt(pos, len);
 
-  if (info.type != Track::kAudio)
-    return -1;
+    if (id < 0)  // error
+      return static_cast<long>(id);
 
-  IMkvReader* const pReader = pSegment->m_pReader;
+    if (id == 0)  // not a value ID
+      return E_FILE_FORMAT_INVALID;
 
-  const Settings& s = info.settings;
-  assert(s.start >= 0);
-  assert(s.size >= 0);
+    pos += len;  // consume ID field
 
-  long long pos = s.start;
-  assert(pos >= 0);
+    // Parse Size
 
-  const long long stop = pos + s.size;
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  double rate = 8000.0;  // MKV default
-  long long channels = 1;
-  long long bit_depth = 0;
+    result = header.GetUIntLength(pos, len);
 
-  while (pos < stop) {
-    long long id, size;
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-    long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-    if (status < 0)  // error
-      return status;
+    if ((pos + len) > payload_stop)
+      return E_FILE_FORMAT_INVALID;
 
-    if (id == 0x35) {  // Sample Rate
-      status = UnserializeFloat(pReader, pos, size, rate);
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-      if (status < 0)
-        return status;
+    const long long size = header.ReadUInt(pos, len);
 
-      if (rate <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x1F) {  // Channel Count
-      channels = UnserializeUInt(pReader, pos, size);
+    if (size < 0)  // error
+      return static_cast<long>(size);
 
-      if (channels <= 0)
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x2264) {  // Bit Depth
-      bit_depth = UnserializeUInt(pReader, pos, size);
+    pos += len;  // consume size field
 
-      if (bit_depth <= 0)
-        return E_FILE_FORMAT_INVALID;
-    }
+    // pos now points to start of sub-block group payload
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
-  }
+    if (pos > payload_stop)
+      return E_FILE_FORMAT_INVALID;
 
-  assert(pos == stop);
+    if (size == 0)  // weird
+      continue;
 
-  AudioTrack* const pTrack =
-      new (std::nothrow) AudioTrack(pSegment, element_start, element_size);
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-  if (pTrack == NULL)
-    return -1;  // generic error
+    if (size == unknown_size)
+      return E_FILE_FORMAT_INVALID;
 
-  const int status = info.Copy(pTrack->m_info);
+    if (id == 0x35A2) {  // DiscardPadding
+      status = UnserializeInt(pReader, pos, size, discard_padding);
 
-  if (status) {
-    delete pTrack;
-    return status;
-  }
+      if (status < 0)  // error
+        return status;
+    }
 
-  pTrack->m_rate = rate;
-  pTrack->m_channels = channels;
-  pTrack->m_bitDepth = bit_depth;
+    if (id != 0x21) {  // sub-part of BlockGroup is not a Block
+      pos += size;  // consume sub-part of block group
+
+      if (pos > payload_stop)
+        return E_FILE_FORMAT_INVALID;
 
-  pResult = pTrack;
-  return 0;  // success
-}
+      continue;
+    }
 
-double AudioTrack::GetSamplingRate() const { return m_rate; }
+    const long long block_stop = pos + size;
 
-long long AudioTrack::GetChannels() const { return m_channels; }
+    if (block_stop > payload_stop)
+      return E_FILE_FORMAT_INVALID;
 
-long long AudioTrack::GetBitDepth() const { return m_bitDepth; }
+    // parse track number
 
-Tracks::Tracks(Segment* pSegment, long long start, long long size_,
-               long long element_start, long long element_size)
-    : m_pSegment(pSegment),
-      m_start(start),
-      m_size(size_),
-      m_element_start(element_start),
-      m_element_size(element_size),
-      m_trackEntries(NULL),
-      m_trackEntriesEnd(NULL) {}
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-long Tracks::Parse() {
-  assert(m_trackEntries == NULL);
-  assert(m_trackEntriesEnd == NULL);
+    result = header.GetUIntLength(pos, len);
 
-  const long long stop = m_start + m_size;
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-  int count = 0;
-  long long pos = m_start;
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  while (pos < stop) {
-    long long id, size;
+    if ((pos + len) > block_stop)
+      return E_FILE_FORMAT_INVALID;
 
-    const long status = ParseElementHeader(pReader, pos, stop, id, size);
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-    if (status < 0)  // error
-      return status;
+    const long long track = header.ReadUInt(pos, len);
 
-    if (size == 0)  // weird
-      continue;
+    if (track < 0)  // error
+      return static_cast<long>(track);
 
-    if (id == 0x2E)  // TrackEntry ID
-      ++count;
+    if (track == 0)
+      return E_FILE_FORMAT_INVALID;
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
-  }
+#if 0
+        //TODO(matthewjheaney)
+        //This turned out to be too conservative.  The problem is that
+        //if we see a track header in the tracks element with an unsupported
+        //track type, we throw that track header away, so it is not present
+        //in the track map.  But even though we don't understand the track
+        //header, there are still blocks in the cluster with that track
+        //number.  It was our decision to ignore that track header, so it's
+        //up to us to deal with blocks associated with that track -- we
+        //cannot simply report an error since technically there's nothing
+        //wrong with the file.
+        //
+        //For now we go ahead and finish the parse, creating a block entry
+        //for this block.  This is somewhat wasteful, because without a
+        //track header there's nothing you can do with the block. What
+        //we really need here is a special return value that indicates to
+        //the caller that he should ignore this particular block, and
+        //continue parsing.
 
-  assert(pos == stop);
+        const Tracks* const pTracks = m_pSegment->GetTracks();
+        assert(pTracks);
 
-  if (count <= 0)
-    return 0;  // success
+        const long tn = static_cast<long>(track);
 
-  m_trackEntries = new (std::nothrow) Track* [count];
+        const Track* const pTrack = pTracks->GetTrackByNumber(tn);
 
-  if (m_trackEntries == NULL)
-    return -1;
+        if (pTrack == NULL)
+            return E_FILE_FORMAT_INVALID;
+#endif
 
-  m_trackEntriesEnd = m_trackEntries;
+    if (!m_pSegment->IsTrackParsed(track)) {
+      m_pos = payload_stop;  // skip the group without creating an entry
+      return 1;
+    }
 
-  pos = m_start;
+    pos += len;  // consume track number
 
-  while (pos < stop) {
-    const long long element_start = pos;
+    if ((pos + 2) > block_stop)
+      return E_FILE_FORMAT_INVALID;
 
-    long long id, payload_size;
+    if ((pos + 2) > avail) {
+      len = 2;
+      return E_BUFFER_NOT_FULL;
+    }
 
-    const long status =
-        ParseElementHeader(pReader, pos, stop, id, payload_size);
+    pos += 2;  // consume timecode
 
-    if (status < 0)  // error
-      return status;
+    if ((pos + 1) > block_stop)
+      return E_FILE_FORMAT_INVALID;
 
-    if (payload_size == 0)  // weird
-      continue;
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-    const long long payload_stop = pos + payload_size;
-    assert(payload_stop <= stop);  // checked in ParseElement
+    unsigned char flags;
 
-    const long long element_size = payload_stop - element_start;
+    status = header.ReadByte(pos, flags);
 
-    if (id == 0x2E) {  // TrackEntry ID
-      Track*& pTrack = *m_trackEntriesEnd;
-      pTrack = NULL;
+    if (status < 0) {  // error or underflow
+      len = 1;
+      return status;
+    }
 
-      const long status = ParseTrackEntry(pos, payload_size, element_start,
-                                          element_size, pTrack);
+    ++pos;  // consume flags byte
+    assert(pos <= avail);
 
-      if (status)
-        return status;
+    if (pos >= block_stop)
+      return E_FILE_FORMAT_INVALID;
 
-      if (pTrack)
-        ++m_trackEntriesEnd;
+    const int lacing = int(flags & 0x06) >> 1;
+
+    if ((lacing != 0) && (block_stop > avail)) {
+      len = static_cast<long>(block_stop - pos);
+      return E_BUFFER_NOT_FULL;
     }
 
-    pos = payload_stop;
-    assert(pos <= stop);
+    pos = block_stop;  // consume block-part of block group
+    assert(pos <= payload_stop);
   }
 
-  assert(pos == stop);
+  assert(pos == payload_stop);
 
-  return 0;  // success
-}
+  status = CreateBlock(0x20,  // BlockGroup ID
+                       payload_start, payload_size, discard_padding);
+  if (status != 0)
+    return status;
 
-unsigned long Tracks::GetTracksCount() const {
-  const ptrdiff_t result = m_trackEntriesEnd - m_trackEntries;
-  assert(result >= 0);
+  m_pos = payload_stop;
 
-  return static_cast<unsigned long>(result);
+  return 0;  // success
 }
 
-long Tracks::ParseTrackEntry(long long track_start, long long track_size,
-                             long long element_start, long long element_size,
-                             Track*& pResult) const {
-  if (pResult)
-    return -1;
-
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+long Cluster::GetEntry(long index, const mkvparser::BlockEntry*& pEntry) const {
+  assert(m_pos >= m_element_start);
 
-  long long pos = track_start;
-  const long long track_stop = track_start + track_size;
+  pEntry = NULL;
 
-  Track::Info info;
+  if (index < 0)
+    return -1;  // generic error
 
-  info.type = 0;
-  info.number = 0;
-  info.uid = 0;
-  info.defaultDuration = 0;
+  if (m_entries_count < 0)
+    return E_BUFFER_NOT_FULL;
 
-  Track::Settings v;
-  v.start = -1;
-  v.size = -1;
+  assert(m_entries);
+  assert(m_entries_size > 0);
+  assert(m_entries_count <= m_entries_size);
 
-  Track::Settings a;
-  a.start = -1;
-  a.size = -1;
+  if (index < m_entries_count) {
+    pEntry = m_entries[index];
+    assert(pEntry);
 
-  Track::Settings e;  // content_encodings_settings;
-  e.start = -1;
-  e.size = -1;
+    return 1;  // found entry
+  }
 
-  long long lacing = 1;  // default is true
+  if (m_element_size < 0)  // we don't know cluster end yet
+    return E_BUFFER_NOT_FULL;  // underflow
 
-  while (pos < track_stop) {
-    long long id, size;
+  const long long element_stop = m_element_start + m_element_size;
 
-    const long status = ParseElementHeader(pReader, pos, track_stop, id, size);
+  if (m_pos >= element_stop)
+    return 0;  // nothing left to parse
 
-    if (status < 0)  // error
-      return status;
+  return E_BUFFER_NOT_FULL;  // underflow, since more remains to be parsed
+}
 
-    if (size < 0)
-      return E_FILE_FORMAT_INVALID;
+Cluster* Cluster::Create(Segment* pSegment, long idx, long long off)
+// long long element_size)
+{
+  assert(pSegment);
+  assert(off >= 0);
 
-    const long long start = pos;
+  const long long element_start = pSegment->m_start + off;
 
-    if (id == 0x60) {  // VideoSettings ID
-      v.start = start;
-      v.size = size;
-    } else if (id == 0x61) {  // AudioSettings ID
-      a.start = start;
-      a.size = size;
-    } else if (id == 0x2D80) {  // ContentEncodings ID
-      e.start = start;
-      e.size = size;
-    } else if (id == 0x33C5) {  // Track UID
-      if (size > 8)
-        return E_FILE_FORMAT_INVALID;
+  Cluster* const pCluster = new Cluster(pSegment, idx, element_start);
+  // element_size);
+  assert(pCluster);
 
-      info.uid = 0;
+  return pCluster;
+}
 
-      long long pos_ = start;
-      const long long pos_end = start + size;
+Cluster::Cluster()
+    : m_pSegment(NULL),
+      m_element_start(0),
+      m_index(0),
+      m_pos(0),
+      m_element_size(0),
+      m_timecode(0),
+      m_entries(NULL),
+      m_entries_size(0),
+      m_entries_count(0),  // means "no entries"
+      m_entries_start(0),
+      m_arena(NULL),
+      m_skimmed(false) {}
 
-      while (pos_ != pos_end) {
-        unsigned char b;
+Cluster::Cluster(Segment* pSegment, long idx, long long element_start
+                 /* long long element_size */)
+    : m_pSegment(pSegment),
+      m_element_start(element_start),
+      m_index(idx),
+      m_pos(element_start),
+      m_element_size(-1 /* element_size */),
+      m_timecode(-1),
+      m_entries(NULL),
+      m_entries_size(0),
+      m_entries_count(-1),  // means "has not been parsed yet"
+      m_entries_start(-1),
+      m_arena(NULL),
+      m_skimmed(false) {}
 
-        const int status = pReader->Read(pos_, 1, &b);
+Cluster::~Cluster() { ReleaseEntries(); }
 
-        if (status)
-          return status;
+struct Cluster::ArenaChunk {
+  enum { kMinSize = 16 * 1024, kMaxSize = 256 * 1024 };
 
-        info.uid <<= 8;
-        info.uid |= b;
+  ArenaChunk* next;  // previously filled chunk
+  size_t size;  // usable bytes following the header
+  size_t used;
+};
 
-        ++pos_;
-      }
-    } else if (id == 0x57) {  // Track Number
-      const long long num = UnserializeUInt(pReader, pos, size);
+void* Cluster::Allocate(size_t size) const {
+  // The objects we store hold long long members, so every allocation must
+  // start at a multiple of its size. The chunk buffer itself is suitably
+  // aligned by new[]; the header is padded (it is only 12 bytes on 32-bit
+  // targets) and allocation sizes are rounded up to keep that alignment.
+  const size_t align = sizeof(long long);
+  const size_t header = (sizeof(ArenaChunk) + align - 1) & ~(align - 1);
+  size = (size + align - 1) & ~(align - 1);
 
-      if ((num <= 0) || (num > 127))
-        return E_FILE_FORMAT_INVALID;
+  ArenaChunk* chunk = m_arena;
 
-      info.number = static_cast<long>(num);
-    } else if (id == 0x03) {  // Track Type
-      const long long type = UnserializeUInt(pReader, pos, size);
+  if ((chunk == NULL) || ((chunk->size - chunk->used) < size)) {
+    size_t chunk_size = (chunk == NULL) ? size_t(ArenaChunk::kMinSize)
+                                        : 2 * chunk->size;
 
-      if ((type <= 0) || (type > 254))
-        return E_FILE_FORMAT_INVALID;
+    if (chunk_size > ArenaChunk::kMaxSize)
+      chunk_size = ArenaChunk::kMaxSize;
 
-      info.type = static_cast<long>(type);
-    } else if (id == 0x136E) {  // Track Name
-      const long status =
-          UnserializeString(pReader, pos, size, info.nameAsUTF8);
+    if (chunk_size < size)
+      chunk_size = size;
 
-      if (status)
-        return status;
-    } else if (id == 0x02B59C) {  // Track Language
-      const long status = UnserializeString(pReader, pos, size, info.language);
+    unsigned char* const buf =
+        new (std::nothrow) unsigned char[header + chunk_size];
 
-      if (status)
-        return status;
-    } else if (id == 0x03E383) {  // Default Duration
-      const long long duration = UnserializeUInt(pReader, pos, size);
+    if (buf == NULL)
+      return NULL;
 
-      if (duration < 0)
-        return E_FILE_FORMAT_INVALID;
+    chunk = reinterpret_cast<ArenaChunk*>(buf);
+    chunk->next = m_arena;
+    chunk->size = chunk_size;
+    chunk->used = 0;
 
-      info.defaultDuration = static_cast<unsigned long long>(duration);
-    } else if (id == 0x06) {  // CodecID
-      const long status = UnserializeString(pReader, pos, size, info.codecId);
+    m_arena = chunk;
+  }
 
-      if (status)
-        return status;
-    } else if (id == 0x1C) {  // lacing
-      lacing = UnserializeUInt(pReader, pos, size);
+  unsigned char* const data = reinterpret_cast<unsigned char*>(chunk) + header;
+  void* const result = data + chunk->used;
 
-      if ((lacing < 0) || (lacing > 1))
-        return E_FILE_FORMAT_INVALID;
-    } else if (id == 0x23A2) {  // Codec Private
-      delete[] info.codecPrivate;
-      info.codecPrivate = NULL;
-      info.codecPrivateSize = 0;
+  chunk->used += size;
 
-      const size_t buflen = static_cast<size_t>(size);
+  return result;
+}
 
-      if (buflen) {
-        typedef unsigned char* buf_t;
+void Cluster::ReleaseEntries() const {
+  // The entries live in the arena, so run their destructors explicitly
+  // before the arena itself is freed.
 
-        const buf_t buf = new (std::nothrow) unsigned char[buflen];
+  if (m_entries_count > 0) {
+    BlockEntry** i = m_entries;
+    BlockEntry** const j = m_entries + m_entries_count;
 
-        if (buf == NULL)
-          return -1;
+    while (i != j) {
+      BlockEntry* p = *i++;
+      assert(p);
 
-        const int status = pReader->Read(pos, static_cast<long>(buflen), buf);
+      p->~BlockEntry();
+    }
+  }
 
-        if (status) {
-          delete[] buf;
-          return status;
-        }
+  while (m_arena) {
+    ArenaChunk* const chunk = m_arena;
+    m_arena = chunk->next;
 
-        info.codecPrivate = buf;
-        info.codecPrivateSize = buflen;
-      }
-    } else if (id == 0x058688) {  // Codec Name
-      const long status =
-          UnserializeString(pReader, pos, size, info.codecNameAsUTF8);
+    delete[] reinterpret_cast<unsigned char*>(chunk);
+  }
 
-      if (status)
-        return status;
-    } else if (id == 0x16AA) {  // Codec Delay
-      info.codecDelay = UnserializeUInt(pReader, pos, size);
-    } else if (id == 0x16BB) {  // Seek Pre Roll
-      info.seekPreRoll = UnserializeUInt(pReader, pos, size);
-    }
+  m_entries = NULL;
+  m_entries_size = 0;
 
-    pos += size;  // consume payload
-    assert(pos <= track_stop);
+  if (m_timecode >= 0) {  // loaded
+    m_entries_count = -1;
+    m_pos = m_entries_start;
   }
+}
 
-  assert(pos == track_stop);
+namespace {
 
-  if (info.number <= 0)  // not specified
-    return E_FILE_FORMAT_INVALID;
+// Reads the ID and size of the element at |pos|, whose payload must end by
+// |stop|, and moves |pos| to the payload. Returns E_BUFFER_NOT_FULL, with
+// |len| set, if the header extends beyond |avail|.
+long SkimElementHeader(HeaderReader& header, long long avail, long long stop,
+                       long long& pos, long& len, long long& id,
+                       long long& size) {
+  for (int field = 0; field < 2; ++field) {
+    if ((pos + 1) > avail) {
+      len = 1;
+      return E_BUFFER_NOT_FULL;
+    }
 
-  if (GetTrackByNumber(info.number))
-    return E_FILE_FORMAT_INVALID;
+    const long long result = header.GetUIntLength(pos, len);
 
-  if (info.type <= 0)  // not specified
-    return E_FILE_FORMAT_INVALID;
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-  info.lacing = (lacing > 0) ? true : false;
+    if (result > 0)  // weird
+      return E_BUFFER_NOT_FULL;
 
-  if (info.type == Track::kVideo) {
-    if (v.start < 0)
+    if ((pos + len) > stop)
       return E_FILE_FORMAT_INVALID;
 
-    if (a.start >= 0)
-      return E_FILE_FORMAT_INVALID;
+    if ((pos + len) > avail)
+      return E_BUFFER_NOT_FULL;
 
-    info.settings = v;
+    const long long value = header.ReadUInt(pos, len);
 
-    VideoTrack* pTrack = NULL;
+    if (value < 0)  // error
+      return static_cast<long>(value);
 
-    const long status = VideoTrack::Parse(m_pSegment, info, element_start,
-                                          element_size, pTrack);
+    if (field == 0) {
+      if (value == 0)
+        return E_FILE_FORMAT_INVALID;
 
-    if (status)
-      return status;
+      id = value;
+    } else {
+      const long long unknown_size = (1LL << (7 * len)) - 1;
 
-    pResult = pTrack;
-    assert(pResult);
+      if (value == unknown_size)
+        return E_FILE_FORMAT_INVALID;
 
-    if (e.start >= 0)
-      pResult->ParseContentEncodingsEntry(e.start, e.size);
-  } else if (info.type == Track::kAudio) {
-    if (a.start < 0)
-      return E_FILE_FORMAT_INVALID;
+      size = value;
+    }
 
-    if (v.start >= 0)
-      return E_FILE_FORMAT_INVALID;
+    pos += len;  // consume field
+  }
 
-    info.settings = a;
+  if ((pos + size) > stop)
+    return E_FILE_FORMAT_INVALID;
 
-    AudioTrack* pTrack = NULL;
+  return 0;  // success
+}
 
-    const long status = AudioTrack::Parse(m_pSegment, info, element_start,
-                                          element_size, pTrack);
+// Reads the track number, the relative timecode and the flags at the start
+// of the Block or SimpleBlock payload at |pos|, which ends at |stop|.
+long SkimBlockHeader(IMkvReader* pReader, HeaderReader& header,
+                     long long avail, long long pos, long long stop,
+                     long& len, long long& track, long long& timecode,
+                     unsigned char& flags) {
+  if ((pos + 1) > avail) {
+    len = 1;
+    return E_BUFFER_NOT_FULL;
+  }
 
-    if (status)
-      return status;
+  long long result = header.GetUIntLength(pos, len);
 
-    pResult = pTrack;
-    assert(pResult);
+  if (result < 0)  // error
+    return static_cast<long>(result);
 
-    if (e.start >= 0)
-      pResult->ParseContentEncodingsEntry(e.start, e.size);
-  } else {
-    // neither video nor audio - probably metadata or subtitles
+  if (result > 0)  // weird
+    return E_BUFFER_NOT_FULL;
 
-    if (a.start >= 0)
-      return E_FILE_FORMAT_INVALID;
+  if ((pos + len) > stop)
+    return E_FILE_FORMAT_INVALID;
 
-    if (v.start >= 0)
-      return E_FILE_FORMAT_INVALID;
+  if ((pos + len + 3) > avail) {
+    len += 3;
+    return E_BUFFER_NOT_FULL;
+  }
 
-    if (info.type == Track::kMetadata && e.start >= 0)
-      return E_FILE_FORMAT_INVALID;
+  track = header.ReadUInt(pos, len);
 
-    info.settings.start = -1;
-    info.settings.size = 0;
+  if (track <= 0)
+    return E_FILE_FORMAT_INVALID;
 
-    Track* pTrack = NULL;
+  pos += len;  // consume track number
 
-    const long status =
-        Track::Create(m_pSegment, info, element_start, element_size, pTrack);
+  if ((stop - pos) < 3)
+    return E_FILE_FORMAT_INVALID;
 
-    if (status)
-      return status;
+  unsigned char buf[3];
 
-    pResult = pTrack;
-    assert(pResult);
-  }
+  if (pReader->Read(pos, 3, buf) != 0)
+    return E_FILE_FORMAT_INVALID;
+
+  timecode = static_cast<short>((buf[0] << 8) | buf[1]);
+  flags = buf[2];
 
   return 0;  // success
 }
 
-Tracks::~Tracks() {
-  Track** i = m_trackEntries;
-  Track** const j = m_trackEntriesEnd;
+}  // namespace
 
-  while (i != j) {
-    Track* const pTrack = *i++;
-    delete pTrack;
-  }
+long Cluster::SkimFirstBlock(long long& track, long long& timecode, bool& key,
+                             long long& pos, long& len) const {
+  assert(m_pSegment);
+  assert(m_timecode >= 0);  // loaded
+  assert(m_element_size > 0);
 
-  delete[] m_trackEntries;
-}
+  IMkvReader* const pReader = m_pSegment->m_pReader;
 
-const Track* Tracks::GetTrackByNumber(long tn) const {
-  if (tn < 0)
-    return NULL;
+  long long total, avail;
 
-  Track** i = m_trackEntries;
-  Track** const j = m_trackEntriesEnd;
+  long status = pReader->Length(&total, &avail);
 
-  while (i != j) {
-    Track* const pTrack = *i++;
+  if (status < 0)  // error
+    return status;
 
-    if (pTrack == NULL)
-      continue;
+  HeaderReader header(pReader, avail);
 
-    if (tn == pTrack->GetNumber())
-      return pTrack;
-  }
+  const long long cluster_stop = m_element_start + m_element_size;
 
-  return NULL;  // not found
-}
+  pos = m_entries_start;
 
-const Track* Tracks::GetTrackByIndex(unsigned long idx) const {
-  const ptrdiff_t count = m_trackEntriesEnd - m_trackEntries;
+  while (pos < cluster_stop) {
+    long long id, size;
 
-  if (idx >= static_cast<unsigned long>(count))
-    return NULL;
+    status = SkimElementHeader(header, avail, cluster_stop, pos, len, id, size);
 
-  return m_trackEntries[idx];
-}
+    if (status < 0)  // error, or underflow
+      return status;
 
-#if 0
-long long Cluster::Unparsed() const
-{
-    if (m_timecode < 0)  //not even partially loaded
-        return LLONG_MAX;
+    if (id == 0x23) {  // SimpleBlock ID
+      unsigned char flags;
 
-    assert(m_pos >= m_element_start);
-    //assert(m_element_size > m_size);
+      status = SkimBlockHeader(pReader, header, avail, pos, pos + size, len,
+                               track, timecode, flags);
 
-    const long long element_stop = m_element_start + m_element_size;
-    assert(m_pos <= element_stop);
+      if (status < 0)  // error, or underflow
+        return status;
 
-    const long long result = element_stop - m_pos;
-    assert(result >= 0);
+      pos += size;  // consume payload
 
-    return result;
-}
-#endif
+      if (!m_pSegment->IsTrackParsed(track))
+        continue;
 
-long Cluster::Load(long long& pos, long& len) const {
-  assert(m_pSegment);
-  assert(m_pos >= m_element_start);
+      key = ((flags & 0x80) != 0);
+      return 0;  // success
+    }
 
-  if (m_timecode >= 0)  // at least partially loaded
-    return 0;
+    if (id == 0x20) {  // BlockGroup ID
+      const long long group_stop = pos + size;
 
-  assert(m_pos == m_element_start);
-  assert(m_element_size < 0);
+      bool block = false;
+      key = true;  // unless it has a ReferenceBlock
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+      while (pos < group_stop) {
+        status = SkimElementHeader(header, avail, group_stop, pos, len, id,
+                                   size);
 
-  long long total, avail;
+        if (status < 0)  // error, or underflow
+          return status;
 
-  const int status = pReader->Length(&total, &avail);
+        if (id == 0x21) {  // Block ID
+          unsigned char flags;
 
-  if (status < 0)  // error
-    return status;
+          status = SkimBlockHeader(pReader, header, avail, pos, pos + size,
+                                   len, track, timecode, flags);
+
+          if (status < 0)  // error, or underflow
+            return status;
+
+          block = true;
+        } else if (id == 0x7B) {  // ReferenceBlock ID
+          key = false;
+        }
+
+        pos += size;  // consume payload
+      }
+
+      if (!block)
+        return E_FILE_FORMAT_INVALID;
+
+      if (!m_pSegment->IsTrackParsed(track))
+        continue;
+
+      return 0;  // success
+    }
+
+    pos += size;  // consume payload
+  }
 
-  assert((total < 0) || (avail <= total));
-  assert((total < 0) || (m_pos <= total));  // TODO: verify this
+  return 1;  // no blocks
+}
 
-  pos = m_pos;
+bool Cluster::EOS() const { return (m_pSegment == NULL); }
 
-  long long cluster_size = -1;
+long Cluster::GetIndex() const { return m_index; }
 
-  {
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+long long Cluster::GetPosition() const {
+  const long long pos = m_element_start - m_pSegment->m_start;
+  assert(pos >= 0);
 
-    long long result = GetUIntLength(pReader, pos, len);
+  return pos;
+}
 
-    if (result < 0)  // error or underflow
-      return static_cast<long>(result);
+long long Cluster::GetElementSize() const { return m_element_size; }
 
-    if (result > 0)  // underflow (weird)
-      return E_BUFFER_NOT_FULL;
+#if 0
+bool Cluster::HasBlockEntries(
+    const Segment* pSegment,
+    long long off) {
+    assert(pSegment);
+    assert(off >= 0);  //relative to start of segment payload
 
-    // if ((pos + len) > segment_stop)
-    //    return E_FILE_FORMAT_INVALID;
+    IMkvReader* const pReader = pSegment->m_pReader;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+    long long pos = pSegment->m_start + off;  //absolute
+    long long size;
 
-    const long long id_ = ReadUInt(pReader, pos, len);
+    {
+        long len;
 
-    if (id_ < 0)  // error
-      return static_cast<long>(id_);
+        const long long id = ReadUInt(pReader, pos, len);
+        (void)id;
+        assert(id >= 0);
+        assert(id == 0x0F43B675);  //Cluster ID
 
-    if (id_ != 0x0F43B675)  // Cluster ID
-      return E_FILE_FORMAT_INVALID;
+        pos += len;  //consume id
 
-    pos += len;  // consume id
+        size = ReadUInt(pReader, pos, len);
+        assert(size > 0);
 
-    // read cluster size
+        pos += len;  //consume size
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
+        //pos now points to start of payload
     }
 
-    result = GetUIntLength(pReader, pos, len);
+    const long long stop = pos + size;
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    while (pos < stop)
+    {
+        long len;
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+        const long long id = ReadUInt(pReader, pos, len);
+        assert(id >= 0);  //TODO
+        assert((pos + len) <= stop);
 
-    // if ((pos + len) > segment_stop)
-    //    return E_FILE_FORMAT_INVALID;
+        pos += len;  //consume id
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+        const long long size = ReadUInt(pReader, pos, len);
+        assert(size >= 0);  //TODO
+        assert((pos + len) <= stop);
 
-    const long long size = ReadUInt(pReader, pos, len);
+        pos += len;  //consume size
 
-    if (size < 0)  // error
-      return static_cast<long>(cluster_size);
+        if (id == 0x20)  //BlockGroup ID
+            return true;
 
-    if (size == 0)
-      return E_FILE_FORMAT_INVALID;  // TODO: verify this
+        if (id == 0x23)  //SimpleBlock ID
+            return true;
 
-    pos += len;  // consume length of size of element
+        pos += size;  //consume payload
+        assert(pos <= stop);
+    }
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+    return false;
+}
+#endif
 
-    if (size != unknown_size)
-      cluster_size = size;
-  }
+long Cluster::HasBlockEntries(
+    const Segment* pSegment,
+    long long off,  // relative to start of segment payload
+    long long& pos, long& len) {
+  assert(pSegment);
+  assert(off >= 0);  // relative to segment
 
-// pos points to start of payload
+  IMkvReader* const pReader = pSegment->m_pReader;
 
-#if 0
-    len = static_cast<long>(size_);
+  long long total, avail;
 
-    if (cluster_stop > avail)
-        return E_BUFFER_NOT_FULL;
-#endif
+  long status = pReader->Length(&total, &avail);
 
-  long long timecode = -1;
-  long long new_pos = -1;
-  bool bBlock = false;
+  if (status < 0)  // error
+    return status;
 
-  long long cluster_stop = (cluster_size < 0) ? -1 : pos + cluster_size;
+  assert((total < 0) || (avail <= total));
 
-  for (;;) {
-    if ((cluster_stop >= 0) && (pos >= cluster_stop))
-      break;
+  pos = pSegment->m_start + off;  // absolute
 
-    // Parse ID
+  if ((total >= 0) && (pos >= total))
+    return 0;  // we don't even have a complete cluster
 
+  const long long segment_stop =
+      (pSegment->m_size < 0) ? -1 : pSegment->m_start + pSegment->m_size;
+
+  long long cluster_stop = -1;  // interpreted later to mean "unknown size"
+
+  {
     if ((pos + 1) > avail) {
       len = 1;
       return E_BUFFER_NOT_FULL;
@@ -6180,12 +8878,15 @@ long Cluster::Load(long long& pos, long& len) const {
     if (result < 0)  // error
       return static_cast<long>(result);
 
-    if (result > 0)  // weird
+    if (result > 0)  // need more data
       return E_BUFFER_NOT_FULL;
 
-    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
       return E_FILE_FORMAT_INVALID;
 
+    if ((total >= 0) && ((pos + len) > total))
+      return 0;
+
     if ((pos + len) > avail)
       return E_BUFFER_NOT_FULL;
 
@@ -6194,22 +8895,12 @@ long Cluster::Load(long long& pos, long& len) const {
     if (id < 0)  // error
       return static_cast<long>(id);
 
-    if (id == 0)
-      return E_FILE_FORMAT_INVALID;
-
-    // This is the distinguished set of ID's we use to determine
-    // that we have exhausted the sub-element's inside the cluster
-    // whose ID we parsed earlier.
-
-    if (id == 0x0F43B675)  // Cluster ID
-      break;
-
-    if (id == 0x0C53BB6B)  // Cues ID
-      break;
+    if (id != 0x0F43B675)  // weird: not cluster ID
+      return -1;  // generic error
 
-    pos += len;  // consume ID field
+    pos += len;  // consume Cluster ID field
 
-    // Parse Size
+    // read size field
 
     if ((pos + 1) > avail) {
       len = 1;
@@ -6224,9 +8915,12 @@ long Cluster::Load(long long& pos, long& len) const {
     if (result > 0)  // weird
       return E_BUFFER_NOT_FULL;
 
-    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
+    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
       return E_FILE_FORMAT_INVALID;
 
+    if ((total >= 0) && ((pos + len) > total))
+      return 0;
+
     if ((pos + len) > avail)
       return E_BUFFER_NOT_FULL;
 
@@ -6235,110 +8929,31 @@ long Cluster::Load(long long& pos, long& len) const {
     if (size < 0)  // error
       return static_cast<long>(size);
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
-
-    if (size == unknown_size)
-      return E_FILE_FORMAT_INVALID;
+    if (size == 0)
+      return 0;  // cluster does not have entries
 
     pos += len;  // consume size field
 
-    if ((cluster_stop >= 0) && (pos > cluster_stop))
-      return E_FILE_FORMAT_INVALID;
-
     // pos now points to start of payload
 
-    if (size == 0)  // weird
-      continue;
-
-    if ((cluster_stop >= 0) && ((pos + size) > cluster_stop))
-      return E_FILE_FORMAT_INVALID;
-
-    if (id == 0x67) {  // TimeCode ID
-      len = static_cast<long>(size);
-
-      if ((pos + size) > avail)
-        return E_BUFFER_NOT_FULL;
-
-      timecode = UnserializeUInt(pReader, pos, size);
-
-      if (timecode < 0)  // error (or underflow)
-        return static_cast<long>(timecode);
-
-      new_pos = pos + size;
-
-      if (bBlock)
-        break;
-    } else if (id == 0x20) {  // BlockGroup ID
-      bBlock = true;
-      break;
-    } else if (id == 0x23) {  // SimpleBlock ID
-      bBlock = true;
-      break;
-    }
-
-    pos += size;  // consume payload
-    assert((cluster_stop < 0) || (pos <= cluster_stop));
-  }
-
-  assert((cluster_stop < 0) || (pos <= cluster_stop));
-
-  if (timecode < 0)  // no timecode found
-    return E_FILE_FORMAT_INVALID;
-
-  if (!bBlock)
-    return E_FILE_FORMAT_INVALID;
-
-  m_pos = new_pos;  // designates position just beyond timecode payload
-  m_timecode = timecode;  // m_timecode >= 0 means we're partially loaded
-
-  if (cluster_size >= 0)
-    m_element_size = cluster_stop - m_element_start;
-
-  return 0;
-}
-
-long Cluster::Parse(long long& pos, long& len) const {
-  long status = Load(pos, len);
-
-  if (status < 0)
-    return status;
-
-  assert(m_pos >= m_element_start);
-  assert(m_timecode >= 0);
-  // assert(m_size > 0);
-  // assert(m_element_size > m_size);
-
-  const long long cluster_stop =
-      (m_element_size < 0) ? -1 : m_element_start + m_element_size;
-
-  if ((cluster_stop >= 0) && (m_pos >= cluster_stop))
-    return 1;  // nothing else to do
-
-  IMkvReader* const pReader = m_pSegment->m_pReader;
-
-  long long total, avail;
-
-  status = pReader->Length(&total, &avail);
-
-  if (status < 0)  // error
-    return status;
-
-  assert((total < 0) || (avail <= total));
-
-  pos = m_pos;
-
-  for (;;) {
-    if ((cluster_stop >= 0) && (pos >= cluster_stop))
-      break;
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-    if ((total >= 0) && (pos >= total)) {
-      if (m_element_size < 0)
-        m_element_size = pos - m_element_start;
+    if (size != unknown_size) {
+      cluster_stop = pos + size;
+      assert(cluster_stop >= 0);
 
-      break;
+      if ((segment_stop >= 0) && (cluster_stop > segment_stop))
+        return E_FILE_FORMAT_INVALID;
+
+      if ((total >= 0) && (cluster_stop > total))
+        // return E_FILE_FORMAT_INVALID;  //too conservative
+        return 0;  // cluster does not have any entries
     }
+  }
 
-    // Parse ID
+  for (;;) {
+    if ((cluster_stop >= 0) && (pos >= cluster_stop))
+      return 0;  // no entries detected
 
     if ((pos + 1) > avail) {
       len = 1;
@@ -6350,7 +8965,7 @@ long Cluster::Parse(long long& pos, long& len) const {
     if (result < 0)  // error
       return static_cast<long>(result);
 
-    if (result > 0)  // weird
+    if (result > 0)  // need more data
       return E_BUFFER_NOT_FULL;
 
     if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
@@ -6364,23 +8979,22 @@ long Cluster::Parse(long long& pos, long& len) const {
     if (id < 0)  // error
       return static_cast<long>(id);
 
-    if (id == 0)  // weird
-      return E_FILE_FORMAT_INVALID;
-
     // This is the distinguished set of ID's we use to determine
     // that we have exhausted the sub-element's inside the cluster
     // whose ID we parsed earlier.
 
-    if ((id == 0x0F43B675) || (id == 0x0C53BB6B)) {  // Cluster or Cues ID
-      if (m_element_size < 0)
-        m_element_size = pos - m_element_start;
+    if (id == 0x0F43B675)  // Cluster ID
+      return 0;  // no entries found
 
-      break;
-    }
+    if (id == 0x0C53BB6B)  // Cues ID
+      return 0;  // no entries found
 
-    pos += len;  // consume ID field
+    pos += len;  // consume id field
 
-    // Parse Size
+    if ((cluster_stop >= 0) && (pos >= cluster_stop))
+      return E_FILE_FORMAT_INVALID;
+
+    // read size field
 
     if ((pos + 1) > avail) {
       len = 1;
@@ -6392,7 +9006,7 @@ long Cluster::Parse(long long& pos, long& len) const {
     if (result < 0)  // error
       return static_cast<long>(result);
 
-    if (result > 0)  // weird
+    if (result > 0)  // underflow
       return E_BUFFER_NOT_FULL;
 
     if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
@@ -6406,1982 +9020,2063 @@ long Cluster::Parse(long long& pos, long& len) const {
     if (size < 0)  // error
       return static_cast<long>(size);
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
-
-    if (size == unknown_size)
-      return E_FILE_FORMAT_INVALID;
-
     pos += len;  // consume size field
 
+    // pos now points to start of payload
+
     if ((cluster_stop >= 0) && (pos > cluster_stop))
       return E_FILE_FORMAT_INVALID;
 
-    // pos now points to start of payload
-
     if (size == 0)  // weird
       continue;
 
-    // const long long block_start = pos;
-    const long long block_stop = pos + size;
-
-    if (cluster_stop >= 0) {
-      if (block_stop > cluster_stop) {
-        if ((id == 0x20) || (id == 0x23))
-          return E_FILE_FORMAT_INVALID;
+    const long long unknown_size = (1LL << (7 * len)) - 1;
 
-        pos = cluster_stop;
-        break;
-      }
-    } else if ((total >= 0) && (block_stop > total)) {
-      m_element_size = total - m_element_start;
-      pos = total;
-      break;
-    } else if (block_stop > avail) {
-      len = static_cast<long>(size);
-      return E_BUFFER_NOT_FULL;
-    }
+    if (size == unknown_size)
+      return E_FILE_FORMAT_INVALID;  // not supported inside cluster
 
-    Cluster* const this_ = const_cast<Cluster*>(this);
+    if ((cluster_stop >= 0) && ((pos + size) > cluster_stop))
+      return E_FILE_FORMAT_INVALID;
 
-    if (id == 0x20)  // BlockGroup
-      return this_->ParseBlockGroup(size, pos, len);
+    if (id == 0x20)  // BlockGroup ID
+      return 1;  // have at least one entry
 
-    if (id == 0x23)  // SimpleBlock
-      return this_->ParseSimpleBlock(size, pos, len);
+    if (id == 0x23)  // SimpleBlock ID
+      return 1;  // have at least one entry
 
     pos += size;  // consume payload
     assert((cluster_stop < 0) || (pos <= cluster_stop));
   }
+}
 
-  assert(m_element_size > 0);
-
-  m_pos = pos;
-  assert((cluster_stop < 0) || (m_pos <= cluster_stop));
+long long Cluster::GetTimeCode() const {
+  long long pos;
+  long len;
 
-  if (m_entries_count > 0) {
-    const long idx = m_entries_count - 1;
+  const long status = Load(pos, len);
 
-    const BlockEntry* const pLast = m_entries[idx];
-    assert(pLast);
+  if (status < 0)  // error
+    return status;
 
-    const Block* const pBlock = pLast->GetBlock();
-    assert(pBlock);
+  return m_timecode;
+}
 
-    const long long start = pBlock->m_start;
+long long Cluster::GetTime() const {
+  const long long tc = GetTimeCode();
 
-    if ((total >= 0) && (start > total))
-      return -1;  // defend against trucated stream
+  if (tc < 0)
+    return tc;
 
-    const long long size = pBlock->m_size;
+  const SegmentInfo* const pInfo = m_pSegment->GetInfo();
+  assert(pInfo);
 
-    const long long stop = start + size;
-    assert((cluster_stop < 0) || (stop <= cluster_stop));
+  const long long scale = pInfo->GetTimeCodeScale();
+  assert(scale >= 1);
 
-    if ((total >= 0) && (stop > total))
-      return -1;  // defend against trucated stream
-  }
+  const long long t = m_timecode * scale;
 
-  return 1;  // no more entries
+  return t;
 }
 
-long Cluster::ParseSimpleBlock(long long block_size, long long& pos,
-                               long& len) {
-  const long long block_start = pos;
-  const long long block_stop = pos + block_size;
+long long Cluster::GetFirstTime() const {
+  const BlockEntry* pEntry;
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+  const long status = GetFirst(pEntry);
 
-  long long total, avail;
+  if (status < 0)  // error
+    return status;
 
-  long status = pReader->Length(&total, &avail);
+  if (pEntry == NULL)  // empty cluster
+    return GetTime();
+
+  const Block* const pBlock = pEntry->GetBlock();
+  assert(pBlock);
+
+  return pBlock->GetTime(this);
+}
+
+long long Cluster::GetLastTime() const {
+  const BlockEntry* pEntry;
+
+  const long status = GetLast(pEntry);
 
   if (status < 0)  // error
     return status;
 
-  assert((total < 0) || (avail <= total));
+  if (pEntry == NULL)  // empty cluster
+    return GetTime();
 
-  // parse track number
+  const Block* const pBlock = pEntry->GetBlock();
+  assert(pBlock);
 
-  if ((pos + 1) > avail) {
-    len = 1;
-    return E_BUFFER_NOT_FULL;
-  }
+  return pBlock->GetTime(this);
+}
 
-  long long result = GetUIntLength(pReader, pos, len);
+long Cluster::CreateBlock(long long id,
+                          long long pos,  // absolute pos of payload
+                          long long size, long long discard_padding) {
+  assert((id == 0x20) || (id == 0x23));  // BlockGroup or SimpleBlock
 
-  if (result < 0)  // error
-    return static_cast<long>(result);
+  if (m_entries_count < 0) {  // haven't parsed anything yet
+    assert(m_entries == NULL);
+    assert(m_entries_size == 0);
 
-  if (result > 0)  // weird
-    return E_BUFFER_NOT_FULL;
+    void* const buf = Allocate(1024 * sizeof(BlockEntry*));
 
-  if ((pos + len) > block_stop)
-    return E_FILE_FORMAT_INVALID;
+    if (buf == NULL)
+      return -1;
 
-  if ((pos + len) > avail)
-    return E_BUFFER_NOT_FULL;
+    m_entries = static_cast<BlockEntry**>(buf);
+    m_entries_size = 1024;
 
-  const long long track = ReadUInt(pReader, pos, len);
+    m_entries_count = 0;
+  } else {
+    assert(m_entries);
+    assert(m_entries_size > 0);
+    assert(m_entries_count <= m_entries_size);
 
-  if (track < 0)  // error
-    return static_cast<long>(track);
+    if (m_entries_count >= m_entries_size) {
+      const long entries_size = 2 * m_entries_size;
 
-  if (track == 0)
-    return E_FILE_FORMAT_INVALID;
+      void* const buf = Allocate(entries_size * sizeof(BlockEntry*));
 
-#if 0
-    //TODO(matthewjheaney)
-    //This turned out to be too conservative.  The problem is that
-    //if we see a track header in the tracks element with an unsupported
-    //track type, we throw that track header away, so it is not present
-    //in the track map.  But even though we don't understand the track
-    //header, there are still blocks in the cluster with that track
-    //number.  It was our decision to ignore that track header, so it's
-    //up to us to deal with blocks associated with that track -- we
-    //cannot simply report an error since technically there's nothing
-    //wrong with the file.
-    //
-    //For now we go ahead and finish the parse, creating a block entry
-    //for this block.  This is somewhat wasteful, because without a
-    //track header there's nothing you can do with the block. What
-    //we really need here is a special return value that indicates to
-    //the caller that he should ignore this particular block, and
-    //continue parsing.
+      if (buf == NULL)
+        return -1;
 
-    const Tracks* const pTracks = m_pSegment->GetTracks();
-    assert(pTracks);
+      BlockEntry** const entries = static_cast<BlockEntry**>(buf);
+
+      BlockEntry** src = m_entries;
+      BlockEntry** const src_end = src + m_entries_count;
+
+      BlockEntry** dst = entries;
+
+      while (src != src_end)
+        *dst++ = *src++;
+
+      // The old array stays in the arena until the cluster is released.
+
+      m_entries = entries;
+      m_entries_size = entries_size;
+    }
+  }
+
+  if (id == 0x20)  // BlockGroup ID
+    return CreateBlockGroup(pos, size, discard_padding);
+  else  // SimpleBlock ID
+    return CreateSimpleBlock(pos, size);
+}
+
+long Cluster::CreateBlockGroup(long long start_offset, long long size,
+                               long long discard_padding) {
+  assert(m_entries);
+  assert(m_entries_size > 0);
+  assert(m_entries_count >= 0);
+  assert(m_entries_count < m_entries_size);
+
+  IMkvReader* const pReader = m_pSegment->m_pReader;
+
+  long long pos = start_offset;
+  const long long stop = start_offset + size;
+
+  // For WebM files, there is a bias towards previous reference times
+  //(in order to support alt-ref frames, which refer back to the previous
+  // keyframe).  Normally a 0 value is not possible, but here we tenatively
+  // allow 0 as the value of a reference frame, with the interpretation
+  // that this is a "previous" reference time.
+
+  long long prev = 1;  // nonce
+  long long next = 0;  // nonce
+  long long duration = -1;  // really, this is unsigned
+
+  long long bpos = -1;
+  long long bsize = -1;
+
+  while (pos < stop) {
+    long len;
+    const long long id = ReadUInt(pReader, pos, len);
+    assert(id >= 0);  // TODO
+    assert((pos + len) <= stop);
 
-    const long tn = static_cast<long>(track);
+    pos += len;  // consume ID
 
-    const Track* const pTrack = pTracks->GetTrackByNumber(tn);
+    const long long size = ReadUInt(pReader, pos, len);
+    assert(size >= 0);  // TODO
+    assert((pos + len) <= stop);
 
-    if (pTrack == NULL)
-        return E_FILE_FORMAT_INVALID;
-#endif
+    pos += len;  // consume size
 
-  pos += len;  // consume track number
+    if (id == 0x21) {  // Block ID
+      if (bpos < 0) {  // Block ID
+        bpos = pos;
+        bsize = size;
+      }
+    } else if (id == 0x1B) {  // Duration ID
+      assert(size <= 8);
 
-  if ((pos + 2) > block_stop)
-    return E_FILE_FORMAT_INVALID;
+      duration = UnserializeUInt(pReader, pos, size);
+      assert(duration >= 0);  // TODO
+    } else if (id == 0x7B) {  // ReferenceBlock
+      assert(size <= 8);
+      const long size_ = static_cast<long>(size);
 
-  if ((pos + 2) > avail) {
-    len = 2;
-    return E_BUFFER_NOT_FULL;
-  }
+      long long time;
 
-  pos += 2;  // consume timecode
+      long status = UnserializeInt(pReader, pos, size_, time);
+      assert(status == 0);
+      if (status != 0)
+        return -1;
 
-  if ((pos + 1) > block_stop)
-    return E_FILE_FORMAT_INVALID;
+      if (time <= 0)  // see note above
+        prev = time;
+      else  // weird
+        next = time;
+    }
 
-  if ((pos + 1) > avail) {
-    len = 1;
-    return E_BUFFER_NOT_FULL;
+    pos += size;  // consume payload
+    assert(pos <= stop);
   }
 
-  unsigned char flags;
+  assert(pos == stop);
+  assert(bpos >= 0);
+  assert(bsize >= 0);
 
-  status = pReader->Read(pos, 1, &flags);
+  const long idx = m_entries_count;
 
-  if (status < 0) {  // error or underflow
-    len = 1;
-    return status;
-  }
+  BlockEntry** const ppEntry = m_entries + idx;
+  BlockEntry*& pEntry = *ppEntry;
 
-  ++pos;  // consume flags byte
-  assert(pos <= avail);
+  void* const buf = Allocate(sizeof(BlockGroup));
 
-  if (pos >= block_stop)
-    return E_FILE_FORMAT_INVALID;
+  if (buf == NULL)
+    return -1;  // generic error
 
-  const int lacing = int(flags & 0x06) >> 1;
+  BlockGroup* const p = new (buf)
+      BlockGroup(this, idx, bpos, bsize, prev, next, duration, discard_padding);
 
-  if ((lacing != 0) && (block_stop > avail)) {
-    len = static_cast<long>(block_stop - pos);
-    return E_BUFFER_NOT_FULL;
-  }
+  pEntry = p;
 
-  status = CreateBlock(0x23,  // simple block id
-                       block_start, block_size,
-                       0);  // DiscardPadding
+  const long status = p->Parse();
 
-  if (status != 0)
-    return status;
+  if (status == 0) {  // success
+    ++m_entries_count;
+    return 0;
+  }
 
-  m_pos = block_stop;
+  p->~BlockGroup();
+  pEntry = 0;
 
-  return 0;  // success
+  return status;
 }
 
-long Cluster::ParseBlockGroup(long long payload_size, long long& pos,
-                              long& len) {
-  const long long payload_start = pos;
-  const long long payload_stop = pos + payload_size;
-
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+long Cluster::CreateSimpleBlock(long long st, long long sz) {
+  assert(m_entries);
+  assert(m_entries_size > 0);
+  assert(m_entries_count >= 0);
+  assert(m_entries_count < m_entries_size);
 
-  long long total, avail;
+  const long idx = m_entries_count;
 
-  long status = pReader->Length(&total, &avail);
+  BlockEntry** const ppEntry = m_entries + idx;
+  BlockEntry*& pEntry = *ppEntry;
 
-  if (status < 0)  // error
-    return status;
+  void* const buf = Allocate(sizeof(SimpleBlock));
 
-  assert((total < 0) || (avail <= total));
+  if (buf == NULL)
+    return -1;  // generic error
 
-  if ((total >= 0) && (payload_stop > total))
-    return E_FILE_FORMAT_INVALID;
+  SimpleBlock* const p = new (buf) SimpleBlock(this, idx, st, sz);
 
-  if (payload_stop > avail) {
-    len = static_cast<long>(payload_size);
-    return E_BUFFER_NOT_FULL;
-  }
+  pEntry = p;
 
-  long long discard_padding = 0;
+  const long status = p->Parse();
 
-  while (pos < payload_stop) {
-    // parse sub-block element ID
+  if (status == 0) {
+    ++m_entries_count;
+    return 0;
+  }
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+  p->~SimpleBlock();
+  pEntry = 0;
 
-    long long result = GetUIntLength(pReader, pos, len);
+  return status;
+}
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+long Cluster::GetFirst(const BlockEntry*& pFirst) const {
+  if (m_entries_count <= 0) {
+    long long pos;
+    long len;
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+    const long status = Parse(pos, len);
 
-    if ((pos + len) > payload_stop)
-      return E_FILE_FORMAT_INVALID;
+    if (status < 0) {  // error
+      pFirst = NULL;
+      return status;
+    }
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+    if (m_entries_count <= 0) {  // empty cluster
+      pFirst = NULL;
+      return 0;
+    }
+  }
 
-    const long long id = ReadUInt(pReader, pos, len);
+  assert(m_entries);
 
-    if (id < 0)  // error
-      return static_cast<long>(id);
+  pFirst = m_entries[0];
+  assert(pFirst);
 
-    if (id == 0)  // not a value ID
-      return E_FILE_FORMAT_INVALID;
+  return 0;  // success
+}
 
-    pos += len;  // consume ID field
+long Cluster::GetLast(const BlockEntry*& pLast) const {
+  for (;;) {
+    long long pos;
+    long len;
 
-    // Parse Size
+    const long status = Parse(pos, len);
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
+    if (status < 0) {  // error
+      pLast = NULL;
+      return status;
     }
 
-    result = GetUIntLength(pReader, pos, len);
+    if (status > 0)  // no new block
+      break;
+  }
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+  if (m_entries_count <= 0) {
+    pLast = NULL;
+    return 0;
+  }
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+  assert(m_entries);
 
-    if ((pos + len) > payload_stop)
-      return E_FILE_FORMAT_INVALID;
+  const long idx = m_entries_count - 1;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+  pLast = m_entries[idx];
+  assert(pLast);
 
-    const long long size = ReadUInt(pReader, pos, len);
+  return 0;
+}
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+long Cluster::GetNext(const BlockEntry* pCurr, const BlockEntry*& pNext) const {
+  assert(pCurr);
+  assert(m_entries);
+  assert(m_entries_count > 0);
 
-    pos += len;  // consume size field
+  size_t idx = pCurr->GetIndex();
+  assert(idx < size_t(m_entries_count));
+  assert(m_entries[idx] == pCurr);
 
-    // pos now points to start of sub-block group payload
+  ++idx;
 
-    if (pos > payload_stop)
-      return E_FILE_FORMAT_INVALID;
+  if (idx >= size_t(m_entries_count)) {
+    long long pos;
+    long len;
 
-    if (size == 0)  // weird
-      continue;
+    const long status = Parse(pos, len);
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+    if (status < 0) {  // error
+      pNext = NULL;
+      return status;
+    }
 
-    if (size == unknown_size)
-      return E_FILE_FORMAT_INVALID;
+    if (status > 0) {
+      pNext = NULL;
+      return 0;
+    }
 
-    if (id == 0x35A2) {  // DiscardPadding
-      status = UnserializeInt(pReader, pos, size, discard_padding);
+    assert(m_entries);
+    assert(m_entries_count > 0);
+    assert(idx < size_t(m_entries_count));
+  }
 
-      if (status < 0)  // error
-        return status;
-    }
+  pNext = m_entries[idx];
+  assert(pNext);
 
-    if (id != 0x21) {  // sub-part of BlockGroup is not a Block
-      pos += size;  // consume sub-part of block group
+  return 0;
+}
 
-      if (pos > payload_stop)
-        return E_FILE_FORMAT_INVALID;
+long Cluster::GetEntryCount() const { return m_entries_count; }
 
-      continue;
-    }
+const BlockEntry* Cluster::GetEntry(const Track* pTrack,
+                                    long long time_ns) const {
+  assert(pTrack);
 
-    const long long block_stop = pos + size;
+  if (m_pSegment == NULL)  // this is the special EOS cluster
+    return pTrack->GetEOS();
 
-    if (block_stop > payload_stop)
-      return E_FILE_FORMAT_INVALID;
+#if 0
+
+    LoadBlockEntries();
 
-    // parse track number
+    if ((m_entries == NULL) || (m_entries_count <= 0))
+        return NULL;  //return EOS here?
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+    const BlockEntry* pResult = pTrack->GetEOS();
 
-    result = GetUIntLength(pReader, pos, len);
+    BlockEntry** i = m_entries;
+    assert(i);
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    BlockEntry** const j = i + m_entries_count;
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+    while (i != j)
+    {
+        const BlockEntry* const pEntry = *i++;
+        assert(pEntry);
+        assert(!pEntry->EOS());
 
-    if ((pos + len) > block_stop)
-      return E_FILE_FORMAT_INVALID;
+        const Block* const pBlock = pEntry->GetBlock();
+        assert(pBlock);
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+        if (pBlock->GetTrackNumber() != pTrack->GetNumber())
+            continue;
 
-    const long long track = ReadUInt(pReader, pos, len);
+        if (pTrack->VetEntry(pEntry))
+        {
+            if (time_ns < 0)  //just want first candidate block
+                return pEntry;
 
-    if (track < 0)  // error
-      return static_cast<long>(track);
+            const long long ns = pBlock->GetTime(this);
 
-    if (track == 0)
-      return E_FILE_FORMAT_INVALID;
+            if (ns > time_ns)
+                break;
 
-#if 0
-        //TODO(matthewjheaney)
-        //This turned out to be too conservative.  The problem is that
-        //if we see a track header in the tracks element with an unsupported
-        //track type, we throw that track header away, so it is not present
-        //in the track map.  But even though we don't understand the track
-        //header, there are still blocks in the cluster with that track
-        //number.  It was our decision to ignore that track header, so it's
-        //up to us to deal with blocks associated with that track -- we
-        //cannot simply report an error since technically there's nothing
-        //wrong with the file.
-        //
-        //For now we go ahead and finish the parse, creating a block entry
-        //for this block.  This is somewhat wasteful, because without a
-        //track header there's nothing you can do with the block. What
-        //we really need here is a special return value that indicates to
-        //the caller that he should ignore this particular block, and
-        //continue parsing.
+            pResult = pEntry;
+        }
+        else if (time_ns >= 0)
+        {
+            const long long ns = pBlock->GetTime(this);
 
-        const Tracks* const pTracks = m_pSegment->GetTracks();
-        assert(pTracks);
+            if (ns > time_ns)
+                break;
+        }
+    }
 
-        const long tn = static_cast<long>(track);
+    return pResult;
 
-        const Track* const pTrack = pTracks->GetTrackByNumber(tn);
+#else
 
-        if (pTrack == NULL)
-            return E_FILE_FORMAT_INVALID;
-#endif
+  const BlockEntry* pResult = pTrack->GetEOS();
 
-    pos += len;  // consume track number
+  long index = 0;
 
-    if ((pos + 2) > block_stop)
-      return E_FILE_FORMAT_INVALID;
+  for (;;) {
+    if (index >= m_entries_count) {
+      long long pos;
+      long len;
 
-    if ((pos + 2) > avail) {
-      len = 2;
-      return E_BUFFER_NOT_FULL;
-    }
+      const long status = Parse(pos, len);
+      assert(status >= 0);
 
-    pos += 2;  // consume timecode
+      if (status > 0)  // completely parsed, and no more entries
+        return pResult;
 
-    if ((pos + 1) > block_stop)
-      return E_FILE_FORMAT_INVALID;
+      if (status < 0)  // should never happen
+        return 0;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
+      assert(m_entries);
+      assert(index < m_entries_count);
     }
 
-    unsigned char flags;
+    const BlockEntry* const pEntry = m_entries[index];
+    assert(pEntry);
+    assert(!pEntry->EOS());
 
-    status = pReader->Read(pos, 1, &flags);
+    const Block* const pBlock = pEntry->GetBlock();
+    assert(pBlock);
 
-    if (status < 0) {  // error or underflow
-      len = 1;
-      return status;
+    if (pBlock->GetTrackNumber() != pTrack->GetNumber()) {
+      ++index;
+      continue;
     }
 
-    ++pos;  // consume flags byte
-    assert(pos <= avail);
+    if (pTrack->VetEntry(pEntry)) {
+      if (time_ns < 0)  // just want first candidate block
+        return pEntry;
 
-    if (pos >= block_stop)
-      return E_FILE_FORMAT_INVALID;
+      const long long ns = pBlock->GetTime(this);
 
-    const int lacing = int(flags & 0x06) >> 1;
+      if (ns > time_ns)
+        return pResult;
 
-    if ((lacing != 0) && (block_stop > avail)) {
-      len = static_cast<long>(block_stop - pos);
-      return E_BUFFER_NOT_FULL;
+      pResult = pEntry;  // have a candidate
+    } else if (time_ns >= 0) {
+      const long long ns = pBlock->GetTime(this);
+
+      if (ns > time_ns)
+        return pResult;
     }
 
-    pos = block_stop;  // consume block-part of block group
-    assert(pos <= payload_stop);
+    ++index;
   }
 
-  assert(pos == payload_stop);
-
-  status = CreateBlock(0x20,  // BlockGroup ID
-                       payload_start, payload_size, discard_padding);
-  if (status != 0)
-    return status;
-
-  m_pos = payload_stop;
-
-  return 0;  // success
+#endif
 }
 
-long Cluster::GetEntry(long index, const mkvparser::BlockEntry*& pEntry) const {
-  assert(m_pos >= m_element_start);
-
-  pEntry = NULL;
+const BlockEntry* Cluster::GetEntry(const CuePoint& cp,
+                                    const CuePoint::TrackPosition& tp) const {
+  assert(m_pSegment);
 
-  if (index < 0)
-    return -1;  // generic error
+#if 0
 
-  if (m_entries_count < 0)
-    return E_BUFFER_NOT_FULL;
+    LoadBlockEntries();
 
-  assert(m_entries);
-  assert(m_entries_size > 0);
-  assert(m_entries_count <= m_entries_size);
+    if (m_entries == NULL)
+        return NULL;
 
-  if (index < m_entries_count) {
-    pEntry = m_entries[index];
-    assert(pEntry);
+    const long long count = m_entries_count;
 
-    return 1;  // found entry
-  }
+    if (count <= 0)
+        return NULL;
 
-  if (m_element_size < 0)  // we don't know cluster end yet
-    return E_BUFFER_NOT_FULL;  // underflow
+    const long long tc = cp.GetTimeCode();
 
-  const long long element_stop = m_element_start + m_element_size;
+    if ((tp.m_block > 0) && (tp.m_block <= count))
+    {
+        const size_t block = static_cast<size_t>(tp.m_block);
+        const size_t index = block - 1;
 
-  if (m_pos >= element_stop)
-    return 0;  // nothing left to parse
+        const BlockEntry* const pEntry = m_entries[index];
+        assert(pEntry);
+        assert(!pEntry->EOS());
 
-  return E_BUFFER_NOT_FULL;  // underflow, since more remains to be parsed
-}
+        const Block* const pBlock = pEntry->GetBlock();
+        assert(pBlock);
 
-Cluster* Cluster::Create(Segment* pSegment, long idx, long long off)
-// long long element_size)
-{
-  assert(pSegment);
-  assert(off >= 0);
+        if ((pBlock->GetTrackNumber() == tp.m_track) &&
+            (pBlock->GetTimeCode(this) == tc))
+        {
+            return pEntry;
+        }
+    }
 
-  const long long element_start = pSegment->m_start + off;
+    const BlockEntry* const* i = m_entries;
+    const BlockEntry* const* const j = i + count;
 
-  Cluster* const pCluster = new Cluster(pSegment, idx, element_start);
-  // element_size);
-  assert(pCluster);
+    while (i != j)
+    {
+#ifdef _DEBUG
+        const ptrdiff_t idx = i - m_entries;
+        idx;
+#endif
 
-  return pCluster;
-}
+        const BlockEntry* const pEntry = *i++;
+        assert(pEntry);
+        assert(!pEntry->EOS());
 
-Cluster::Cluster()
-    : m_pSegment(NULL),
-      m_element_start(0),
-      m_index(0),
-      m_pos(0),
-      m_element_size(0),
-      m_timecode(0),
-      m_entries(NULL),
-      m_entries_size(0),
-      m_entries_count(0)  // means "no entries"
-{}
+        const Block* const pBlock = pEntry->GetBlock();
+        assert(pBlock);
 
-Cluster::Cluster(Segment* pSegment, long idx, long long element_start
-                 /* long long element_size */)
-    : m_pSegment(pSegment),
-      m_element_start(element_start),
-      m_index(idx),
-      m_pos(element_start),
-      m_element_size(-1 /* element_size */),
-      m_timecode(-1),
-      m_entries(NULL),
-      m_entries_size(0),
-      m_entries_count(-1)  // means "has not been parsed yet"
-{}
+        if (pBlock->GetTrackNumber() != tp.m_track)
+            continue;
 
-Cluster::~Cluster() {
-  if (m_entries_count <= 0)
-    return;
+        const long long tc_ = pBlock->GetTimeCode(this);
+        assert(tc_ >= 0);
 
-  BlockEntry** i = m_entries;
-  BlockEntry** const j = m_entries + m_entries_count;
+        if (tc_ < tc)
+            continue;
 
-  while (i != j) {
-    BlockEntry* p = *i++;
-    assert(p);
+        if (tc_ > tc)
+            return NULL;
 
-    delete p;
-  }
+        const Tracks* const pTracks = m_pSegment->GetTracks();
+        assert(pTracks);
 
-  delete[] m_entries;
-}
+        const long tn = static_cast<long>(tp.m_track);
+        const Track* const pTrack = pTracks->GetTrackByNumber(tn);
 
-bool Cluster::EOS() const { return (m_pSegment == NULL); }
+        if (pTrack == NULL)
+            return NULL;
 
-long Cluster::GetIndex() const { return m_index; }
+        const long long type = pTrack->GetType();
 
-long long Cluster::GetPosition() const {
-  const long long pos = m_element_start - m_pSegment->m_start;
-  assert(pos >= 0);
+        if (type == 2)  //audio
+            return pEntry;
 
-  return pos;
-}
+        if (type != 1)  //not video
+            return NULL;
 
-long long Cluster::GetElementSize() const { return m_element_size; }
+        if (!pBlock->IsKey())
+            return NULL;
 
-#if 0
-bool Cluster::HasBlockEntries(
-    const Segment* pSegment,
-    long long off) {
-    assert(pSegment);
-    assert(off >= 0);  //relative to start of segment payload
+        return pEntry;
+    }
 
-    IMkvReader* const pReader = pSegment->m_pReader;
+    return NULL;
 
-    long long pos = pSegment->m_start + off;  //absolute
-    long long size;
+#else
 
-    {
-        long len;
+  const long long tc = cp.GetTimeCode();
 
-        const long long id = ReadUInt(pReader, pos, len);
-        (void)id;
-        assert(id >= 0);
-        assert(id == 0x0F43B675);  //Cluster ID
+  if (tp.m_block > 0) {
+    const long block = static_cast<long>(tp.m_block);
+    const long index = block - 1;
 
-        pos += len;  //consume id
+    while (index >= m_entries_count) {
+      long long pos;
+      long len;
 
-        size = ReadUInt(pReader, pos, len);
-        assert(size > 0);
+      const long status = Parse(pos, len);
 
-        pos += len;  //consume size
+      if (status < 0)  // TODO: can this happen?
+        return NULL;
 
-        //pos now points to start of payload
+      if (status > 0)  // nothing remains to be parsed
+        return NULL;
     }
 
-    const long long stop = pos + size;
+    const BlockEntry* const pEntry = m_entries[index];
+    assert(pEntry);
+    assert(!pEntry->EOS());
 
-    while (pos < stop)
-    {
-        long len;
+    const Block* const pBlock = pEntry->GetBlock();
+    assert(pBlock);
 
-        const long long id = ReadUInt(pReader, pos, len);
-        assert(id >= 0);  //TODO
-        assert((pos + len) <= stop);
+    if ((pBlock->GetTrackNumber() == tp.m_track) &&
+        (pBlock->GetTimeCode(this) == tc)) {
+      return pEntry;
+    }
+  }
 
-        pos += len;  //consume id
+  long index = 0;
 
-        const long long size = ReadUInt(pReader, pos, len);
-        assert(size >= 0);  //TODO
-        assert((pos + len) <= stop);
+  for (;;) {
+    if (index >= m_entries_count) {
+      long long pos;
+      long len;
 
-        pos += len;  //consume size
+      const long status = Parse(pos, len);
 
-        if (id == 0x20)  //BlockGroup ID
-            return true;
+      if (status < 0)  // TODO: can this happen?
+        return NULL;
 
-        if (id == 0x23)  //SimpleBlock ID
-            return true;
+      if (status > 0)  // nothing remains to be parsed
+        return NULL;
 
-        pos += size;  //consume payload
-        assert(pos <= stop);
+      assert(m_entries);
+      assert(index < m_entries_count);
     }
 
-    return false;
-}
-#endif
+    const BlockEntry* const pEntry = m_entries[index];
+    assert(pEntry);
+    assert(!pEntry->EOS());
 
-long Cluster::HasBlockEntries(
-    const Segment* pSegment,
-    long long off,  // relative to start of segment payload
-    long long& pos, long& len) {
-  assert(pSegment);
-  assert(off >= 0);  // relative to segment
+    const Block* const pBlock = pEntry->GetBlock();
+    assert(pBlock);
 
-  IMkvReader* const pReader = pSegment->m_pReader;
+    if (pBlock->GetTrackNumber() != tp.m_track) {
+      ++index;
+      continue;
+    }
 
-  long long total, avail;
+    const long long tc_ = pBlock->GetTimeCode(this);
 
-  long status = pReader->Length(&total, &avail);
+    if (tc_ < tc) {
+      ++index;
+      continue;
+    }
 
-  if (status < 0)  // error
-    return status;
+    if (tc_ > tc)
+      return NULL;
 
-  assert((total < 0) || (avail <= total));
+    const Tracks* const pTracks = m_pSegment->GetTracks();
+    assert(pTracks);
 
-  pos = pSegment->m_start + off;  // absolute
+    const long tn = static_cast<long>(tp.m_track);
+    const Track* const pTrack = pTracks->GetTrackByNumber(tn);
 
-  if ((total >= 0) && (pos >= total))
-    return 0;  // we don't even have a complete cluster
+    if (pTrack == NULL)
+      return NULL;
 
-  const long long segment_stop =
-      (pSegment->m_size < 0) ? -1 : pSegment->m_start + pSegment->m_size;
+    const long long type = pTrack->GetType();
 
-  long long cluster_stop = -1;  // interpreted later to mean "unknown size"
+    if (type == 2)  // audio
+      return pEntry;
 
-  {
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+    if (type != 1)  // not video
+      return NULL;
 
-    long long result = GetUIntLength(pReader, pos, len);
+    if (!pBlock->IsKey())
+      return NULL;
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    return pEntry;
+  }
 
-    if (result > 0)  // need more data
-      return E_BUFFER_NOT_FULL;
+#endif
+}
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+#if 0
+const BlockEntry* Cluster::GetMaxKey(const VideoTrack* pTrack) const
+{
+    assert(pTrack);
 
-    if ((total >= 0) && ((pos + len) > total))
-      return 0;
+    if (m_pSegment == NULL)  //EOS
+        return pTrack->GetEOS();
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+    LoadBlockEntries();
 
-    const long long id = ReadUInt(pReader, pos, len);
+    if ((m_entries == NULL) || (m_entries_count <= 0))
+        return pTrack->GetEOS();
 
-    if (id < 0)  // error
-      return static_cast<long>(id);
+    BlockEntry** i = m_entries + m_entries_count;
+    BlockEntry** const j = m_entries;
 
-    if (id != 0x0F43B675)  // weird: not cluster ID
-      return -1;  // generic error
+    while (i != j)
+    {
+        const BlockEntry* const pEntry = *--i;
+        assert(pEntry);
+        assert(!pEntry->EOS());
 
-    pos += len;  // consume Cluster ID field
+        const Block* const pBlock = pEntry->GetBlock();
+        assert(pBlock);
 
-    // read size field
+        if (pBlock->GetTrackNumber() != pTrack->GetNumber())
+            continue;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
+        if (pBlock->IsKey())
+            return pEntry;
     }
 
-    result = GetUIntLength(pReader, pos, len);
+    return pTrack->GetEOS();  //no satisfactory block found
+}
+#endif
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+ClusterFrames::ClusterFrames()
+    : m_buf(NULL),
+      m_buf_size(0),
+      m_data(NULL),
+      m_frames(NULL),
+      m_frames_size(0),
+      m_count(0) {}
 
-    if (result > 0)  // weird
-      return E_BUFFER_NOT_FULL;
+ClusterFrames::~ClusterFrames() {
+  delete[] m_buf;
+  delete[] m_frames;
+}
 
-    if ((segment_stop >= 0) && ((pos + len) > segment_stop))
-      return E_FILE_FORMAT_INVALID;
+long ClusterFrames::Read(const Cluster* pCluster, long long track) {
+  m_data = NULL;
+  m_count = 0;
 
-    if ((total >= 0) && ((pos + len) > total))
-      return 0;
+  if ((pCluster == NULL) || pCluster->EOS())
+    return -1;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+  // Collect the frames first, with their absolute positions, to find the
+  // range that covers them all.
 
-    const long long size = ReadUInt(pReader, pos, len);
+  long long start = -1;
+  long long stop = -1;
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+  const BlockEntry* pEntry;
 
-    if (size == 0)
-      return 0;  // cluster does not have entries
+  long status = pCluster->GetFirst(pEntry);
 
-    pos += len;  // consume size field
+  if (status < 0)  // error
+    return status;
 
-    // pos now points to start of payload
+  while ((pEntry != NULL) && !pEntry->EOS()) {
+    const Block* const pBlock = pEntry->GetBlock();
+    assert(pBlock);
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+    if ((track <= 0) || (pBlock->GetTrackNumber() == track)) {
+      const int frame_count = pBlock->GetFrameCount();
 
-    if (size != unknown_size) {
-      cluster_stop = pos + size;
-      assert(cluster_stop >= 0);
+      for (int i = 0; i < frame_count; ++i) {
+        const Block::Frame& f = pBlock->GetFrame(i);
 
-      if ((segment_stop >= 0) && (cluster_stop > segment_stop))
-        return E_FILE_FORMAT_INVALID;
+        if (m_count >= m_frames_size) {
+          const long size = (m_frames_size <= 0) ? 256 : 2 * m_frames_size;
 
-      if ((total >= 0) && (cluster_stop > total))
-        // return E_FILE_FORMAT_INVALID;  //too conservative
-        return 0;  // cluster does not have any entries
-    }
-  }
+          Frame* const frames = new (std::nothrow) Frame[size];
 
-  for (;;) {
-    if ((cluster_stop >= 0) && (pos >= cluster_stop))
-      return 0;  // no entries detected
+          if (frames == NULL)
+            return -1;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
-    }
+          for (long k = 0; k < m_count; ++k)
+            frames[k] = m_frames[k];
 
-    long long result = GetUIntLength(pReader, pos, len);
+          delete[] m_frames;
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+          m_frames = frames;
+          m_frames_size = size;
+        }
 
-    if (result > 0)  // need more data
-      return E_BUFFER_NOT_FULL;
+        Frame& frame = m_frames[m_count++];
 
-    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
-      return E_FILE_FORMAT_INVALID;
+        frame.entry = pEntry;
+        frame.offset = f.pos;
+        frame.len = f.len;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+        if ((start < 0) || (f.pos < start))
+          start = f.pos;
 
-    const long long id = ReadUInt(pReader, pos, len);
+        if ((f.pos + f.len) > stop)
+          stop = f.pos + f.len;
+      }
+    }
 
-    if (id < 0)  // error
-      return static_cast<long>(id);
+    status = pCluster->GetNext(pEntry, pEntry);
 
-    // This is the distinguished set of ID's we use to determine
-    // that we have exhausted the sub-element's inside the cluster
-    // whose ID we parsed earlier.
+    if (status < 0)  // error
+      return status;
+  }
 
-    if (id == 0x0F43B675)  // Cluster ID
-      return 0;  // no entries found
+  if (m_count <= 0)
+    return 0;  // no frames
 
-    if (id == 0x0C53BB6B)  // Cues ID
-      return 0;  // no entries found
+  if ((stop - start) > LONG_MAX) {
+    m_count = 0;
+    return -1;
+  }
 
-    pos += len;  // consume id field
+  const long size = static_cast<long>(stop - start);
 
-    if ((cluster_stop >= 0) && (pos >= cluster_stop))
-      return E_FILE_FORMAT_INVALID;
+  IMkvReader* const pReader = pCluster->m_pSegment->m_pReader;
 
-    // read size field
+  if (pReader->GetSpan(start, size, &m_data) != 0) {
+    if (size > m_buf_size) {
+      delete[] m_buf;
 
-    if ((pos + 1) > avail) {
-      len = 1;
-      return E_BUFFER_NOT_FULL;
+      m_buf = new (std::nothrow) unsigned char[size];
+      m_buf_size = (m_buf == NULL) ? 0 : size;
+
+      if (m_buf == NULL) {
+        m_count = 0;
+        return -1;
+      }
     }
 
-    result = GetUIntLength(pReader, pos, len);
+    status = pReader->Read(start, size, m_buf);
 
-    if (result < 0)  // error
-      return static_cast<long>(result);
+    if (status != 0) {
+      m_data = NULL;
+      m_count = 0;
+      return (status < 0) ? status : E_BUFFER_NOT_FULL;
+    }
 
-    if (result > 0)  // underflow
-      return E_BUFFER_NOT_FULL;
+    m_data = m_buf;
+  }
 
-    if ((cluster_stop >= 0) && ((pos + len) > cluster_stop))
-      return E_FILE_FORMAT_INVALID;
+  for (long i = 0; i < m_count; ++i)
+    m_frames[i].offset -= start;
 
-    if ((pos + len) > avail)
-      return E_BUFFER_NOT_FULL;
+  return 0;  // success
+}
 
-    const long long size = ReadUInt(pReader, pos, len);
+long ClusterFrames::GetCount() const { return m_count; }
 
-    if (size < 0)  // error
-      return static_cast<long>(size);
+const ClusterFrames::Frame& ClusterFrames::GetFrame(long index) const {
+  assert(index >= 0);
+  assert(index < m_count);
 
-    pos += len;  // consume size field
+  return m_frames[index];
+}
 
-    // pos now points to start of payload
+const unsigned char* ClusterFrames::GetData() const { return m_data; }
 
-    if ((cluster_stop >= 0) && (pos > cluster_stop))
-      return E_FILE_FORMAT_INVALID;
+FrameCursor::FrameCursor(Segment* pSegment, long long track, bool release)
+    : m_pSegment(pSegment),
+      m_track(track),
+      m_release(release),
+      m_pCluster(NULL),
+      m_index(0) {}
 
-    if (size == 0)  // weird
-      continue;
+long FrameCursor::GetNextCluster(const Cluster* pCurr,
+                                 const Cluster*& pNext) {
+  for (;;) {
+    pNext = (pCurr == NULL) ? m_pSegment->GetFirst()
+                            : m_pSegment->GetNext(pCurr);
 
-    const long long unknown_size = (1LL << (7 * len)) - 1;
+    if (pNext == NULL)
+      return -1;
 
-    if (size == unknown_size)
-      return E_FILE_FORMAT_INVALID;  // not supported inside cluster
+    if (!pNext->EOS())
+      return 0;  // success
 
-    if ((cluster_stop >= 0) && ((pos + size) > cluster_stop))
-      return E_FILE_FORMAT_INVALID;
+    if (m_pSegment->DoneParsing())
+      return 1;  // no more clusters
 
-    if (id == 0x20)  // BlockGroup ID
-      return 1;  // have at least one entry
+    long long pos;
+    long len;
 
-    if (id == 0x23)  // SimpleBlock ID
-      return 1;  // have at least one entry
+    const long status = m_pSegment->LoadCluster(pos, len);
 
-    pos += size;  // consume payload
-    assert((cluster_stop < 0) || (pos <= cluster_stop));
+    if (status < 0)  // error, or underflow
+      return status;
+
+    if (status > 0)  // no more clusters
+      return 1;
   }
 }
 
-long long Cluster::GetTimeCode() const {
-  long long pos;
-  long len;
+long FrameCursor::Next(Frame& frame) {
+  if (m_pSegment == NULL)
+    return -1;
 
-  const long status = Load(pos, len);
+  while ((m_pCluster == NULL) || (m_index >= m_frames.GetCount())) {
+    const Cluster* pNext;
 
-  if (status < 0)  // error
-    return status;
+    long status = GetNextCluster(m_pCluster, pNext);
 
-  return m_timecode;
-}
+    if (status != 0)  // end of segment, error, or underflow
+      return status;
 
-long long Cluster::GetTime() const {
-  const long long tc = GetTimeCode();
+    status = m_frames.Read(pNext, m_track);
 
-  if (tc < 0)
-    return tc;
+    if (status < 0)  // error, or underflow
+      return status;
 
-  const SegmentInfo* const pInfo = m_pSegment->GetInfo();
-  assert(pInfo);
+    if (m_release && (m_pCluster != NULL))
+      m_pSegment->ReleaseCluster(m_pCluster);
 
-  const long long scale = pInfo->GetTimeCodeScale();
-  assert(scale >= 1);
+    m_pCluster = pNext;
+    m_index = 0;
 
-  const long long t = m_timecode * scale;
+    // Load the header of the next cluster, and have the reader fetch the
+    // rest of it ahead of time. This is only a hint, so errors (including
+    // underflow) are left for when the cursor gets there.
 
-  return t;
-}
+    const Cluster* pAhead;
 
-long long Cluster::GetFirstTime() const {
-  const BlockEntry* pEntry;
+    if (GetNextCluster(m_pCluster, pAhead) == 0) {
+      long long pos;
+      long len;
 
-  const long status = GetFirst(pEntry);
+      if (pAhead->Load(pos, len) == 0) {
+        const long long size = pAhead->GetElementSize();
 
-  if (status < 0)  // error
-    return status;
+        if ((size > 0) && (size <= LONG_MAX)) {
+          m_pSegment->m_pReader->Prefetch(pAhead->m_element_start,
+                                          static_cast<long>(size));
+        }
+      }
+    }
+  }
 
-  if (pEntry == NULL)  // empty cluster
-    return GetTime();
+  const ClusterFrames::Frame& f = m_frames.GetFrame(m_index++);
 
-  const Block* const pBlock = pEntry->GetBlock();
+  const Block* const pBlock = f.entry->GetBlock();
   assert(pBlock);
 
-  return pBlock->GetTime(this);
+  frame.track = pBlock->GetTrackNumber();
+  frame.time = pBlock->GetTime(m_pCluster);
+  frame.key = pBlock->IsKey();
+  frame.data = m_frames.GetData() + f.offset;
+  frame.len = f.len;
+  frame.entry = f.entry;
+
+  return 0;  // success
 }
 
-long long Cluster::GetLastTime() const {
-  const BlockEntry* pEntry;
+BlockEntry::BlockEntry(Cluster* p, long idx) : m_pCluster(p), m_index(idx) {}
 
-  const long status = GetLast(pEntry);
+BlockEntry::~BlockEntry() {}
 
-  if (status < 0)  // error
-    return status;
+bool BlockEntry::EOS() const { return (GetKind() == kBlockEOS); }
 
-  if (pEntry == NULL)  // empty cluster
-    return GetTime();
+const Cluster* BlockEntry::GetCluster() const { return m_pCluster; }
 
-  const Block* const pBlock = pEntry->GetBlock();
-  assert(pBlock);
+long BlockEntry::GetIndex() const { return m_index; }
 
-  return pBlock->GetTime(this);
-}
+SimpleBlock::SimpleBlock(Cluster* pCluster, long idx, long long start,
+                         long long size)
+    : BlockEntry(pCluster, idx), m_block(start, size, 0) {}
 
-long Cluster::CreateBlock(long long id,
-                          long long pos,  // absolute pos of payload
-                          long long size, long long discard_padding) {
-  assert((id == 0x20) || (id == 0x23));  // BlockGroup or SimpleBlock
+long SimpleBlock::Parse() { return m_block.Parse(m_pCluster); }
 
-  if (m_entries_count < 0) {  // haven't parsed anything yet
-    assert(m_entries == NULL);
-    assert(m_entries_size == 0);
+BlockEntry::Kind SimpleBlock::GetKind() const { return kBlockSimple; }
 
-    m_entries_size = 1024;
-    m_entries = new BlockEntry* [m_entries_size];
+const Block* SimpleBlock::GetBlock() const { return &m_block; }
 
-    m_entries_count = 0;
-  } else {
-    assert(m_entries);
-    assert(m_entries_size > 0);
-    assert(m_entries_count <= m_entries_size);
+BlockGroup::BlockGroup(Cluster* pCluster, long idx, long long block_start,
+                       long long block_size, long long prev, long long next,
+                       long long duration, long long discard_padding)
+    : BlockEntry(pCluster, idx),
+      m_block(block_start, block_size, discard_padding),
+      m_prev(prev),
+      m_next(next),
+      m_duration(duration) {}
 
-    if (m_entries_count >= m_entries_size) {
-      const long entries_size = 2 * m_entries_size;
+long BlockGroup::Parse() {
+  const long status = m_block.Parse(m_pCluster);
 
-      BlockEntry** const entries = new BlockEntry* [entries_size];
-      assert(entries);
+  if (status)
+    return status;
 
-      BlockEntry** src = m_entries;
-      BlockEntry** const src_end = src + m_entries_count;
+  m_block.SetKey((m_prev > 0) && (m_next <= 0));
 
-      BlockEntry** dst = entries;
+  return 0;
+}
 
-      while (src != src_end)
-        *dst++ = *src++;
+#if 0
+void BlockGroup::ParseBlock(long long start, long long size)
+{
+    IMkvReader* const pReader = m_pCluster->m_pSegment->m_pReader;
 
-      delete[] m_entries;
+    Block* const pBlock = new Block(start, size, pReader);
+    assert(pBlock);  //TODO
 
-      m_entries = entries;
-      m_entries_size = entries_size;
-    }
-  }
+    //TODO: the Matroska spec says you have multiple blocks within the
+    //same block group, with blocks ranked by priority (the flag bits).
 
-  if (id == 0x20)  // BlockGroup ID
-    return CreateBlockGroup(pos, size, discard_padding);
-  else  // SimpleBlock ID
-    return CreateSimpleBlock(pos, size);
+    assert(m_pBlock == NULL);
+    m_pBlock = pBlock;
 }
+#endif
 
-long Cluster::CreateBlockGroup(long long start_offset, long long size,
-                               long long discard_padding) {
-  assert(m_entries);
-  assert(m_entries_size > 0);
-  assert(m_entries_count >= 0);
-  assert(m_entries_count < m_entries_size);
+BlockEntry::Kind BlockGroup::GetKind() const { return kBlockGroup; }
 
-  IMkvReader* const pReader = m_pSegment->m_pReader;
+const Block* BlockGroup::GetBlock() const { return &m_block; }
 
-  long long pos = start_offset;
-  const long long stop = start_offset + size;
+long long BlockGroup::GetPrevTimeCode() const { return m_prev; }
 
-  // For WebM files, there is a bias towards previous reference times
-  //(in order to support alt-ref frames, which refer back to the previous
-  // keyframe).  Normally a 0 value is not possible, but here we tenatively
-  // allow 0 as the value of a reference frame, with the interpretation
-  // that this is a "previous" reference time.
+long long BlockGroup::GetNextTimeCode() const { return m_next; }
 
-  long long prev = 1;  // nonce
-  long long next = 0;  // nonce
-  long long duration = -1;  // really, this is unsigned
+long long BlockGroup::GetDurationTimeCode() const { return m_duration; }
 
-  long long bpos = -1;
-  long long bsize = -1;
+Block::Block(long long start, long long size_, long long discard_padding)
+    : m_start(start),
+      m_size(size_),
+      m_track(0),
+      m_frames(NULL),
+      m_frame_count(-1),
+      m_timecode(-1),
+      m_flags(0),
+      m_discard_padding(discard_padding) {}
 
-  while (pos < stop) {
-    long len;
-    const long long id = ReadUInt(pReader, pos, len);
-    assert(id >= 0);  // TODO
-    assert((pos + len) <= stop);
+Block::~Block() {}  // m_frames belongs to the cluster's arena
 
-    pos += len;  // consume ID
+long Block::Parse(const Cluster* pCluster) {
+  if (pCluster == NULL)
+    return -1;
 
-    const long long size = ReadUInt(pReader, pos, len);
-    assert(size >= 0);  // TODO
-    assert((pos + len) <= stop);
+  if (pCluster->m_pSegment == NULL)
+    return -1;
 
-    pos += len;  // consume size
+  assert(m_start >= 0);
+  assert(m_size >= 0);
+  assert(m_track <= 0);
+  assert(m_frame_count <= 0);
 
-    if (id == 0x21) {  // Block ID
-      if (bpos < 0) {  // Block ID
-        bpos = pos;
-        bsize = size;
-      }
-    } else if (id == 0x1B) {  // Duration ID
-      assert(size <= 8);
+  long long pos = m_start;
+  const long long stop = m_start + m_size;
+
+  long len;
+
+  IMkvReader* const pReader = pCluster->m_pSegment->m_pReader;
+
+  m_track = ReadUInt(pReader, pos, len);
 
-      duration = UnserializeUInt(pReader, pos, size);
-      assert(duration >= 0);  // TODO
-    } else if (id == 0x7B) {  // ReferenceBlock
-      assert(size <= 8);
-      const long size_ = static_cast<long>(size);
+  if (m_track <= 0)
+    return E_FILE_FORMAT_INVALID;
 
-      long long time;
+  if ((pos + len) > stop)
+    return E_FILE_FORMAT_INVALID;
 
-      long status = UnserializeInt(pReader, pos, size_, time);
-      assert(status == 0);
-      if (status != 0)
-        return -1;
+  pos += len;  // consume track number
 
-      if (time <= 0)  // see note above
-        prev = time;
-      else  // weird
-        next = time;
-    }
+  if ((stop - pos) < 2)
+    return E_FILE_FORMAT_INVALID;
 
-    pos += size;  // consume payload
-    assert(pos <= stop);
-  }
+  long status;
+  long long value;
 
-  assert(pos == stop);
-  assert(bpos >= 0);
-  assert(bsize >= 0);
+  status = UnserializeInt(pReader, pos, 2, value);
 
-  const long idx = m_entries_count;
+  if (status)
+    return E_FILE_FORMAT_INVALID;
 
-  BlockEntry** const ppEntry = m_entries + idx;
-  BlockEntry*& pEntry = *ppEntry;
+  if (value < SHRT_MIN)
+    return E_FILE_FORMAT_INVALID;
 
-  pEntry = new (std::nothrow)
-      BlockGroup(this, idx, bpos, bsize, prev, next, duration, discard_padding);
+  if (value > SHRT_MAX)
+    return E_FILE_FORMAT_INVALID;
 
-  if (pEntry == NULL)
-    return -1;  // generic error
+  m_timecode = static_cast<short>(value);
 
-  BlockGroup* const p = static_cast<BlockGroup*>(pEntry);
+  pos += 2;
 
-  const long status = p->Parse();
+  if ((stop - pos) <= 0)
+    return E_FILE_FORMAT_INVALID;
 
-  if (status == 0) {  // success
-    ++m_entries_count;
-    return 0;
-  }
+  status = pReader->Read(pos, 1, &m_flags);
 
-  delete pEntry;
-  pEntry = 0;
+  if (status)
+    return E_FILE_FORMAT_INVALID;
 
-  return status;
-}
+  const int lacing = int(m_flags & 0x06) >> 1;
 
-long Cluster::CreateSimpleBlock(long long st, long long sz) {
-  assert(m_entries);
-  assert(m_entries_size > 0);
-  assert(m_entries_count >= 0);
-  assert(m_entries_count < m_entries_size);
+  ++pos;  // consume flags byte
 
-  const long idx = m_entries_count;
+  if (lacing == 0) {  // no lacing
+    if (pos > stop)
+      return E_FILE_FORMAT_INVALID;
 
-  BlockEntry** const ppEntry = m_entries + idx;
-  BlockEntry*& pEntry = *ppEntry;
+    m_frame_count = 1;
 
-  pEntry = new (std::nothrow) SimpleBlock(this, idx, st, sz);
+    Frame& f = m_frame;
+    f.pos = pos;
 
-  if (pEntry == NULL)
-    return -1;  // generic error
+    const long long frame_size = stop - pos;
 
-  SimpleBlock* const p = static_cast<SimpleBlock*>(pEntry);
+    if (frame_size > LONG_MAX)
+      return E_FILE_FORMAT_INVALID;
 
-  const long status = p->Parse();
+    f.len = static_cast<long>(frame_size);
 
-  if (status == 0) {
-    ++m_entries_count;
-    return 0;
+    return 0;  // success
   }
 
-  delete pEntry;
-  pEntry = 0;
+  if (pos >= stop)
+    return E_FILE_FORMAT_INVALID;
 
-  return status;
-}
+  unsigned char biased_count;
 
-long Cluster::GetFirst(const BlockEntry*& pFirst) const {
-  if (m_entries_count <= 0) {
-    long long pos;
-    long len;
+  status = pReader->Read(pos, 1, &biased_count);
 
-    const long status = Parse(pos, len);
+  if (status)
+    return E_FILE_FORMAT_INVALID;
 
-    if (status < 0) {  // error
-      pFirst = NULL;
-      return status;
-    }
+  ++pos;  // consume frame count
+  assert(pos <= stop);
 
-    if (m_entries_count <= 0) {  // empty cluster
-      pFirst = NULL;
-      return 0;
-    }
-  }
+  m_frame_count = int(biased_count) + 1;
 
-  assert(m_entries);
+  Frame* frames = &m_frame;
 
-  pFirst = m_entries[0];
-  assert(pFirst);
+  if (m_frame_count > 1) {
+    frames = static_cast<Frame*>(
+        pCluster->Allocate(m_frame_count * sizeof(Frame)));
 
-  return 0;  // success
-}
+    if (frames == NULL)
+      return -1;
 
-long Cluster::GetLast(const BlockEntry*& pLast) const {
-  for (;;) {
-    long long pos;
-    long len;
+    m_frames = frames;
+  }
 
-    const long status = Parse(pos, len);
+  if (lacing == 1) {  // Xiph
+    Frame* pf = frames;
+    Frame* const pf_end = pf + m_frame_count;
 
-    if (status < 0) {  // error
-      pLast = NULL;
-      return status;
-    }
+    long size = 0;
+    int frame_count = m_frame_count;
 
-    if (status > 0)  // no new block
-      break;
-  }
+    LaceReader lace(pReader, pos, stop);
 
-  if (m_entries_count <= 0) {
-    pLast = NULL;
-    return 0;
-  }
+    while (frame_count > 1) {
+      long frame_size = 0;
 
-  assert(m_entries);
+      for (;;) {
+        long avail;
 
-  const long idx = m_entries_count - 1;
+        const unsigned char* const buf = lace.Peek(1, avail);
 
-  pLast = m_entries[idx];
-  assert(pLast);
+        if (buf == NULL)
+          return E_FILE_FORMAT_INVALID;
 
-  return 0;
-}
+        // Consume the run of 255 bytes that is buffered in one step.
 
-long Cluster::GetNext(const BlockEntry* pCurr, const BlockEntry*& pNext) const {
-  assert(pCurr);
-  assert(m_entries);
-  assert(m_entries_count > 0);
+        long n = 0;
 
-  size_t idx = pCurr->GetIndex();
-  assert(idx < size_t(m_entries_count));
-  assert(m_entries[idx] == pCurr);
+        while ((n < avail) && (buf[n] == 255))
+          ++n;
 
-  ++idx;
+        if ((255 * static_cast<long long>(n)) > (stop - pos - frame_size))
+          return E_FILE_FORMAT_INVALID;
 
-  if (idx >= size_t(m_entries_count)) {
-    long long pos;
-    long len;
+        frame_size += 255 * n;
 
-    const long status = Parse(pos, len);
+        if (n < avail) {
+          frame_size += buf[n];
+          lace.Skip(n + 1);  // consume xiph size bytes
+          break;
+        }
 
-    if (status < 0) {  // error
-      pNext = NULL;
-      return status;
-    }
+        lace.Skip(n);
+      }
 
-    if (status > 0) {
-      pNext = NULL;
-      return 0;
-    }
+      Frame& f = *pf++;
+      assert(pf < pf_end);
 
-    assert(m_entries);
-    assert(m_entries_count > 0);
-    assert(idx < size_t(m_entries_count));
-  }
+      f.pos = 0;  // patch later
 
-  pNext = m_entries[idx];
-  assert(pNext);
+      f.len = frame_size;
+      size += frame_size;  // contribution of this frame
 
-  return 0;
-}
+      --frame_count;
+    }
 
-long Cluster::GetEntryCount() const { return m_entries_count; }
+    pos = lace.GetPosition();
 
-const BlockEntry* Cluster::GetEntry(const Track* pTrack,
-                                    long long time_ns) const {
-  assert(pTrack);
+    assert(pf < pf_end);
+    assert(pos <= stop);
 
-  if (m_pSegment == NULL)  // this is the special EOS cluster
-    return pTrack->GetEOS();
+    {
+      Frame& f = *pf++;
 
-#if 0
+      if (pf != pf_end)
+        return E_FILE_FORMAT_INVALID;
 
-    LoadBlockEntries();
+      f.pos = 0;  // patch later
 
-    if ((m_entries == NULL) || (m_entries_count <= 0))
-        return NULL;  //return EOS here?
+      const long long total_size = stop - pos;
 
-    const BlockEntry* pResult = pTrack->GetEOS();
+      if (total_size < size)
+        return E_FILE_FORMAT_INVALID;
 
-    BlockEntry** i = m_entries;
-    assert(i);
+      const long long frame_size = total_size - size;
 
-    BlockEntry** const j = i + m_entries_count;
+      if (frame_size > LONG_MAX)
+        return E_FILE_FORMAT_INVALID;
 
-    while (i != j)
-    {
-        const BlockEntry* const pEntry = *i++;
-        assert(pEntry);
-        assert(!pEntry->EOS());
+      f.len = static_cast<long>(frame_size);
+    }
 
-        const Block* const pBlock = pEntry->GetBlock();
-        assert(pBlock);
+    pf = frames;
+    while (pf != pf_end) {
+      Frame& f = *pf++;
+      assert((pos + f.len) <= stop);
 
-        if (pBlock->GetTrackNumber() != pTrack->GetNumber())
-            continue;
+      f.pos = pos;
+      pos += f.len;
+    }
 
-        if (pTrack->VetEntry(pEntry))
-        {
-            if (time_ns < 0)  //just want first candidate block
-                return pEntry;
+    assert(pos == stop);
+  } else if (lacing == 2) {  // fixed-size lacing
+    const long long total_size = stop - pos;
 
-            const long long ns = pBlock->GetTime(this);
+    if ((total_size % m_frame_count) != 0)
+      return E_FILE_FORMAT_INVALID;
 
-            if (ns > time_ns)
-                break;
+    const long long frame_size = total_size / m_frame_count;
 
-            pResult = pEntry;
-        }
-        else if (time_ns >= 0)
-        {
-            const long long ns = pBlock->GetTime(this);
+    if (frame_size > LONG_MAX)
+      return E_FILE_FORMAT_INVALID;
+
+    Frame* pf = frames;
+    Frame* const pf_end = pf + m_frame_count;
+
+    while (pf != pf_end) {
+      assert((pos + frame_size) <= stop);
 
-            if (ns > time_ns)
-                break;
-        }
+      Frame& f = *pf++;
+
+      f.pos = pos;
+      f.len = static_cast<long>(frame_size);
+
+      pos += frame_size;
     }
 
-    return pResult;
+    assert(pos == stop);
+  } else {
+    assert(lacing == 3);  // EBML lacing
 
-#else
+    if (pos >= stop)
+      return E_FILE_FORMAT_INVALID;
 
-  const BlockEntry* pResult = pTrack->GetEOS();
+    // The sizes below describe a first and a last frame at least.
+    if (m_frame_count < 2)
+      return E_FILE_FORMAT_INVALID;
 
-  long index = 0;
+    long size = 0;
+    int frame_count = m_frame_count;
 
-  for (;;) {
-    if (index >= m_entries_count) {
-      long long pos;
-      long len;
+    LaceReader lace(pReader, pos, stop);
 
-      const long status = Parse(pos, len);
-      assert(status >= 0);
+    long long frame_size = lace.ReadVInt();
 
-      if (status > 0)  // completely parsed, and no more entries
-        return pResult;
+    if (frame_size < 0)
+      return E_FILE_FORMAT_INVALID;
 
-      if (status < 0)  // should never happen
-        return 0;
+    if (frame_size > LONG_MAX)
+      return E_FILE_FORMAT_INVALID;
 
-      assert(m_entries);
-      assert(index < m_entries_count);
-    }
+    pos = lace.GetPosition();  // consume length of size of first frame
 
-    const BlockEntry* const pEntry = m_entries[index];
-    assert(pEntry);
-    assert(!pEntry->EOS());
+    if ((pos + frame_size) > stop)
+      return E_FILE_FORMAT_INVALID;
 
-    const Block* const pBlock = pEntry->GetBlock();
-    assert(pBlock);
+    Frame* pf = frames;
+    Frame* const pf_end = pf + m_frame_count;
 
-    if (pBlock->GetTrackNumber() != pTrack->GetNumber()) {
-      ++index;
-      continue;
-    }
+    {
+      Frame& curr = *pf;
 
-    if (pTrack->VetEntry(pEntry)) {
-      if (time_ns < 0)  // just want first candidate block
-        return pEntry;
+      curr.pos = 0;  // patch later
 
-      const long long ns = pBlock->GetTime(this);
+      curr.len = static_cast<long>(frame_size);
+      size += curr.len;  // contribution of this frame
+    }
 
-      if (ns > time_ns)
-        return pResult;
+    --frame_count;
 
-      pResult = pEntry;  // have a candidate
-    } else if (time_ns >= 0) {
-      const long long ns = pBlock->GetTime(this);
+    while (frame_count > 1) {
+      if (pos >= stop)
+        return E_FILE_FORMAT_INVALID;
 
-      if (ns > time_ns)
-        return pResult;
-    }
+      assert(pf < pf_end);
 
-    ++index;
-  }
+      const Frame& prev = *pf++;
+      assert(prev.len == frame_size);
+      if (prev.len != frame_size)
+        return E_FILE_FORMAT_INVALID;
 
-#endif
-}
+      assert(pf < pf_end);
 
-const BlockEntry* Cluster::GetEntry(const CuePoint& cp,
-                                    const CuePoint::TrackPosition& tp) const {
-  assert(m_pSegment);
+      Frame& curr = *pf;
 
-#if 0
+      curr.pos = 0;  // patch later
 
-    LoadBlockEntries();
+      const long long delta_size_ = lace.ReadVInt();
 
-    if (m_entries == NULL)
-        return NULL;
+      if (delta_size_ < 0)
+        return E_FILE_FORMAT_INVALID;
 
-    const long long count = m_entries_count;
+      pos = lace.GetPosition();  // consume length of (delta) size
+      assert(pos <= stop);
 
-    if (count <= 0)
-        return NULL;
+      const int exp = 7 * lace.GetLength() - 1;
+      const long long bias = (1LL << exp) - 1LL;
+      const long long delta_size = delta_size_ - bias;
 
-    const long long tc = cp.GetTimeCode();
+      frame_size += delta_size;
 
-    if ((tp.m_block > 0) && (tp.m_block <= count))
-    {
-        const size_t block = static_cast<size_t>(tp.m_block);
-        const size_t index = block - 1;
+      if (frame_size < 0)
+        return E_FILE_FORMAT_INVALID;
 
-        const BlockEntry* const pEntry = m_entries[index];
-        assert(pEntry);
-        assert(!pEntry->EOS());
+      if (frame_size > LONG_MAX)
+        return E_FILE_FORMAT_INVALID;
 
-        const Block* const pBlock = pEntry->GetBlock();
-        assert(pBlock);
+      curr.len = static_cast<long>(frame_size);
+      size += curr.len;  // contribution of this frame
 
-        if ((pBlock->GetTrackNumber() == tp.m_track) &&
-            (pBlock->GetTimeCode(this) == tc))
-        {
-            return pEntry;
-        }
+      --frame_count;
     }
 
-    const BlockEntry* const* i = m_entries;
-    const BlockEntry* const* const j = i + count;
-
-    while (i != j)
     {
-#ifdef _DEBUG
-        const ptrdiff_t idx = i - m_entries;
-        idx;
-#endif
+      assert(pos <= stop);
+      assert(pf < pf_end);
 
-        const BlockEntry* const pEntry = *i++;
-        assert(pEntry);
-        assert(!pEntry->EOS());
+      const Frame& prev = *pf++;
+      assert(prev.len == frame_size);
+      if (prev.len != frame_size)
+        return E_FILE_FORMAT_INVALID;
 
-        const Block* const pBlock = pEntry->GetBlock();
-        assert(pBlock);
+      assert(pf < pf_end);
 
-        if (pBlock->GetTrackNumber() != tp.m_track)
-            continue;
+      Frame& curr = *pf++;
+      assert(pf == pf_end);
 
-        const long long tc_ = pBlock->GetTimeCode(this);
-        assert(tc_ >= 0);
+      curr.pos = 0;  // patch later
 
-        if (tc_ < tc)
-            continue;
+      const long long total_size = stop - pos;
 
-        if (tc_ > tc)
-            return NULL;
+      if (total_size < size)
+        return E_FILE_FORMAT_INVALID;
 
-        const Tracks* const pTracks = m_pSegment->GetTracks();
-        assert(pTracks);
+      frame_size = total_size - size;
 
-        const long tn = static_cast<long>(tp.m_track);
-        const Track* const pTrack = pTracks->GetTrackByNumber(tn);
+      if (frame_size > LONG_MAX)
+        return E_FILE_FORMAT_INVALID;
 
-        if (pTrack == NULL)
-            return NULL;
+      curr.len = static_cast<long>(frame_size);
+    }
 
-        const long long type = pTrack->GetType();
+    pf = frames;
+    while (pf != pf_end) {
+      Frame& f = *pf++;
+      assert((pos + f.len) <= stop);
 
-        if (type == 2)  //audio
-            return pEntry;
+      f.pos = pos;
+      pos += f.len;
+    }
 
-        if (type != 1)  //not video
-            return NULL;
+    assert(pos == stop);
+  }
 
-        if (!pBlock->IsKey())
-            return NULL;
+  return 0;  // success
+}
 
-        return pEntry;
-    }
+long long Block::GetTimeCode(const Cluster* pCluster) const {
+  if (pCluster == 0)
+    return m_timecode;
 
-    return NULL;
+  const long long tc0 = pCluster->GetTimeCode();
+  assert(tc0 >= 0);
 
-#else
+  const long long tc = tc0 + m_timecode;
 
-  const long long tc = cp.GetTimeCode();
+  return tc;  // unscaled timecode units
+}
 
-  if (tp.m_block > 0) {
-    const long block = static_cast<long>(tp.m_block);
-    const long index = block - 1;
+long long Block::GetTime(const Cluster* pCluster) const {
+  assert(pCluster);
 
-    while (index >= m_entries_count) {
-      long long pos;
-      long len;
+  const long long tc = GetTimeCode(pCluster);
 
-      const long status = Parse(pos, len);
+  const Segment* const pSegment = pCluster->m_pSegment;
+  const SegmentInfo* const pInfo = pSegment->GetInfo();
+  assert(pInfo);
 
-      if (status < 0)  // TODO: can this happen?
-        return NULL;
+  const long long scale = pInfo->GetTimeCodeScale();
+  assert(scale >= 1);
 
-      if (status > 0)  // nothing remains to be parsed
-        return NULL;
-    }
+  const long long ns = tc * scale;
 
-    const BlockEntry* const pEntry = m_entries[index];
-    assert(pEntry);
-    assert(!pEntry->EOS());
+  return ns;
+}
 
-    const Block* const pBlock = pEntry->GetBlock();
-    assert(pBlock);
+long long Block::GetTrackNumber() const { return m_track; }
 
-    if ((pBlock->GetTrackNumber() == tp.m_track) &&
-        (pBlock->GetTimeCode(this) == tc)) {
-      return pEntry;
-    }
-  }
+bool Block::IsKey() const {
+  return ((m_flags & static_cast<unsigned char>(1 << 7)) != 0);
+}
 
-  long index = 0;
+void Block::SetKey(bool bKey) {
+  if (bKey)
+    m_flags |= static_cast<unsigned char>(1 << 7);
+  else
+    m_flags &= 0x7F;
+}
 
-  for (;;) {
-    if (index >= m_entries_count) {
-      long long pos;
-      long len;
+bool Block::IsInvisible() const { return bool(int(m_flags & 0x08) != 0); }
+
+Block::Lacing Block::GetLacing() const {
+  const int value = int(m_flags & 0x06) >> 1;
+  return static_cast<Lacing>(value);
+}
+
+int Block::GetFrameCount() const { return m_frame_count; }
+
+const Block::Frame& Block::GetFrame(int idx) const {
+  assert(idx >= 0);
+  assert(idx < m_frame_count);
 
-      const long status = Parse(pos, len);
+  const Frame& f = (m_frame_count == 1) ? m_frame : m_frames[idx];
+  assert(f.pos > 0);
+  assert(f.len > 0);
 
-      if (status < 0)  // TODO: can this happen?
-        return NULL;
+  return f;
+}
 
-      if (status > 0)  // nothing remains to be parsed
-        return NULL;
+long Block::Frame::Read(IMkvReader* pReader, unsigned char* buf) const {
+  assert(pReader);
+  assert(buf);
 
-      assert(m_entries);
-      assert(index < m_entries_count);
-    }
+  const unsigned char* span;
 
-    const BlockEntry* const pEntry = m_entries[index];
-    assert(pEntry);
-    assert(!pEntry->EOS());
+  if (pReader->GetSpan(pos, len, &span) == 0) {
+    memcpy(buf, span, len);
+    return 0;
+  }
 
-    const Block* const pBlock = pEntry->GetBlock();
-    assert(pBlock);
+  const long status = pReader->Read(pos, len, buf);
+  return status;
+}
 
-    if (pBlock->GetTrackNumber() != tp.m_track) {
-      ++index;
-      continue;
-    }
+long Block::Frame::GetSpan(IMkvReader* pReader,
+                           const unsigned char*& buf) const {
+  assert(pReader);
 
-    const long long tc_ = pBlock->GetTimeCode(this);
+  buf = NULL;
 
-    if (tc_ < tc) {
-      ++index;
-      continue;
-    }
+  const long status = pReader->GetSpan(pos, len, &buf);
 
-    if (tc_ > tc)
-      return NULL;
+  if (status != 0)
+    buf = NULL;
 
-    const Tracks* const pTracks = m_pSegment->GetTracks();
-    assert(pTracks);
+  return status;
+}
 
-    const long tn = static_cast<long>(tp.m_track);
-    const Track* const pTrack = pTracks->GetTrackByNumber(tn);
+long long Block::GetDiscardPadding() const { return m_discard_padding; }
 
-    if (pTrack == NULL)
-      return NULL;
+StreamParser::Window::Window() : m_pos(0), m_data(NULL), m_len(0) {}
 
-    const long long type = pTrack->GetType();
+void StreamParser::Window::Set(long long pos, const unsigned char* data,
+                               long len) {
+  m_pos = pos;
+  m_data = data;
+  m_len = len;
+}
 
-    if (type == 2)  // audio
-      return pEntry;
+long long StreamParser::Window::GetStop() const { return m_pos + m_len; }
 
-    if (type != 1)  // not video
-      return NULL;
+int StreamParser::Window::Read(long long pos, long len, unsigned char* buf) {
+  const unsigned char* span;
 
-    if (!pBlock->IsKey())
-      return NULL;
+  const int status = GetSpan(pos, len, &span);
 
-    return pEntry;
-  }
+  if (status < 0)
+    return status;
 
-#endif
+  if (len > 0)
+    memcpy(buf, span, len);
+
+  return 0;  // success
 }
 
-#if 0
-const BlockEntry* Cluster::GetMaxKey(const VideoTrack* pTrack) const
-{
-    assert(pTrack);
+int StreamParser::Window::Length(long long* total, long long* available) {
+  if (total)
+    *total = -1;  // live stream
 
-    if (m_pSegment == NULL)  //EOS
-        return pTrack->GetEOS();
+  if (available)
+    *available = m_pos + m_len;
 
-    LoadBlockEntries();
+  return 0;
+}
 
-    if ((m_entries == NULL) || (m_entries_count <= 0))
-        return pTrack->GetEOS();
+int StreamParser::Window::GetSpan(long long pos, long len,
+                                  const unsigned char** buf) {
+  if ((pos < m_pos) || (len < 0) || ((pos - m_pos) > (m_len - len)))
+    return -1;  // consumed, or not yet written
 
-    BlockEntry** i = m_entries + m_entries_count;
-    BlockEntry** const j = m_entries;
+  *buf = m_data + (pos - m_pos);
+  return 0;  // success
+}
 
-    while (i != j)
-    {
-        const BlockEntry* const pEntry = *--i;
-        assert(pEntry);
-        assert(!pEntry->EOS());
+StreamParser::StreamParser(IMkvStreamHandler* pHandler, long max_buffer)
+    : m_pHandler(pHandler),
+      m_max_buffer(max_buffer),
+      m_state(kHeader),
+      m_status(0),
+      m_pos(0),
+      m_skip(0),
+      m_need(1),
+      m_buf(NULL),
+      m_buf_size(0),
+      m_buf_len(0),
+      m_pSegment(NULL),
+      m_segment_stop(-1),
+      m_started(false),
+      m_pCluster(NULL),
+      m_cluster_stop(-1),
+      m_cluster_count(0) {}
 
-        const Block* const pBlock = pEntry->GetBlock();
-        assert(pBlock);
+StreamParser::~StreamParser() {
+  delete m_pCluster;
+  delete m_pSegment;
+  delete[] m_buf;
+}
 
-        if (pBlock->GetTrackNumber() != pTrack->GetNumber())
-            continue;
+const Segment* StreamParser::GetSegment() const { return m_pSegment; }
 
-        if (pBlock->IsKey())
-            return pEntry;
-    }
+long long StreamParser::GetPosition() const { return m_pos; }
 
-    return pTrack->GetEOS();  //no satisfactory block found
-}
-#endif
+long StreamParser::Write(const unsigned char* data, long len) {
+  if (m_status < 0)
+    return m_status;
 
-BlockEntry::BlockEntry(Cluster* p, long idx) : m_pCluster(p), m_index(idx) {}
+  if ((data == NULL) && (len != 0))
+    return -1;
 
-BlockEntry::~BlockEntry() {}
+  while (len > 0) {
+    if (m_buf_len <= 0) {
+      // Parse in place, and buffer what remains of an incomplete element.
 
-bool BlockEntry::EOS() const { return (GetKind() == kBlockEOS); }
+      long consumed;
 
-const Cluster* BlockEntry::GetCluster() const { return m_pCluster; }
+      const long status = Parse(data, len, consumed);
 
-long BlockEntry::GetIndex() const { return m_index; }
+      if (status < 0) {
+        m_status = status;
+        return status;
+      }
 
-SimpleBlock::SimpleBlock(Cluster* pCluster, long idx, long long start,
-                         long long size)
-    : BlockEntry(pCluster, idx), m_block(start, size, 0) {}
+      data += consumed;
+      len -= consumed;
 
-long SimpleBlock::Parse() { return m_block.Parse(m_pCluster); }
+      if (len <= 0)
+        break;
 
-BlockEntry::Kind SimpleBlock::GetKind() const { return kBlockSimple; }
+      assert(len < m_need);
+    }
 
-const Block* SimpleBlock::GetBlock() const { return &m_block; }
+    // Add bytes to the buffer until it holds the m_need bytes required.
 
-BlockGroup::BlockGroup(Cluster* pCluster, long idx, long long block_start,
-                       long long block_size, long long prev, long long next,
-                       long long duration, long long discard_padding)
-    : BlockEntry(pCluster, idx),
-      m_block(block_start, block_size, discard_padding),
-      m_prev(prev),
-      m_next(next),
-      m_duration(duration) {}
+    if (m_need > m_buf_size) {
+      if (m_need > m_max_buffer) {
+        m_status = -1;  // element too large to buffer
+        return m_status;
+      }
 
-long BlockGroup::Parse() {
-  const long status = m_block.Parse(m_pCluster);
+      const long size = (m_need < 4096) ? 4096 : m_need;
 
-  if (status)
-    return status;
+      unsigned char* const buf = new (std::nothrow) unsigned char[size];
 
-  m_block.SetKey((m_prev > 0) && (m_next <= 0));
+      if (buf == NULL) {
+        m_status = -1;
+        return m_status;
+      }
 
-  return 0;
-}
+      if (m_buf_len > 0)
+        memcpy(buf, m_buf, m_buf_len);
 
-#if 0
-void BlockGroup::ParseBlock(long long start, long long size)
-{
-    IMkvReader* const pReader = m_pCluster->m_pSegment->m_pReader;
+      delete[] m_buf;
 
-    Block* const pBlock = new Block(start, size, pReader);
-    assert(pBlock);  //TODO
+      m_buf = buf;
+      m_buf_size = size;
+    }
 
-    //TODO: the Matroska spec says you have multiple blocks within the
-    //same block group, with blocks ranked by priority (the flag bits).
+    long n = m_need - m_buf_len;
 
-    assert(m_pBlock == NULL);
-    m_pBlock = pBlock;
-}
-#endif
+    if (n > len)
+      n = len;
 
-BlockEntry::Kind BlockGroup::GetKind() const { return kBlockGroup; }
+    memcpy(m_buf + m_buf_len, data, n);
+    m_buf_len += n;
 
-const Block* BlockGroup::GetBlock() const { return &m_block; }
+    data += n;
+    len -= n;
 
-long long BlockGroup::GetPrevTimeCode() const { return m_prev; }
+    if (m_buf_len < m_need)
+      break;
 
-long long BlockGroup::GetNextTimeCode() const { return m_next; }
+    long consumed;
 
-long long BlockGroup::GetDurationTimeCode() const { return m_duration; }
+    const long status = Parse(m_buf, m_buf_len, consumed);
 
-Block::Block(long long start, long long size_, long long discard_padding)
-    : m_start(start),
-      m_size(size_),
-      m_track(0),
-      m_timecode(-1),
-      m_flags(0),
-      m_frames(NULL),
-      m_frame_count(-1),
-      m_discard_padding(discard_padding) {}
+    if (status < 0) {
+      m_status = status;
+      return status;
+    }
 
-Block::~Block() { delete[] m_frames; }
+    m_buf_len -= consumed;
 
-long Block::Parse(const Cluster* pCluster) {
-  if (pCluster == NULL)
-    return -1;
+    if (m_buf_len > 0)
+      memmove(m_buf, m_buf + consumed, m_buf_len);
+  }
 
-  if (pCluster->m_pSegment == NULL)
-    return -1;
+  return 0;  // success
+}
 
-  assert(m_start >= 0);
-  assert(m_size >= 0);
-  assert(m_track <= 0);
-  assert(m_frames == NULL);
-  assert(m_frame_count <= 0);
+long StreamParser::Finish() {
+  if (m_status < 0)
+    return m_status;
 
-  long long pos = m_start;
-  const long long stop = m_start + m_size;
+  if ((m_state == kCluster) && (m_cluster_stop < 0) && (m_skip <= 0) &&
+      (m_buf_len <= 0)) {
+    m_pCluster->m_element_size = m_pos - m_pCluster->m_element_start;
 
-  long len;
+    const long status = EndCluster();
 
-  IMkvReader* const pReader = pCluster->m_pSegment->m_pReader;
+    if (status < 0) {
+      m_status = status;
+      return status;
+    }
 
-  m_track = ReadUInt(pReader, pos, len);
+    m_state = kSegment;
+  }
 
-  if (m_track <= 0)
-    return E_FILE_FORMAT_INVALID;
+  if (((m_state != kSegment) && (m_state != kDone)) || (m_skip > 0) ||
+      (m_buf_len > 0)) {
+    return E_BUFFER_NOT_FULL;
+  }
 
-  if ((pos + len) > stop)
-    return E_FILE_FORMAT_INVALID;
+  return 0;  // success
+}
 
-  pos += len;  // consume track number
+long StreamParser::Parse(const unsigned char* data, long len,
+                         long& consumed) {
+  const long long start = m_pos;
 
-  if ((stop - pos) < 2)
-    return E_FILE_FORMAT_INVALID;
+  m_window.Set(start, data, len);
 
   long status;
-  long long value;
 
-  status = UnserializeInt(pReader, pos, 2, value);
+  do
+    status = ParseNext();
+  while (status == 0);
 
-  if (status)
-    return E_FILE_FORMAT_INVALID;
+  m_window.Set(m_pos, NULL, 0);
 
-  if (value < SHRT_MIN)
-    return E_FILE_FORMAT_INVALID;
+  consumed = static_cast<long>(m_pos - start);
 
-  if (value > SHRT_MAX)
-    return E_FILE_FORMAT_INVALID;
+  return (status < 0) ? status : 0;
+}
 
-  m_timecode = static_cast<short>(value);
+long StreamParser::NeedBytes(long long size) {
+  if ((m_pos + size) <= m_window.GetStop())
+    return 0;
 
-  pos += 2;
+  if (size > m_max_buffer)
+    return -1;  // element too large to buffer
 
-  if ((stop - pos) <= 0)
-    return E_FILE_FORMAT_INVALID;
+  m_need = static_cast<long>(size);
+  return 1;  // need more data
+}
 
-  status = pReader->Read(pos, 1, &m_flags);
+long StreamParser::ParseHeader(long long& id, long long& size, long& len) {
+  long long pos = m_pos;
 
-  if (status)
-    return E_FILE_FORMAT_INVALID;
+  for (int field = 0; field < 2; ++field) {
+    long status = NeedBytes(pos + 1 - m_pos);
 
-  const int lacing = int(m_flags & 0x06) >> 1;
+    if (status)
+      return status;
 
-  ++pos;  // consume flags byte
+    long n;
 
-  if (lacing == 0) {  // no lacing
-    if (pos > stop)
-      return E_FILE_FORMAT_INVALID;
+    const long long result = GetUIntLength(&m_window, pos, n);
 
-    m_frame_count = 1;
-    m_frames = new Frame[m_frame_count];
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-    Frame& f = m_frames[0];
-    f.pos = pos;
+    status = NeedBytes(pos + n - m_pos);
 
-    const long long frame_size = stop - pos;
+    if (status)
+      return status;
 
-    if (frame_size > LONG_MAX)
-      return E_FILE_FORMAT_INVALID;
+    const long long value = ReadUInt(&m_window, pos, n);
 
-    f.len = static_cast<long>(frame_size);
+    if (value < 0)  // error
+      return static_cast<long>(value);
 
-    return 0;  // success
+    if (field == 0) {
+      if (value == 0)  // not a valid ID
+        return E_FILE_FORMAT_INVALID;
+
+      id = value;
+    } else {
+      const long long unknown_size = (1LL << (7 * n)) - 1;
+      size = (value == unknown_size) ? -1 : value;
+    }
+
+    pos += n;
   }
 
-  if (pos >= stop)
-    return E_FILE_FORMAT_INVALID;
+  len = static_cast<long>(pos - m_pos);
+  return 0;
+}
 
-  unsigned char biased_count;
+long StreamParser::ParseNext() {
+  if (m_skip > 0) {
+    const long long avail = m_window.GetStop() - m_pos;
 
-  status = pReader->Read(pos, 1, &biased_count);
+    if (avail <= 0) {
+      m_need = 1;
+      return 1;  // need more data
+    }
 
-  if (status)
-    return E_FILE_FORMAT_INVALID;
+    const long long n = (m_skip < avail) ? m_skip : avail;
 
-  ++pos;  // consume frame count
-  assert(pos <= stop);
+    m_pos += n;
+    m_skip -= n;
 
-  m_frame_count = int(biased_count) + 1;
+    return 0;
+  }
 
-  m_frames = new Frame[m_frame_count];
-  assert(m_frames);
+  if (m_state == kSegment)
+    return ParseSegmentElement();
 
-  if (lacing == 1) {  // Xiph
-    Frame* pf = m_frames;
-    Frame* const pf_end = pf + m_frame_count;
+  if (m_state == kCluster)
+    return ParseClusterElement();
 
-    long size = 0;
-    int frame_count = m_frame_count;
+  if (m_state == kDone) {  // ignore anything after the segment
+    m_pos = m_window.GetStop();
+    m_need = 1;
 
-    while (frame_count > 1) {
-      long frame_size = 0;
+    return 1;  // need more data
+  }
 
-      for (;;) {
-        unsigned char val;
+  long long id, size;
+  long len;
+
+  long status = ParseHeader(id, size, len);
 
-        if (pos >= stop)
-          return E_FILE_FORMAT_INVALID;
+  if (status)
+    return status;
 
-        status = pReader->Read(pos, 1, &val);
+  if (m_state == kHeader) {
+    if ((m_pos != 0) || (id != 0x0A45DFA3) || (size < 0))  // EBML Header ID
+      return E_FILE_FORMAT_INVALID;
 
-        if (status)
-          return E_FILE_FORMAT_INVALID;
+    status = NeedBytes(len + size);
 
-        ++pos;  // consume xiph size byte
+    if (status)
+      return status;
 
-        frame_size += val;
+    EBMLHeader header;
+    long long pos;
 
-        if (val < 255)
-          break;
-      }
+    const long long result = header.Parse(&m_window, pos);
 
-      Frame& f = *pf++;
-      assert(pf < pf_end);
+    if (result < 0)  // error
+      return static_cast<long>(result);
 
-      f.pos = 0;  // patch later
+    if ((result > 0) || (pos != (len + size)))
+      return E_FILE_FORMAT_INVALID;
 
-      f.len = frame_size;
-      size += frame_size;  // contribution of this frame
+    m_pos = pos;
+    m_state = kSegmentHeader;
 
-      --frame_count;
-    }
+    return 0;
+  }
 
-    assert(pf < pf_end);
-    assert(pos <= stop);
+  assert(m_state == kSegmentHeader);
 
-    {
-      Frame& f = *pf++;
+  if (id != 0x08538067) {  // not Segment ID
+    if (size < 0)
+      return E_FILE_FORMAT_INVALID;
 
-      if (pf != pf_end)
-        return E_FILE_FORMAT_INVALID;
+    m_pos += len;
+    m_skip = size;  // skip top-level element
 
-      f.pos = 0;  // patch later
+    return 0;
+  }
 
-      const long long total_size = stop - pos;
+  const long long start = m_pos + len;
 
-      if (total_size < size)
-        return E_FILE_FORMAT_INVALID;
+  m_pSegment = new (std::nothrow) Segment(&m_window, m_pos, start, size);
 
-      const long long frame_size = total_size - size;
+  if (m_pSegment == NULL)
+    return -1;
 
-      if (frame_size > LONG_MAX)
-        return E_FILE_FORMAT_INVALID;
+  m_segment_stop = (size < 0) ? -1 : start + size;
 
-      f.len = static_cast<long>(frame_size);
-    }
+  m_pos = start;
+  m_state = kSegment;
 
-    pf = m_frames;
-    while (pf != pf_end) {
-      Frame& f = *pf++;
-      assert((pos + f.len) <= stop);
+  return 0;
+}
 
-      f.pos = pos;
-      pos += f.len;
-    }
+long StreamParser::ParseSegmentElement() {
+  if ((m_segment_stop >= 0) && (m_pos >= m_segment_stop)) {
+    m_state = kDone;
+    return 0;
+  }
 
-    assert(pos == stop);
-  } else if (lacing == 2) {  // fixed-size lacing
-    const long long total_size = stop - pos;
+  long long id, size;
+  long len;
 
-    if ((total_size % m_frame_count) != 0)
-      return E_FILE_FORMAT_INVALID;
+  long status = ParseHeader(id, size, len);
 
-    const long long frame_size = total_size / m_frame_count;
+  if (status)
+    return status;
 
-    if (frame_size > LONG_MAX)
-      return E_FILE_FORMAT_INVALID;
+  const long long element_start = m_pos;
+  const long long start = m_pos + len;
 
-    Frame* pf = m_frames;
-    Frame* const pf_end = pf + m_frame_count;
+  if ((m_segment_stop >= 0) && (size >= 0) &&
+      ((start + size) > m_segment_stop)) {
+    return E_FILE_FORMAT_INVALID;
+  }
 
-    while (pf != pf_end) {
-      assert((pos + frame_size) <= stop);
+  if (id == 0x0F43B675) {  // Cluster ID
+    if (!m_started) {
+      if ((m_pSegment->m_pInfo == NULL) || (m_pSegment->m_pTracks == NULL))
+        return E_FILE_FORMAT_INVALID;
 
-      Frame& f = *pf++;
+      m_started = true;
 
-      f.pos = pos;
-      f.len = static_cast<long>(frame_size);
+      status = m_pHandler->OnSegment(m_pSegment);
 
-      pos += frame_size;
+      if (status < 0)
+        return status;
     }
 
-    assert(pos == stop);
-  } else {
-    assert(lacing == 3);  // EBML lacing
-
-    if (pos >= stop)
-      return E_FILE_FORMAT_INVALID;
+    m_pCluster = new (std::nothrow)
+        Cluster(m_pSegment, m_cluster_count, element_start);
 
-    long size = 0;
-    int frame_count = m_frame_count;
+    if (m_pCluster == NULL)
+      return -1;
 
-    long long frame_size = ReadUInt(pReader, pos, len);
+    if (size >= 0)
+      m_pCluster->m_element_size = len + size;
 
-    if (frame_size < 0)
-      return E_FILE_FORMAT_INVALID;
+    m_cluster_stop = (size < 0) ? -1 : start + size;
 
-    if (frame_size > LONG_MAX)
-      return E_FILE_FORMAT_INVALID;
+    m_pos = start;
+    m_state = kCluster;
 
-    if ((pos + len) > stop)
-      return E_FILE_FORMAT_INVALID;
+    return 0;
+  }
 
-    pos += len;  // consume length of size of first frame
+  if (size < 0)
+    return E_FILE_FORMAT_INVALID;
 
-    if ((pos + frame_size) > stop)
-      return E_FILE_FORMAT_INVALID;
+  const bool parse = !m_started && ((id == 0x0549A966) ||  // Segment Info ID
+                                    (id == 0x0654AE6B) ||  // Tracks ID
+                                    (id == 0x0043A770));  // Chapters ID
 
-    Frame* pf = m_frames;
-    Frame* const pf_end = pf + m_frame_count;
+  if (!parse) {
+    m_pos = start;
+    m_skip = size;  // consume payload without buffering it
 
-    {
-      Frame& curr = *pf;
+    return 0;
+  }
 
-      curr.pos = 0;  // patch later
+  // We read these elements either in total or nothing at all.
 
-      curr.len = static_cast<long>(frame_size);
-      size += curr.len;  // contribution of this frame
-    }
+  status = NeedBytes(len + size);
 
-    --frame_count;
+  if (status)
+    return status;
 
-    while (frame_count > 1) {
-      if (pos >= stop)
-        return E_FILE_FORMAT_INVALID;
+  const long long element_size = len + size;
 
-      assert(pf < pf_end);
+  if (id == 0x0549A966) {  // Segment Info ID
+    if (m_pSegment->m_pInfo)
+      return E_FILE_FORMAT_INVALID;
 
-      const Frame& prev = *pf++;
-      assert(prev.len == frame_size);
-      if (prev.len != frame_size)
-        return E_FILE_FORMAT_INVALID;
+    m_pSegment->m_pInfo = new (std::nothrow)
+        SegmentInfo(m_pSegment, start, size, element_start, element_size);
 
-      assert(pf < pf_end);
+    if (m_pSegment->m_pInfo == NULL)
+      return -1;
 
-      Frame& curr = *pf;
+    status = m_pSegment->m_pInfo->Parse();
+  } else if (id == 0x0654AE6B) {  // Tracks ID
+    if (m_pSegment->m_pTracks)
+      return E_FILE_FORMAT_INVALID;
 
-      curr.pos = 0;  // patch later
+    m_pSegment->m_pTracks = new (std::nothrow)
+        Tracks(m_pSegment, start, size, element_start, element_size);
 
-      const long long delta_size_ = ReadUInt(pReader, pos, len);
+    if (m_pSegment->m_pTracks == NULL)
+      return -1;
 
-      if (delta_size_ < 0)
-        return E_FILE_FORMAT_INVALID;
+    status = m_pSegment->m_pTracks->Parse();
+  } else if (m_pSegment->m_pChapters == NULL) {
+    m_pSegment->m_pChapters = new (std::nothrow)
+        Chapters(m_pSegment, start, size, element_start, element_size);
 
-      if ((pos + len) > stop)
-        return E_FILE_FORMAT_INVALID;
+    if (m_pSegment->m_pChapters == NULL)
+      return -1;
 
-      pos += len;  // consume length of (delta) size
-      assert(pos <= stop);
+    status = m_pSegment->m_pChapters->Parse();
+  }
 
-      const int exp = 7 * len - 1;
-      const long long bias = (1LL << exp) - 1LL;
-      const long long delta_size = delta_size_ - bias;
+  if (status)
+    return status;
 
-      frame_size += delta_size;
+  m_pos = start + size;  // consume payload
+  return 0;
+}
 
-      if (frame_size < 0)
-        return E_FILE_FORMAT_INVALID;
+long StreamParser::ParseClusterElement() {
+  if ((m_segment_stop >= 0) && (m_pos >= m_segment_stop))
+    m_pCluster->m_element_size = m_pos - m_pCluster->m_element_start;
 
-      if (frame_size > LONG_MAX)
-        return E_FILE_FORMAT_INVALID;
+  if ((m_pos - m_pCluster->m_element_start) == m_pCluster->m_element_size) {
+    const long status = EndCluster();
 
-      curr.len = static_cast<long>(frame_size);
-      size += curr.len;  // contribution of this frame
+    if (status < 0)
+      return status;
 
-      --frame_count;
-    }
+    m_state = kSegment;
+    return 0;
+  }
 
-    {
-      assert(pos <= stop);
-      assert(pf < pf_end);
+  long long id, size;
+  long len;
 
-      const Frame& prev = *pf++;
-      assert(prev.len == frame_size);
-      if (prev.len != frame_size)
-        return E_FILE_FORMAT_INVALID;
+  long status = ParseHeader(id, size, len);
 
-      assert(pf < pf_end);
+  if (status)
+    return status;
 
-      Frame& curr = *pf++;
-      assert(pf == pf_end);
+  if ((m_cluster_stop < 0) &&
+      ((id == 0x0F43B675) ||  // Cluster ID
+       (id == 0x0C53BB6B) ||  // Cues ID
+       (id == 0x0254C367) ||  // Tags ID
+       (id == 0x0549A966) ||  // Segment Info ID
+       (id == 0x0654AE6B) ||  // Tracks ID
+       (id == 0x014D9B74) ||  // SeekHead ID
+       (id == 0x0043A770) ||  // Chapters ID
+       (id == 0x0141A4E9))) {  // Attachments ID
+    // The next level 1 element ends a cluster of unknown size.
 
-      curr.pos = 0;  // patch later
+    m_pCluster->m_element_size = m_pos - m_pCluster->m_element_start;
 
-      const long long total_size = stop - pos;
+    status = EndCluster();
 
-      if (total_size < size)
-        return E_FILE_FORMAT_INVALID;
+    if (status < 0)
+      return status;
 
-      frame_size = total_size - size;
+    m_state = kSegment;
+    return 0;
+  }
 
-      if (frame_size > LONG_MAX)
-        return E_FILE_FORMAT_INVALID;
+  const long long start = m_pos + len;
 
-      curr.len = static_cast<long>(frame_size);
-    }
+  if (size < 0)
+    return E_FILE_FORMAT_INVALID;
 
-    pf = m_frames;
-    while (pf != pf_end) {
-      Frame& f = *pf++;
-      assert((pos + f.len) <= stop);
+  if ((m_cluster_stop >= 0) && ((start + size) > m_cluster_stop))
+    return E_FILE_FORMAT_INVALID;
 
-      f.pos = pos;
-      pos += f.len;
-    }
+  if (id == 0x67) {  // Timecode ID
+    status = NeedBytes(len + size);
 
-    assert(pos == stop);
-  }
+    if (status)
+      return status;
 
-  return 0;  // success
-}
+    if (m_pCluster->m_timecode < 0) {
+      const long long timecode = UnserializeUInt(&m_window, start, size);
 
-long long Block::GetTimeCode(const Cluster* pCluster) const {
-  if (pCluster == 0)
-    return m_timecode;
+      if (timecode < 0)  // error
+        return static_cast<long>(timecode);
 
-  const long long tc0 = pCluster->GetTimeCode();
-  assert(tc0 >= 0);
+      m_pCluster->m_timecode = timecode;
 
-  const long long tc = tc0 + m_timecode;
+      status = m_pHandler->OnCluster(m_pCluster);
 
-  return tc;  // unscaled timecode units
-}
+      if (status < 0)
+        return status;
+    }
+  } else if (((id == 0x20) || (id == 0x23)) && (size > 0)) {
+    // BlockGroup or SimpleBlock
 
-long long Block::GetTime(const Cluster* pCluster) const {
-  assert(pCluster);
+    if (m_pCluster->m_timecode < 0)  // no timecode found in cluster
+      return E_FILE_FORMAT_INVALID;
 
-  const long long tc = GetTimeCode(pCluster);
+    status = NeedBytes(len + size);
 
-  const Segment* const pSegment = pCluster->m_pSegment;
-  const SegmentInfo* const pInfo = pSegment->GetInfo();
-  assert(pInfo);
+    if (status)
+      return status;
 
-  const long long scale = pInfo->GetTimeCodeScale();
-  assert(scale >= 1);
+    long long pos = start;
+    long n;
 
-  const long long ns = tc * scale;
+    status = (id == 0x20) ? m_pCluster->ParseBlockGroup(size, pos, n)
+                          : m_pCluster->ParseSimpleBlock(size, pos, n);
 
-  return ns;
-}
+    if (status < 0)  // error
+      return (status == E_BUFFER_NOT_FULL) ? E_FILE_FORMAT_INVALID : status;
 
-long long Block::GetTrackNumber() const { return m_track; }
+    if (status == 0) {  // new entry
+      const long idx = m_pCluster->m_entries_count - 1;
 
-bool Block::IsKey() const {
-  return ((m_flags & static_cast<unsigned char>(1 << 7)) != 0);
-}
+      status = m_pHandler->OnBlock(m_pCluster, m_pCluster->m_entries[idx]);
 
-void Block::SetKey(bool bKey) {
-  if (bKey)
-    m_flags |= static_cast<unsigned char>(1 << 7);
-  else
-    m_flags &= 0x7F;
-}
+      if (status < 0)
+        return status;
+    }
+  } else {
+    m_pos = start;
+    m_skip = size;  // consume payload without buffering it
 
-bool Block::IsInvisible() const { return bool(int(m_flags & 0x08) != 0); }
+    return 0;
+  }
 
-Block::Lacing Block::GetLacing() const {
-  const int value = int(m_flags & 0x06) >> 1;
-  return static_cast<Lacing>(value);
+  m_pos = start + size;  // consume payload
+  return 0;
 }
 
-int Block::GetFrameCount() const { return m_frame_count; }
+long StreamParser::EndCluster() {
+  assert(m_pCluster);
 
-const Block::Frame& Block::GetFrame(int idx) const {
-  assert(idx >= 0);
-  assert(idx < m_frame_count);
+  if (m_pCluster->m_timecode < 0)  // no timecode found in cluster
+    return E_FILE_FORMAT_INVALID;
 
-  const Frame& f = m_frames[idx];
-  assert(f.pos > 0);
-  assert(f.len > 0);
+  const long status = m_pHandler->OnClusterEnd(m_pCluster);
 
-  return f;
-}
+  delete m_pCluster;
+  m_pCluster = NULL;
 
-long Block::Frame::Read(IMkvReader* pReader, unsigned char* buf) const {
-  assert(pReader);
-  assert(buf);
+  ++m_cluster_count;
 
-  const long status = pReader->Read(pos, len, buf);
-  return status;
+  return (status < 0) ? status : 0;
 }
 
-long long Block::GetDiscardPadding() const { return m_discard_padding; }
-
 }  // end namespace mkvparser
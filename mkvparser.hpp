@@ -23,10 +23,35 @@ class IMkvReader {
   virtual int Read(long long pos, long len, unsigned char* buf) = 0;
   virtual int Length(long long* total, long long* available) = 0;
 
+  // Optional zero-copy access. Readers backed by memory may override this to
+  // set |*buf| to their own storage for the |len| bytes at |pos| and return 0;
+  // the pointer must remain valid for the lifetime of that storage. The
+  // default implementation returns -1, which means the caller must use Read.
+  virtual int GetSpan(long long pos, long len, const unsigned char** buf);
+
+  // Hint that the |len| bytes at |pos| will be read soon, so that readers
+  // that can may start loading them in the background. The default
+  // implementation does nothing.
+  virtual void Prefetch(long long pos, long len);
+
  protected:
   virtual ~IMkvReader();
 };
 
+// Interface through which the parser runs independent tasks concurrently,
+// e.g. on the caller's thread pool.
+class IMkvTaskRunner {
+ public:
+  typedef void (*Task)(long index, void* context);
+
+  // Calls task(i, context) once for each i in [0, count), in any order and
+  // possibly concurrently, and returns when all of the calls have completed.
+  virtual void Run(Task task, void* context, long count) = 0;
+
+ protected:
+  virtual ~IMkvTaskRunner();
+};
+
 long long GetUIntLength(IMkvReader*, long long, long&);
 long long ReadUInt(IMkvReader*, long long, long&);
 long long UnserializeUInt(IMkvReader*, long long pos, long long size);
@@ -95,6 +120,11 @@ class Block {
     long len;
 
     long Read(IMkvReader*, unsigned char*) const;
+
+    // Sets |buf| to the frame data in the reader's own storage, without
+    // copying. Returns a nonzero value if the reader does not support
+    // IMkvReader::GetSpan, in which case the caller must use Read.
+    long GetSpan(IMkvReader*, const unsigned char*& buf) const;
   };
 
   const Frame& GetFrame(int frame_index) const;
@@ -103,11 +133,20 @@ class Block {
 
  private:
   long long m_track;  // Track::Number()
-  short m_timecode;  // relative to cluster
-  unsigned char m_flags;
 
-  Frame* m_frames;
+  // A block with a single frame (as nearly all unlaced blocks are) stores it
+  // inline, which saves allocating it separately; Block is no smaller than
+  // with a pointer alone, since the fields below fill the padding it had.
+  // Otherwise the frames are allocated from the arena of the cluster passed
+  // to Parse.
+  union {
+    Frame m_frame;  // m_frame_count == 1
+    Frame* m_frames;  // m_frame_count > 1
+  };
+
   int m_frame_count;
+  short m_timecode;  // relative to cluster
+  unsigned char m_flags;
 
  protected:
   const long long m_discard_padding;
@@ -294,6 +333,8 @@ class ContentEncoding {
 };
 
 class Track {
+  friend class Segment;
+
   Track(const Track&);
   Track& operator=(const Track&);
 
@@ -366,9 +407,42 @@ class Track {
 
   long ParseContentEncodingsEntry(long long start, long long size);
 
+  // Entry of the keyframe index of a track. The index of a video track holds
+  // its keyframes; since every block of other tracks is a seek target, their
+  // index holds the first of their blocks in each cluster. The index is built
+  // by Segment::BuildKeyframeIndex or Segment::SkimClusters, or installed by
+  // Segment::LoadSeekIndex, and it is extended by Seek with the clusters that
+  // have been parsed since. Clusters indexed by SkimClusters contribute at
+  // most their first block.
+  struct Keyframe {
+    long long time;  // ns
+    long cluster;  // index of the cluster in the segment
+    long block;  // index of the block entry in the cluster
+  };
+
+  // Returns the keyframe index, ordered by cluster and block, and sets
+  // |count| to the number of entries. Returns NULL if the index is empty.
+  const Keyframe* GetKeyframes(long& count) const;
+
+  // Stores in |entries| the blocks of this track from |pStart| (typically the
+  // keyframe returned by Seek for |time_ns|) up to the first block whose time
+  // is later than |time_ns|: the blocks to decode, in order, to present the
+  // frame at |time_ns|. At most |size| entries are stored; call with a NULL
+  // |entries| to query the count. Returns the number of blocks in the list,
+  // E_BUFFER_NOT_FULL if another cluster must be loaded first, or another
+  // negative value on error.
+  long GetDecodeList(const BlockEntry* pStart, long long time_ns,
+                     const BlockEntry** entries, long size) const;
+
  protected:
   Track(Segment*, long long element_start, long long element_size);
 
+  // Returns the last indexed block at or before |time_ns| in the clusters up
+  // to and including the one at index |cluster|, using the keyframe index.
+  // Returns NULL if the index does not cover those clusters completely, in
+  // which case the caller must scan the clusters instead.
+  const BlockEntry* FindKeyframe(long cluster, long long time_ns) const;
+
   Info m_info;
 
   class EOSBlock : public BlockEntry {
@@ -384,6 +458,18 @@ class Track {
  private:
   ContentEncoding** content_encoding_entries_;
   ContentEncoding** content_encoding_entries_end_;
+
+  // Appends |keyframe| to the keyframe index. Returns false if memory
+  // cannot be allocated.
+  bool AddKeyframe(const Keyframe& keyframe) const;
+
+  // Removes the entries of the keyframe index for the clusters at index
+  // |cluster| and above.
+  void TruncateKeyframes(long cluster) const;
+
+  mutable Keyframe* m_keyframes;
+  mutable long m_keyframes_count;
+  mutable long m_keyframes_size;
 };
 
 class VideoTrack : public Track {
@@ -757,6 +843,12 @@ class Cues {
   // long GetTotal() const;  //loaded + preloaded
   bool DoneParsing() const;
 
+  // Loads all remaining cue points, then builds a contiguous index of their
+  // times, and for each track, of their track positions. Find searches this
+  // index instead of the CuePoint objects once it has been built. Returns
+  // false if there are no cue points or memory cannot be allocated.
+  bool BuildIndex() const;
+
  private:
   void Init() const;
   void PreloadCuePoint(long&, long long) const;
@@ -765,10 +857,21 @@ class Cues {
   mutable long m_count;
   mutable long m_preload_count;
   mutable long long m_pos;
+
+  // The index built by BuildIndex, stored column-wise. Entry k of each
+  // column corresponds to m_cue_points[k].
+  mutable long long* m_index_times;  // ns, ascending
+  mutable long long* m_index_tracks;  // track numbers, one per column below
+  mutable const CuePoint::TrackPosition** m_index_positions;  // or NULL
+  mutable long m_index_count;  // entries per column
+  mutable long m_index_track_count;
 };
 
 class Cluster {
   friend class Segment;
+  friend class Block;
+  friend class Track;
+  friend class StreamParser;
 
   Cluster(const Cluster&);
   Cluster& operator=(const Cluster&);
@@ -837,6 +940,39 @@ class Cluster {
   mutable long m_entries_size;
   mutable long m_entries_count;
 
+  // Position just beyond the timecode payload, where parsing of block
+  // entries begins; set by Load.
+  mutable long long m_entries_start;
+
+  // The block entries, the entry array and the block frames of a cluster are
+  // allocated from a per-cluster arena: a list of chunks from which memory is
+  // carved sequentially, and which is freed all at once.
+  struct ArenaChunk;
+  mutable ArenaChunk* m_arena;
+
+  // Returns |size| bytes from the arena, suitably aligned for any of the
+  // objects above, or NULL if memory cannot be allocated.
+  void* Allocate(size_t size) const;
+
+  // Frees the block entries and returns the cluster to its loaded but
+  // unparsed state.
+  void ReleaseEntries() const;
+
+  // Reads the header of the first block of the (loaded) cluster that passes
+  // the track filter, skipping all payloads: its track number, its timecode
+  // relative to the cluster, and whether it is a keyframe. Returns 0 on
+  // success, 1 if the cluster has no blocks, E_BUFFER_NOT_FULL (with |pos|
+  // and |len| set as for Load) if more data is needed, or another negative
+  // value on error.
+  long SkimFirstBlock(long long& track, long long& timecode, bool& key,
+                      long long& pos, long& len) const;
+
+  // Whether only the first block of the cluster is in the keyframe indexes,
+  // as added by Segment::SkimClusters.
+  mutable bool m_skimmed;
+
+  // These return 0 once an entry has been created for the block, or 1 if the
+  // block was skipped by the segment's track filter.
   long ParseSimpleBlock(long long, long long&, long&);
   long ParseBlockGroup(long long, long long&, long&);
 
@@ -847,10 +983,96 @@ class Cluster {
   long CreateSimpleBlock(long long, long long);
 };
 
+// Reads the frames of a cluster with a single IMkvReader::Read covering all
+// of them, in place of one Block::Frame::Read per frame. The buffer is kept
+// and reused, growing as needed, when the object reads the next cluster.
+class ClusterFrames {
+  ClusterFrames(const ClusterFrames&);
+  ClusterFrames& operator=(const ClusterFrames&);
+
+ public:
+  struct Frame {
+    const BlockEntry* entry;  // block holding the frame
+    long long offset;  // of the frame data, relative to GetData()
+    long len;
+  };
+
+  ClusterFrames();
+  ~ClusterFrames();
+
+  // Parses |pCluster| and reads the frames of its blocks, in block order, or
+  // only those of track number |track| if it is positive. If the reader
+  // supports GetSpan, the frames are not copied. Returns 0 on success,
+  // E_BUFFER_NOT_FULL if the cluster is not available yet, or another
+  // negative value on error. The frames of the previous cluster become
+  // invalid.
+  long Read(const Cluster* pCluster, long long track = 0);
+
+  long GetCount() const;
+  const Frame& GetFrame(long index) const;
+  const unsigned char* GetData() const;
+
+ private:
+  unsigned char* m_buf;
+  long m_buf_size;
+  const unsigned char* m_data;
+  Frame* m_frames;
+  long m_frames_size;
+  long m_count;
+};
+
+// Forward iterator over the frames of a segment, across cluster boundaries.
+// The frames of each cluster are read at once, as by ClusterFrames. On
+// entering a cluster, the cursor loads the header of the next one and asks
+// the reader to prefetch it (see IMkvReader::Prefetch), so that its bytes
+// can arrive while the caller consumes the current cluster. Clusters are
+// loaded as needed, so the segment need not have been loaded beyond its
+// headers.
+class FrameCursor {
+  FrameCursor(const FrameCursor&);
+  FrameCursor& operator=(const FrameCursor&);
+
+ public:
+  struct Frame {
+    long long track;  // track number
+    long long time;  // ns
+    bool key;
+    const unsigned char* data;
+    long len;
+    const BlockEntry* entry;  // block holding the frame
+  };
+
+  // Iterates over the frames of |pSegment|, or only those of track number
+  // |track| if it is positive. If |release| is true, each cluster is
+  // released (see Segment::ReleaseCluster) once the cursor has left it.
+  explicit FrameCursor(Segment* pSegment, long long track = 0,
+                       bool release = false);
+
+  // Sets |frame| to the next frame, whose data remain valid until the
+  // cursor leaves its cluster. Returns 0 on success, 1 at the end of the
+  // segment, E_BUFFER_NOT_FULL if more data is needed (the call can be
+  // repeated), or another negative value on error.
+  long Next(Frame& frame);
+
+ private:
+  // Sets |pNext| to the loaded cluster after |pCurr|, or to the first one
+  // if |pCurr| is NULL, loading it if needed. Returns 0 on success, 1 if
+  // there are no more clusters, or a negative value as for LoadCluster.
+  long GetNextCluster(const Cluster* pCurr, const Cluster*& pNext);
+
+  Segment* const m_pSegment;
+  const long long m_track;
+  const bool m_release;
+  const Cluster* m_pCluster;
+  ClusterFrames m_frames;
+  long m_index;  // of the next frame in m_frames
+};
+
 class Segment {
   friend class Cues;
   friend class Track;
   friend class VideoTrack;
+  friend class StreamParser;
 
   Segment(const Segment&);
   Segment& operator=(const Segment&);
@@ -909,6 +1131,99 @@ class Segment {
 
   const Cluster* FindOrPreloadCluster(long long pos);
 
+  // Loads and fully parses the clusters at |positions| (offsets relative to
+  // the start of the segment payload, as found in Cues and the SeekHead),
+  // then adds them to the cluster index in position order. Clusters that
+  // directly follow the last loaded cluster become loaded (as if by
+  // LoadCluster); the others are preloaded, as by FindOrPreloadCluster.
+  // Clusters are parsed concurrently using |pRunner|, or on the
+  // calling thread if |pRunner| is NULL; in the former case the segment's
+  // reader must support concurrent calls (e.g. PreadMkvReader or
+  // MmapMkvReader), and the segment must not otherwise be used until this
+  // returns. Positions already in the index are ignored. If any cluster fails
+  // to parse, none is added and its status is returned; returns 0 on success.
+  long ParseClusters(const long long* positions, long count,
+                     IMkvTaskRunner* pRunner);
+
+  // Adds the blocks of the loaded clusters not yet covered to the tracks'
+  // keyframe indexes (see Track::Keyframe). This parses those clusters; the
+  // ones that had not been parsed before are released again afterwards.
+  // Returns 0 on success, or a negative value on error.
+  long BuildKeyframeIndex();
+
+  // Serializes a seek index for this segment: the offsets, sizes and
+  // timecodes of the loaded clusters, and the keyframe indexes of the tracks
+  // (building them first, as by BuildKeyframeIndex). The index is
+  // written to |buf| if it holds at least |size| bytes; call with a NULL
+  // |buf| to query the size. Returns the size of the index in bytes, or a
+  // negative value on error.
+  long long WriteSeekIndex(unsigned char* buf, long long size);
+
+  // Installs the seek index read from |pIndexReader|, which must have been
+  // written by WriteSeekIndex for this same file; the index records the file
+  // length and segment bounds, and is rejected if they differ. The indexed
+  // clusters are added as loaded clusters without reading them, and parsing
+  // (e.g. by LoadCluster) resumes after the last of them. Must be called
+  // after ParseHeaders and before any cluster has been loaded. Returns 0 on
+  // success, E_FILE_FORMAT_INVALID if the index is malformed, belongs to a
+  // different file or was written in an older format, or another negative
+  // value on error; the segment is unchanged unless 0 is returned.
+  long LoadSeekIndex(IMkvReader* pIndexReader);
+
+  // Restricts the block entries created when clusters are parsed to the
+  // blocks of the |count| tracks whose numbers are in |tracks|; the blocks of
+  // other tracks are skipped after reading their track number. Call with a
+  // NULL |tracks| to parse all tracks again. Clusters parsed before the call
+  // keep their entries. Block indexes, as in Track::Keyframe, count only the
+  // blocks that are parsed, so a seek index is only valid with the filter it
+  // was written with. Returns 0 on success, or -1 if memory cannot be
+  // allocated.
+  long SetTrackFilter(const long long* tracks, long count);
+
+  // Returns whether the blocks of |track| pass the track filter.
+  bool IsTrackParsed(long long track) const;
+
+  // Loads the remaining clusters of the segment reading only their headers:
+  // the ID and size, the Timecode, and the header of the first block; block
+  // payloads are skipped. The first block of each cluster is added to the
+  // keyframe index of its track (see Track::Keyframe), unless it is a video
+  // block that is not a keyframe. This makes a file seekable by cluster
+  // (FindCluster, Track::Seek, WriteSeekIndex) after reading a tiny part of
+  // it, whether or not it has Cues. A cluster of unknown size must still be
+  // parsed in full to find its end. Returns 0 once all clusters have been
+  // loaded, E_BUFFER_NOT_FULL (with |pos| and |len| set as for LoadCluster)
+  // if more data is needed, after which the call can be repeated, or another
+  // negative value on error.
+  long SkimClusters(long long& pos, long& len);
+
+  // Frees the block entries of |pCluster|, so that memory use stays bounded
+  // when streaming through a long file: call it for clusters the caller has
+  // moved past. The cluster itself remains in the index, for FindCluster,
+  // GetNext and Track::Seek, and its entries are parsed again if it is
+  // visited later. BlockEntry pointers obtained from the cluster become
+  // invalid. Returns 0 on success, or a negative value if |pCluster| does not
+  // belong to this segment, is still being parsed, or the segment is frozen.
+  long ReleaseCluster(const Cluster* pCluster);
+
+  // Loads and parses the entire segment: all clusters and their block
+  // entries, and all cue points, and builds the keyframe index (see
+  // Track::GetKeyframes) and the cue index (see Cues::BuildIndex). The
+  // segment is then frozen: it is never modified again, neither by its own
+  // functions nor by those of its clusters, cues, tracks and block entries,
+  // so any number of threads may seek and read it at once (GetNext,
+  // FindCluster, Track::Seek, Cluster::GetEntry, Cues::Find, and so on),
+  // provided that the reader supports concurrent calls (as PreadMkvReader
+  // and MmapMkvReader do, but MkvReader does not). Once frozen, functions
+  // that would change the segment (SetTrackFilter, ReleaseCluster,
+  // ParseClusters, and preloading clusters for cue points that do not match
+  // a cluster) fail instead. Returns 0 on success, E_BUFFER_NOT_FULL if the
+  // file is not yet complete, or another negative value on error; the call
+  // can be repeated until it succeeds.
+  long Freeze();
+
+  // Returns whether Freeze has completed.
+  bool IsFrozen() const;
+
   long ParseCues(long long cues_off,  // offset relative to start of segment
                  long long& parse_pos, long& parse_len);
 
@@ -926,6 +1241,25 @@ class Segment {
   long m_clusterPreloadCount;  // number of entries for which m_index < 0
   long m_clusterSize;  // array size
 
+  // number of leading loaded clusters covered by the tracks' keyframe indexes
+  long m_keyframeClusterCount;
+
+  // track numbers set by SetTrackFilter; all tracks are parsed if NULL
+  long long* m_trackFilter;
+  long m_trackFilterCount;
+
+  // set by Freeze, once the segment is completely parsed and indexed
+  bool m_frozen;
+
+  // Adds the blocks of the cluster at index m_keyframeClusterCount to the
+  // keyframe indexes, parsing the cluster as needed. On failure nothing is
+  // added.
+  long IndexNextCluster();
+
+  // Extends the keyframe indexes over the clusters that follow the covered
+  // ones and have been parsed completely. Does not read from the file.
+  void IndexParsedClusters();
+
   long DoLoadCluster(long long&, long&);
   long DoLoadClusterUnknownSize(long long&, long&);
   long DoParseNext(const Cluster*&, long long&, long&);
@@ -940,6 +1274,144 @@ class Segment {
   const BlockEntry* GetBlock(const CuePoint&, const CuePoint::TrackPosition&);
 };
 
+// Receives the elements parsed by StreamParser, as soon as each is complete.
+// A negative return value stops parsing, and is returned by
+// StreamParser::Write.
+class IMkvStreamHandler {
+ public:
+  // Called once, when the first cluster starts, after the segment's Info,
+  // Tracks and Chapters have been parsed. The handler may call
+  // Segment::SetTrackFilter here to choose the tracks it receives blocks of.
+  virtual long OnSegment(Segment* pSegment);
+
+  // Called when a cluster starts, once its timecode is known.
+  virtual long OnCluster(const Cluster* pCluster);
+
+  // Called for each block of the current cluster that passes the track
+  // filter. Until the call returns, the frame data can be read through the
+  // segment's reader, e.g. with Block::Frame::Read, or without copying with
+  // Block::Frame::GetSpan. |pEntry| remains valid until the cluster ends.
+  virtual long OnBlock(const Cluster* pCluster, const BlockEntry* pEntry) = 0;
+
+  // Called when the current cluster ends.
+  virtual long OnClusterEnd(const Cluster* pCluster);
+
+ protected:
+  virtual ~IMkvStreamHandler();
+};
+
+// Parser for live input that is pushed to it, rather than pulled through an
+// IMkvReader: the caller passes the bytes of the stream to Write as they
+// arrive, in chunks of any size, and the parser reports the segment headers,
+// clusters and blocks to a handler as each is completed. Every byte is
+// parsed once. Elements are parsed in place in the caller's chunk; only an
+// incomplete element at the end of a chunk is buffered, up to the limit
+// given to the constructor. Cues, SeekHead, Tags and other elements the
+// parser does not report are skipped without being buffered.
+//
+// The clusters passed to the handler are not part of the segment's cluster
+// index (they must not be passed to Segment::GetNext, for example), and only
+// their position, size and time may be queried.
+class StreamParser {
+  StreamParser(const StreamParser&);
+  StreamParser& operator=(const StreamParser&);
+
+ public:
+  enum { kDefaultMaxBuffer = 16 * 1024 * 1024 };
+
+  // Reports the elements of the stream to |pHandler|. Elements that must be
+  // buffered (an incomplete block, or the segment headers) may be at most
+  // |max_buffer| bytes long.
+  explicit StreamParser(IMkvStreamHandler* pHandler,
+                        long max_buffer = kDefaultMaxBuffer);
+  ~StreamParser();
+
+  // Parses the |len| bytes at |data|, which follow the bytes passed to the
+  // previous calls. Returns 0 once the bytes have been consumed, or a
+  // negative value on error (including an element larger than the buffer
+  // limit), or as returned by the handler; after an error, every call
+  // returns the same value.
+  long Write(const unsigned char* data, long len);
+
+  // Signals the end of the stream, ending the current cluster if its size is
+  // unknown. Returns 0 on success, E_BUFFER_NOT_FULL if the stream ended
+  // inside an element, or another negative value as for Write.
+  long Finish();
+
+  // Returns the segment, once its header has been parsed, or NULL.
+  const Segment* GetSegment() const;
+
+  // Returns the number of bytes parsed, i.e. the stream position up to which
+  // elements have been consumed; any bytes after it are buffered.
+  long long GetPosition() const;
+
+ private:
+  // The reader through which the segment, and the handler, see the bytes
+  // being parsed: |len| bytes at stream position |pos|.
+  class Window : public IMkvReader {
+   public:
+    Window();
+
+    void Set(long long pos, const unsigned char* data, long len);
+    long long GetStop() const;
+
+    virtual int Read(long long pos, long len, unsigned char* buf);
+    virtual int Length(long long* total, long long* available);
+    virtual int GetSpan(long long pos, long len, const unsigned char** buf);
+
+   private:
+    long long m_pos;
+    const unsigned char* m_data;
+    long m_len;
+  };
+
+  enum State { kHeader, kSegmentHeader, kSegment, kCluster, kDone };
+
+  // Parses the elements in the |len| bytes at |data|, which start at m_pos,
+  // and sets |consumed| to the number of bytes consumed.
+  long Parse(const unsigned char* data, long len, long& consumed);
+
+  // Consumes the next element, or part of it. Returns 0 on progress, 1 if
+  // m_need bytes at m_pos are needed first, or a negative value on error.
+  long ParseNext();
+  long ParseSegmentElement();
+  long ParseClusterElement();
+
+  // Reads the ID and size (-1 if unknown) of the element at m_pos, and sets
+  // |len| to the length of its header. Returns as for ParseNext.
+  long ParseHeader(long long& id, long long& size, long& len);
+
+  // Returns 0 if the |size| bytes at m_pos are in the window, or as for
+  // ParseNext otherwise.
+  long NeedBytes(long long size);
+
+  long EndCluster();
+
+  IMkvStreamHandler* const m_pHandler;
+  const long m_max_buffer;
+
+  Window m_window;
+  State m_state;
+  long m_status;  // first error, which every later call returns
+
+  long long m_pos;  // stream position of the next byte to parse
+  long long m_skip;  // bytes of the current element still to be skipped
+  long m_need;  // bytes needed at m_pos before parsing can continue
+
+  // The bytes at m_pos that could not be parsed yet.
+  unsigned char* m_buf;
+  long m_buf_size;
+  long m_buf_len;
+
+  Segment* m_pSegment;
+  long long m_segment_stop;  // -1 if unknown
+  bool m_started;  // whether OnSegment was called
+
+  Cluster* m_pCluster;  // the current cluster, or NULL
+  long long m_cluster_stop;  // -1 if unknown
+  long m_cluster_count;
+};
+
 }  // end namespace mkvparser
 
 inline long mkvparser::Segment::LoadCluster() {
@@ -9,12 +9,63 @@
 #include "mkvreader.hpp"
 
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace mkvparser {
 
-MkvReader::MkvReader() : m_file(NULL), reader_owns_file_(true) {}
+MkvReader::MkvReader()
+    : m_file(NULL),
+      reader_owns_file_(true),
+      m_file_pos(-1),
+      m_page_size(0),
+      m_page_count(0),
+      m_readahead(0),
+      m_cache(NULL),
+      m_cache_page(NULL),
+      m_cache_len(NULL),
+      m_hash_head(NULL),
+      m_hash_next(NULL),
+      m_hash_size(0),
+      m_lru_prev(NULL),
+      m_lru_next(NULL),
+      m_lru_head(-1),
+      m_lru_tail(-1),
+      m_last_miss(-2) {
+  ResetCacheStats();
+}
 
-MkvReader::MkvReader(FILE* fp) : m_file(fp), reader_owns_file_(false) {
+MkvReader::MkvReader(FILE* fp)
+    : m_file(fp),
+      reader_owns_file_(false),
+      m_file_pos(-1),
+      m_page_size(0),
+      m_page_count(0),
+      m_readahead(0),
+      m_cache(NULL),
+      m_cache_page(NULL),
+      m_cache_len(NULL),
+      m_hash_head(NULL),
+      m_hash_next(NULL),
+      m_hash_size(0),
+      m_lru_prev(NULL),
+      m_lru_next(NULL),
+      m_lru_head(-1),
+      m_lru_tail(-1),
+      m_last_miss(-2) {
+  ResetCacheStats();
   GetFileSize();
 }
 
@@ -22,6 +73,7 @@ MkvReader::~MkvReader() {
   if (reader_owns_file_)
     Close();
   m_file = NULL;
+  FreeCache();
 }
 
 int MkvReader::Open(const char* fileName) {
@@ -73,6 +125,8 @@ bool MkvReader::GetFileSize() {
   fseek(m_file, 0L, SEEK_SET);
 #endif
 
+  m_file_pos = reader_owns_file_ ? 0 : -1;
+
   return true;
 }
 
@@ -81,6 +135,13 @@ void MkvReader::Close() {
     fclose(m_file);
     m_file = NULL;
   }
+
+  m_file_pos = -1;
+
+  // Keep the cache configuration, but drop any contents since they belong
+  // to the file just closed.
+  if (m_cache)
+    ClearCache();
 }
 
 int MkvReader::Length(long long* total, long long* available) {
@@ -112,21 +173,989 @@ int MkvReader::Read(long long offset, long len, unsigned char* buffer) {
   if (offset >= m_length)
     return -1;
 
+  if (len > (m_length - offset))
+    return -1;  // the read would fail short
+
+  if ((len >= m_page_size) || !AllocateCache()) {
+    ++m_stats.bypasses;
+    return ReadFile(offset, len, buffer);
+  }
+
+  bool hit = true;
+
+  while (len > 0) {
+    const long long page = offset / m_page_size;
+    long slot = FindPage(page);
+
+    if (slot < 0) {
+      hit = false;
+      slot = LoadPage(page);
+
+      if (slot < 0)
+        return -1;  // error
+    }
+
+    TouchSlot(slot);
+
+    const long off = static_cast<long>(offset - page * m_page_size);
+    assert(off < m_cache_len[slot]);
+
+    long n = m_cache_len[slot] - off;
+
+    if (n > len)
+      n = len;
+
+    memcpy(buffer, m_cache + slot * m_page_size + off, n);
+
+    buffer += n;
+    offset += n;
+    len -= n;
+  }
+
+  if (hit)
+    ++m_stats.hits;
+
+  return 0;  // success
+}
+
+void MkvReader::Prefetch(long long offset, long len) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+  if ((m_file == NULL) || (offset < 0) || (len <= 0) || (offset >= m_length))
+    return;
+
+  const int fd = fileno(m_file);
+
+  if (fd >= 0)
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#else
+  (void)offset;
+  (void)len;
+#endif
+}
+
+int MkvReader::SetCache(long page_size, long page_count, long readahead) {
+  if ((page_size < 0) || (page_count < 0) || (readahead < 0))
+    return -1;
+
+  FreeCache();
+
+  if ((page_size == 0) || (page_count == 0)) {
+    m_page_size = 0;
+    m_page_count = 0;
+  } else {
+    m_page_size = page_size;
+    m_page_count = page_count;
+  }
+
+  m_readahead = readahead;
+
+  if (m_readahead > m_page_count / 2)
+    m_readahead = m_page_count / 2;
+
+  return 0;
+}
+
+void MkvReader::ResetCacheStats() {
+  m_stats.hits = 0;
+  m_stats.misses = 0;
+  m_stats.readahead_pages = 0;
+  m_stats.bypasses = 0;
+}
+
+int MkvReader::ReadFile(long long offset, long len, unsigned char* buffer) {
+  if (offset != m_file_pos) {
 #ifdef _MSC_VER
-  const int status = _fseeki64(m_file, offset, SEEK_SET);
+    const int status = _fseeki64(m_file, offset, SEEK_SET);
 
-  if (status)
-    return -1;  // error
+    if (status) {
+      m_file_pos = -1;
+      return -1;  // error
+    }
 #else
-  fseek(m_file, offset, SEEK_SET);
+    fseek(m_file, offset, SEEK_SET);
 #endif
+  }
 
   const size_t size = fread(buffer, 1, len, m_file);
 
-  if (size < size_t(len))
+  if (size < size_t(len)) {
+    m_file_pos = -1;
+    return -1;  // error
+  }
+
+  m_file_pos = reader_owns_file_ ? offset + len : -1;
+
+  return 0;  // success
+}
+
+bool MkvReader::AllocateCache() {
+  if (m_cache)
+    return true;
+
+  if ((m_page_size <= 0) || (m_page_count <= 0))
+    return false;
+
+  // Keep the chains short: at least two buckets per slot.
+  m_hash_size = 1;
+
+  while (m_hash_size < 2 * m_page_count)
+    m_hash_size *= 2;
+
+  m_cache = new (std::nothrow) unsigned char[m_page_size * m_page_count];
+  m_cache_page = new (std::nothrow) long long[m_page_count];
+  m_cache_len = new (std::nothrow) long[m_page_count];
+  m_hash_head = new (std::nothrow) long[m_hash_size];
+  m_hash_next = new (std::nothrow) long[m_page_count];
+  m_lru_prev = new (std::nothrow) long[m_page_count];
+  m_lru_next = new (std::nothrow) long[m_page_count];
+
+  if (!m_cache || !m_cache_page || !m_cache_len || !m_hash_head ||
+      !m_hash_next || !m_lru_prev || !m_lru_next) {
+    FreeCache();
+    return false;
+  }
+
+  ClearCache();
+
+  return true;
+}
+
+void MkvReader::FreeCache() {
+  delete[] m_cache;
+  m_cache = NULL;
+
+  delete[] m_cache_page;
+  m_cache_page = NULL;
+
+  delete[] m_cache_len;
+  m_cache_len = NULL;
+
+  delete[] m_hash_head;
+  m_hash_head = NULL;
+
+  delete[] m_hash_next;
+  m_hash_next = NULL;
+
+  delete[] m_lru_prev;
+  m_lru_prev = NULL;
+
+  delete[] m_lru_next;
+  m_lru_next = NULL;
+
+  m_hash_size = 0;
+  m_lru_head = -1;
+  m_lru_tail = -1;
+}
+
+void MkvReader::ClearCache() {
+  for (long i = 0; i < m_hash_size; ++i)
+    m_hash_head[i] = -1;
+
+  for (long i = 0; i < m_page_count; ++i) {
+    m_cache_page[i] = -1;
+    m_cache_len[i] = 0;
+    m_hash_next[i] = -1;
+    m_lru_prev[i] = i - 1;
+    m_lru_next[i] = (i + 1 < m_page_count) ? i + 1 : -1;
+  }
+
+  m_lru_head = 0;
+  m_lru_tail = m_page_count - 1;
+  m_last_miss = -2;
+}
+
+long MkvReader::FindPage(long long page) const {
+  const long bucket = static_cast<long>(page & (m_hash_size - 1));
+
+  for (long i = m_hash_head[bucket]; i >= 0; i = m_hash_next[i]) {
+    if (m_cache_page[i] == page)
+      return i;
+  }
+
+  return -1;  // not cached
+}
+
+void MkvReader::TouchSlot(long slot) {
+  if (slot == m_lru_head)
+    return;
+
+  // Unlink; |slot| is not the head, so it has a predecessor.
+  const long prev = m_lru_prev[slot];
+  const long next = m_lru_next[slot];
+
+  m_lru_next[prev] = next;
+
+  if (next >= 0)
+    m_lru_prev[next] = prev;
+  else
+    m_lru_tail = prev;
+
+  m_lru_prev[slot] = -1;
+  m_lru_next[slot] = m_lru_head;
+  m_lru_prev[m_lru_head] = slot;
+  m_lru_head = slot;
+}
+
+long MkvReader::LoadPage(long long page) {
+  const long long last_page = (m_length - 1) / m_page_size;
+
+  // A miss on the page following the previous miss means the parser is
+  // walking the file; fetch the pages after it too, while the file position
+  // is already there.
+  long long stop = page + 1;
+
+  if (page == m_last_miss + 1)
+    stop += m_readahead;
+
+  if (stop > last_page + 1)
+    stop = last_page + 1;
+
+  long result = -1;
+
+  for (long long p = page; p < stop; ++p) {
+    if ((p != page) && (FindPage(p) >= 0))
+      break;  // the rest was read ahead already
+
+    const long slot = m_lru_tail;
+
+    // Unhash the page the slot held.
+    if (m_cache_page[slot] >= 0) {
+      const long bucket =
+          static_cast<long>(m_cache_page[slot] & (m_hash_size - 1));
+      long* link = &m_hash_head[bucket];
+
+      while (*link != slot)
+        link = &m_hash_next[*link];
+
+      *link = m_hash_next[slot];
+      m_cache_page[slot] = -1;
+    }
+
+    const long long pos = p * m_page_size;
+    const long long remaining = m_length - pos;
+    const long len = (remaining < m_page_size) ? static_cast<long>(remaining)
+                                                : m_page_size;
+
+    unsigned char* const buf = m_cache + slot * m_page_size;
+
+    if (ReadFile(pos, len, buf) < 0)
+      return (p == page) ? -1 : result;
+
+    const long bucket = static_cast<long>(p & (m_hash_size - 1));
+
+    m_cache_page[slot] = p;
+    m_cache_len[slot] = len;
+    m_hash_next[slot] = m_hash_head[bucket];
+    m_hash_head[bucket] = slot;
+
+    TouchSlot(slot);
+
+    if (p == page) {
+      ++m_stats.misses;
+      result = slot;
+    } else {
+      ++m_stats.readahead_pages;
+    }
+
+    m_last_miss = p;
+  }
+
+  return result;
+}
+
+MmapMkvReader::MmapMkvReader()
+    : m_data(NULL),
+      m_length(0),
+      m_open(false)
+#ifdef _WIN32
+      ,
+      m_file(NULL),
+      m_mapping(NULL)
+#endif
+{
+}
+
+MmapMkvReader::~MmapMkvReader() { Close(); }
+
+int MmapMkvReader::Open(const char* fileName) {
+  if (fileName == NULL)
+    return -1;
+
+  if (m_open)
+    return -1;
+
+#ifdef _WIN32
+  const HANDLE file =
+      CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+  if (file == INVALID_HANDLE_VALUE)
+    return -1;
+
+  LARGE_INTEGER size;
+
+  if (!GetFileSizeEx(file, &size) || (size.QuadPart < 0) ||
+      (static_cast<unsigned long long>(size.QuadPart) > size_t(-1))) {
+    CloseHandle(file);
+    return -1;
+  }
+
+  m_length = size.QuadPart;
+
+  if (m_length > 0) {
+    const HANDLE mapping =
+        CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mapping == NULL) {
+      CloseHandle(file);
+      return -1;
+    }
+
+    void* const data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (data == NULL) {
+      CloseHandle(mapping);
+      CloseHandle(file);
+      return -1;
+    }
+
+    m_mapping = mapping;
+    m_data = static_cast<const unsigned char*>(data);
+  }
+
+  m_file = file;
+#else
+  const int fd = open(fileName, O_RDONLY);
+
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+
+  if ((fstat(fd, &st) != 0) || (st.st_size < 0) ||
+      (static_cast<unsigned long long>(st.st_size) > size_t(-1))) {
+    close(fd);
+    return -1;
+  }
+
+  m_length = st.st_size;
+
+  if (m_length > 0) {
+    const size_t size = static_cast<size_t>(m_length);
+    void* const data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+
+    m_data = static_cast<const unsigned char*>(data);
+  }
+
+  // The mapping keeps its own reference to the file.
+  close(fd);
+#endif
+
+  m_open = true;
+  return 0;
+}
+
+void MmapMkvReader::Close() {
+#ifdef _WIN32
+  if (m_data != NULL)
+    UnmapViewOfFile(m_data);
+
+  if (m_mapping != NULL)
+    CloseHandle(m_mapping);
+
+  if (m_file != NULL)
+    CloseHandle(m_file);
+
+  m_mapping = NULL;
+  m_file = NULL;
+#else
+  if (m_data != NULL)
+    munmap(const_cast<unsigned char*>(m_data), static_cast<size_t>(m_length));
+#endif
+
+  m_data = NULL;
+  m_length = 0;
+  m_open = false;
+}
+
+int MmapMkvReader::Length(long long* total, long long* available) {
+  if (!m_open)
+    return -1;
+
+  if (total)
+    *total = m_length;
+
+  if (available)
+    *available = m_length;
+
+  return 0;
+}
+
+int MmapMkvReader::Read(long long offset, long len, unsigned char* buffer) {
+  if (!m_open)
+    return -1;
+
+  if (offset < 0)
+    return -1;
+
+  if (len < 0)
+    return -1;
+
+  if (len == 0)
+    return 0;
+
+  if (offset >= m_length)
+    return -1;
+
+  if (len > (m_length - offset))
     return -1;  // error
 
+  memcpy(buffer, m_data + offset, len);
+
   return 0;  // success
 }
 
+int MmapMkvReader::GetSpan(long long offset, long len,
+                           const unsigned char** buffer) {
+  if (!m_open)
+    return -1;
+
+  if ((offset < 0) || (len < 0) || (buffer == NULL))
+    return -1;
+
+  if ((offset > m_length) || (len > (m_length - offset)))
+    return -1;
+
+  *buffer = m_data + offset;
+
+  return 0;  // success
+}
+
+void MmapMkvReader::Prefetch(long long offset, long len) {
+#if !defined(_WIN32) && defined(MADV_WILLNEED)
+  if (!m_open || (m_data == NULL) || (offset < 0) || (len <= 0) ||
+      (offset >= m_length)) {
+    return;
+  }
+
+  if (len > (m_length - offset))
+    len = static_cast<long>(m_length - offset);
+
+  // The address passed to madvise must be page-aligned.
+  const long long page_size = sysconf(_SC_PAGESIZE);
+  const long long start = (page_size > 0) ? offset - (offset % page_size) : 0;
+
+  madvise(const_cast<unsigned char*>(m_data) + start,
+          static_cast<size_t>(offset + len - start), MADV_WILLNEED);
+#else
+  (void)offset;
+  (void)len;
+#endif
+}
+
+#ifdef _WIN32
+PreadMkvReader::PreadMkvReader()
+    : m_file(NULL), m_length(0), m_owns_file(false) {}
+
+PreadMkvReader::PreadMkvReader(int fd)
+    : m_file(NULL), m_length(0), m_owns_file(false) {
+  const intptr_t handle = _get_osfhandle(fd);
+
+  if (handle == -1)
+    return;
+
+  m_file = reinterpret_cast<void*>(handle);
+
+  if (!GetFileSize())
+    m_file = NULL;
+}
+#else
+PreadMkvReader::PreadMkvReader() : m_fd(-1), m_length(0), m_owns_file(false) {}
+
+PreadMkvReader::PreadMkvReader(int fd)
+    : m_fd(fd), m_length(0), m_owns_file(false) {
+  if (!GetFileSize())
+    m_fd = -1;
+}
+#endif
+
+PreadMkvReader::~PreadMkvReader() { Close(); }
+
+int PreadMkvReader::Open(const char* fileName) {
+  if (fileName == NULL)
+    return -1;
+
+#ifdef _WIN32
+  if (m_file != NULL)
+    return -1;
+
+  const HANDLE file =
+      CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                  FILE_ATTRIBUTE_NORMAL, NULL);
+
+  if (file == INVALID_HANDLE_VALUE)
+    return -1;
+
+  m_file = file;
+#else
+  if (m_fd >= 0)
+    return -1;
+
+  m_fd = open(fileName, O_RDONLY);
+
+  if (m_fd < 0)
+    return -1;
+#endif
+
+  m_owns_file = true;
+
+  if (!GetFileSize()) {
+    Close();
+    return -1;
+  }
+
+  return 0;
+}
+
+void PreadMkvReader::Close() {
+#ifdef _WIN32
+  if (m_owns_file && (m_file != NULL))
+    CloseHandle(m_file);
+
+  m_file = NULL;
+#else
+  if (m_owns_file && (m_fd >= 0))
+    close(m_fd);
+
+  m_fd = -1;
+#endif
+
+  m_length = 0;
+  m_owns_file = false;
+}
+
+bool PreadMkvReader::GetFileSize() {
+#ifdef _WIN32
+  LARGE_INTEGER size;
+
+  if (!GetFileSizeEx(m_file, &size) || (size.QuadPart < 0))
+    return false;
+
+  m_length = size.QuadPart;
+#else
+  struct stat st;
+
+  if ((fstat(m_fd, &st) != 0) || (st.st_size < 0))
+    return false;
+
+  m_length = st.st_size;
+#endif
+
+  return true;
+}
+
+int PreadMkvReader::Length(long long* total, long long* available) {
+#ifdef _WIN32
+  if (m_file == NULL)
+    return -1;
+#else
+  if (m_fd < 0)
+    return -1;
+#endif
+
+  if (total)
+    *total = m_length;
+
+  if (available)
+    *available = m_length;
+
+  return 0;
+}
+
+int PreadMkvReader::Read(long long offset, long len, unsigned char* buffer) {
+#ifdef _WIN32
+  if (m_file == NULL)
+    return -1;
+#else
+  if (m_fd < 0)
+    return -1;
+#endif
+
+  if (offset < 0)
+    return -1;
+
+  if (len < 0)
+    return -1;
+
+  if (len == 0)
+    return 0;
+
+  if (offset >= m_length)
+    return -1;
+
+  if (len > (m_length - offset))
+    return -1;
+
+  // A positional read may transfer fewer bytes than requested, so loop until
+  // the whole range has been read.
+  while (len > 0) {
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+
+    overlapped.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    DWORD size;
+
+    if (!ReadFile(m_file, buffer, static_cast<DWORD>(len), &size, &overlapped))
+      return -1;  // error
+#else
+    const ssize_t size = pread(m_fd, buffer, len, offset);
+
+    if (size < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;  // error
+    }
+#endif
+
+    if (size == 0)
+      return -1;  // unexpected end of file
+
+    buffer += size;
+    offset += size;
+    len -= static_cast<long>(size);
+  }
+
+  return 0;  // success
+}
+
+void PreadMkvReader::Prefetch(long long offset, long len) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+  if ((m_fd < 0) || (offset < 0) || (len <= 0) || (offset >= m_length))
+    return;
+
+  posix_fadvise(m_fd, offset, len, POSIX_FADV_WILLNEED);
+#else
+  (void)offset;
+  (void)len;
+#endif
+}
+
+StatsMkvReader::StatsMkvReader(IMkvReader* pReader)
+    : m_pReader(pReader),
+      m_last_start(-1),
+      m_last_stop(-1),
+      m_log(NULL),
+      m_log_size(0),
+      m_log_count(0) {
+  assert(m_pReader);
+  ResetStats();
+}
+
+StatsMkvReader::~StatsMkvReader() { delete[] m_log; }
+
+int StatsMkvReader::Read(long long offset, long len, unsigned char* buffer) {
+  ++m_stats.reads;
+
+  if (len > 0)
+    m_stats.read_bytes += len;
+
+  Record(offset, len, false);
+
+  return m_pReader->Read(offset, len, buffer);
+}
+
+int StatsMkvReader::Length(long long* total, long long* available) {
+  ++m_stats.length_calls;
+
+  return m_pReader->Length(total, available);
+}
+
+int StatsMkvReader::GetSpan(long long offset, long len,
+                            const unsigned char** buffer) {
+  const int status = m_pReader->GetSpan(offset, len, buffer);
+
+  if (status == 0) {  // otherwise, the caller reads instead
+    ++m_stats.spans;
+
+    if (len > 0)
+      m_stats.span_bytes += len;
+
+    Record(offset, len, true);
+  }
+
+  return status;
+}
+
+void StatsMkvReader::Prefetch(long long offset, long len) {
+  ++m_stats.prefetches;
+
+  m_pReader->Prefetch(offset, len);
+}
+
+void StatsMkvReader::ResetStats() {
+  memset(&m_stats, 0, sizeof m_stats);
+
+  m_last_start = -1;
+  m_last_stop = -1;
+  m_log_count = 0;
+}
+
+int StatsMkvReader::SetLogCapacity(long capacity) {
+  if (capacity < 0)
+    return -1;
+
+  Access* log = NULL;
+
+  if (capacity > 0) {
+    log = new (std::nothrow) Access[capacity];
+
+    if (log == NULL)
+      return -1;
+  }
+
+  if (m_log_count > capacity)
+    m_log_count = capacity;
+
+  for (long i = 0; i < m_log_count; ++i)
+    log[i] = m_log[i];
+
+  delete[] m_log;
+
+  m_log = log;
+  m_log_size = capacity;
+
+  return 0;
+}
+
+void StatsMkvReader::Record(long long offset, long len, bool span) {
+  if ((offset < m_last_start) || (offset > m_last_stop)) {
+    ++m_stats.seeks;
+
+    if (offset < m_last_start)
+      ++m_stats.backward_seeks;
+  }
+
+  m_last_start = offset;
+  m_last_stop = offset + ((len > 0) ? len : 0);
+
+  int k = 0;
+
+  while ((k < (kSizeClassCount - 1)) && ((len >> (k + 1)) > 0))
+    ++k;
+
+  ++m_stats.sizes[k];
+
+  if (m_log_count < m_log_size) {
+    Access& access = m_log[m_log_count++];
+
+    access.pos = offset;
+    access.len = len;
+    access.span = span;
+  }
+}
+
+void StatsMkvReader::DumpLog(FILE* file) const {
+  assert(file);
+
+  for (long i = 0; i < m_log_count; ++i) {
+    const Access& access = m_log[i];
+
+    fprintf(file, "%c %lld %ld\n", access.span ? 'S' : 'R', access.pos,
+            access.len);
+  }
+}
+
+namespace {
+
+int CompareAccess(const void* a_, const void* b_) {
+  const StatsMkvReader::Access* const a =
+      static_cast<const StatsMkvReader::Access*>(a_);
+
+  const StatsMkvReader::Access* const b =
+      static_cast<const StatsMkvReader::Access*>(b_);
+
+  if (a->pos < b->pos)
+    return -1;
+
+  return (a->pos > b->pos) ? 1 : 0;
+}
+
+}  // namespace
+
+long long StatsMkvReader::CountDistinctBytes() const {
+  if (m_log_count <= 0)
+    return 0;
+
+  Access* const log = new (std::nothrow) Access[m_log_count];
+
+  if (log == NULL)
+    return -1;
+
+  memcpy(log, m_log, m_log_count * sizeof(Access));
+  qsort(log, m_log_count, sizeof(Access), CompareAccess);
+
+  long long count = 0;
+  long long stop = 0;  // end of the bytes counted so far
+
+  for (long i = 0; i < m_log_count; ++i) {
+    const long long start = (log[i].pos > stop) ? log[i].pos : stop;
+    const long long end = log[i].pos + log[i].len;
+
+    if (end > start) {
+      count += end - start;
+      stop = end;
+    }
+  }
+
+  delete[] log;
+  return count;
+}
+
+int StatsMkvReader::Attribute(Segment* pSegment,
+                              ElementStats stats[kElementCount]) const {
+  assert(pSegment);
+
+  for (int i = 0; i < kElementCount; ++i) {
+    stats[i].reads = 0;
+    stats[i].bytes = 0;
+  }
+
+  // The elements other than clusters, of which there is one of each.
+
+  long long starts[kElementCount];
+  long long stops[kElementCount];
+
+  for (int i = 0; i < kElementCount; ++i)
+    starts[i] = stops[i] = -1;
+
+  const SeekHead* const pSeekHead = pSegment->GetSeekHead();
+
+  if (pSeekHead) {
+    starts[kElementSeekHead] = pSeekHead->m_element_start;
+    stops[kElementSeekHead] =
+        starts[kElementSeekHead] + pSeekHead->m_element_size;
+  }
+
+  const SegmentInfo* const pInfo = pSegment->GetInfo();
+
+  if (pInfo) {
+    starts[kElementInfo] = pInfo->m_element_start;
+    stops[kElementInfo] = starts[kElementInfo] + pInfo->m_element_size;
+  }
+
+  const Tracks* const pTracks = pSegment->GetTracks();
+
+  if (pTracks) {
+    starts[kElementTracks] = pTracks->m_element_start;
+    stops[kElementTracks] = starts[kElementTracks] + pTracks->m_element_size;
+  }
+
+  const Cues* const pCues = pSegment->GetCues();
+
+  if (pCues) {
+    starts[kElementCues] = pCues->m_element_start;
+    stops[kElementCues] = starts[kElementCues] + pCues->m_element_size;
+  }
+
+  const Chapters* const pChapters = pSegment->GetChapters();
+
+  if (pChapters) {
+    starts[kElementChapters] = pChapters->m_element_start;
+    stops[kElementChapters] =
+        starts[kElementChapters] + pChapters->m_element_size;
+  }
+
+  // The loaded clusters, in position order. A cluster whose size is not
+  // known yet extends to the next one.
+
+  const long count = static_cast<long>(pSegment->GetCount());
+
+  long long* cluster_starts = NULL;
+  long long* cluster_stops = NULL;
+
+  if (count > 0) {
+    cluster_starts = new (std::nothrow) long long[count];
+    cluster_stops = new (std::nothrow) long long[count];
+
+    if ((cluster_starts == NULL) || (cluster_stops == NULL)) {
+      delete[] cluster_starts;
+      delete[] cluster_stops;
+
+      return -1;
+    }
+
+    const Cluster* pCluster = pSegment->GetFirst();
+
+    for (long i = 0; i < count; ++i) {
+      assert(pCluster && !pCluster->EOS());
+
+      const long long size = pCluster->GetElementSize();
+
+      cluster_starts[i] = pCluster->m_element_start;
+      cluster_stops[i] = (size < 0) ? -1 : cluster_starts[i] + size;
+
+      pCluster = pSegment->GetNext(pCluster);
+    }
+  }
+
+  for (long i = 0; i < m_log_count; ++i) {
+    const Access& access = m_log[i];
+
+    int element = kElementOther;
+
+    for (int k = 0; k < kElementCount; ++k) {
+      if ((access.pos >= starts[k]) && (access.pos < stops[k])) {
+        element = k;
+        break;
+      }
+    }
+
+    if ((element == kElementOther) && (count > 0)) {
+      // Find the last cluster that starts at or before the access.
+
+      long lo = 0;
+      long hi = count;
+
+      while (lo < hi) {
+        const long mid = lo + (hi - lo) / 2;
+
+        if (cluster_starts[mid] <= access.pos)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+
+      if (lo > 0) {
+        const long long stop = cluster_stops[lo - 1];
+
+        if ((stop < 0) || (access.pos < stop))
+          element = kElementCluster;
+      }
+    }
+
+    ++stats[element].reads;
+
+    if (access.len > 0)
+      stats[element].bytes += access.len;
+  }
+
+  delete[] cluster_starts;
+  delete[] cluster_stops;
+
+  return 0;
+}
+
 }  // end namespace mkvparser
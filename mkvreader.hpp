@@ -14,8 +14,27 @@
 
 namespace mkvparser {
 
+// Implementation of IMkvReader backed by a FILE*. Optionally, reads smaller
+// than a page are served from an internal page cache, so that the many small
+// reads made while parsing element headers do not each seek and read the
+// file. Larger reads (typically frame payloads) bypass the cache. The cache
+// is disabled by default; SetCache enables it, e.g. with the kDefaultCache*
+// values below, which take 512 KiB.
 class MkvReader : public IMkvReader {
  public:
+  enum {
+    kDefaultCachePageSize = 16 * 1024,
+    kDefaultCachePageCount = 32,
+    kDefaultCacheReadAhead = 4
+  };
+
+  struct CacheStats {
+    long long hits;  // reads served entirely from cached pages
+    long long misses;  // pages loaded on demand
+    long long readahead_pages;  // pages loaded speculatively
+    long long bypasses;  // reads passed straight through to the file
+  };
+
   MkvReader();
   explicit MkvReader(FILE* fp);
   virtual ~MkvReader();
@@ -26,6 +45,22 @@ class MkvReader : public IMkvReader {
   virtual int Read(long long position, long length, unsigned char* buffer);
   virtual int Length(long long* total, long long* available);
 
+  // Advises the system to read the range into its page cache
+  // (posix_fadvise(POSIX_FADV_WILLNEED) on the file descriptor of the FILE*).
+  // The pages of this reader's own cache are still loaded on demand.
+  virtual void Prefetch(long long position, long length);
+
+  // Configures the page cache. |page_size| is the size in bytes of each page
+  // (pages are aligned to multiples of it within the file), |page_count| the
+  // number of pages held, and |readahead| the number of pages loaded ahead of
+  // a miss when sequential access is detected (clamped to half of
+  // |page_count|). A |page_size| or |page_count| of 0 disables the cache.
+  // Returns 0 on success, or -1 if the arguments are invalid.
+  int SetCache(long page_size, long page_count, long readahead);
+
+  const CacheStats& GetCacheStats() const { return m_stats; }
+  void ResetCacheStats();
+
  private:
   MkvReader(const MkvReader&);
   MkvReader& operator=(const MkvReader&);
@@ -35,9 +70,248 @@ class MkvReader : public IMkvReader {
   // success.
   bool GetFileSize();
 
+  // Reads |length| bytes at |position| from the file into |buffer|, seeking
+  // only when the file position is not already there. Returns 0 on success.
+  int ReadFile(long long position, long length, unsigned char* buffer);
+
+  // Allocates the page cache, if it has not been allocated yet. Returns false
+  // if the cache is disabled or cannot be allocated.
+  bool AllocateCache();
+  void FreeCache();
+
+  // Empties the cache, without freeing it.
+  void ClearCache();
+
+  // Returns the slot holding |page|, or -1 if it is not cached.
+  long FindPage(long long page) const;
+
+  // Moves |slot| to the front of the LRU list.
+  void TouchSlot(long slot);
+
+  // Loads |page| into the least recently used slot. Returns the slot, or a
+  // negative value on error.
+  long LoadPage(long long page);
+
   long long m_length;
   FILE* m_file;
   bool reader_owns_file_;
+
+  // File position after the last read, or -1 if unknown. Only tracked when
+  // the reader owns the file, since the caller may otherwise move it.
+  long long m_file_pos;
+
+  long m_page_size;
+  long m_page_count;
+  long m_readahead;
+  unsigned char* m_cache;  // m_page_count pages of m_page_size bytes
+  long long* m_cache_page;  // page index held by each slot, or -1
+  long* m_cache_len;  // valid bytes in each slot
+
+  // Slots are found through a hash table of m_hash_size (a power of two)
+  // chains, indexed by the low bits of the page index.
+  long* m_hash_head;  // first slot of each chain, or -1
+  long* m_hash_next;  // next slot in the chain of each slot, or -1
+  long m_hash_size;
+
+  // Slots in order of use, most recent first.
+  long* m_lru_prev;
+  long* m_lru_next;
+  long m_lru_head;
+  long m_lru_tail;
+
+  long long m_last_miss;  // page index of the last demand miss
+  CacheStats m_stats;
+};
+
+// Implementation of IMkvReader that maps the entire file into memory
+// (read-only), so that each Read is a memcpy from the mapping instead of a
+// seek and read of the underlying file.
+class MmapMkvReader : public IMkvReader {
+ public:
+  MmapMkvReader();
+  virtual ~MmapMkvReader();
+
+  // Opens and maps |fileName|. Returns 0 on success.
+  int Open(const char* fileName);
+
+  // Unmaps and closes the file. Pointers obtained from GetBuffer become
+  // invalid.
+  void Close();
+
+  virtual int Read(long long position, long length, unsigned char* buffer);
+  virtual int Length(long long* total, long long* available);
+  virtual int GetSpan(long long position, long length,
+                      const unsigned char** buffer);
+
+  // Advises the system to page in the range (madvise(MADV_WILLNEED)).
+  virtual void Prefetch(long long position, long length);
+
+  // Returns the base address of the mapping, or NULL when no file is mapped
+  // (or the file is empty). The buffer holds the entire file, and remains
+  // valid until Close is called or the reader is destroyed.
+  const unsigned char* GetBuffer() const { return m_data; }
+
+ private:
+  MmapMkvReader(const MmapMkvReader&);
+  MmapMkvReader& operator=(const MmapMkvReader&);
+
+  const unsigned char* m_data;
+  long long m_length;
+  bool m_open;
+#ifdef _WIN32
+  void* m_file;
+  void* m_mapping;
+#endif
+};
+
+// Implementation of IMkvReader that uses positional reads (pread on POSIX,
+// overlapped ReadFile on Windows), so there is no shared file position.
+// Once opened, Read and Length may be called concurrently from any number of
+// threads, and one reader may be shared by several Segment instances.
+class PreadMkvReader : public IMkvReader {
+ public:
+  PreadMkvReader();
+
+  // Reads from the already open file descriptor |fd|. The reader does not
+  // take ownership of |fd|, which must remain open while the reader is used.
+  explicit PreadMkvReader(int fd);
+
+  virtual ~PreadMkvReader();
+
+  // Opens |fileName| for reading. Returns 0 on success.
+  int Open(const char* fileName);
+
+  // Closes the file if it was opened by Open.
+  void Close();
+
+  virtual int Read(long long position, long length, unsigned char* buffer);
+  virtual int Length(long long* total, long long* available);
+
+  // Advises the system to read the range into the page cache
+  // (posix_fadvise(POSIX_FADV_WILLNEED)).
+  virtual void Prefetch(long long position, long length);
+
+ private:
+  PreadMkvReader(const PreadMkvReader&);
+  PreadMkvReader& operator=(const PreadMkvReader&);
+
+  // Determines the size of the file. Returns true on success.
+  bool GetFileSize();
+
+#ifdef _WIN32
+  void* m_file;
+#else
+  int m_fd;
+#endif
+  long long m_length;
+  bool m_owns_file;
+};
+
+// Implementation of IMkvReader that forwards each call to another reader,
+// counting the calls and the bytes read, to measure the I/O that parsing
+// operations (e.g. Segment::Load or Cues::Find) cost with a given reader.
+// Optionally, each read is also logged, so that the access pattern can be
+// dumped, the bytes read more than once counted, and the reads attributed to
+// the elements of the segment. Unlike the reader it wraps, this reader must
+// not be called concurrently.
+class StatsMkvReader : public IMkvReader {
+ public:
+  enum { kSizeClassCount = 32 };
+
+  struct Stats {
+    long long reads;  // Read calls
+    long long read_bytes;  // bytes requested by Read calls
+    long long spans;  // GetSpan calls that succeeded
+    long long span_bytes;
+    // Reads and spans starting outside of the range of the previous one, so
+    // that re-reading part of it (e.g. a payload after a look-ahead read of
+    // its header) is not a seek; backward_seeks counts the seeks that start
+    // before it.
+    long long seeks;
+    long long backward_seeks;
+    long long length_calls;
+    long long prefetches;
+    // Reads and spans of 2^k to 2^(k+1)-1 bytes, for k in [0,
+    // kSizeClassCount); the first class also counts empty reads, and the
+    // last one all larger reads.
+    long long sizes[kSizeClassCount];
+  };
+
+  struct Access {
+    long long pos;
+    long len;
+    bool span;  // GetSpan rather than Read
+  };
+
+  // The level 1 elements to which Attribute assigns reads.
+  enum Element {
+    kElementOther,  // EBML header, Void, Tags, and anything else
+    kElementSeekHead,
+    kElementInfo,
+    kElementTracks,
+    kElementCues,
+    kElementChapters,
+    kElementCluster,
+    kElementCount
+  };
+
+  struct ElementStats {
+    long long reads;  // reads and spans
+    long long bytes;
+  };
+
+  // Forwards to |pReader|, which must outlive this reader.
+  explicit StatsMkvReader(IMkvReader* pReader);
+  virtual ~StatsMkvReader();
+
+  virtual int Read(long long position, long length, unsigned char* buffer);
+  virtual int Length(long long* total, long long* available);
+  virtual int GetSpan(long long position, long length,
+                      const unsigned char** buffer);
+  virtual void Prefetch(long long position, long length);
+
+  const Stats& GetStats() const { return m_stats; }
+
+  // Zeroes the counters, and empties the log.
+  void ResetStats();
+
+  // Starts logging the first |capacity| reads and spans (of those made after
+  // the log was last emptied), or stops logging if |capacity| is 0. Returns
+  // 0 on success, or -1 if memory cannot be allocated.
+  int SetLogCapacity(long capacity);
+
+  long GetLogCount() const { return m_log_count; }
+  const Access* GetLog() const { return m_log; }
+
+  // Writes the log to |file|, one access per line: "R" for a Read or "S" for
+  // a GetSpan, followed by the position and the length.
+  void DumpLog(FILE* file) const;
+
+  // Returns the number of distinct bytes covered by the logged accesses; the
+  // difference with the bytes read shows how much was read more than once.
+  // Returns -1 if memory cannot be allocated.
+  long long CountDistinctBytes() const;
+
+  // Sets |stats| to the logged accesses attributed to the level 1 element of
+  // |pSegment| that holds their first byte, as far as the segment has been
+  // parsed. Returns 0 on success, or -1 if memory cannot be allocated.
+  int Attribute(Segment* pSegment, ElementStats stats[kElementCount]) const;
+
+ private:
+  StatsMkvReader(const StatsMkvReader&);
+  StatsMkvReader& operator=(const StatsMkvReader&);
+
+  // Counts, and logs if enabled, an access of |length| bytes at |position|.
+  void Record(long long position, long length, bool span);
+
+  IMkvReader* const m_pReader;
+  Stats m_stats;
+  long long m_last_start;  // range of the last read or span, or -1
+  long long m_last_stop;
+
+  Access* m_log;
+  long m_log_size;
+  long m_log_count;
 };
 
 }  // end namespace mkvparser
@@ -12,13 +12,31 @@
 #include <share.h>  // for _SH_DENYWR
 #endif
 
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/uio.h>
+#endif
+
 #include <new>
 
 namespace mkvmuxer {
 
-MkvWriter::MkvWriter() : file_(NULL), writer_owns_file_(true) {}
+MkvWriter::MkvWriter() : file_(NULL), writer_owns_file_(true), position_(0) {}
 
-MkvWriter::MkvWriter(FILE* fp) : file_(fp), writer_owns_file_(false) {}
+MkvWriter::MkvWriter(FILE* fp)
+    : file_(fp), writer_owns_file_(false), position_(0) {
+  if (file_) {
+#ifdef _MSC_VER
+    position_ = _ftelli64(file_);
+#else
+    position_ = ftell(file_);
+#endif
+    // A stream that cannot report its position, such as a pipe, is taken to
+    // start at 0.
+    if (position_ < 0)
+      position_ = 0;
+  }
+}
 
 MkvWriter::~MkvWriter() { Close(); }
 
@@ -33,10 +51,79 @@ int32 MkvWriter::Write(const void* buffer, uint32 length) {
     return -1;
 
   const size_t bytes_written = fwrite(buffer, 1, length, file_);
+  position_ += bytes_written;
 
   return (bytes_written == length) ? 0 : -1;
 }
 
+int32 MkvWriter::WriteV(const WriteBuffer* buffers, int32 count) {
+  if (!file_)
+    return -1;
+
+#ifdef _WIN32
+  return IMkvWriter::WriteV(buffers, count);
+#else
+  // Most number of buffers passed to a single writev call.
+  const int32 kMaxBuffers = 16;
+
+  if (count < 0 || count > kMaxBuffers || (count > 0 && !buffers))
+    return IMkvWriter::WriteV(buffers, count);
+
+  struct iovec iov[kMaxBuffers];
+  int32 iov_count = 0;
+  uint64 total = 0;
+
+  for (int32 i = 0; i < count; ++i) {
+    if (buffers[i].length == 0)
+      continue;
+
+    if (buffers[i].data == NULL)
+      return -1;
+
+    iov[iov_count].iov_base = const_cast<void*>(buffers[i].data);
+    iov[iov_count].iov_len = buffers[i].length;
+    ++iov_count;
+    total += buffers[i].length;
+  }
+
+  // Batches smaller than the stdio buffer are cheaper to copy into it than
+  // to pass to the file with a system call of their own.
+  if (total < BUFSIZ)
+    return IMkvWriter::WriteV(buffers, count);
+
+  if (fflush(file_))
+    return -1;
+
+  const int fd = fileno(file_);
+  struct iovec* next = iov;
+
+  while (iov_count > 0) {
+    const ssize_t bytes_written = writev(fd, next, iov_count);
+    if (bytes_written <= 0) {
+      if (bytes_written < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    position_ += bytes_written;
+
+    // Skip what was written, in case writev stopped short.
+    size_t left = static_cast<size_t>(bytes_written);
+    while (iov_count > 0 && left >= next->iov_len) {
+      left -= next->iov_len;
+      ++next;
+      --iov_count;
+    }
+    if (iov_count > 0) {
+      next->iov_base = static_cast<uint8*>(next->iov_base) + left;
+      next->iov_len -= left;
+    }
+  }
+
+  return 0;
+#endif
+}
+
 bool MkvWriter::Open(const char* filename) {
   if (filename == NULL)
     return false;
@@ -51,6 +138,7 @@ bool MkvWriter::Open(const char* filename) {
 #endif
   if (file_ == NULL)
     return false;
+  position_ = 0;
   return true;
 }
 
@@ -59,17 +147,14 @@ void MkvWriter::Close() {
     fclose(file_);
   }
   file_ = NULL;
+  position_ = 0;
 }
 
 int64 MkvWriter::Position() const {
   if (!file_)
     return 0;
 
-#ifdef _MSC_VER
-  return _ftelli64(file_);
-#else
-  return ftell(file_);
-#endif
+  return position_;
 }
 
 int32 MkvWriter::Position(int64 position) {
@@ -77,10 +162,13 @@ int32 MkvWriter::Position(int64 position) {
     return -1;
 
 #ifdef _MSC_VER
-  return _fseeki64(file_, position, SEEK_SET);
+  const int32 status = _fseeki64(file_, position, SEEK_SET);
 #else
-  return fseek(file_, position, SEEK_SET);
+  const int32 status = fseek(file_, position, SEEK_SET);
 #endif
+  if (status == 0)
+    position_ = position;
+  return status;
 }
 
 bool MkvWriter::Seekable() const { return true; }
@@ -28,6 +28,7 @@ class MkvWriter : public IMkvWriter {
   virtual int32 Position(int64 position);
   virtual bool Seekable() const;
   virtual int32 Write(const void* buffer, uint32 length);
+  virtual int32 WriteV(const WriteBuffer* buffers, int32 count);
   virtual void ElementStartNotify(uint64 element_id, int64 position);
 
   // Creates and opens a file for writing. |filename| is the name of the file
@@ -43,6 +44,10 @@ class MkvWriter : public IMkvWriter {
   FILE* file_;
   bool writer_owns_file_;
 
+  // Offset of the file position from the beginning of the file, kept here so
+  // Position() does not have to query the file.
+  int64 position_;
+
   LIBWEBM_DISALLOW_COPY_AND_ASSIGN(MkvWriter);
 };
 
@@ -0,0 +1,179 @@
+// Copyright (c) 2015 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+//
+// Times the muxer's queue of held-back audio frames on a synthetic stream:
+// one video track with long GOPs and several audio tracks. Audio frames are
+// queued until the next video frame; the lower the video frame rate, the
+// more frames are queued. Segment::WriteFramesAll and
+// Segment::WriteFramesLessThan run inside the AddFrame calls for video frames
+// and inside Finalize, so the time of those calls is compared with the same
+// video muxed without audio. Output goes to a writer that discards it.
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "mkvmuxer.hpp"
+
+namespace {
+
+// Writer that only keeps track of the output position.
+class NullWriter : public mkvmuxer::IMkvWriter {
+ public:
+  NullWriter() : position_(0), size_(0) {}
+  virtual ~NullWriter() {}
+
+  virtual mkvmuxer::int32 Write(const void*, mkvmuxer::uint32 len) {
+    position_ += len;
+    if (position_ > size_)
+      size_ = position_;
+    return 0;
+  }
+  virtual mkvmuxer::int64 Position() const { return position_; }
+  virtual mkvmuxer::int32 Position(mkvmuxer::int64 position) {
+    position_ = position;
+    return 0;
+  }
+  virtual bool Seekable() const { return true; }
+  virtual void ElementStartNotify(mkvmuxer::uint64, mkvmuxer::int64) {}
+
+  mkvmuxer::int64 size() const { return size_; }
+
+ private:
+  mkvmuxer::int64 position_;
+  mkvmuxer::int64 size_;
+};
+
+struct Options {
+  int seconds;
+  int audio_tracks;
+  int gop_seconds;
+  int video_fps;
+};
+
+struct Result {
+  double audio_seconds;  // in AddFrame for audio frames
+  double video_seconds;  // in AddFrame for video frames, and Finalize
+  long audio_frames;
+  long video_frames;
+  mkvmuxer::int64 size;
+};
+
+double Elapsed(clock_t start) {
+  return static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Muxes the stream described by |options|, with |audio_tracks| audio tracks.
+// Returns false on error.
+bool Mux(const Options& options, int audio_tracks, Result* result) {
+  const mkvmuxer::uint64 kMs = 1000000;
+  const int kMaxAudioTracks = 16;
+  static unsigned char data[8192];
+
+  NullWriter writer;
+  mkvmuxer::Segment segment;
+  if (!segment.Init(&writer))
+    return false;
+  segment.set_mode(mkvmuxer::Segment::kFile);
+
+  const mkvmuxer::uint64 video = segment.AddVideoTrack(640, 360, 0);
+  if (!video || !segment.CuesTrack(video))
+    return false;
+
+  mkvmuxer::uint64 audio[kMaxAudioTracks];
+  mkvmuxer::uint64 next_audio[kMaxAudioTracks];
+  for (int i = 0; i < audio_tracks; ++i) {
+    audio[i] = segment.AddAudioTrack(48000, 2, 0);
+    if (!audio[i])
+      return false;
+    next_audio[i] = i * 7 * kMs;  // stagger the tracks
+  }
+
+  srand(1);
+  result->audio_seconds = 0;
+  result->video_seconds = 0;
+  result->audio_frames = 0;
+  result->video_frames = 0;
+
+  const mkvmuxer::uint64 duration = options.seconds * 1000 * kMs;
+  const mkvmuxer::uint64 frame_duration = 1000 * kMs / options.video_fps;
+  const mkvmuxer::uint64 gop = options.gop_seconds * 1000 * kMs;
+
+  for (mkvmuxer::uint64 t = 0; t < duration; t += frame_duration) {
+    // Add the audio up to this video frame, in 20-22 ms frames.
+    for (int i = 0; i < audio_tracks; ++i) {
+      while (next_audio[i] <= t) {
+        const clock_t start = clock();
+        if (!segment.AddFrame(data, 100 + rand() % 400, audio[i],
+                              next_audio[i], true))
+          return false;
+        result->audio_seconds += Elapsed(start);
+        ++result->audio_frames;
+        next_audio[i] += (20 + rand() % 3) * kMs;
+      }
+    }
+
+    const bool is_key = (t % gop) < frame_duration;
+    const clock_t start = clock();
+    if (!segment.AddFrame(data, 1000 + rand() % 7000, video, t, is_key))
+      return false;
+    result->video_seconds += Elapsed(start);
+    ++result->video_frames;
+  }
+
+  const clock_t start = clock();
+  if (!segment.Finalize())
+    return false;
+  result->video_seconds += Elapsed(start);
+
+  result->size = writer.size();
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.seconds = (argc > 1) ? atoi(argv[1]) : 120;
+  options.audio_tracks = (argc > 2) ? atoi(argv[2]) : 3;
+  options.gop_seconds = (argc > 3) ? atoi(argv[3]) : 10;
+  options.video_fps = (argc > 4) ? atoi(argv[4]) : 30;
+
+  if (options.seconds < 1 || options.audio_tracks < 1 ||
+      options.audio_tracks > 16 || options.gop_seconds < 1 ||
+      options.video_fps < 1) {
+    printf("usage: %s [seconds] [audio tracks (1-16)] [gop seconds]"
+           " [video fps]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Result with_audio;
+  Result video_only;
+  if (!Mux(options, options.audio_tracks, &with_audio) ||
+      !Mux(options, 0, &video_only)) {
+    printf("muxing failed\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%d s, %d audio tracks, %d fps video, %d s GOPs\n",
+         options.seconds, options.audio_tracks, options.video_fps,
+         options.gop_seconds);
+  printf("output:                %lld bytes\n",
+         static_cast<long long>(with_audio.size));
+  printf("queue audio frames:    %8.3f ms (%ld frames)\n",
+         with_audio.audio_seconds * 1e3, with_audio.audio_frames);
+  printf("video with audio:      %8.3f ms (%ld frames)\n",
+         with_audio.video_seconds * 1e3, with_audio.video_frames);
+  printf("video only:            %8.3f ms\n", video_only.video_seconds * 1e3);
+  printf("write queued frames:   %8.3f ms (%.1f ns per audio frame)\n",
+         (with_audio.video_seconds - video_only.video_seconds) * 1e3,
+         (with_audio.video_seconds - video_only.video_seconds) * 1e9 /
+             with_audio.audio_frames);
+
+  return EXIT_SUCCESS;
+}
@@ -437,90 +437,62 @@ int main(int argc, char* argv[]) {
     muxer_segment.CuesTrack(aud_track);
 
   // Write clusters
-  unsigned char* data = NULL;
-  int data_len = 0;
+  mkvparser::FrameCursor cursor(parser_segment, 0, true);
+  mkvparser::FrameCursor::Frame frame;
 
-  const mkvparser::Cluster* cluster = parser_segment->GetFirst();
+  for (;;) {
+    const long status = cursor.Next(frame);
 
-  while ((cluster != NULL) && !cluster->EOS()) {
-    const mkvparser::BlockEntry* block_entry;
-
-    long status = cluster->GetFirst(block_entry);
+    if (status == 1)  // no more frames
+      break;
 
     if (status) {
-      printf("\n Could not get first block of cluster.\n");
+      printf("\n Could not read frame.\n");
       return EXIT_FAILURE;
     }
 
-    while ((block_entry != NULL) && !block_entry->EOS()) {
-      const mkvparser::Block* const block = block_entry->GetBlock();
-      const long long trackNum = block->GetTrackNumber();
-      const mkvparser::Track* const parser_track =
-          parser_tracks->GetTrackByNumber(static_cast<unsigned long>(trackNum));
+    const mkvparser::Track* const parser_track =
+        parser_tracks->GetTrackByNumber(
+            static_cast<unsigned long>(frame.track));
 
-      // When |parser_track| is NULL, it means that the track number in the
-      // Block is invalid (i.e.) the was no TrackEntry corresponding to the
-      // track number. So we reject the file.
-      if (!parser_track) {
-        return EXIT_FAILURE;
-      }
+    // When |parser_track| is NULL, it means that the track number in the
+    // Block is invalid (i.e.) the was no TrackEntry corresponding to the
+    // track number. So we reject the file.
+    if (!parser_track) {
+      return EXIT_FAILURE;
+    }
 
-      const long long track_type = parser_track->GetType();
-      const long long time_ns = block->GetTime(cluster);
+    const long long track_type = parser_track->GetType();
+    const long long time_ns = frame.time;
 
-      // Flush any metadata frames to the output file, before we write
-      // the current block.
-      if (!metadata.Write(time_ns))
-        return EXIT_FAILURE;
+    // Flush any metadata frames to the output file, before we write
+    // the current frame.
+    if (!metadata.Write(time_ns))
+      return EXIT_FAILURE;
 
-      if ((track_type == Track::kAudio && output_audio) ||
-          (track_type == Track::kVideo && output_video)) {
-        const int frame_count = block->GetFrameCount();
-        const bool is_key = block->IsKey();
-        const int64 discard_padding = block->GetDiscardPadding();
-
-        for (int i = 0; i < frame_count; ++i) {
-          const mkvparser::Block::Frame& frame = block->GetFrame(i);
-
-          if (frame.len > data_len) {
-            delete[] data;
-            data = new unsigned char[frame.len];
-            if (!data)
-              return EXIT_FAILURE;
-            data_len = frame.len;
-          }
-
-          if (frame.Read(&reader, data))
-            return EXIT_FAILURE;
-
-          uint64 track_num = vid_track;
-          if (track_type == Track::kAudio)
-            track_num = aud_track;
-
-          bool frame_added = false;
-          if (discard_padding) {
-            frame_added = muxer_segment.AddFrameWithDiscardPadding(
-                data, frame.len, discard_padding, track_num, time_ns, is_key);
-          } else {
-            frame_added = muxer_segment.AddFrame(data, frame.len, track_num,
-                                                 time_ns, is_key);
-          }
-          if (!frame_added) {
-            printf("\n Could not add frame.\n");
-            return EXIT_FAILURE;
-          }
-        }
+    if ((track_type == Track::kAudio && output_audio) ||
+        (track_type == Track::kVideo && output_video)) {
+      const int64 discard_padding =
+          frame.entry->GetBlock()->GetDiscardPadding();
+
+      uint64 track_num = vid_track;
+      if (track_type == Track::kAudio)
+        track_num = aud_track;
+
+      bool frame_added = false;
+      if (discard_padding) {
+        frame_added = muxer_segment.AddFrameWithDiscardPadding(
+            frame.data, frame.len, discard_padding, track_num, time_ns,
+            frame.key);
+      } else {
+        frame_added = muxer_segment.AddFrame(frame.data, frame.len, track_num,
+                                             time_ns, frame.key);
       }
-
-      status = cluster->GetNext(block_entry, block_entry);
-
-      if (status) {
-        printf("\n Could not get next block of cluster.\n");
+      if (!frame_added) {
+        printf("\n Could not add frame.\n");
         return EXIT_FAILURE;
       }
     }
-
-    cluster = parser_segment->GetNext(cluster);
   }
 
   // We have exhausted all video and audio frames in the input file.
@@ -554,7 +526,6 @@ int main(int argc, char* argv[]) {
     remove(temp_file);
   }
 
-  delete[] data;
   delete parser_segment;
 
   return EXIT_SUCCESS;
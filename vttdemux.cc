@@ -11,6 +11,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 #include "./mkvparser.hpp"
 #include "./mkvreader.hpp"
 #include "./webvttparser.h"
@@ -585,6 +586,27 @@ bool vttdemux::WriteFiles(const metadata_map_t& m, mkvparser::Segment* s) {
   if (!WriteChaptersFile(m, s))
     return false;
 
+  // Only the metadata blocks are of interest, so have the parser skip
+  // the blocks of all other tracks.
+
+  std::vector<long long> tracks;  // NOLINT
+
+  typedef metadata_map_t::const_iterator iter_t;
+
+  for (iter_t i = m.begin(); i != m.end(); ++i) {
+    if (i->first != kChaptersKey)
+      tracks.push_back(i->first);
+  }
+
+  if (!tracks.empty()) {
+    const long count = static_cast<long>(tracks.size());  // NOLINT
+
+    if (s->SetTrackFilter(&tracks[0], count) < 0) {
+      printf("unable to set track filter\n");
+      return false;
+    }
+  }
+
   // Now iterate over the clusters, writing the WebVTT cue as we parse
   // each metadata block.
 